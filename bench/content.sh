@@ -0,0 +1,42 @@
+#!/bin/sh
+# server CPU time per GiB of file content sent to a connection, for each given server build
+# usage: bench/content.sh [size in MiB] [server]..., run from the repository after `make bench`
+# e.g. compare a build from before content was sent by sendfile() with the current one
+SIZE=${1:-1024}
+[ $# -gt 0 ] && shift
+[ $# -gt 0 ] || set -- ./server
+PORT=${PORT:-53310}
+REQUESTS=3
+
+DIR=$(mktemp -d)
+dd if=/dev/urandom of="$DIR/big" bs=1M count="$SIZE" status=none
+# the file is sent from page cache, so the disk isn't measured
+cat "$DIR/big" > /dev/null
+TICKS=$(getconf CLK_TCK)
+
+# user and system CPU ticks of process `$1` and its children, which are kept as zombies until the server exits
+cpu_ticks() {
+    for pid in $1 $(ps -o pid= --ppid "$1"); do
+        awk '{ print $14 + $15 }' "/proc/$pid/stat" 2> /dev/null
+    done | awk '{ sum += $1 } END { print sum }'
+}
+
+for SERVER in "$@"; do
+    "$SERVER" -d "$DIR" -p "$PORT" --config /dev/null > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.3
+
+    START=$(date +%s.%N)
+    obj/bench_rtt "$PORT" big $REQUESTS > /dev/null || echo "fetch from $SERVER failed"
+    END=$(date +%s.%N)
+    TICKS_USED=$(cpu_ticks $SERVER_PID)
+
+    echo "$SERVER $TICKS_USED $TICKS $START $END" | awk -v size="$SIZE" -v requests=$REQUESTS '{
+        gib = size * requests / 1024
+        printf "%s: %.3f s CPU per GiB, %.0f MiB/s\n", $1, $2 / $3 / gib, size * requests / ($5 - $4)
+    }'
+
+    kill $SERVER_PID
+    wait $SERVER_PID 2> /dev/null
+done
+rm -rf "$DIR"
@@ -0,0 +1,107 @@
+// round-trip latency of small requests sent one at a time on a connection to a local server
+// usage: rtt <port> <path> [requests]
+// content of "{path}" is requested, or features when `path` is "-", which measures the transport alone
+// content is read through a fixed buffer, so a large file can be requested as well
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "protocol.h"
+
+static int compare_double(void const *a, void const *b) {
+    double x = *(double const *)a;
+    double y = *(double const *)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+    int const DEFAULT_REQUESTS = 20000;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <port> <path> [requests]\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[1]);
+    char *path = argv[2];
+    bool is_content = strcmp(path, "-");
+    int requests = argc > 3 ? atoi(argv[3]) : DEFAULT_REQUESTS;
+    if (requests <= 0) {
+        fprintf(stderr, "invalid number of requests %s\n", argv[3]);
+        return 1;
+    }
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int option_value = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        ERROR("connect");
+        return 1;
+    }
+
+    // [1][path length][path] or [4]
+    uint64_t request_len = sizeof(uint32_t) + (is_content ? sizeof(uint64_t) + strlen(path) : 0);
+    char *request = (char *)malloc(sizeof(char) * (request_len + 1));
+    uint64_t offset = append_buf_uint32(request, 0, htonl(is_content ? COMMAND_CONTENT : COMMAND_FEATURES));
+    if (is_content) {
+        offset = append_buf_uint64(request, offset, my_htonll(strlen(path)));
+        append_buf_charp(request, offset, path);
+    }
+
+    double *latencies = (double *)malloc(sizeof(double) * requests);
+    uint64_t const buf_size = 1 << 16;
+    char *buf = (char *)malloc(sizeof(char) * buf_size);
+    for (int i = 0; i < requests; i++) {
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (bulk_write(sock_fd, request, request_len) != (ssize_t)request_len) {
+            ERROR("send request %d failed", i);
+            return 1;
+        }
+        // [content length][content] or [features]
+        uint64_t len;
+        if (bulk_read(sock_fd, &len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            ERROR("receive response %d failed", i);
+            return 1;
+        }
+        for (len = is_content ? my_ntohll(len) : 0; len > 0;) {
+            ssize_t read_len = read(sock_fd, buf, MIN(buf_size, len));
+            if (read_len <= 0) {
+                ERROR("receive response %d failed", i);
+                return 1;
+            }
+            len -= read_len;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        latencies[i] = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+    }
+
+    qsort(latencies, requests, sizeof(double), compare_double);
+    double sum = 0;
+    for (int i = 0; i < requests; i++) {
+        sum += latencies[i];
+    }
+    printf("%d requests: mean %.1f us, p50 %.1f us, p99 %.1f us\n", requests, sum / requests,
+        latencies[requests / 2], latencies[(int64_t)requests * 99 / 100]);
+
+    uint32_t command = htonl(COMMAND_EXIT);
+    bulk_write(sock_fd, &command, sizeof(uint32_t));
+    close(sock_fd);
+    free(buf);
+    free(latencies);
+    free(request);
+    return 0;
+}
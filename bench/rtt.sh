@@ -0,0 +1,24 @@
+#!/bin/sh
+# round-trip latency of features, a 100-byte file and a 4 KiB file, requested one at a time
+# usage: bench/rtt.sh [server] [mode] [port], run from the repository after `make bench`
+SERVER=${1:-./server}
+MODE=${2:-fork}
+PORT=${3:-53300}
+
+DIR=$(mktemp -d)
+head -c 100 /dev/urandom > "$DIR/small"
+head -c 4096 /dev/urandom > "$DIR/page"
+
+"$SERVER" -d "$DIR" -p "$PORT" --config /dev/null --mode "$MODE" > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 0.3
+
+echo "$SERVER ($MODE)"
+for path in - small page; do
+    printf "  %-6s " "$path"
+    obj/bench_rtt "$PORT" "$path"
+done
+
+kill $SERVER_PID
+wait $SERVER_PID 2> /dev/null
+rm -rf "$DIR"
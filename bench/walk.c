@@ -0,0 +1,237 @@
+// time and system calls of walking a directory with walk(), against the walk by working directory it replaced,
+// which enters every sub-directory with chdir() and back by getcwd(), and stats every file by name
+// usage: walk <dir> [runs]
+// system calls are counted by tracing a child process with ptrace, so only on Linux
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <linux/ptrace.h>
+#include "utils.h"
+#include "walker.h"
+
+// number of entries seen, so neither walk is optimized away and both can be compared
+typedef struct {
+    uint64_t files_size;
+    uint64_t dirs_size;
+} walk_count_t;
+
+static void count_nodes(walk_node_t *dir, walk_count_t *count) {
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        if (dir->entries[i].type == WALK_DIRECTORY) {
+            count->dirs_size++;
+            count_nodes(&dir->entries[i], count);
+        }
+        else {
+            count->files_size++;
+        }
+    }
+}
+
+static int walk_fd(char *path, walk_count_t *count) {
+    int dir_fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        return -1;
+    }
+    walk_node_t root;
+    if (walk(dir_fd, ".", 1, &root) == -1) {
+        return -1;
+    }
+    count_nodes(&root, count);
+    walk_node_kill(&root);
+    return 0;
+}
+
+// walk of working directory as the server did before walk()
+static int walk_cwd_recursive(walk_count_t *count) {
+    struct stat st;
+    if (stat(".", &st) == -1) {
+        return 0;
+    }
+    DIR *dirp = opendir(".");
+    if (!dirp) {
+        return 0;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dirp))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (entry->d_type == DT_REG) {
+            if (stat(entry->d_name, &st) == 0) {
+                count->files_size++;
+            }
+        }
+        else if (entry->d_type == DT_DIR) {
+            char *cwd = getcwd(NULL, 0);
+            if (chdir(entry->d_name) == -1) {
+                free(cwd);
+                continue;
+            }
+            count->dirs_size++;
+            walk_cwd_recursive(count);
+            if (chdir(cwd) == -1) {
+                free(cwd);
+                closedir(dirp);
+                return -1;
+            }
+            free(cwd);
+        }
+    }
+    closedir(dirp);
+    return 0;
+}
+
+static int walk_cwd(char *path, walk_count_t *count) {
+    char *cwd = getcwd(NULL, 0);
+    if (chdir(path) == -1) {
+        free(cwd);
+        return -1;
+    }
+    int ret = walk_cwd_recursive(count);
+    if (chdir(cwd) == -1) {
+        ret = -1;
+    }
+    free(cwd);
+    return ret;
+}
+
+typedef int (*walk_method_t)(char *path, walk_count_t *count);
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// system calls shown by name, the others are summed
+static struct {
+    long number;
+    char *name;
+} const named_syscalls[] = {
+    { SYS_getdents64, "getdents64" },
+#ifdef SYS_statx
+    { SYS_statx, "statx" },
+#endif
+#ifdef SYS_newfstatat
+    { SYS_newfstatat, "newfstatat" },
+#endif
+#ifdef SYS_stat
+    { SYS_stat, "stat" },
+#endif
+    { SYS_openat, "openat" },
+    { SYS_close, "close" },
+    { SYS_chdir, "chdir" },
+    { SYS_getcwd, "getcwd" },
+};
+
+#define NAMED_SYSCALLS_SIZE (sizeof(named_syscalls) / sizeof(named_syscalls[0]))
+
+// run `method` once in a traced child and count system calls it makes
+// `counts` has one count for each of `named_syscalls` followed by the others
+// return 0 when success, -1 when error
+static int count_syscalls(walk_method_t method, char *path, uint64_t *counts) {
+    memset(counts, 0, sizeof(uint64_t) * (NAMED_SYSCALLS_SIZE + 1));
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        ERROR("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // stop until the parent starts tracing system calls, so only the walk is counted
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+            _exit(1);
+        }
+        raise(SIGSTOP);
+        walk_count_t count = { 0 };
+        _exit(method(path, &count) == 0 ? 0 : 1);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status)) {
+        ERROR("trace child failed");
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 && waitpid(pid, &status, 0) != -1 && WIFSTOPPED(status)) {
+        if (WSTOPSIG(status) != (SIGTRAP | 0x80)) {
+            continue;
+        }
+        struct ptrace_syscall_info info;
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) <= 0 || info.op != PTRACE_SYSCALL_INFO_ENTRY) {
+            continue;
+        }
+        uint64_t i = 0;
+        while (i < NAMED_SYSCALLS_SIZE && named_syscalls[i].number != (long)info.entry.nr) {
+            i++;
+        }
+        counts[i]++;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int bench(char *label, walk_method_t method, char *path, int runs) {
+    walk_count_t count = { 0 };
+    double best_ms = 0;
+    for (int i = 0; i < runs; i++) {
+        walk_count_t run_count = { 0 };
+        double start = now_ms();
+        if (method(path, &run_count) == -1) {
+            ERROR("walk %s failed", path);
+            return -1;
+        }
+        double ms = now_ms() - start;
+        best_ms = i == 0 || ms < best_ms ? ms : best_ms;
+        count = run_count;
+    }
+
+    uint64_t counts[NAMED_SYSCALLS_SIZE + 1];
+    if (count_syscalls(method, path, counts) == -1) {
+        ERROR("count system calls of walk %s failed", path);
+        return -1;
+    }
+    uint64_t total = 0;
+    for (uint64_t i = 0; i <= NAMED_SYSCALLS_SIZE; i++) {
+        total += counts[i];
+    }
+
+    printf("%s: %" PRIu64 " files, %" PRIu64 " directories, best of %d runs %.1f ms, %" PRIu64 " system calls\n",
+        label, count.files_size, count.dirs_size, runs, best_ms, total);
+    for (uint64_t i = 0; i < NAMED_SYSCALLS_SIZE; i++) {
+        if (counts[i]) {
+            printf("  %-12s %" PRIu64 "\n", named_syscalls[i].name, counts[i]);
+        }
+    }
+    printf("  %-12s %" PRIu64 "\n", "others", counts[NAMED_SYSCALLS_SIZE]);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int const DEFAULT_RUNS = 5;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <dir> [runs]\n", argv[0]);
+        return 1;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : DEFAULT_RUNS;
+    if (runs <= 0) {
+        fprintf(stderr, "invalid number of runs %s\n", argv[2]);
+        return 1;
+    }
+
+    if (bench("walk()", walk_fd, argv[1], runs) == -1 || bench("chdir walk", walk_cwd, argv[1], runs) == -1) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef _CHUNK_H
+#define _CHUNK_H
+
+#include <stdint.h>
+
+// content-defined chunking like FastCDC, so content shared by files or by versions of a file is split into the same
+// chunks wherever it is
+// a cut point only depends on the bytes just before it, and a chunk is CHUNK_MIN_SIZE to CHUNK_MAX_SIZE bytes,
+// about CHUNK_AVG_SIZE on average
+#define CHUNK_MIN_SIZE (1 << 14)
+#define CHUNK_AVG_SIZE (1 << 16)
+#define CHUNK_MAX_SIZE (1 << 18)
+
+// length of the first chunk of `len` bytes of `data`, which should be at least CHUNK_MAX_SIZE bytes
+// unless the content ends in it
+uint64_t chunk_cut(char const *data, uint64_t len);
+
+// called with each chunk in order, `hash` is its murmur3_128() in utils.h
+// return 0 to continue, -1 to stop
+typedef int (*chunk_visit_t)(uint64_t offset, uint64_t len, uint64_t *hash, void *arg);
+
+// read `size` bytes from `fd` and split them into chunks
+// return 0 when success, -1 when `fd` can't be read or it's stopped
+int chunk_file(int fd, uint64_t size, chunk_visit_t visit, void *arg);
+
+#endif
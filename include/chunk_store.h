@@ -0,0 +1,42 @@
+#ifndef _CHUNK_STORE_H
+#define _CHUNK_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// local chunks by their 128-bit hashes, so a chunk which is already in a local file is copied instead of transferred
+// chunks are kept in an open addressing table in a memory-mapped file, which is neither loaded nor parsed,
+// so a lookup touches about one page however many chunks there are
+// a file having chunks is only trusted while its size and mtime are the recorded ones, and a copied chunk should
+// still be checked against its hash
+// it's safe to be used by several threads
+typedef struct chunk_store chunk_store_t;
+
+// use files "{dir}/chunks" and "{dir}/chunk_files", directory `dir` must exist
+// a store which isn't closed by chunk_store_close() is dropped
+// return NULL when error
+chunk_store_t *chunk_store_open(char *dir);
+
+// save the store and close it
+void chunk_store_close(chunk_store_t *store);
+
+// record that file `path` of `size` bytes with mtime `mtime` has the chunks added with the returned id,
+// chunks recorded for the path before are dropped
+uint32_t chunk_store_add_file(chunk_store_t *store, char *path, uint64_t size, struct timespec mtime);
+
+// whether file `path` is recorded and still as recorded
+bool chunk_store_has_file(chunk_store_t *store, char *path);
+
+// record chunk `hash` of `len` bytes at `offset` of file `file`, a chunk already recorded elsewhere is kept
+void chunk_store_add_chunk(chunk_store_t *store, uint32_t file, uint64_t *hash, uint64_t offset, uint64_t len);
+
+// find chunk `hash` of `len` bytes, `*file` and `*offset` are set to where it is
+// return 0 when found, -1 otherwise
+int chunk_store_find(chunk_store_t *store, uint64_t *hash, uint64_t len, uint32_t *file, uint64_t *offset);
+
+// open file `file` for reading if it's still as recorded, otherwise its chunks are dropped
+// return fd when success, -1 when error
+int chunk_store_open_file(chunk_store_t *store, uint32_t file);
+
+#endif
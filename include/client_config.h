@@ -9,6 +9,19 @@ typedef struct {
     char *remote_dir;
     char *local_dir;
     char *config_path;
+    int pipeline_window;
+    int parallelism;
+    // whether content is requested compressed, on or off
+    char *compression;
+    // a file at least `stripe_threshold` MiB is received by at most `max_stripes` connections at once
+    int stripe_threshold;
+    int max_stripes;
+    // whether content found in local files is copied instead of transferred, on or off
+    char *dedup;
+    // whether large files are requested by chunks, so only chunks not found locally are transferred, on or off
+    char *chunking;
+    // send and receive buffer size of a connection in KiB, 0 when autotuned by the kernel
+    int socket_buffer;
     bool is_query_mode;
 } config_t;
 
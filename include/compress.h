@@ -0,0 +1,30 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdint.h>
+
+// LZ4 block format codec, blocks are at most COMPRESS_BLOCK_SIZE bytes so matches are always in the block
+#define COMPRESS_BLOCK_SIZE (1 << 16)
+
+// level 1 is the fastest, higher level searches more matches for a better ratio
+#define COMPRESS_MIN_LEVEL 1
+#define COMPRESS_MAX_LEVEL 6
+
+typedef struct compressor compressor_t;
+
+compressor_t *compressor_init();
+
+void compressor_kill(compressor_t *compressor);
+
+// max compressed length of `len` bytes
+uint64_t compress_bound(uint64_t len);
+
+// compress `len` bytes of `src` into `dst`, which must be at least compress_bound(`len`) long
+// return compressed length
+uint64_t compress_block(compressor_t *compressor, char const *src, uint64_t len, char *dst, int level);
+
+// decompress `len` bytes of `src` into `dst`, which is `capacity` long
+// return decompressed length, -1 when `src` is invalid
+int64_t decompress_block(char const *src, uint64_t len, char *dst, uint64_t capacity);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _CONTENT_CACHE_H
+#define _CONTENT_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// on-disk cache of compressed content, one file per served file keyed by its path, device, inode, size and mtime
+// cached files are the blocks of COMMAND_COMPRESSED_CONTENT response, and the least recently used ones
+// are removed when the cache is larger than its limit
+// counters and size are shared by processes forked after it's created
+typedef struct content_cache content_cache_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    // bytes sent from the cache
+    uint64_t hit_bytes;
+    uint64_t insertions;
+    uint64_t evictions;
+    // bytes in the cache
+    uint64_t size;
+} content_cache_stats_t;
+
+// use directory `dir` for at most `max_size` bytes, `dir` is created if it doesn't exist
+// return NULL when error
+content_cache_t *content_cache_init(char *dir, uint64_t max_size);
+
+// open cached content of `path` whose status is `st`, and count a hit or a miss
+// `*len` is set to the cached length
+// return fd when success, -1 when it isn't cached
+int content_cache_open(content_cache_t *cache, char *path, struct stat *st, uint64_t *len);
+
+// create a temporary file to be filled with content of `path`, then passed to content_cache_commit()
+// `*temp_name` should be passed to content_cache_commit()
+// return fd when success, -1 when error
+int content_cache_create(content_cache_t *cache, char **temp_name);
+
+// add the temporary file as content of `path` whose status is `st` if `is_complete`, otherwise remove it
+// `fd` is closed and `temp_name` is freed
+void content_cache_commit(content_cache_t *cache, char *path, struct stat *st, int fd, char *temp_name,
+    bool is_complete);
+
+void content_cache_get_stats(content_cache_t *cache, content_cache_stats_t *stats);
+
+#endif
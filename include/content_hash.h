@@ -0,0 +1,25 @@
+#ifndef _CONTENT_HASH_H
+#define _CONTENT_HASH_H
+
+#include <stdint.h>
+
+// 128-bit content hashes of served files, cached by path, size and mtime
+// the cache is a fixed table shared by processes forked after it's created, a slot is simply replaced
+// when another file takes it
+typedef struct content_hash_cache content_hash_cache_t;
+
+// cache at most `slots_size` hashes
+// return NULL when error
+content_hash_cache_t *content_hash_init(uint64_t slots_size);
+
+// get content hash of file `path` relative to `dir_fd`, whose size and mtime are those in a manifest
+// the file is read and hashed if it isn't cached
+// return 0 when success, -1 when it can't be read or it's changed
+int content_hash_get(content_hash_cache_t *cache, int dir_fd, char *path, uint64_t size, int64_t mtime_sec,
+    uint32_t mtime_nsec, uint64_t *hash);
+
+// hash `size` bytes of `fd` from its current offset, the same way as content_hash_get()
+// return 0 when success, -1 when they can't be read
+int content_hash_read(int fd, uint64_t size, uint64_t *hash);
+
+#endif
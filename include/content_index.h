@@ -0,0 +1,31 @@
+#ifndef _CONTENT_INDEX_H
+#define _CONTENT_INDEX_H
+
+#include <stdint.h>
+#include <time.h>
+
+// local files by their 128-bit content hashes, so content which is already somewhere locally is copied
+// instead of transferred
+// a file is only trusted while its size and mtime are still the recorded ones, nothing is hashed by the index,
+// so content copied from a found file should be checked against its hash
+// it's safe to be used by several threads
+typedef struct content_index content_index_t;
+
+// load what's encoded by content_index_encode(), an empty index is made if `data` is NULL or invalid
+content_index_t *content_index_init(char const *data, uint64_t len);
+
+void content_index_kill(content_index_t *index);
+
+// record that file `path` of `size` bytes with mtime `mtime` has content `hash`, which may be written later,
+// another file recorded with the same content is kept if it's still as recorded
+void content_index_add(content_index_t *index, uint64_t *hash, char *path, uint64_t size, struct timespec mtime);
+
+// find a file with content `hash` of `size` bytes which is still as recorded
+// return its path which should be freed by caller, NULL when there's none
+char *content_index_find(content_index_t *index, uint64_t *hash, uint64_t size);
+
+// encode files which are still as recorded
+// return data which should be freed by caller, whose length is set to `*len`
+char *content_index_encode(content_index_t *index, uint64_t *len);
+
+#endif
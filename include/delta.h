@@ -0,0 +1,39 @@
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include <stdint.h>
+
+// rsync-like delta of a file against an old copy on the other side
+// the old copy is described by signatures of its full blocks, and the new content
+// is made of blocks of the old copy and literal data
+
+// signature of a block
+typedef struct {
+    // weak_checksum() in utils.h
+    uint32_t weak;
+    // murmur3_128() in utils.h
+    uint64_t strong[2];
+} delta_signature_t;
+
+// [weak][strong] on the wire, weak is uint32 and strong is two uint64, all in network order
+#define DELTA_SIGNATURE_LEN (sizeof(uint32_t) + 2 * sizeof(uint64_t))
+// server rejects more signatures, which cover a copy of 400 GiB at the largest block size
+#define MAX_DELTA_SIGNATURES_LEN (1 << 26)
+
+// block size of an old copy of `size` bytes, about its square root
+uint64_t delta_block_size(uint64_t size);
+
+void delta_sign(void const *block, uint64_t len, delta_signature_t *signature);
+
+// called with each piece of the new content in order
+// if `block` is -1, `data` is `len` bytes of literal data, otherwise `len` blocks are copied from `block`
+// return 0 to continue, -1 to stop
+typedef int (*delta_visit_t)(char *data, uint64_t len, int64_t block, void *arg);
+
+// read `size` bytes from `fd` and describe them with blocks in `signatures` of `block_size` bytes
+// consecutive blocks are merged into one piece
+// return 0 when success, -1 when `fd` can't be read, memory can't be allocated or it's stopped
+int delta_generate(int fd, uint64_t size, uint64_t block_size, delta_signature_t *signatures,
+    uint64_t signatures_size, delta_visit_t visit, void *arg);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _IO_RING_H
+#define _IO_RING_H
+
+#include <stdint.h>
+
+// minimal io_uring with registered buffers, made by system calls directly
+// a ring is used by one thread only
+typedef struct io_ring io_ring_t;
+
+// create a ring of at least `entries` requests in flight and `bufs_size` registered buffers of `buf_len` bytes
+// only supported on Linux
+// return NULL when the kernel doesn't support it
+io_ring_t *ring_init(unsigned entries, int bufs_size, uint64_t buf_len);
+
+// all requests must be completed before killed
+void ring_kill(io_ring_t *ring);
+
+// registered buffer `index`
+char *ring_buf(io_ring_t *ring, int index);
+
+// queue reading `len` bytes from `fd` at `offset` into registered buffer `index` at `buf_offset`
+// `offset` is -1 for the current position, e.g. of a socket
+// `data` is returned with the completion
+// return 0 when success, -1 when the ring is full
+int ring_read(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data);
+
+// same as ring_read() but write
+int ring_write(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data);
+
+// submit queued requests and wait for a completion
+// `*res` is the result of the request like read() or write() except that error is -errno
+// return 0 when success, -1 when error
+int ring_wait(io_ring_t *ring, uint64_t *data, int32_t *res);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef _LOCAL_INDEX_H
+#define _LOCAL_INDEX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// local files and directories as of the last sync, so an entry which server still has as recorded is known to be
+// synced without touching it
+// entries are kept by 128-bit hashes of their paths in an open addressing table in a memory-mapped file
+// recorded directories are checked once when it's opened, an entry directly in a directory whose inode and mtime
+// are unchanged is trusted, since creating, removing or renaming it changes the mtime, otherwise an entry is only
+// trusted if the directory still has it with the recorded inode
+// a file edited in place isn't noticed, as client only updates a file whose server mtime is newer anyway
+// it isn't thread-safe
+typedef struct local_index local_index_t;
+
+// use files "{dir}/local_index" and "{dir}/local_dirs", directory `dir` must exist
+// an index which isn't closed by local_index_close() is dropped
+// return NULL when error
+local_index_t *local_index_open(char *dir);
+
+// record expected files which are synced, and the status of recorded directories, then save the index and close it
+void local_index_close(local_index_t *index);
+
+// whether `path` is trusted and recorded with server mtime `mtime`, `size` and content `hash`, which may be NULL
+bool local_index_is_synced(local_index_t *index, char *path, bool is_dir, struct timespec mtime, uint64_t size,
+    uint64_t *hash);
+
+// record that `path` whose local status is `st` is synced with server mtime `mtime`, `size` and content `hash`
+// `st` is only used for files, a directory is checked when the index is closed
+void local_index_add(local_index_t *index, char *path, bool is_dir, struct timespec mtime, uint64_t size,
+    uint64_t *hash, struct stat *st);
+
+// drop file `path`, which is recorded when the index is closed if its mtime isn't older than `mtime` by then
+void local_index_expect(local_index_t *index, char *path, struct timespec mtime, uint64_t size, uint64_t *hash);
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _MANIFEST_CACHE_H
+#define _MANIFEST_CACHE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include "walker.h"
+
+// immutable manifest of the served tree
+// nodes are stored as structure of arrays and node 0 is the root
+// children of a directory are contiguous and sorted by name
+typedef struct {
+    atomic_int refs;
+    // position in the change journal
+    uint64_t epoch;
+    uint64_t generation;
+
+    uint32_t nodes_size;
+    uint64_t *name_offsets;
+    uint8_t *types;
+    uint16_t *permissions;
+    int64_t *mtime_secs;
+    uint32_t *mtime_nsecs;
+    uint64_t *sizes;
+    // only for directory
+    uint32_t *first_children;
+    uint32_t *children_sizes;
+    int *wds;
+    // merkle hash like walk_hash()
+    uint64_t *hashes;
+
+    // '\0'-terminated names pointed by `name_offsets`
+    char *names;
+    uint64_t names_len;
+} manifest_snapshot_t;
+
+typedef struct manifest_cache manifest_cache_t;
+
+// walk current working directory and keep its manifest up to date with inotify in a background thread
+// every rebuilt snapshot has a new generation, and paths changed in it are recorded in a journal
+// of the latest `journal_size` changes, the journal starts over with a new epoch when the process starts
+// only supported on Linux
+// return NULL when error
+manifest_cache_t *cache_init(uint64_t journal_size);
+
+// get the latest snapshot, which must be released after used
+// return NULL when the cache can't be trusted anymore
+manifest_snapshot_t *cache_acquire(manifest_cache_t *cache);
+
+// get the latest snapshot like cache_acquire() and paths in directory `path` changed since `generation` of `epoch`
+// changed paths are relative to `path`, unique, and sorted by depth then by name,
+// so entries of the same directory are adjacent and come after their parent
+// `*paths` and its elements should be freed by caller
+// return 0 when success, -1 when the changes are no longer in the journal, `*snapshot` is still set
+int cache_acquire_changes(manifest_cache_t *cache, char *path, uint64_t epoch, uint64_t generation,
+    manifest_snapshot_t **snapshot, char ***paths, uint64_t *paths_size);
+
+void snapshot_release(manifest_snapshot_t *snapshot);
+
+// find `path` relative to the root, "." and empty components are skipped
+// return its node, -1 when it's not in `snapshot`
+int64_t snapshot_find(manifest_snapshot_t *snapshot, char *path);
+
+// same as snapshot_find() but only for directory
+int64_t snapshot_find_dir(manifest_snapshot_t *snapshot, char *path);
+
+// status of `node` without entries, name points into `snapshot`
+void snapshot_node(manifest_snapshot_t *snapshot, uint32_t node, walk_node_t *walk_node);
+
+// same as walk() but read from directory node `dir` of `snapshot`
+// names point into `snapshot`, so `snapshot` must be released after `root` is killed
+void snapshot_walk(manifest_snapshot_t *snapshot, uint32_t dir, char *name, walk_node_t *root);
+
+// same as walk_stream() but read from directory node `dir` of `snapshot`
+// return 0 when success, -1 when walking is stopped
+int snapshot_walk_stream(manifest_snapshot_t *snapshot, uint32_t dir, walk_visit_t visit, void *arg);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef _MANIFEST_TREE_H
+#define _MANIFEST_TREE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// JSON manifest parsed into a flat tree without a JSON tree in between, nodes are in one array where entries of a
+// directory are adjacent, and names are interned in one arena, so it's freed at once
+
+typedef enum {
+    MANIFEST_UNKNOWN,
+    MANIFEST_FILE,
+    MANIFEST_DIRECTORY
+} manifest_type_t;
+
+typedef struct {
+    // offset of name in the arena, or of path for a record of COMMAND_STREAM_INFO
+    uint64_t name;
+    // entries are nodes [entries, entries + entries_size)
+    uint64_t entries;
+    uint64_t entries_size;
+    int64_t mtime_sec;
+    mode_t permission;
+    manifest_type_t type;
+} manifest_node_t;
+
+typedef struct {
+    manifest_node_t *nodes;
+    uint64_t nodes_size;
+    uint64_t nodes_capacity;
+    // names terminated by '\0', the first one is ""
+    char *names;
+    uint64_t names_len;
+    uint64_t names_capacity;
+    // the root of COMMAND_INFO, or records of a frame of COMMAND_STREAM_INFO
+    uint64_t roots;
+    uint64_t roots_size;
+} manifest_tree_t;
+
+// parse info of COMMAND_INFO, or a frame of COMMAND_STREAM_INFO, in `data` of `len` bytes into `tree`
+// unknown keys are skipped, and a name of an entry which is empty, has '/', or is "." or ".." is malformed
+// return 0 when success, -1 when it's malformed, then `tree` is killed
+int manifest_tree_parse(manifest_tree_t *tree, char const *data, uint64_t len);
+
+void manifest_tree_kill(manifest_tree_t *tree);
+
+#endif
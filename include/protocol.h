@@ -0,0 +1,97 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+// commands sent from client, each is a uint32 followed by its arguments
+typedef enum {
+    // [0][path length][path] -> [info length][info]
+    COMMAND_INFO = 0,
+    // [1][path length][path] -> [content length][content]
+    COMMAND_CONTENT = 1,
+    // [2]
+    COMMAND_EXIT = 2,
+    // [3] -> [path length][path]
+    COMMAND_WORKING_DIR = 3,
+    // [4] -> [features]
+    // server which doesn't know it won't respond
+    COMMAND_FEATURES = 4,
+    // [5][path length][path] -> ([frame length][frame])... [0]
+    // each frame is a json array of {"path", "entries"}, one for each directory,
+    // a directory is always sent after its parent, and entries of a directory are sorted by name
+    COMMAND_STREAM_INFO = 5,
+    // [6][path length][path] -> ([frame length][frame])... [0]
+    // same as COMMAND_STREAM_INFO, but each frame is a binary manifest described in utils.h
+    COMMAND_BINARY_INFO = 6,
+    // [7][path length][path][epoch][generation] -> [epoch][generation][is full] ([frame length][frame])... [0]
+    // epoch, generation and is full are uint64
+    // frames are the same as COMMAND_BINARY_INFO, epoch and generation are those of the server manifest,
+    // if the client's are still in the journal, frames only have entries changed since then,
+    // otherwise (is full is 1) the whole directory is sent
+    COMMAND_CHANGES = 7,
+    // [8][path length][path][hashes length][hashes] -> ([frame length][frame])... [0]
+    // hashes are merkle hashes of directories the client synced last time, as a directory hash list in utils.h,
+    // hashes length is at most MAX_DIR_HASHES_LEN
+    // frames are the same as COMMAND_BINARY_INFO, but only directories whose hashes differ are sent,
+    // with their sub-trees skipped otherwise, each record is preceded by the directory hash as uint64
+    COMMAND_MERKLE = 8,
+    // [9][path length][path][block size][signatures length][signatures] -> [content length]([instruction])... [end]
+    // signatures are those of full blocks of the client copy, described in delta.h,
+    // and the content is rebuilt by instructions in delta_instruction_t
+    COMMAND_DELTA = 9,
+    // [10][path length][path] -> [content length]([raw length][stored length][data])...
+    // content is split into blocks of at most COMPRESS_BLOCK_SIZE bytes in compress.h,
+    // data is compressed unless stored length equals raw length, both lengths are uint32
+    COMMAND_COMPRESSED_CONTENT = 10,
+    // [11] -> [stats length][stats]
+    // stats is a json object of server counters
+    COMMAND_STATS = 11,
+    // [12][path length][path][offset][length] -> [content length][content]
+    // content is at most length bytes of the file from offset, empty if offset isn't before its end
+    COMMAND_RANGE_CONTENT = 12,
+    // [13][path length][path][names length]([name length][name])... -> [bundle length]([content length][content])...
+    // names are paths relative to the directory path, and name length is varint,
+    // contents of the files are responded in order, bundle length is the total length of what follows
+    COMMAND_BATCH_CONTENT = 13,
+    // [14][min size]
+    // binary manifests sent later on the connection have content hashes of files of at least min size bytes,
+    // nothing is responded
+    COMMAND_CONTENT_HASHES = 14,
+    // [15][path length][path] -> [list length][size][mtime sec][mtime nsec]([chunk length][hash])...
+    // the file is split into chunks by chunk.h, chunk length is varint and hash is two uint64,
+    // the list is empty if the file can't be read
+    COMMAND_CHUNK_LIST = 15,
+    // [16][path length][path][size][mtime sec][mtime nsec][ranges length]([offset][length])...
+    // -> [content length][content]
+    // ranges of the file are responded in order if its size and mtime are still those in its chunk list,
+    // otherwise the content is empty, offset and length are varints and ranges must be ascending
+    COMMAND_CHUNK_CONTENT = 16
+} command_t;
+
+// server closes the connection for longer directory hashes, then client sends none instead
+#define MAX_DIR_HASHES_LEN (1 << 24)
+
+// optional commands supported by server, responded as a uint64 bitmask
+typedef enum {
+    FEATURE_STREAM_INFO = 1 << 0,
+    FEATURE_BINARY_INFO = 1 << 1,
+    FEATURE_CHANGES = 1 << 2,
+    FEATURE_MERKLE = 1 << 3,
+    FEATURE_DELTA = 1 << 4,
+    FEATURE_COMPRESSION = 1 << 5,
+    FEATURE_STATS = 1 << 6,
+    FEATURE_RANGE_CONTENT = 1 << 7,
+    FEATURE_BATCH_CONTENT = 1 << 8,
+    FEATURE_CONTENT_HASHES = 1 << 9,
+    FEATURE_CHUNKS = 1 << 10
+} feature_t;
+
+// instructions of COMMAND_DELTA response, each is a uint32 followed by its arguments
+typedef enum {
+    // [0][first block][blocks size]: copy blocks of the client copy
+    DELTA_COPY = 0,
+    // [1][length][data]
+    DELTA_LITERAL = 1,
+    // [2]
+    DELTA_END = 2
+} delta_instruction_t;
+
+#endif
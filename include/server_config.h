@@ -7,6 +7,24 @@ typedef struct {
     int port;
     char *work_dir;
     char *config_path;
+    // "fork" or "epoll"
+    char *mode;
+    // number of threads handling connections in epoll mode
+    int threads;
+    // number of threads walking a requested directory
+    int scan_threads;
+    // "walk" or "cache"
+    char *manifest;
+    // number of changes kept for incremental manifests in cache mode
+    int journal_size;
+    // directory of compressed content cache, empty when disabled
+    char *compress_cache_dir;
+    // max size of compressed content cache in MiB
+    int compress_cache_size;
+    // send and receive buffer size of a connection in KiB, 0 when autotuned by the kernel
+    int socket_buffer;
+    // seconds a connection may stall in the middle of a request, 0 when it may wait forever
+    int timeout;
 } config_t;
 
 extern config_t config;
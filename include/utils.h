@@ -3,10 +3,13 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
 #include <sys/errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #define ERROR(...) do {\
     fprintf(stderr, "[ERROR] ");\
@@ -30,6 +33,7 @@
 } while (0)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 // extend `*buf` to at least `new_buf_size` long, data may be cleared
 // `new_buf_size` doesn't include the terminating '\0'
@@ -43,9 +47,132 @@ uint64_t append_buf_uint32(char *buf, uint64_t offset, uint32_t data);
 uint64_t append_buf_uint64(char *buf, uint64_t offset, uint64_t data);
 uint64_t append_buf_charp(char *buf, uint64_t offset, char *data);
 
+// varint is little-endian base 128, `data` takes at most `VARINT_MAX_LEN` bytes
+#define VARINT_MAX_LEN 10
+uint64_t append_buf_varint(char *buf, uint64_t offset, uint64_t data);
+
+// read varint from `buf[*offset]` and advance `*offset`
+// `buf_len` is the valid length of `buf`
+// return 0 when success, -1 when `buf` is truncated or malformed
+int read_buf_varint(char const *buf, uint64_t buf_len, uint64_t *offset, uint64_t *data);
+
+// binary manifest is a sequence of directory records, all integers are varints
+// record: [path length][path][entries size][entry]...
+// entry: [shared length][suffix length][suffix][has hash << 13 | permission << 1 | is directory][mtime sec][mtime nsec]
+//     ([size])([hash])
+// name of an entry is the first "shared length" bytes of the previous name in the record followed by suffix
+// entries of a record are sorted by name with strcmp, so client merges them with its local directory
+// mtime sec is zigzag encoded, size is only for files, hash is 128-bit content hash as two uint64 in network order
+// and only for files when it's requested
+
+// file or directory in binary manifest
+typedef struct {
+    char *name;
+    bool is_dir;
+    mode_t permission;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t size;
+    bool has_hash;
+    uint64_t hash[2];
+} manifest_entry_t;
+
+// upper bound of encoded length
+#define MANIFEST_DIR_MAX_LEN(path_len) (2 * VARINT_MAX_LEN + (path_len))
+#define MANIFEST_ENTRY_MAX_LEN(name_len) (6 * VARINT_MAX_LEN + 2 * sizeof(uint64_t) + (name_len))
+
+// `buf` should be long enough
+// `prev_name` is name of the previous entry in the record, NULL for the first one
+// return valid buffer length after appending
+uint64_t append_buf_manifest_dir(char *buf, uint64_t offset, char *path, uint64_t entries_size);
+uint64_t append_buf_manifest_entry(char *buf, uint64_t offset, char *prev_name, manifest_entry_t *entry);
+
+// whether `path` of `len` bytes stays in the directory it's relative to, so it isn't empty or absolute,
+// and none of its components is ".."
+bool is_contained_path(char const *path, uint64_t len);
+
+// read from `buf[*offset]` and advance `*offset`
+// `*path` is allocated and should be freed by caller
+// `name` holds name of the previous entry in the record (must be "" for the first one) and has `NAME_MAX + 1` bytes,
+// it's overwritten by the read name which `entry->name` points to
+// a directory path which is empty, absolute or has a ".." component is malformed
+// return 0 when success, -1 when `buf` is truncated or malformed
+int read_buf_manifest_dir(char const *buf, uint64_t buf_len, uint64_t *offset, char **path, uint64_t *entries_size);
+int read_buf_manifest_entry(char const *buf, uint64_t buf_len, uint64_t *offset, char *name, manifest_entry_t *entry);
+
+// directory hash list: [path length][path][hash]..., path length is varint, hash is uint64 in network order
+// paths are relative to the requested directory, which is "."
+#define DIR_HASH_MAX_LEN(path_len) (VARINT_MAX_LEN + (path_len) + sizeof(uint64_t))
+
+// `buf` should be long enough
+// return valid buffer length after appending
+uint64_t append_buf_dir_hash(char *buf, uint64_t offset, char *path, uint64_t hash);
+
+// read from `buf[*offset]` and advance `*offset`
+// `*path` is allocated and should be freed by caller
+// return 0 when success, -1 when `buf` is truncated or malformed
+int read_buf_uint64(char const *buf, uint64_t buf_len, uint64_t *offset, uint64_t *data);
+int read_buf_dir_hash(char const *buf, uint64_t buf_len, uint64_t *offset, char **path, uint64_t *hash);
+
+// 64-bit FNV-1a, start from `HASH_INIT` and feed data piece by piece
+#define HASH_INIT 0xcbf29ce484222325ULL
+uint64_t hash_bytes(uint64_t hash, void const *data, uint64_t len);
+// `data` is fed in little-endian, so the hash doesn't depend on host byte order
+uint64_t hash_uint64(uint64_t hash, uint64_t data);
+
+// rolling checksum of rsync: the low 16 bits are the sum of bytes `a`,
+// the high 16 bits are the sum of `a` after each byte `b`
+// when byte `out` leaves a window of `len` bytes and `in` enters, `a` becomes `a - out + in`
+// and `b` becomes `b - len * out + new a`
+uint32_t weak_checksum(void const *data, uint64_t len);
+
+// MurmurHash3 x64 128-bit of `data`, stored in `hash[0]` and `hash[1]`
+// data is read in little-endian, so the hash doesn't depend on host byte order
+void murmur3_128(void const *data, uint64_t len, uint64_t *hash);
+
 // use loop to make sure all data is read / written
 ssize_t bulk_read(int fd, void *buf, size_t len);
 ssize_t bulk_write(int fd, void const *buf, size_t len);
+// write at `offset` without moving the file offset, so threads can write the same file
+ssize_t bulk_pwrite(int fd, void const *buf, size_t len, off_t offset);
+
+// buffered connection of a socket, reads are served from a buffer filled by one read() as large as possible,
+// and a message is written in one call instead of one per field
+// reading and writing can be done by different threads, but each by one thread at a time
+typedef struct {
+    int fd;
+    // received bytes not read yet are buf[start, end)
+    char *buf;
+    uint64_t start;
+    uint64_t end;
+} transport_t;
+
+#define TRANSPORT_BUF_LEN (1 << 16)
+
+void transport_init(transport_t *transport, int fd);
+// `fd` isn't closed
+void transport_kill(transport_t *transport);
+
+// like bulk_read(), but a read no smaller than the buffer bypasses it once buffered bytes are consumed
+ssize_t transport_read(transport_t *transport, void *buf, size_t len);
+// like read(), buffered bytes are returned if there are any, otherwise `fd` is read once
+ssize_t transport_read_some(transport_t *transport, void *buf, size_t len);
+// bytes received but not read yet, which a poll on `fd` doesn't see
+uint64_t transport_buffered(transport_t *transport);
+
+// write all of `iov` by sendmsg(), `iov` is modified
+// if `has_more`, the kernel may hold a partial segment for following data (MSG_MORE), so the last write of a
+// message mustn't have it
+// return written length like bulk_write()
+ssize_t transport_writev(transport_t *transport, struct iovec *iov, int iov_size, bool has_more);
+ssize_t transport_write(transport_t *transport, void const *buf, size_t len, bool has_more);
+// write [len][data] in one call, len is uint64 in network order
+// return 0 when success, -1 when error
+int transport_write_frame(transport_t *transport, void const *data, uint64_t len, bool has_more);
+
+// set send and receive buffers of socket `fd` to `size` bytes, they're left autotuned if `size` is 0
+// return 0 when success, -1 when error
+int set_socket_buffers(int fd, int size);
 
 // ntohll and htonll are only in macOS
 uint64_t my_ntohll(uint64_t n);
@@ -0,0 +1,70 @@
+#ifndef _WALKER_H
+#define _WALKER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+    WALK_NONE,
+    WALK_FILE,
+    WALK_DIRECTORY
+} walk_type_t;
+
+// status of a file or directory
+typedef struct walk_node {
+    // points into name pool of its parent directory
+    char *name;
+    walk_type_t type;
+    mode_t permission;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint64_t size;
+
+    // only for directory
+    struct walk_node *entries;
+    uint64_t entries_size;
+    char *names;
+    // merkle hash of the whole directory, only set by walk_hash() and snapshot
+    uint64_t hash;
+} walk_node_t;
+
+// walk directory `dir_fd` recursively and store result in `*root`
+// `root->name` is set to `name`, which isn't copied
+// only regular files and directories are recorded, unreadable entries are skipped
+// entries are sorted by name, so the result doesn't depend on `threads_size`
+// directories are scanned by `threads_size` threads when it's greater than 1
+// `dir_fd` is closed when returned
+// return 0 when success, -1 when `dir_fd` can't be read
+int walk(int dir_fd, char *name, int threads_size, walk_node_t *root);
+
+// read status of directory `dir_fd` and its entries into `dir` without walking sub-directories
+// `dir->name` isn't touched, sub-directories in entries have no entries
+// `dir_fd` isn't closed
+// return 0 when success, -1 when error, entries read so far are kept
+int walk_entries(int dir_fd, walk_node_t *dir);
+
+// called when entries of directory `path` are read, before its sub-directories are walked
+// entries of `dir->entries` aren't read yet
+// return 0 to continue, -1 to stop walking
+typedef int (*walk_visit_t)(char *path, walk_node_t *dir, void *arg);
+
+// walk directory `dir_fd` recursively in pre-order without keeping the whole tree
+// `path` of `dir_fd` itself is ".", others are relative to it
+// sub-directories are visited in the order of entries
+// a sub-directory which can't be entered is still listed in its parent but never visited
+// `dir_fd` is closed when returned
+// return 0 when success, -1 when `dir_fd` can't be read or walking is stopped
+int walk_stream(int dir_fd, walk_visit_t visit, void *arg);
+
+// feed status of `entry` into `hash`: name, type, permission and mtime,
+// size for a file and merkle hash for a directory, whose size differs between file systems
+uint64_t walk_hash_entry(uint64_t hash, walk_node_t *entry);
+
+// set merkle hash of directory `dir` and its sub-directories recursively,
+// which is hashed over its entries with walk_hash_entry() from `HASH_INIT`
+void walk_hash(walk_node_t *dir);
+
+// release entries of `node` recursively, `node` itself isn't freed
+void walk_node_kill(walk_node_t *node);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _WORK_QUEUE_H
+#define _WORK_QUEUE_H
+
+#include <stdbool.h>
+
+// thread-safe FIFO queue of `void *` items
+typedef struct work_queue work_queue_t;
+
+work_queue_t *queue_init();
+
+// append `item` to the queue, it's ignored if the queue is closed
+void queue_push(work_queue_t *queue, void *item);
+
+// take the first item, block until there's one
+// return NULL when the queue is closed and empty
+void *queue_pop(work_queue_t *queue);
+
+// take the first item without blocking
+// return whether an item is taken
+bool queue_try_pop(work_queue_t *queue, void **item);
+
+// no more item will be pushed, wake up all blocked `queue_pop`
+void queue_close(work_queue_t *queue);
+
+// remaining items are released by `release` if it isn't NULL
+void queue_kill(work_queue_t *queue, void (*release)(void *));
+
+#endif
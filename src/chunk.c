@@ -0,0 +1,145 @@
+#include "chunk.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "utils.h"
+
+// normalized chunking: a cut point is harder to find before the average size and easier after it,
+// so most chunks are close to the average
+// masks take the high bits of the gear hash, which depend on the most bytes
+#define MASK_SMALL (~0ULL << (64 - 18))
+#define MASK_LARGE (~0ULL << (64 - 14))
+
+// random value of each byte, fixed so both sides cut the same content at the same points
+static uint64_t const GEAR[256] = {
+    0x66c853c930379e12ULL, 0x1d3a88d2e4d5c04bULL, 0x38558538f0d0894fULL, 0xc8e3b14edcf325f4ULL,
+    0xf51020d72e77ecc6ULL, 0x1c656bf5dc9a6bdfULL, 0xbbde04a8225e7d5cULL, 0xdeb07b4e1bbc9bddULL,
+    0x057e29f611401bf3ULL, 0xf84613c454adb642ULL, 0x65268db5a0396c60ULL, 0x49208ee6a22c4e1fULL,
+    0x97044c4ae0a69577ULL, 0xdb8b5579b3e76622ULL, 0x0cf2165952f842e5ULL, 0xa6f2c1f8500e0430ULL,
+    0xc46a7a862d86f2e1ULL, 0xb472d9bc6d100040ULL, 0x73a19c01ae5d6981ULL, 0x1f76a0b190a127d4ULL,
+    0x5fd0756a24fed749ULL, 0x09e1dfcf8f6bef93ULL, 0x50b5f7461fbce263ULL, 0xeabcf437a87d79a1ULL,
+    0xc944168390c81da2ULL, 0xe1129636cbe08759ULL, 0x6635995d2d3c3c78ULL, 0x03f409db43e2826dULL,
+    0x01259fdd2115a414ULL, 0x23af5d874d8aeeafULL, 0xc870077f257edb69ULL, 0x1b2fa4e7ab3ed49aULL,
+    0xbc24bed4dbbbb7aaULL, 0xeb7536d788bec630ULL, 0x847e1fabbac758b6ULL, 0x38cc6726a3759cd6ULL,
+    0x92a1bb632186c16dULL, 0x47b1ae743be31edbULL, 0xa1423129c362d973ULL, 0x32298b501ace40e2ULL,
+    0x3e46a0881f855faeULL, 0xae6d5f0c77f23ffeULL, 0xf14322a44860fd2bULL, 0xf57fc272cce78a96ULL,
+    0x914be0bc1bdc481cULL, 0x23e7c89e7c07ca4aULL, 0x54b61b4bfac2d460ULL, 0x3b8f9da88faa9bc7ULL,
+    0x19d4cac31f23ae8dULL, 0xefa35337c27566e9ULL, 0xffe7ab9af5410fecULL, 0x474aef41e89720beULL,
+    0x50c3cf2b9dd79c32ULL, 0x48fc184477321597ULL, 0xcc6aab2630f85380ULL, 0xabc8e21df132cb81ULL,
+    0x758bb114dbddb204ULL, 0x506df377efcd9fb2ULL, 0xb4e1e75ffe898efcULL, 0xd9521dbf50926590ULL,
+    0xfb91ab423d5bf507ULL, 0xd26480c763d43616ULL, 0x6c6ff60b0e1e298dULL, 0xcde9d2ae6b34bed7ULL,
+    0x341dd3084198f6e7ULL, 0x706d6457a36b56afULL, 0x6794ce94435fad1fULL, 0x960aeea7f415d3ddULL,
+    0x619076b1855237a2ULL, 0x36d11f039d4217c1ULL, 0xeae079485dc626e8ULL, 0x1eb13f155f8e79ffULL,
+    0xbff3b8ae6bfde0feULL, 0x25a6d6430e729bd7ULL, 0x4408cfe0c2a661bcULL, 0x6c135c6b887905fcULL,
+    0xeb717143a45d4d1aULL, 0x3d15b23676bd2a4aULL, 0xe579c9daa431a3f1ULL, 0xde3befe2b65cc796ULL,
+    0x5869d71c5d8f4d01ULL, 0x94f62f3cca276684ULL, 0xb91615204a088cebULL, 0x2108cd8068a919fdULL,
+    0x8022d7ea5298f2a3ULL, 0xded34e56c2eaf3daULL, 0xf0c7aa8e5198e68eULL, 0x3b0c320e35da261bULL,
+    0xee2ccb4e881f0f3cULL, 0x632ceb2ccc8782ccULL, 0x40a35e8e152cd6d9ULL, 0xffd87a79d0569871ULL,
+    0x6faf9d59f9c07b41ULL, 0xb125a12b6ef82a40ULL, 0x77d30aed10611d2aULL, 0x07ce89a31fd1f951ULL,
+    0xcfd918be355847c4ULL, 0xda47bb37d3393ab4ULL, 0x6ff98ddfa92f6330ULL, 0xace3185de66ce70bULL,
+    0xc464e787ce8a6cdeULL, 0x0a80e28cf0e798e1ULL, 0x95128af4a12d49b8ULL, 0xefc264982f3152a0ULL,
+    0xd7b81f63d8ed41a2ULL, 0x13e17cc2ce282137ULL, 0x352de6d290688b16ULL, 0x2b9a1d4dd229ebdfULL,
+    0xa9b1965eda890fb6ULL, 0x8bf89640f0dd3be2ULL, 0xb8c035ed7af0f3c6ULL, 0xf5936014b6c8e792ULL,
+    0x751016b148c4903bULL, 0x73974eed9961c030ULL, 0xd7338bd328ce2f9cULL, 0x14c4433c252eb178ULL,
+    0xfbd61f2c835628c3ULL, 0x33e5ed7bf215c649ULL, 0x5fbcd3cc71bb8726ULL, 0x293b9dadb4c14619ULL,
+    0xf9b7828b567329ebULL, 0x131110ee4381c75dULL, 0xb024f15a9deac78bULL, 0xaa9755e248ea96e6ULL,
+    0x3cdcbddaf6d5b9e6ULL, 0xf9031cccc7821435ULL, 0xe09fc2bf01188162ULL, 0xad615cb919198d7fULL,
+    0x34ac190568483ddbULL, 0xc4497c6c07dd1297ULL, 0xbe9fdc66d27c3e4cULL, 0x4663ca4f6af8f49dULL,
+    0x9452b676755d0bfcULL, 0x0d7f76ef14a9dbb7ULL, 0xc7aaf7d5c13411d7ULL, 0xb6d314b7653292e3ULL,
+    0xeccc0594376576b7ULL, 0x94b927f10d28a2cbULL, 0xa9a394a0ae2f07a2ULL, 0x2e3226fd7cc1fc93ULL,
+    0x97b37dc83f5bfad8ULL, 0x27e3915f473507b1ULL, 0x770b2df6578f333eULL, 0x54247321d2e4f809ULL,
+    0x901e0732d769c5a6ULL, 0x8ffc608ba6b7b5e7ULL, 0x41eb11466eec44a1ULL, 0xf293ae5862d40e13ULL,
+    0x532a10051ea7bc29ULL, 0xe002afb21961de31ULL, 0x5241202a978fab10ULL, 0xd0f5a7540a8c8a99ULL,
+    0xb5bed37cf5c20637ULL, 0x6422c35582d5934bULL, 0xe14e038287ebb7a7ULL, 0x62a739bf750e6ee5ULL,
+    0xd59ad3fd98ae4c5fULL, 0xfc8698fc51520072ULL, 0xfdbd7d2e6839c7a2ULL, 0x8e5ac28504b0ae90ULL,
+    0xadf48ca91f99a23aULL, 0x392a4ce50b4b57eaULL, 0xb12d45066dd219a9ULL, 0xea75cfff716e5073ULL,
+    0xf17c88ef310cd94dULL, 0xf57f13db90c5e016ULL, 0x9dde1578820547d9ULL, 0x981d9a008b5bf0f2ULL,
+    0xfe4f8648c1758ba4ULL, 0xd52a9a1a1f4f1a3bULL, 0xb99bec09a72ef2d2ULL, 0xb8ae3c373b9b5eebULL,
+    0xc32129028bdca708ULL, 0xea98dae0e61c9c7fULL, 0xf25fab5528073fa5ULL, 0x9041b998bf4839c1ULL,
+    0x837712c4ab02bc86ULL, 0x7993651cfbb916dbULL, 0x2e484fec81c70ae9ULL, 0x8fddd618dae864d7ULL,
+    0x28e2a453730bed41ULL, 0xbee1f3b0e970bb6eULL, 0x1688d505db7ad529ULL, 0xbc421ab5954f6627ULL,
+    0x20e1aa1495de6ec0ULL, 0xe6a956f2965b9f5fULL, 0x254bcdb001b1e38cULL, 0xdace8df12630e77bULL,
+    0x59ee6c659d166bb4ULL, 0x544d4fcd45157cd2ULL, 0x19cdcf87fc8320c4ULL, 0x933747ce18b01579ULL,
+    0x30cf923cb14ae425ULL, 0x10da42494b81b0c6ULL, 0x06c77f0ae652f3b4ULL, 0x1d5f891b7a1ce745ULL,
+    0xdaf8decd04629577ULL, 0x47ecf93c30e2e321ULL, 0xf2a07f8a544b804bULL, 0xbee480ced7cce6d7ULL,
+    0xeeaa783cff8cacf5ULL, 0xb450afd4477d3a2fULL, 0x1980fec595ca935aULL, 0x19b3df5807a1125bULL,
+    0x62338093e677ca06ULL, 0xd92b36844df68323ULL, 0xc0987985b3763412ULL, 0xeb2050bef21ce93dULL,
+    0xa395c5221b24f165ULL, 0x011c3c6b39f9d551ULL, 0xe432cf9e10f33f3cULL, 0x31962279b3e2530cULL,
+    0xad5a33be6f2a4125ULL, 0x6877eae7bcd98114ULL, 0x74c532b8fade2085ULL, 0x3ee3162203fc525fULL,
+    0x60ca72e021782986ULL, 0x80babc5865a5f464ULL, 0xdbcb7d8336c14b60ULL, 0x0539c78f686a8841ULL,
+    0x5b2053a21ad2ea96ULL, 0x94f79500bf5d2c85ULL, 0x947ec12a002a6e9eULL, 0xcc6ab10e7a974f38ULL,
+    0x29b87e329a245fcbULL, 0x8b9b80333a35ca9cULL, 0x70069a2442a46c96ULL, 0x89220d03bb0afe5fULL,
+    0xeac0b3b9626f31d3ULL, 0x02d18975dcda92e1ULL, 0x528ca1d2047e64c8ULL, 0x679bcb439cbb0645ULL,
+    0x7494ed8bac57560bULL, 0x345746fa30f99ff3ULL, 0x74575dc10bb01c4fULL, 0x8e546db240730155ULL,
+    0x82d311230b36ebccULL, 0x1e7e0e8e55ac009bULL, 0x8cc3e0fa465a74b5ULL, 0x44c70c3fc2e2c4a2ULL,
+    0xd206904858e98b08ULL, 0x1464d3a8eaaf33ceULL, 0x2c609aa37aba144eULL, 0x5cd82a7bd04e3ff9ULL,
+    0x4e72c15fde0d7bbfULL, 0xe1563929491cb199ULL, 0x9902c3833d7244dcULL, 0x65d96898d9d71c3fULL,
+    0xcfd9bdde23a0cfbdULL, 0x7f72596ae59985c6ULL, 0x61aaae23885d067bULL, 0x758d425a1a783e32ULL,
+    0x386a3d8709ec925eULL, 0x883f25b526bf22eaULL, 0x00db8bfddd8cced0ULL, 0x41f96b07f6d3c632ULL,
+};
+
+uint64_t chunk_cut(char const *data_, uint64_t len) {
+    unsigned char const *data = (unsigned char const *)data_;
+    if (len <= CHUNK_MIN_SIZE) {
+        return len;
+    }
+
+    // no cut point is looked for in the minimum size
+    uint64_t end = MIN(len, CHUNK_MAX_SIZE);
+    uint64_t normal_end = MIN(end, CHUNK_AVG_SIZE);
+    uint64_t hash = 0;
+    uint64_t i = CHUNK_MIN_SIZE;
+    for (; i < normal_end; i++) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if (!(hash & MASK_SMALL)) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if (!(hash & MASK_LARGE)) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+int chunk_file(int fd, uint64_t size, chunk_visit_t visit, void *arg) {
+    uint64_t const READ_SIZE = 1 << 20;
+
+    // `buf[pos, end)` is read but not chunked yet, which is kept at least CHUNK_MAX_SIZE bytes until the end
+    uint64_t buf_size = READ_SIZE + CHUNK_MAX_SIZE;
+    char *buf = (char *)malloc(sizeof(char) * buf_size);
+    uint64_t pos = 0;
+    uint64_t end = 0;
+    uint64_t read_len = 0;
+    uint64_t offset = 0;
+    int ret = 0;
+    while (offset < size) {
+        if (end - pos < CHUNK_MAX_SIZE && read_len < size) {
+            memmove(buf, buf + pos, end - pos);
+            end -= pos;
+            pos = 0;
+            uint64_t len = MIN(buf_size - end, size - read_len);
+            if (bulk_read(fd, buf + end, len) != len) {
+                ret = -1;
+                break;
+            }
+            end += len;
+            read_len += len;
+        }
+
+        uint64_t len = chunk_cut(buf + pos, end - pos);
+        uint64_t hash[2];
+        murmur3_128(buf + pos, len, hash);
+        if (visit(offset, len, hash, arg) == -1) {
+            ret = -1;
+            break;
+        }
+        pos += len;
+        offset += len;
+    }
+
+    free(buf);
+    return ret;
+}
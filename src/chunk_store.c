@@ -0,0 +1,510 @@
+#include "chunk_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+// "{dir}/chunks" is a header followed by slots, and it's written in place through a shared mapping
+// "{dir}/chunk_files" is ([path length][path][size][mtime sec][mtime nsec])... by file id, path length is varint and
+// others are uint64 in network order, a dropped file has an empty path
+#define TABLE_NAME "chunks"
+#define FILES_NAME "chunk_files"
+// "FSCHUNK1"
+#define TABLE_MAGIC 0x46534348554e4b31ULL
+#define MIN_SLOTS_SIZE (1 << 16)
+#define MIN_PATHS_CAPACITY (1 << 10)
+
+typedef struct {
+    uint64_t magic;
+    // a power of 2
+    uint64_t slots_size;
+    uint64_t used;
+    // files recorded when it's closed, the table is only valid with them
+    uint64_t files_size;
+    // set while it's open, so a table left by a killed client is dropped
+    uint64_t is_open;
+} header_t;
+
+// a slot of 0 length is empty
+typedef struct {
+    uint64_t hash[2];
+    uint64_t offset;
+    uint32_t file;
+    uint32_t len;
+} slot_t;
+
+typedef struct {
+    int fd;
+    header_t *header;
+    slot_t *slots;
+    uint64_t map_len;
+} table_t;
+
+typedef struct {
+    // NULL when it's dropped
+    char *path;
+    uint64_t size;
+    struct timespec mtime;
+} file_t;
+
+struct chunk_store {
+    pthread_mutex_t lock;
+    char *table_path;
+    char *files_path;
+    // header is NULL when there's no table
+    table_t table;
+
+    // file ids aren't changed while the store is open
+    file_t *files;
+    uint64_t files_size;
+    uint64_t files_capacity;
+    uint64_t dropped_size;
+    // open addressing from path to file id + 1, 0 is empty, at most half full
+    uint32_t *paths;
+    uint64_t paths_size;
+    uint64_t paths_capacity;
+};
+
+static char *join_path(char *dir, char *name) {
+    char *path = (char *)malloc(sizeof(char) * (strlen(dir) + strlen(name) + 2));
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static void unmap_table(table_t *table) {
+    munmap(table->header, table->map_len);
+    close(table->fd);
+    table->header = NULL;
+}
+
+// map file `path` as a table, it's created empty with `slots_size` slots unless `slots_size` is 0
+// return 0 when success, -1 when error or it isn't a valid table
+static int map_table(char *path, uint64_t slots_size, table_t *table) {
+    int fd = slots_size ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0600) : open(path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    // slots of a new table are empty since the file is filled with zeros
+    uint64_t map_len = sizeof(header_t) + sizeof(slot_t) * slots_size;
+    struct stat st;
+    if (slots_size ? ftruncate(fd, map_len) == -1 : fstat(fd, &st) == -1 || st.st_size < sizeof(header_t)) {
+        close(fd);
+        return -1;
+    }
+    if (!slots_size) {
+        map_len = st.st_size;
+    }
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    table->fd = fd;
+    table->header = (header_t *)map;
+    table->slots = (slot_t *)(table->header + 1);
+    table->map_len = map_len;
+
+    header_t *header = table->header;
+    if (slots_size) {
+        header->magic = TABLE_MAGIC;
+        header->slots_size = slots_size;
+        header->used = 0;
+        header->files_size = 0;
+        header->is_open = 1;
+        return 0;
+    }
+    uint64_t size = header->slots_size;
+    if (header->magic != TABLE_MAGIC || !size || (size & (size - 1))
+        || map_len != sizeof(header_t) + sizeof(slot_t) * size) {
+        unmap_table(table);
+        return -1;
+    }
+    return 0;
+}
+
+// slot of `hash`, or the empty slot where it should be
+static slot_t *find_slot(table_t *table, uint64_t *hash) {
+    uint64_t mask = table->header->slots_size - 1;
+    uint64_t i = hash[0] & mask;
+    while (table->slots[i].len && (table->slots[i].hash[0] != hash[0] || table->slots[i].hash[1] != hash[1])) {
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+static bool is_live(chunk_store_t *store, uint32_t file) {
+    return file < store->files_size && store->files[file].path;
+}
+
+static void drop_file(chunk_store_t *store, uint32_t file) {
+    if (store->files[file].path) {
+        free(store->files[file].path);
+        store->files[file].path = NULL;
+        store->dropped_size++;
+    }
+}
+
+// slot of `path` in `paths`, or the empty slot where it should be
+static uint64_t path_slot(chunk_store_t *store, char *path) {
+    uint64_t mask = store->paths_capacity - 1;
+    uint64_t i = hash_bytes(HASH_INIT, path, strlen(path)) & mask;
+    // a dropped file is passed, its slot is reused only when its path is added again
+    while (store->paths[i] && (!store->files[store->paths[i] - 1].path
+        || strcmp(store->files[store->paths[i] - 1].path, path))) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static void rebuild_paths(chunk_store_t *store) {
+    uint64_t capacity = MIN_PATHS_CAPACITY;
+    while (capacity < (store->files_size - store->dropped_size + 1) * 4) {
+        capacity <<= 1;
+    }
+    free(store->paths);
+    store->paths = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+    store->paths_capacity = capacity;
+    store->paths_size = 0;
+    for (uint64_t i = 0; i < store->files_size; i++) {
+        if (store->files[i].path) {
+            store->paths[path_slot(store, store->files[i].path)] = i + 1;
+            store->paths_size++;
+        }
+    }
+}
+
+// `path` is taken by the store
+static uint32_t append_file(chunk_store_t *store, char *path, uint64_t size, struct timespec mtime) {
+    if (store->files_size == store->files_capacity) {
+        store->files_capacity = store->files_capacity ? store->files_capacity * 2 : 64;
+        store->files = (file_t *)realloc(store->files, sizeof(file_t) * store->files_capacity);
+    }
+    store->files[store->files_size].path = path;
+    store->files[store->files_size].size = size;
+    store->files[store->files_size].mtime = mtime;
+    if (!path) {
+        store->dropped_size++;
+    }
+    return store->files_size++;
+}
+
+static void clear_files(chunk_store_t *store) {
+    for (uint64_t i = 0; i < store->files_size; i++) {
+        free(store->files[i].path);
+    }
+    store->files_size = 0;
+    store->dropped_size = 0;
+}
+
+// move chunks of files which aren't dropped into a new table of `slots_size` slots, which replaces the old one
+// dropped files are removed and the others are renumbered if `is_compact`
+// return 0 when success, -1 when error, then the old table is kept
+static int rebuild(chunk_store_t *store, uint64_t slots_size, bool is_compact) {
+    char *temp_path = (char *)malloc(sizeof(char) * (strlen(store->table_path) + 5));
+    sprintf(temp_path, "%s.tmp", store->table_path);
+    table_t table;
+    if (map_table(temp_path, slots_size, &table) == -1) {
+        ERROR("create chunk table %s failed", temp_path);
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    // new id of each file
+    uint32_t *ids = (uint32_t *)malloc(sizeof(uint32_t) * (store->files_size + 1));
+    uint64_t files_size = 0;
+    for (uint64_t i = 0; i < store->files_size; i++) {
+        ids[i] = !is_compact ? i : store->files[i].path ? files_size++ : UINT32_MAX;
+    }
+    if (store->table.header) {
+        for (uint64_t i = 0; i < store->table.header->slots_size; i++) {
+            slot_t *slot = &store->table.slots[i];
+            if (!slot->len || !is_live(store, slot->file)) {
+                continue;
+            }
+            slot_t *new_slot = find_slot(&table, slot->hash);
+            *new_slot = *slot;
+            new_slot->file = ids[slot->file];
+            table.header->used++;
+        }
+    }
+
+    if (rename(temp_path, store->table_path) == -1) {
+        ERROR("rename %s to %s failed", temp_path, store->table_path);
+        unmap_table(&table);
+        unlink(temp_path);
+        free(temp_path);
+        free(ids);
+        return -1;
+    }
+    free(temp_path);
+    if (store->table.header) {
+        unmap_table(&store->table);
+    }
+    store->table = table;
+
+    if (is_compact) {
+        for (uint64_t i = 0; i < store->files_size; i++) {
+            if (ids[i] != UINT32_MAX) {
+                store->files[ids[i]] = store->files[i];
+            }
+        }
+        store->files_size = files_size;
+        store->dropped_size = 0;
+        rebuild_paths(store);
+    }
+    free(ids);
+    return 0;
+}
+
+// return 0 when success, -1 when it doesn't exist or it's invalid, then no file is loaded
+static int load_files(chunk_store_t *store) {
+    int fd = open(store->files_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    char *buf = (char *)malloc(sizeof(char) * (st.st_size + 1));
+    if (bulk_read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    uint64_t len = st.st_size;
+    uint64_t offset = 0;
+    while (offset < len) {
+        uint64_t path_len;
+        uint64_t size;
+        uint64_t mtime[2];
+        if (read_buf_varint(buf, len, &offset, &path_len) == -1 || path_len > len - offset) {
+            goto fail;
+        }
+        char *path = NULL;
+        if (path_len) {
+            path = (char *)malloc(sizeof(char) * (path_len + 1));
+            memcpy(path, buf + offset, path_len);
+            path[path_len] = 0;
+        }
+        offset += path_len;
+        if (read_buf_uint64(buf, len, &offset, &size) == -1 || read_buf_uint64(buf, len, &offset, &mtime[0]) == -1
+            || read_buf_uint64(buf, len, &offset, &mtime[1]) == -1 || store->files_size >= UINT32_MAX) {
+            free(path);
+            goto fail;
+        }
+        struct timespec ts = { .tv_sec = (time_t)mtime[0], .tv_nsec = (long)mtime[1] };
+        append_file(store, path, size, ts);
+    }
+    free(buf);
+    return 0;
+
+fail:
+    free(buf);
+    clear_files(store);
+    return -1;
+}
+
+// return 0 when success, -1 when error
+static int save_files(chunk_store_t *store) {
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < store->files_size; i++) {
+        len += VARINT_MAX_LEN + (store->files[i].path ? strlen(store->files[i].path) : 0) + 3 * sizeof(uint64_t);
+    }
+    char *buf = (char *)malloc(sizeof(char) * (len + 1));
+    len = 0;
+    for (uint64_t i = 0; i < store->files_size; i++) {
+        file_t *file = &store->files[i];
+        len = append_buf_varint(buf, len, file->path ? strlen(file->path) : 0);
+        len = append_buf_charp(buf, len, file->path ? file->path : "");
+        len = append_buf_uint64(buf, len, my_htonll(file->size));
+        len = append_buf_uint64(buf, len, my_htonll(file->mtime.tv_sec));
+        len = append_buf_uint64(buf, len, my_htonll(file->mtime.tv_nsec));
+    }
+
+    char *temp_path = (char *)malloc(sizeof(char) * (strlen(store->files_path) + 5));
+    sprintf(temp_path, "%s.tmp", store->files_path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int ret = fd == -1 || bulk_write(fd, buf, len) != len ? -1 : 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (ret == 0 && rename(temp_path, store->files_path) == -1) {
+        ret = -1;
+    }
+    if (ret == -1) {
+        ERROR("write chunk files %s failed", store->files_path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+    free(buf);
+    return ret;
+}
+
+chunk_store_t *chunk_store_open(char *dir) {
+    chunk_store_t *store = (chunk_store_t *)calloc(1, sizeof(chunk_store_t));
+    pthread_mutex_init(&store->lock, NULL);
+    store->table_path = join_path(dir, TABLE_NAME);
+    store->files_path = join_path(dir, FILES_NAME);
+
+    // the table is only trusted with the files it's closed with
+    bool is_valid = load_files(store) == 0 && map_table(store->table_path, 0, &store->table) == 0;
+    if (is_valid && (store->table.header->is_open || store->table.header->files_size != store->files_size)) {
+        unmap_table(&store->table);
+        is_valid = false;
+    }
+    if (!is_valid) {
+        clear_files(store);
+        if (rebuild(store, MIN_SLOTS_SIZE, false) == -1) {
+            pthread_mutex_destroy(&store->lock);
+            free(store->files);
+            free(store->table_path);
+            free(store->files_path);
+            free(store);
+            return NULL;
+        }
+    }
+    store->table.header->is_open = 1;
+    rebuild_paths(store);
+
+    // dropped files are removed once they're most of the files
+    if (store->dropped_size * 2 > store->files_size) {
+        rebuild(store, store->table.header->slots_size, true);
+    }
+    return store;
+}
+
+void chunk_store_close(chunk_store_t *store) {
+    if (save_files(store) == 0) {
+        store->table.header->files_size = store->files_size;
+        store->table.header->is_open = 0;
+    }
+    unmap_table(&store->table);
+
+    clear_files(store);
+    free(store->files);
+    free(store->paths);
+    free(store->table_path);
+    free(store->files_path);
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+uint32_t chunk_store_add_file(chunk_store_t *store, char *path, uint64_t size, struct timespec mtime) {
+    char *path_copy = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(path_copy, path);
+
+    pthread_mutex_lock(&store->lock);
+    if ((store->paths_size + 1) * 2 > store->paths_capacity) {
+        rebuild_paths(store);
+    }
+    uint64_t i = path_slot(store, path);
+    if (store->paths[i]) {
+        drop_file(store, store->paths[i] - 1);
+    }
+    else {
+        store->paths_size++;
+    }
+    uint32_t file = append_file(store, path_copy, size, mtime);
+    store->paths[i] = file + 1;
+    pthread_mutex_unlock(&store->lock);
+
+    return file;
+}
+
+// whether `st` is the recorded status of `file`
+static bool is_same_file(struct stat *st, file_t *file) {
+    if (!S_ISREG(st->st_mode) || (uint64_t)st->st_size != file->size) {
+        return false;
+    }
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_sec == file->mtime.tv_sec && st->st_mtimespec.tv_nsec == file->mtime.tv_nsec;
+#else
+    return st->st_mtim.tv_sec == file->mtime.tv_sec && st->st_mtim.tv_nsec == file->mtime.tv_nsec;
+#endif
+}
+
+bool chunk_store_has_file(chunk_store_t *store, char *path) {
+    pthread_mutex_lock(&store->lock);
+    uint64_t i = path_slot(store, path);
+    file_t file = store->paths[i] ? store->files[store->paths[i] - 1] : (file_t){ 0 };
+    pthread_mutex_unlock(&store->lock);
+
+    struct stat st;
+    return file.path && lstat(path, &st) == 0 && is_same_file(&st, &file);
+}
+
+void chunk_store_add_chunk(chunk_store_t *store, uint32_t file, uint64_t *hash, uint64_t offset, uint64_t len) {
+    if (!len || len > UINT32_MAX) {
+        return;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    // at most 3/4 full, a full table keeps what it has
+    header_t *header = store->table.header;
+    if ((header->used + 1) * 4 > header->slots_size * 3 && rebuild(store, header->slots_size * 2, false) == -1
+        && header->used + 1 >= header->slots_size) {
+        pthread_mutex_unlock(&store->lock);
+        return;
+    }
+    slot_t *slot = find_slot(&store->table, hash);
+    if (!slot->len || !is_live(store, slot->file)) {
+        if (!slot->len) {
+            store->table.header->used++;
+        }
+        slot->hash[0] = hash[0];
+        slot->hash[1] = hash[1];
+        slot->offset = offset;
+        slot->file = file;
+        slot->len = len;
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+int chunk_store_find(chunk_store_t *store, uint64_t *hash, uint64_t len, uint32_t *file, uint64_t *offset) {
+    pthread_mutex_lock(&store->lock);
+    slot_t *slot = find_slot(&store->table, hash);
+    int ret = -1;
+    if (slot->len && slot->len == len && is_live(store, slot->file)) {
+        *file = slot->file;
+        *offset = slot->offset;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&store->lock);
+    return ret;
+}
+
+int chunk_store_open_file(chunk_store_t *store, uint32_t file) {
+    pthread_mutex_lock(&store->lock);
+    if (!is_live(store, file)) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    file_t record = store->files[file];
+    char *path = (char *)malloc(sizeof(char) * (strlen(record.path) + 1));
+    strcpy(path, record.path);
+    pthread_mutex_unlock(&store->lock);
+
+    int fd = open(path, O_RDONLY);
+    free(path);
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && is_same_file(&st, &record)) {
+        return fd;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&store->lock);
+    drop_file(store, file);
+    pthread_mutex_unlock(&store->lock);
+    return -1;
+}
@@ -1,10 +1,15 @@
 // TODO: record error and summarize at last
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// for fallocate
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <fcntl.h>
@@ -13,20 +18,51 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <inttypes.h>
-#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
 #include "json.h"
 #include "list.h"
 #include "utils.h"
+#include "work_queue.h"
 #include "client_config.h"
+#include "protocol.h"
+#include "delta.h"
+#include "io_ring.h"
+#include "compress.h"
+#include "content_index.h"
+#include "content_hash.h"
+#include "chunk.h"
+#include "chunk_store.h"
+#include "local_index.h"
+#include "manifest_tree.h"
+
+#ifdef __linux__
+// linux/fs.h can't be included, as it defines BLOCK_SIZE
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
 
 volatile bool raised_sigint = false;
+// set when anything fails to be synced, then the sync state isn't saved
+atomic_bool has_failed = false;
+// features supported by server
+uint64_t server_features = 0;
+// local files by content, NULL when content isn't deduplicated
+content_index_t *content_index = NULL;
+// local chunks, NULL when large files aren't requested by chunks
+chunk_store_t *chunk_store = NULL;
+// local entries synced last time, NULL when every entry is checked
+local_index_t *local_index = NULL;
 
 void handler_sigint(int signum) {
     raised_sigint = true;
 
-    char *message = "received SIGINT, will terminate after updating current file\n"
-        "use ^\\ to terminate forcibly, but current file may be incomplete\n"
-        "and can't be updated with re-execution\n";
+    char *message = "received SIGINT, will terminate after updating requested files\n"
+        "use ^\\ to terminate forcibly, then large files being received are resumed with re-execution,\n"
+        "but other current files may be incomplete and can't be updated\n";
     write(2, message, strlen(message));
 }
 
@@ -49,386 +85,3671 @@ int init_socket(char *host, int port) {
         return -1;
     };
 
+    // before connecting, so the window scale is negotiated for the receive buffer
+    if (set_socket_buffers(conn_fd, config.socket_buffer << 10) == -1) {
+        ERROR("set socket buffers");
+    }
+
     if (connect(conn_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         ERROR("connect to %s:%d failed", host, port);
         WARN("is server alive?");
         return -1;
     }
 
-    return conn_fd;
+    // content requests are small and pipelined, don't let them wait for ack
+    int option_value = 1;
+    if (setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int)) == -1) {
+        ERROR("setsockopt");
+    }
+
+    return conn_fd;
+}
+
+// info is parsed into `*info`
+// return 0 when success, -1 when error
+int request_info(transport_t *conn, char *path, manifest_tree_t *info, char **buf, uint64_t *buf_size) {
+    // send [0][path length][path]
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) + strlen(path);
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_INFO));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(path)));
+    message_len = append_buf_charp(*buf, message_len, path);
+
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s info failed", path);
+        return -1;
+    }
+    INFO("requested %s info", path);
+
+    // get requested result
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        goto receive_fail;
+    }
+    message_len = my_ntohll(message_len);
+
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    if (transport_read(conn, *buf, message_len) != message_len) {
+        goto receive_fail;
+    }
+    (*buf)[message_len] = 0;
+    INFO("received %s info (%" PRIu64 " bytes)", path, message_len);
+
+    if (manifest_tree_parse(info, *buf, message_len) == -1) {
+        ERROR("received info is invalid");
+        return -1;
+    }
+
+    return 0;
+
+receive_fail:
+    ERROR("receive %s info failed", path);
+    return -1;
+}
+
+// part of content to be received into a temporary file, from `offset` until `end`
+typedef struct {
+    uint64_t offset;
+    uint64_t end;
+} content_range_t;
+
+// a large file received by several connections at once, each receives a stripe of it into the temporary file
+// it's completed by the last finished stripe
+typedef struct {
+    char *path;
+    uint64_t size;
+    struct timespec modify_time;
+    mode_t permission;
+    int file_fd;
+    char *temp_path;
+    int progress_fd;
+    char *progress_path;
+
+    pthread_mutex_t lock;
+    // what's left of each stripe
+    content_range_t *ranges;
+    uint64_t ranges_size;
+    // stripes not finished yet
+    uint64_t remaining;
+    bool has_failed;
+} striped_file_t;
+
+// a small file whose content is requested with others by one COMMAND_BATCH_CONTENT
+typedef struct {
+    char *path;
+    struct timespec modify_time;
+    // set when the file doesn't exist, it's created with `permission` when its content is received
+    bool is_new;
+    mode_t permission;
+} batch_file_t;
+
+// files of at most BATCH_MAX_FILE_SIZE bytes are batched, a batch has at most BATCH_MAX_FILES files
+// and BATCH_MAX_LEN bytes by their remote sizes
+#define BATCH_MAX_FILE_SIZE (1 << 16)
+#define BATCH_MAX_FILES 256
+#define BATCH_MAX_LEN (1 << 20)
+// remote file size which isn't known, then the file isn't batched
+#define SIZE_UNKNOWN UINT64_MAX
+// batched files are cheaper to transfer than to find in local files, so larger ones have content hashes
+#define DEDUP_MIN_SIZE (BATCH_MAX_FILE_SIZE + 1)
+// small file is cheaper to transfer as a whole than by chunks
+#define CHUNKED_MIN_SIZE (1 << 20)
+
+// a chunk of a file requested by chunks
+typedef struct {
+    uint64_t offset;
+    uint64_t len;
+    uint64_t hash[2];
+    // set when it isn't found locally, then it's received
+    bool is_missing;
+} file_chunk_t;
+
+// a content request which is sent but not yet responded
+typedef struct {
+    char *path;
+    struct timespec modify_time;
+    int file_fd;
+    bool is_compressed;
+
+    // set when `file_fd` is temporary file `temp_path`, which replaces "{path}" with `permission`
+    // after the content is complete
+    char *temp_path;
+    mode_t permission;
+
+    // set when delta against the old content is requested
+    bool is_delta;
+    int basis_fd;
+    uint64_t block_size;
+    uint64_t blocks_size;
+    delta_signature_t *signatures;
+
+    // set when progress of the temporary file is recorded in `progress_fd`, so it can be resumed,
+    // and the content is received from `offset`
+    bool is_resumable;
+    int progress_fd;
+    char *progress_path;
+    uint64_t offset;
+
+    // set when chunk list is requested, `chunks` is NULL until it's received, then chunks found locally are copied
+    // into temporary file `temp_path` and the missing ones are requested, `list_size` and `list_mtime` are those of
+    // the remote file in the list
+    bool is_chunked;
+    file_chunk_t *chunks;
+    uint64_t chunks_size;
+    uint64_t list_size;
+    uint64_t list_mtime[2];
+
+    // set when a stripe is requested, then the others are unused
+    striped_file_t *striped;
+    uint64_t stripe;
+
+    // set when a batch is requested, then the others are unused
+    batch_file_t *batch;
+    uint64_t batch_size;
+} content_request_t;
+
+// content requests in flight on one connection
+// server responds in request order, so they are kept in a ring buffer
+typedef struct {
+    transport_t *conn;
+    int window;
+    content_request_t *requests;
+    int head;
+    int size;
+    // set when the connection can't be trusted anymore
+    bool is_broken;
+    // receives large content if io_uring is supported, NULL otherwise
+    io_ring_t *ring;
+    // a decompressed block
+    char *block;
+    // stripes in flight
+    int stripes_size;
+    // small files to be requested in the next batch, `batch_len` is their total size
+    batch_file_t *batch;
+    uint64_t batch_size;
+    uint64_t batch_len;
+} pipeline_t;
+
+// a request longer than this may not fit in socket buffers, which are full of earlier responses while the server is
+// blocked sending them, so the responses are received before it's sent
+#define MAX_PIPELINED_REQUEST_LEN (1 << 12)
+
+// buffers of a ring, one is being received while the others are being written
+#define RING_BUFS_SIZE 4
+#define RING_BUF_LEN (1 << 19)
+
+pipeline_t *pipeline_init(transport_t *conn, int window) {
+    pipeline_t *pipeline = (pipeline_t *)malloc(sizeof(pipeline_t));
+    pipeline->conn = conn;
+    pipeline->window = window;
+    pipeline->requests = (content_request_t *)malloc(sizeof(content_request_t) * window);
+    pipeline->head = 0;
+    pipeline->size = 0;
+    pipeline->is_broken = false;
+    pipeline->stripes_size = 0;
+    pipeline->batch = (batch_file_t *)malloc(sizeof(batch_file_t) * BATCH_MAX_FILES);
+    pipeline->batch_size = 0;
+    pipeline->batch_len = 0;
+    pipeline->block = (char *)malloc(sizeof(char) * COMPRESS_BLOCK_SIZE);
+    pipeline->ring = ring_init(RING_BUFS_SIZE * 2, RING_BUFS_SIZE, RING_BUF_LEN);
+    if (!pipeline->ring) {
+        INFO("io_uring isn't supported, content is received by blocking I/O");
+    }
+    return pipeline;
+}
+
+void kill_batch(batch_file_t *batch, uint64_t batch_size) {
+    for (uint64_t i = 0; i < batch_size; i++) {
+        free(batch[i].path);
+    }
+    free(batch);
+}
+
+// pipeline must be drained before killed, files not requested in the next batch are dropped
+void pipeline_kill(pipeline_t *pipeline) {
+    if (pipeline->ring) {
+        ring_kill(pipeline->ring);
+    }
+    kill_batch(pipeline->batch, pipeline->batch_size);
+    free(pipeline->block);
+    free(pipeline->requests);
+    free(pipeline);
+}
+
+// receive `len` bytes of content in compressed blocks and write to `file_fd`
+// return 0 when success, -1 when receiving fails, 1 when writing fails but the content is consumed
+int receive_compressed_content(pipeline_t *pipeline, int file_fd, uint64_t len, char **buf, uint64_t *buf_size) {
+    *buf_size = extend_buf(buf, *buf_size, compress_bound(COMPRESS_BLOCK_SIZE));
+    bool write_failed = false;
+    uint64_t receive_len = 0;
+    while (receive_len < len) {
+        // get [raw length][stored length][data]
+        uint32_t header[2];
+        if (transport_read(pipeline->conn, header, sizeof(header)) != sizeof(header)) {
+            return -1;
+        }
+        uint32_t raw_len = ntohl(header[0]);
+        uint32_t stored_len = ntohl(header[1]);
+        if (raw_len == 0 || raw_len > COMPRESS_BLOCK_SIZE || raw_len > len - receive_len
+            || stored_len > compress_bound(raw_len)) {
+            ERROR("invalid compressed block");
+            return -1;
+        }
+        if (transport_read(pipeline->conn, *buf, stored_len) != stored_len) {
+            return -1;
+        }
+
+        char *data = *buf;
+        if (stored_len != raw_len) {
+            if (decompress_block(*buf, stored_len, pipeline->block, COMPRESS_BLOCK_SIZE) != raw_len) {
+                ERROR("invalid compressed block");
+                return -1;
+            }
+            data = pipeline->block;
+        }
+        if (!write_failed && bulk_write(file_fd, data, raw_len) != raw_len) {
+            write_failed = true;
+        }
+        receive_len += raw_len;
+    }
+    return write_failed ? 1 : 0;
+}
+
+// receive `len` bytes of content and write to `file_fd` from `offset`
+// return 0 when success, -1 when receiving fails, 1 when writing fails but the content is consumed
+int receive_plain_content(pipeline_t *pipeline, int file_fd, uint64_t offset, uint64_t len, char **buf,
+    uint64_t *buf_size) {
+    int const BLOCK_SIZE = 4096;
+
+    *buf_size = extend_buf(buf, *buf_size, BLOCK_SIZE);
+    bool write_failed = false;
+    uint64_t receive_len = 0;
+    while (receive_len < len) {
+        int chunk_len = transport_read(pipeline->conn, *buf, MIN(BLOCK_SIZE, len - receive_len));
+        if (chunk_len == 0 || chunk_len == -1) {
+            return -1;
+        }
+
+        // the rest content must still be consumed to keep following responses in order
+        if (!write_failed && bulk_pwrite(file_fd, *buf, chunk_len, offset + receive_len) != chunk_len) {
+            write_failed = true;
+        }
+        receive_len += chunk_len;
+    }
+    return write_failed ? 1 : 0;
+}
+
+// receive `len` bytes of content and write to `file_fd` from `offset` with the ring of `pipeline`
+// the socket is read by one request at a time to keep the stream in order, and each filled buffer
+// is written at its offset meanwhile, so receiving and writing overlap
+// return 0 when success, -1 when receiving fails, 1 when writing fails but the content is consumed
+int receive_content_ring(pipeline_t *pipeline, int file_fd, uint64_t offset, uint64_t len) {
+    // completion of the read request, others are writes of buffer `data`
+    uint64_t const READ_DATA = RING_BUFS_SIZE;
+
+    io_ring_t *ring = pipeline->ring;
+    bool write_failed = false;
+
+    // the ring reads the socket directly, so content already buffered by the transport is written first
+    while (len > 0 && transport_buffered(pipeline->conn)) {
+        uint64_t chunk_len = MIN(MIN(transport_buffered(pipeline->conn), COMPRESS_BLOCK_SIZE), len);
+        transport_read(pipeline->conn, pipeline->block, chunk_len);
+        if (!write_failed && bulk_pwrite(file_fd, pipeline->block, chunk_len, offset) != chunk_len) {
+            write_failed = true;
+        }
+        offset += chunk_len;
+        len -= chunk_len;
+    }
+
+    bool is_free[RING_BUFS_SIZE];
+    uint32_t write_lens[RING_BUFS_SIZE];
+    for (int i = 0; i < RING_BUFS_SIZE; i++) {
+        is_free[i] = true;
+    }
+
+    // buffer being received, -1 when all are being written
+    int cur = 0;
+    is_free[0] = false;
+    uint64_t fill_len = 0;
+    uint64_t file_offset = offset;
+    uint64_t receive_len = 0;
+    bool is_reading = false;
+    int writes_size = 0;
+    bool receive_failed = false;
+
+    while (1) {
+        if (!is_reading && !receive_failed && receive_len < len && cur != -1) {
+            ring_read(ring, pipeline->conn->fd, -1, cur, fill_len, MIN(RING_BUF_LEN - fill_len, len - receive_len),
+                READ_DATA);
+            is_reading = true;
+        }
+        if (!is_reading && writes_size == 0) {
+            break;
+        }
+
+        uint64_t data;
+        int32_t res;
+        if (ring_wait(ring, &data, &res) == -1) {
+            // requests in flight are unknown, so the ring can't be used anymore
+            ERROR("wait for io_uring failed");
+            pipeline->ring = NULL;
+            return -1;
+        }
+
+        if (data == READ_DATA) {
+            is_reading = false;
+            if (res <= 0) {
+                receive_failed = true;
+                continue;
+            }
+            fill_len += res;
+            receive_len += res;
+            if (fill_len < RING_BUF_LEN && receive_len < len) {
+                continue;
+            }
+
+            // buffer is filled, write it and receive into a free one
+            if (!write_failed) {
+                ring_write(ring, file_fd, file_offset, cur, 0, fill_len, cur);
+                write_lens[cur] = fill_len;
+                writes_size++;
+                cur = -1;
+                for (int i = 0; i < RING_BUFS_SIZE; i++) {
+                    if (is_free[i]) {
+                        cur = i;
+                        is_free[i] = false;
+                        break;
+                    }
+                }
+            }
+            file_offset += fill_len;
+            fill_len = 0;
+        }
+        else {
+            writes_size--;
+            // short write to a regular file means the disk is full
+            if (res != write_lens[data]) {
+                write_failed = true;
+            }
+            if (cur == -1) {
+                cur = data;
+            }
+            else {
+                is_free[data] = true;
+            }
+        }
+    }
+
+    if (receive_failed) {
+        return -1;
+    }
+    return write_failed ? 1 : 0;
+}
+
+// receive delta of `request` and rebuild its content in the temporary file
+// return 0 when success, -1 when error
+int receive_delta(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    int const BLOCK_SIZE = 4096;
+
+    transport_t *conn = pipeline->conn;
+    char *path = request->path;
+    int file_fd = request->file_fd;
+    uint64_t block_size = request->block_size;
+    // cleared when the content can't be rebuilt, but the response must still be consumed
+    bool is_valid = true;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s delta failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // get content length
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s/%s delta failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    message_len = my_ntohll(message_len);
+    INFO("receiving %s/%s delta", config.remote_dir, path);
+
+    // follow instructions until [end]
+    *buf_size = extend_buf(buf, *buf_size, MAX(BLOCK_SIZE, block_size));
+    uint64_t receive_len = 0;
+    uint64_t literal_len = 0;
+    while (1) {
+        uint32_t instruction;
+        if (transport_read(conn, &instruction, sizeof(uint32_t)) != sizeof(uint32_t)) {
+            ERROR("receive %s/%s delta failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        instruction = ntohl(instruction);
+        if (instruction == DELTA_END) {
+            break;
+        }
+
+        if (instruction == DELTA_COPY) {
+            // [first block][blocks size]
+            uint64_t message[2];
+            if (transport_read(conn, message, sizeof(message)) != sizeof(message)) {
+                ERROR("receive %s/%s delta failed", config.remote_dir, path);
+                pipeline->is_broken = true;
+                goto fail;
+            }
+            uint64_t first = my_ntohll(message[0]);
+            uint64_t size = my_ntohll(message[1]);
+            if (first >= request->blocks_size || size > request->blocks_size - first) {
+                ERROR("invalid %s/%s delta", config.remote_dir, path);
+                pipeline->is_broken = true;
+                goto fail;
+            }
+            receive_len += size * block_size;
+
+            for (uint64_t i = first; is_valid && i < first + size; i++) {
+                // the old content may be changed after it's signed, so copied block is checked again
+                delta_signature_t signature;
+                if (pread(request->basis_fd, *buf, block_size, i * block_size) != block_size) {
+                    ERROR("read %s failed", path);
+                    is_valid = false;
+                    break;
+                }
+                delta_sign(*buf, block_size, &signature);
+                if (signature.weak != request->signatures[i].weak
+                    || signature.strong[0] != request->signatures[i].strong[0]
+                    || signature.strong[1] != request->signatures[i].strong[1]) {
+                    ERROR("%s is changed while syncing", path);
+                    is_valid = false;
+                    break;
+                }
+                if (bulk_write(file_fd, *buf, block_size) != block_size) {
+                    ERROR("write %s/%s content to file failed", config.remote_dir, path);
+                    is_valid = false;
+                    break;
+                }
+            }
+        }
+        else if (instruction == DELTA_LITERAL) {
+            // [length][data]
+            uint64_t len;
+            if (transport_read(conn, &len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+                ERROR("receive %s/%s delta failed", config.remote_dir, path);
+                pipeline->is_broken = true;
+                goto fail;
+            }
+            len = my_ntohll(len);
+            receive_len += len;
+            literal_len += len;
+
+            uint64_t read_len = 0;
+            while (read_len < len) {
+                int chunk_len = transport_read(conn, *buf, MIN(BLOCK_SIZE, len - read_len));
+                if (chunk_len == 0 || chunk_len == -1) {
+                    ERROR("receive %s/%s delta failed", config.remote_dir, path);
+                    pipeline->is_broken = true;
+                    goto fail;
+                }
+                read_len += chunk_len;
+
+                if (is_valid && bulk_write(file_fd, *buf, chunk_len) != chunk_len) {
+                    ERROR("write %s/%s content to file failed", config.remote_dir, path);
+                    is_valid = false;
+                }
+            }
+        }
+        else {
+            ERROR("invalid %s/%s delta", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+    }
+    if (!is_valid) {
+        goto fail;
+    }
+    if (receive_len != message_len) {
+        ERROR("invalid %s/%s delta", config.remote_dir, path);
+        goto fail;
+    }
+
+    // make mtime equal for bidirectional sync, and keep permission of the old file
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = request->modify_time;
+    if (futimens(file_fd, ts) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+    if (fchmod(file_fd, request->permission) == -1) {
+        ERROR("change %s mode failed", request->temp_path);
+    }
+    if (rename(request->temp_path, path) == -1) {
+        ERROR("replace %s failed", path);
+        goto fail;
+    }
+    INFO("synced %s (%" PRIu64 " bytes, %" PRIu64 " bytes literal)", path, receive_len, literal_len);
+
+    close(file_fd);
+    close(request->basis_fd);
+    free(request->signatures);
+    free(request->temp_path);
+    free(path);
+
+    return 0;
+
+fail:
+    has_failed = true;
+    close(file_fd);
+    unlink(request->temp_path);
+    close(request->basis_fd);
+    free(request->signatures);
+    free(request->temp_path);
+    free(path);
+    return -1;
+}
+
+// flush written data of `fd` to disk
+// return 0 when success, -1 when error
+static int sync_data(int fd) {
+#ifdef __APPLE__
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+// "{dir}/.{name}{suffix}" for file "{path}", which is next to it and hidden
+// return allocated path
+char *sibling_path(char *path, char *suffix) {
+    char *name = strrchr(path, '/');
+    uint64_t dir_len = name ? name - path + 1 : 0;
+    name = name ? name + 1 : path;
+    char *sibling = (char *)malloc(sizeof(char) * (strlen(path) + strlen(suffix) + 2));
+    memcpy(sibling, path, dir_len);
+    sprintf(sibling + dir_len, ".%s%s", name, suffix);
+    return sibling;
+}
+
+// suffixes of a temporary file which content is received into and the record of its progress
+#define PART_SUFFIX ".filesync.part"
+#define PROGRESS_SUFFIX ".filesync.progress"
+// progress is recorded each time this many bytes are written, which is a multiple of COMPRESS_BLOCK_SIZE
+// so compressed blocks aren't split
+#define RESUME_CHECKPOINT_LEN (1 << 25)
+
+// progress record: [mtime sec][mtime nsec][ranges size]([offset][end])...[check], all are uint64 in network order
+// ranges are what's left to receive, the end of content received as a whole is UINT64_MAX
+// mtime is of the remote file, so content is only resumed if it isn't changed since then,
+// and check is hash of the others, so a torn record isn't trusted
+#define PROGRESS_MAX_RANGES 64
+#define PROGRESS_LEN(ranges_size) ((4 + 2 * (ranges_size)) * sizeof(uint64_t))
+
+static uint64_t progress_check(uint64_t *record, uint64_t record_size) {
+    uint64_t hash = HASH_INIT;
+    for (uint64_t i = 0; i < record_size; i++) {
+        hash = hash_uint64(hash, record[i]);
+    }
+    return hash;
+}
+
+// record that content of remote mtime `modify_time` is left to receive in `ranges`
+// return 0 when success, -1 when error
+int save_progress(int progress_fd, struct timespec modify_time, content_range_t *ranges, uint64_t ranges_size) {
+    uint64_t record[PROGRESS_LEN(PROGRESS_MAX_RANGES) / sizeof(uint64_t)];
+    uint64_t record_size = 0;
+    record[record_size++] = modify_time.tv_sec;
+    record[record_size++] = modify_time.tv_nsec;
+    record[record_size++] = ranges_size;
+    for (uint64_t i = 0; i < ranges_size; i++) {
+        record[record_size++] = ranges[i].offset;
+        record[record_size++] = ranges[i].end;
+    }
+    record[record_size] = progress_check(record, record_size);
+    record_size++;
+    for (uint64_t i = 0; i < record_size; i++) {
+        record[i] = my_htonll(record[i]);
+    }
+
+    if (pwrite(progress_fd, record, PROGRESS_LEN(ranges_size), 0) != PROGRESS_LEN(ranges_size)) {
+        ERROR("record progress failed");
+        return -1;
+    }
+    return 0;
+}
+
+// remove the temporary file of "{path}" and its record
+void discard_progress(char *path) {
+    char *temp_path = sibling_path(path, PART_SUFFIX);
+    char *progress_path = sibling_path(path, PROGRESS_SUFFIX);
+    unlink(temp_path);
+    unlink(progress_path);
+    free(temp_path);
+    free(progress_path);
+}
+
+// read progress of "{path}" content received last time, whose remote mtime must still be `modify_time`
+// the temporary file and its record are removed if they can't be resumed
+// `*ranges_size` is set to the number of ranges left
+// return allocated ranges left to receive, NULL when nothing can be resumed
+content_range_t *load_progress(char *path, struct timespec modify_time, uint64_t *ranges_size) {
+    char *progress_path = sibling_path(path, PROGRESS_SUFFIX);
+    int progress_fd = open(progress_path, O_RDONLY);
+    free(progress_path);
+    if (progress_fd == -1) {
+        return NULL;
+    }
+
+    uint64_t record[PROGRESS_LEN(PROGRESS_MAX_RANGES) / sizeof(uint64_t) + 1];
+    ssize_t len = pread(progress_fd, record, sizeof(record), 0);
+    close(progress_fd);
+    uint64_t record_size = len > 0 ? len / sizeof(uint64_t) : 0;
+    for (uint64_t i = 0; i < record_size; i++) {
+        record[i] = my_ntohll(record[i]);
+    }
+    bool is_valid = record_size >= 4 && record[2] <= PROGRESS_MAX_RANGES && len == PROGRESS_LEN(record[2])
+        && record[0] == (uint64_t)modify_time.tv_sec && record[1] == (uint64_t)modify_time.tv_nsec
+        && record[record_size - 1] == progress_check(record, record_size - 1);
+
+    // received content must still be there
+    struct stat st;
+    char *temp_path = sibling_path(path, PART_SUFFIX);
+    is_valid = is_valid && lstat(temp_path, &st) == 0 && S_ISREG(st.st_mode);
+    free(temp_path);
+    content_range_t *ranges = NULL;
+    if (is_valid) {
+        *ranges_size = record[2];
+        ranges = (content_range_t *)malloc(sizeof(content_range_t) * (*ranges_size + 1));
+        for (uint64_t i = 0; i < *ranges_size; i++) {
+            ranges[i].offset = record[3 + 2 * i];
+            ranges[i].end = record[4 + 2 * i];
+            if (ranges[i].offset > ranges[i].end || ranges[i].offset > st.st_size) {
+                is_valid = false;
+            }
+        }
+    }
+
+    if (!is_valid) {
+        INFO("%s can't be resumed, discard received content", path);
+        discard_progress(path);
+        free(ranges);
+        return NULL;
+    }
+    return ranges;
+}
+
+// receive `len` bytes of content of `request` and write to `file_fd` from `offset`
+// compressed content is decompressed by blocks and written at the current offset of `file_fd`, which must be `offset`,
+// and large content is received and written by io_uring if possible
+// return 0 when success, -1 when receiving fails, 1 when writing fails but the content is consumed
+int receive_content_piece(pipeline_t *pipeline, content_request_t *request, int file_fd, uint64_t offset,
+    uint64_t len, char **buf, uint64_t *buf_size) {
+    if (request->is_compressed) {
+        return receive_compressed_content(pipeline, file_fd, len, buf, buf_size);
+    }
+    if (pipeline->ring && len >= RING_BUF_LEN) {
+        return receive_content_ring(pipeline, file_fd, offset, len);
+    }
+    return receive_plain_content(pipeline, file_fd, offset, len, buf, buf_size);
+}
+
+// receive content of `request` into its temporary file, and record progress at each checkpoint
+// the temporary file replaces "{path}" when the content is complete, otherwise it's kept to be resumed
+// return 0 when success, -1 when error
+int receive_resumable(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    char *path = request->path;
+    int file_fd = request->file_fd;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // get content length
+    uint64_t message_len;
+    if (transport_read(pipeline->conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    message_len = my_ntohll(message_len);
+    // progress is never recorded at the end, so there must be content left
+    if (request->offset && message_len == 0) {
+        ERROR("%s/%s is changed, discard received content", config.remote_dir, path);
+        unlink(request->temp_path);
+        unlink(request->progress_path);
+        goto fail;
+    }
+    INFO("receiving %s/%s content from %" PRIu64, config.remote_dir, path, request->offset);
+
+    // written content is synced before its progress is recorded, so the record is never ahead of the file
+    uint64_t receive_len = 0;
+    bool write_failed = false;
+    while (receive_len < message_len) {
+        uint64_t len = MIN(RESUME_CHECKPOINT_LEN, message_len - receive_len);
+        // after writing fails, the rest is only consumed
+        int ret = receive_content_piece(pipeline, request, write_failed ? -1 : file_fd,
+            request->offset + receive_len, len, buf, buf_size);
+        if (ret == -1) {
+            ERROR("receive %s/%s content failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        receive_len += len;
+        if (ret == 1 && !write_failed) {
+            ERROR("write %s/%s content to file failed", config.remote_dir, path);
+            write_failed = true;
+        }
+        if (!write_failed && receive_len < message_len && sync_data(file_fd) == 0) {
+            content_range_t range = { request->offset + receive_len, UINT64_MAX };
+            save_progress(request->progress_fd, request->modify_time, &range, 1);
+        }
+    }
+    if (write_failed) {
+        goto fail;
+    }
+
+    // make mtime equal for bidirectional sync, and keep permission of the old file
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = request->modify_time;
+    if (futimens(file_fd, ts) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+    if (fchmod(file_fd, request->permission) == -1) {
+        ERROR("change %s mode failed", request->temp_path);
+    }
+    if (rename(request->temp_path, path) == -1) {
+        ERROR("replace %s failed", path);
+        goto fail;
+    }
+    unlink(request->progress_path);
+    INFO("synced %s (%" PRIu64 " bytes, %" PRIu64 " bytes resumed)", path, request->offset + receive_len,
+        request->offset);
+
+    close(file_fd);
+    close(request->progress_fd);
+    free(request->temp_path);
+    free(request->progress_path);
+    free(path);
+
+    return 0;
+
+fail:
+    has_failed = true;
+    close(file_fd);
+    close(request->progress_fd);
+    free(request->temp_path);
+    free(request->progress_path);
+    free(path);
+    return -1;
+}
+
+// finish a stripe of `striped`, which has failed unless `is_success`
+// the last finished stripe replaces "{path}" with the temporary file if no stripe has failed,
+// otherwise the temporary file is kept to be resumed
+void finish_stripe(striped_file_t *striped, bool is_success) {
+    pthread_mutex_lock(&striped->lock);
+    if (!is_success) {
+        striped->has_failed = true;
+    }
+    bool is_last = --striped->remaining == 0;
+    pthread_mutex_unlock(&striped->lock);
+    if (!is_last) {
+        return;
+    }
+
+    char *path = striped->path;
+    if (striped->has_failed) {
+        has_failed = true;
+    }
+    else {
+        // mtime is set after all stripes are written, and permission of the old file is kept
+        struct timespec ts[2];
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1] = striped->modify_time;
+        if (futimens(striped->file_fd, ts) == -1) {
+            ERROR("set %s mtime failed", path);
+        }
+        if (fchmod(striped->file_fd, striped->permission) == -1) {
+            ERROR("change %s mode failed", striped->temp_path);
+        }
+        if (rename(striped->temp_path, path) == -1) {
+            ERROR("replace %s failed", path);
+            has_failed = true;
+        }
+        else {
+            unlink(striped->progress_path);
+            INFO("synced %s (%" PRIu64 " bytes in %" PRIu64 " stripes)", path, striped->size, striped->ranges_size);
+        }
+    }
+
+    close(striped->file_fd);
+    close(striped->progress_fd);
+    pthread_mutex_destroy(&striped->lock);
+    free(striped->ranges);
+    free(striped->temp_path);
+    free(striped->progress_path);
+    free(path);
+    free(striped);
+}
+
+// receive a stripe of `request` into the temporary file of its striped file, and record progress at each checkpoint
+// return 0 when success, -1 when error
+int receive_stripe(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    striped_file_t *striped = request->striped;
+    content_range_t *range = &striped->ranges[request->stripe];
+    char *path = striped->path;
+    // the range is only moved by this connection
+    uint64_t offset = range->offset;
+    uint64_t stripe_len = range->end - range->offset;
+    pipeline->stripes_size--;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // get content length
+    uint64_t message_len;
+    if (transport_read(pipeline->conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    message_len = my_ntohll(message_len);
+    INFO("receiving %s/%s content from %" PRIu64 " (%" PRIu64 " bytes)", config.remote_dir, path, offset, message_len);
+
+    // like receive_resumable(), written content is synced before its progress is recorded
+    uint64_t receive_len = 0;
+    bool write_failed = false;
+    while (receive_len < message_len) {
+        uint64_t len = MIN(RESUME_CHECKPOINT_LEN, message_len - receive_len);
+        int ret = receive_content_piece(pipeline, request, write_failed ? -1 : striped->file_fd, offset + receive_len,
+            len, buf, buf_size);
+        if (ret == -1) {
+            ERROR("receive %s/%s content failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        receive_len += len;
+        if (ret == 1 && !write_failed) {
+            ERROR("write %s/%s content to file failed", config.remote_dir, path);
+            write_failed = true;
+        }
+        if (!write_failed && sync_data(striped->file_fd) == 0) {
+            pthread_mutex_lock(&striped->lock);
+            range->offset = offset + receive_len;
+            save_progress(striped->progress_fd, striped->modify_time, striped->ranges, striped->ranges_size);
+            pthread_mutex_unlock(&striped->lock);
+        }
+    }
+    if (write_failed) {
+        goto fail;
+    }
+    // the remote file is shorter than when it's listed
+    if (message_len != stripe_len) {
+        ERROR("%s/%s is changed while syncing", config.remote_dir, path);
+        goto fail;
+    }
+
+    finish_stripe(striped, true);
+    return 0;
+
+fail:
+    has_failed = true;
+    finish_stripe(striped, false);
+    return -1;
+}
+
+// open file "{path}" to write its content, create it with `permission` if `is_new`
+// write permission of the file is added for a moment if it's missing, its directory is already writable
+// since sync_entry() allows it before the file is queued, and it's reset in the fixup pass
+// return fd when success, -1 when error
+int open_content_file(char *path, bool is_new, mode_t permission) {
+    int flags = is_new ? O_WRONLY | O_CREAT | O_EXCL : O_WRONLY | O_TRUNC;
+    int file_fd = open(path, flags, permission);
+    if (file_fd != -1 || errno != EACCES || is_new) {
+        return file_fd;
+    }
+
+    struct stat st;
+    if (stat(path, &st) == -1 || chmod(path, st.st_mode | 0200) == -1) {
+        return -1;
+    }
+    file_fd = open(path, flags);
+    if (chmod(path, st.st_mode) == -1) {
+        ERROR("reset %s mode failed", path);
+    }
+    return file_fd;
+}
+
+// read from `conn` into `buf` of `buf_len` bytes until `need` bytes from `*start` are there,
+// at most `*left` bytes are read so nothing after them is consumed
+// return 0 when success, -1 when error
+static int fill_batch_buf(transport_t *conn, char *buf, uint64_t buf_len, uint64_t *start, uint64_t *end,
+    uint64_t *left, uint64_t need) {
+    if (*end - *start >= need) {
+        return 0;
+    }
+    if (buf_len - *start < need) {
+        memmove(buf, buf + *start, *end - *start);
+        *end -= *start;
+        *start = 0;
+    }
+    while (*end - *start < need) {
+        if (*left == 0) {
+            return -1;
+        }
+        ssize_t len = transport_read_some(conn, buf + *end, MIN(buf_len - *end, *left));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return -1;
+        }
+        *end += len;
+        *left -= len;
+    }
+    return 0;
+}
+
+// receive contents of a batch in one bundle, each is written to its file which is created if it's new
+// return 0 when success, -1 when error
+int receive_batch(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    // the bundle is read through a buffer, content fitting in it is received before its file is opened
+    uint64_t const BUF_LEN = 1 << 18;
+
+    transport_t *conn = pipeline->conn;
+    batch_file_t *batch = request->batch;
+    uint64_t batch_size = request->batch_size;
+    int ret = 0;
+
+    uint64_t left;
+    if (pipeline->is_broken || transport_read(conn, &left, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive batch content failed (%" PRIu64 " files)", batch_size);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    left = my_ntohll(left);
+
+    *buf_size = extend_buf(buf, *buf_size, BUF_LEN);
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (uint64_t i = 0; i < batch_size; i++) {
+        char *path = batch[i].path;
+        uint64_t message_len;
+        if (fill_batch_buf(conn, *buf, BUF_LEN, &start, &end, &left, sizeof(uint64_t)) == -1) {
+            ERROR("receive %s/%s content failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        memcpy(&message_len, *buf + start, sizeof(uint64_t));
+        message_len = my_ntohll(message_len);
+        start += sizeof(uint64_t);
+
+        if (message_len <= BUF_LEN
+            && fill_batch_buf(conn, *buf, BUF_LEN, &start, &end, &left, message_len) == -1) {
+            ERROR("receive %s/%s content failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        int file_fd = open_content_file(path, batch[i].is_new, batch[i].permission);
+        if (file_fd == -1) {
+            ERROR("open %s failed", path);
+        }
+        // content which isn't received yet keeps the file out of date in case the client is killed
+        if (file_fd != -1 && message_len > end - start) {
+            struct timeval tv[2] = { 0 };
+            if (futimes(file_fd, tv) == -1) {
+                ERROR("set %s mtime failed", path);
+            }
+        }
+
+        // content is consumed even if it can't be written
+        bool is_written = file_fd != -1;
+        uint64_t receive_len = 0;
+        while (receive_len < message_len) {
+            if (start == end && fill_batch_buf(conn, *buf, BUF_LEN, &start, &end, &left, 1) == -1) {
+                ERROR("receive %s/%s content failed", config.remote_dir, path);
+                pipeline->is_broken = true;
+                if (file_fd != -1) {
+                    close(file_fd);
+                }
+                goto fail;
+            }
+            uint64_t chunk_len = MIN(end - start, message_len - receive_len);
+            if (is_written && bulk_write(file_fd, *buf + start, chunk_len) != chunk_len) {
+                ERROR("write %s/%s content to file failed", config.remote_dir, path);
+                is_written = false;
+            }
+            start += chunk_len;
+            receive_len += chunk_len;
+        }
+        if (!is_written) {
+            ret = -1;
+            has_failed = true;
+            if (file_fd != -1) {
+                close(file_fd);
+            }
+            continue;
+        }
+
+        // make mtime equal for bidirectional sync
+        struct timespec ts[2];
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1] = batch[i].modify_time;
+        if (futimens(file_fd, ts) == -1) {
+            ERROR("set %s mtime failed", path);
+        }
+        close(file_fd);
+        INFO("synced %s (%" PRIu64 " bytes)", path, message_len);
+    }
+    if (left || start != end) {
+        ERROR("received invalid batch content");
+        pipeline->is_broken = true;
+        goto fail;
+    }
+
+    kill_batch(batch, batch_size);
+    return ret;
+
+fail:
+    has_failed = true;
+    kill_batch(batch, batch_size);
+    return -1;
+}
+
+// a chunked request which can't be finished
+static void kill_chunked(content_request_t *request) {
+    has_failed = true;
+    if (request->temp_path) {
+        close(request->file_fd);
+        unlink(request->temp_path);
+        free(request->temp_path);
+    }
+    free(request->chunks);
+    free(request->path);
+}
+
+static int add_local_chunk(uint64_t offset, uint64_t len, uint64_t *hash, void *arg) {
+    chunk_store_add_chunk(chunk_store, *(uint32_t *)arg, hash, offset, len);
+    return 0;
+}
+
+// split file "{path}" into chunks and record them, unless it's already recorded
+static void record_local_chunks(char *path) {
+    if (chunk_store_has_file(chunk_store, path)) {
+        return;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size) {
+#ifdef __APPLE__
+        uint32_t file = chunk_store_add_file(chunk_store, path, st.st_size, st.st_mtimespec);
+#else
+        uint32_t file = chunk_store_add_file(chunk_store, path, st.st_size, st.st_mtim);
+#endif
+        chunk_file(fd, st.st_size, add_local_chunk, &file);
+    }
+    close(fd);
+}
+
+// set mtime and permission of the rebuilt temporary file of `request`, which replaces "{path}",
+// and record its chunks
+// return 0 when success, -1 when error
+static int finish_chunked(content_request_t *request, uint64_t receive_len) {
+    char *path = request->path;
+    int file_fd = request->file_fd;
+
+    // make mtime equal for bidirectional sync, and keep permission of the old file
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = request->modify_time;
+    if (futimens(file_fd, ts) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+    if (fchmod(file_fd, request->permission) == -1) {
+        ERROR("change %s mode failed", request->temp_path);
+    }
+    struct stat st;
+    bool stat_success = fstat(file_fd, &st) == 0;
+    if (rename(request->temp_path, path) == -1) {
+        ERROR("replace %s failed", path);
+        kill_chunked(request);
+        return -1;
+    }
+    INFO("synced %s (%" PRIu64 " bytes, %" PRIu64 " bytes copied from local chunks)", path, request->list_size,
+        request->list_size - receive_len);
+
+    // the recorded status is what's set, in case the file system has coarser mtime
+    if (stat_success) {
+#ifdef __APPLE__
+        uint32_t file = chunk_store_add_file(chunk_store, path, st.st_size, st.st_mtimespec);
+#else
+        uint32_t file = chunk_store_add_file(chunk_store, path, st.st_size, st.st_mtim);
+#endif
+        for (uint64_t i = 0; i < request->chunks_size; i++) {
+            file_chunk_t *chunk = &request->chunks[i];
+            chunk_store_add_chunk(chunk_store, file, chunk->hash, chunk->offset, chunk->len);
+        }
+    }
+
+    close(file_fd);
+    free(request->chunks);
+    free(request->temp_path);
+    free(path);
+    return 0;
+}
+
+// copy chunks of `request` found in local files into its temporary file, the others are left missing
+// `buf` must hold CHUNK_MAX_SIZE bytes
+// return length of copied chunks
+static uint64_t copy_local_chunks(content_request_t *request, char *buf) {
+    uint64_t copy_len = 0;
+    // chunks are usually found in the same file one after another
+    uint32_t source = UINT32_MAX;
+    int source_fd = -1;
+    for (uint64_t i = 0; i < request->chunks_size; i++) {
+        file_chunk_t *chunk = &request->chunks[i];
+        chunk->is_missing = true;
+        uint32_t file;
+        uint64_t offset;
+        if (chunk_store_find(chunk_store, chunk->hash, chunk->len, &file, &offset) == -1) {
+            continue;
+        }
+        if (file != source) {
+            if (source_fd != -1) {
+                close(source_fd);
+            }
+            source = file;
+            source_fd = chunk_store_open_file(chunk_store, file);
+        }
+        if (source_fd == -1 || pread(source_fd, buf, chunk->len, offset) != chunk->len) {
+            continue;
+        }
+
+        // a local file may be changed without changing its mtime, so copied chunk is checked
+        uint64_t hash[2];
+        murmur3_128(buf, chunk->len, hash);
+        if (hash[0] == chunk->hash[0] && hash[1] == chunk->hash[1]
+            && bulk_pwrite(request->file_fd, buf, chunk->len, chunk->offset) == chunk->len) {
+            chunk->is_missing = false;
+            copy_len += chunk->len;
+        }
+    }
+    if (source_fd != -1) {
+        close(source_fd);
+    }
+    return copy_len;
+}
+
+// defined below with the other receiving functions
+int drain_content(pipeline_t *pipeline, char **buf, uint64_t *buf_size);
+
+// receive chunk list of `request`, copy chunks found locally into a temporary file next to the file,
+// and request the missing ones, which are received by receive_chunk_content()
+// return 0 when success, -1 when error
+int receive_chunk_list(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    uint64_t const MAX_LIST_LEN = 1 << 30;
+    // the server limits length of ranges
+    uint64_t const MAX_RANGES_LEN = 1 << 24;
+
+    transport_t *conn = pipeline->conn;
+    char *path = request->path;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s chunk list failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // get list length, then the list
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)
+        || (message_len = my_ntohll(message_len)) > MAX_LIST_LEN) {
+        ERROR("receive %s/%s chunk list failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    *buf_size = extend_buf(buf, *buf_size, MAX(message_len, CHUNK_MAX_SIZE));
+    if (transport_read(conn, *buf, message_len) != message_len) {
+        ERROR("receive %s/%s chunk list failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    if (!message_len) {
+        ERROR("list %s/%s chunks failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // [size][mtime sec][mtime nsec]([chunk length][hash])...
+    uint64_t offset = 0;
+    if (read_buf_uint64(*buf, message_len, &offset, &request->list_size) == -1
+        || read_buf_uint64(*buf, message_len, &offset, &request->list_mtime[0]) == -1
+        || read_buf_uint64(*buf, message_len, &offset, &request->list_mtime[1]) == -1) {
+        ERROR("invalid %s/%s chunk list", config.remote_dir, path);
+        goto fail;
+    }
+    // a chunk takes at least a byte of length and its hash
+    request->chunks = (file_chunk_t *)malloc(sizeof(file_chunk_t)
+        * (message_len / (1 + 2 * sizeof(uint64_t)) + 1));
+    request->chunks_size = 0;
+    uint64_t list_len = 0;
+    while (offset < message_len) {
+        file_chunk_t *chunk = &request->chunks[request->chunks_size];
+        if (read_buf_varint(*buf, message_len, &offset, &chunk->len) == -1
+            || read_buf_uint64(*buf, message_len, &offset, &chunk->hash[0]) == -1
+            || read_buf_uint64(*buf, message_len, &offset, &chunk->hash[1]) == -1 || !chunk->len
+            || chunk->len > CHUNK_MAX_SIZE || chunk->len > request->list_size - list_len) {
+            ERROR("invalid %s/%s chunk list", config.remote_dir, path);
+            goto fail;
+        }
+        chunk->offset = list_len;
+        list_len += chunk->len;
+        request->chunks_size++;
+    }
+    if (list_len != request->list_size) {
+        ERROR("invalid %s/%s chunk list", config.remote_dir, path);
+        goto fail;
+    }
+
+    // chunks of the old content are found too
+    record_local_chunks(path);
+
+    request->temp_path = sibling_path(path, ".filesync");
+    request->file_fd = open(request->temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (request->file_fd == -1 || ftruncate(request->file_fd, request->list_size) == -1) {
+        ERROR("create %s failed", request->temp_path);
+        if (request->file_fd == -1) {
+            free(request->temp_path);
+            request->temp_path = NULL;
+        }
+        goto fail;
+    }
+    uint64_t copy_len = copy_local_chunks(request, *buf);
+    if (copy_len == request->list_size) {
+        return finish_chunked(request, 0);
+    }
+
+    // send [16][path length][path][size][mtime sec][mtime nsec][ranges length]([offset][length])...
+    // consecutive missing chunks are one range
+    uint64_t path_len = strlen(config.remote_dir) + 1 + strlen(path);
+    uint64_t message_max_len = sizeof(uint32_t) + 5 * sizeof(uint64_t) + path_len
+        + request->chunks_size * 2 * VARINT_MAX_LEN;
+    // `request` is out of the pipeline, so later requests are received before it
+    if (message_max_len > MAX_PIPELINED_REQUEST_LEN) {
+        drain_content(pipeline, buf, buf_size);
+    }
+    *buf_size = extend_buf(buf, *buf_size, message_max_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_CHUNK_CONTENT));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(path_len));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(request->list_size));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(request->list_mtime[0]));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(request->list_mtime[1]));
+    uint64_t ranges_offset = message_len;
+    message_len += sizeof(uint64_t);
+    uint64_t ranges_size = 0;
+    for (uint64_t i = 0; i < request->chunks_size; i++) {
+        if (!request->chunks[i].is_missing) {
+            continue;
+        }
+        uint64_t j = i;
+        while (j + 1 < request->chunks_size && request->chunks[j + 1].is_missing) {
+            j++;
+        }
+        message_len = append_buf_varint(*buf, message_len, request->chunks[i].offset);
+        message_len = append_buf_varint(*buf, message_len,
+            request->chunks[j].offset + request->chunks[j].len - request->chunks[i].offset);
+        ranges_size++;
+        i = j;
+    }
+    uint64_t ranges_len = message_len - ranges_offset - sizeof(uint64_t);
+    append_buf_uint64(*buf, ranges_offset, my_htonll(ranges_len));
+    if (ranges_len > MAX_RANGES_LEN) {
+        ERROR("too many %s/%s chunks are missing", config.remote_dir, path);
+        goto fail;
+    }
+
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s chunk content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    INFO("requested %s/%s chunk content (%" PRIu64 " ranges, %" PRIu64 " bytes copied from local chunks)",
+        config.remote_dir, path, ranges_size, copy_len);
+
+    // the received list is out of the pipeline, so there's room for it
+    content_request_t *next = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    *next = *request;
+    pipeline->size++;
+
+    return 0;
+
+fail:
+    kill_chunked(request);
+    return -1;
+}
+
+// receive missing chunks of `request` into its temporary file, which replaces the file when it's complete
+// return 0 when success, -1 when error
+int receive_chunk_content(pipeline_t *pipeline, content_request_t *request, char **buf, uint64_t *buf_size) {
+    transport_t *conn = pipeline->conn;
+    char *path = request->path;
+    // cleared when the content can't be rebuilt, but the response must still be consumed
+    bool is_valid = true;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s chunk content failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s/%s chunk content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    message_len = my_ntohll(message_len);
+    uint64_t missing_len = 0;
+    for (uint64_t i = 0; i < request->chunks_size; i++) {
+        if (request->chunks[i].is_missing) {
+            missing_len += request->chunks[i].len;
+        }
+    }
+    if (!message_len) {
+        ERROR("%s/%s is changed while syncing", config.remote_dir, path);
+        goto fail;
+    }
+    if (message_len != missing_len) {
+        ERROR("invalid %s/%s chunk content", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    INFO("receiving %s/%s chunk content", config.remote_dir, path);
+
+    *buf_size = extend_buf(buf, *buf_size, CHUNK_MAX_SIZE);
+    for (uint64_t i = 0; i < request->chunks_size; i++) {
+        file_chunk_t *chunk = &request->chunks[i];
+        if (!chunk->is_missing) {
+            continue;
+        }
+        if (transport_read(conn, *buf, chunk->len) != chunk->len) {
+            ERROR("receive %s/%s chunk content failed", config.remote_dir, path);
+            pipeline->is_broken = true;
+            goto fail;
+        }
+        if (!is_valid) {
+            continue;
+        }
+        uint64_t hash[2];
+        murmur3_128(*buf, chunk->len, hash);
+        if (hash[0] != chunk->hash[0] || hash[1] != chunk->hash[1]) {
+            ERROR("%s/%s is changed while syncing", config.remote_dir, path);
+            is_valid = false;
+        }
+        else if (bulk_pwrite(request->file_fd, *buf, chunk->len, chunk->offset) != chunk->len) {
+            ERROR("write %s/%s content to file failed", config.remote_dir, path);
+            is_valid = false;
+        }
+    }
+    if (!is_valid) {
+        goto fail;
+    }
+
+    return finish_chunked(request, message_len);
+
+fail:
+    kill_chunked(request);
+    return -1;
+}
+
+// receive the oldest requested content
+// received content will be written to its opened file
+// file mtime will be set to `modify_time`
+// return 0 when success, -1 when error
+int receive_content(pipeline_t *pipeline, char **buf, uint64_t *buf_size) {
+    content_request_t request = pipeline->requests[pipeline->head];
+    pipeline->head = (pipeline->head + 1) % pipeline->window;
+    pipeline->size--;
+
+    if (request.is_delta) {
+        return receive_delta(pipeline, &request, buf, buf_size);
+    }
+    if (request.is_resumable) {
+        return receive_resumable(pipeline, &request, buf, buf_size);
+    }
+    if (request.striped) {
+        return receive_stripe(pipeline, &request, buf, buf_size);
+    }
+    if (request.batch) {
+        return receive_batch(pipeline, &request, buf, buf_size);
+    }
+    if (request.is_chunked) {
+        return request.chunks ? receive_chunk_content(pipeline, &request, buf, buf_size)
+            : receive_chunk_list(pipeline, &request, buf, buf_size);
+    }
+
+    transport_t *conn = pipeline->conn;
+    char *path = request.path;
+    int file_fd = request.file_fd;
+
+    if (pipeline->is_broken) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // get requested content length
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    message_len = my_ntohll(message_len);
+    INFO("receiving %s/%s content", config.remote_dir, path);
+
+    int ret = receive_content_piece(pipeline, &request, file_fd, 0, message_len, buf, buf_size);
+    if (ret == -1) {
+        ERROR("receive %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        goto fail;
+    }
+    if (ret == 1) {
+        ERROR("write %s/%s content to file failed", config.remote_dir, path);
+        goto fail;
+    }
+
+    // make mtime equal for bidirectional sync
+    struct timespec ts[2];
+    // remain atime
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    // set mtime equal to server file
+    ts[1] = request.modify_time;
+    if (futimens(file_fd, ts) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+    INFO("synced %s (%" PRIu64 " bytes)", path, message_len);
+
+    close(file_fd);
+    free(path);
+
+    return 0;
+
+fail:
+    has_failed = true;
+    close(file_fd);
+    free(path);
+    return -1;
+}
+
+// receive all requested content
+// return 0 when success, -1 when any error
+int drain_content(pipeline_t *pipeline, char **buf, uint64_t *buf_size) {
+    int ret = 0;
+    while (pipeline->size > 0) {
+        if (receive_content(pipeline, buf, buf_size) == -1) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+// request chunk list of "{remote_dir}/{path}" without waiting for the response
+// chunks which aren't found locally are requested when it's received, and the content is rebuilt in a temporary file
+// next to file "{path}", `size` is the remote file size, SIZE_UNKNOWN when it's unknown
+// return 0 when success, -1 when error, 1 when chunks aren't used and the content should be requested otherwise
+int request_chunk_list(pipeline_t *pipeline, char *path, struct timespec modify_time, uint64_t size, char **buf,
+    uint64_t *buf_size) {
+    // only plain regular file is replaced, a link or a file with several names is written in place
+    struct stat st;
+    if (!chunk_store || size == SIZE_UNKNOWN || size < CHUNKED_MIN_SIZE || lstat(path, &st) == -1
+        || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        return 1;
+    }
+
+    // send [15][path length][path]
+    uint64_t path_len = strlen(config.remote_dir) + 1 + strlen(path);
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) + path_len;
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_CHUNK_LIST));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(path_len));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s chunk list failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        has_failed = true;
+        return -1;
+    }
+    INFO("requested %s/%s chunk list", config.remote_dir, path);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(request->path, path);
+    request->modify_time = modify_time;
+    request->file_fd = -1;
+    request->is_compressed = false;
+    request->temp_path = NULL;
+    request->permission = st.st_mode & 07777;
+    request->is_delta = false;
+    request->is_resumable = false;
+    request->is_chunked = true;
+    request->chunks = NULL;
+    request->chunks_size = 0;
+    request->striped = NULL;
+    request->batch = NULL;
+    pipeline->size++;
+
+    return 0;
+}
+
+// small file is cheaper to transfer as a whole than by delta
+#define DELTA_MIN_SIZE (1 << 20)
+
+// request delta of "{remote_dir}/{path}" against file "{path}" without waiting for the response
+// signatures of "{path}" are sent, and the new content is rebuilt in a temporary file next to it
+// return 0 when success, -1 when error, 1 when delta isn't used and the whole content should be requested
+int request_delta(pipeline_t *pipeline, char *path, struct timespec modify_time, char **buf, uint64_t *buf_size) {
+    // only plain regular file is replaced, a link or a file with several names is written in place
+    struct stat st;
+    if (!(server_features & FEATURE_DELTA) || lstat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_nlink != 1
+        || st.st_size < DELTA_MIN_SIZE
+        || st.st_size / delta_block_size(st.st_size) * DELTA_SIGNATURE_LEN > MAX_DELTA_SIGNATURES_LEN) {
+        return 1;
+    }
+
+    int basis_fd = open(path, O_RDONLY);
+    if (basis_fd == -1) {
+        return 1;
+    }
+
+    char *temp_path = sibling_path(path, ".filesync");
+
+    int file_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (file_fd == -1) {
+        INFO("create %s failed, request whole content", temp_path);
+        free(temp_path);
+        close(basis_fd);
+        return 1;
+    }
+
+    // send [9][path length][path][block size][signatures length][signatures]
+    uint64_t block_size = delta_block_size(st.st_size);
+    uint64_t blocks_size = st.st_size / block_size;
+    uint64_t path_len = strlen(config.remote_dir) + 1 + strlen(path);
+    uint64_t message_len = sizeof(uint32_t) + 3 * sizeof(uint64_t) + path_len + blocks_size * DELTA_SIGNATURE_LEN;
+    if (message_len > MAX_PIPELINED_REQUEST_LEN) {
+        drain_content(pipeline, buf, buf_size);
+    }
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    if (!*buf) {
+        ERROR("malloc");
+        *buf_size = 0;
+        close(file_fd);
+        unlink(temp_path);
+        free(temp_path);
+        close(basis_fd);
+        return -1;
+    }
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_DELTA));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(path_len));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(block_size));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(blocks_size * DELTA_SIGNATURE_LEN));
+
+    delta_signature_t *signatures = (delta_signature_t *)malloc(sizeof(delta_signature_t) * (blocks_size + 1));
+    char *block = (char *)malloc(sizeof(char) * block_size);
+    if (!signatures || !block) {
+        INFO("malloc failed, request whole content of %s", path);
+        free(block);
+        free(signatures);
+        close(file_fd);
+        unlink(temp_path);
+        free(temp_path);
+        close(basis_fd);
+        return 1;
+    }
+    for (uint64_t i = 0; i < blocks_size; i++) {
+        if (bulk_read(basis_fd, block, block_size) != block_size) {
+            ERROR("read %s failed, request whole content", path);
+            free(block);
+            free(signatures);
+            close(file_fd);
+            unlink(temp_path);
+            free(temp_path);
+            close(basis_fd);
+            return 1;
+        }
+        delta_sign(block, block_size, &signatures[i]);
+        message_len = append_buf_uint32(*buf, message_len, htonl(signatures[i].weak));
+        message_len = append_buf_uint64(*buf, message_len, my_htonll(signatures[i].strong[0]));
+        message_len = append_buf_uint64(*buf, message_len, my_htonll(signatures[i].strong[1]));
+    }
+    free(block);
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s delta failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        has_failed = true;
+        free(signatures);
+        close(file_fd);
+        unlink(temp_path);
+        free(temp_path);
+        close(basis_fd);
+        return -1;
+    }
+    INFO("requested %s/%s delta (%" PRIu64 " blocks of %" PRIu64 " bytes)", config.remote_dir, path, blocks_size,
+        block_size);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(request->path, path);
+    request->modify_time = modify_time;
+    request->file_fd = file_fd;
+    request->is_compressed = false;
+    request->temp_path = temp_path;
+    request->permission = st.st_mode & 07777;
+    request->is_delta = true;
+    request->basis_fd = basis_fd;
+    request->block_size = block_size;
+    request->blocks_size = blocks_size;
+    request->signatures = signatures;
+    request->is_resumable = false;
+    request->is_chunked = false;
+    request->striped = NULL;
+    request->batch = NULL;
+    pipeline->size++;
+
+    return 0;
+}
+
+// request "{remote_dir}/{path}" content into a temporary file next to file "{path}" without waiting for the response
+// the content is received from `offset` given by load_progress(), and its progress is recorded so it can be resumed
+// `size` is the remote file size, SIZE_UNKNOWN when it's unknown
+// return 0 when success, -1 when error, 1 when the content isn't resumable and should be written in place
+int request_resumable(pipeline_t *pipeline, char *path, struct timespec modify_time, uint64_t size, uint64_t offset,
+    char **buf, uint64_t *buf_size) {
+    // small file is quick to receive again
+    uint64_t const RESUME_MIN_SIZE = 1 << 20;
+
+    // only plain regular file is replaced, a link or a file with several names is written in place
+    struct stat st;
+    if (!(server_features & FEATURE_RANGE_CONTENT) || (!offset && (size == SIZE_UNKNOWN || size < RESUME_MIN_SIZE))
+        || lstat(path, &st) == -1 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+        return 1;
+    }
+
+    // content written after the recorded offset isn't trusted
+    char *temp_path = sibling_path(path, PART_SUFFIX);
+    char *progress_path = sibling_path(path, PROGRESS_SUFFIX);
+    content_range_t range = { offset, UINT64_MAX };
+    int file_fd = open(temp_path, offset ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int progress_fd = file_fd == -1 ? -1 : open(progress_path, offset ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (progress_fd == -1 || ftruncate(file_fd, offset) == -1 || lseek(file_fd, offset, SEEK_SET) == -1
+        || save_progress(progress_fd, modify_time, &range, 1) == -1) {
+        INFO("create %s failed, write content in place", temp_path);
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        if (progress_fd != -1) {
+            close(progress_fd);
+        }
+        unlink(temp_path);
+        unlink(progress_path);
+        free(temp_path);
+        free(progress_path);
+        return 1;
+    }
+
+    // send [12][path length][path][offset][length] to resume, otherwise the whole content is requested
+    // by [1][path length][path] or [10] for compressed content
+    bool is_compressed = !offset && (server_features & FEATURE_COMPRESSION) && !strcmp(config.compression, "on");
+    uint32_t command = offset ? COMMAND_RANGE_CONTENT : is_compressed ? COMMAND_COMPRESSED_CONTENT : COMMAND_CONTENT;
+    uint64_t path_len = strlen(config.remote_dir) + 1 + strlen(path);
+    uint64_t message_len = sizeof(uint32_t) + 3 * sizeof(uint64_t) + path_len;
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(command));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(path_len));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+    if (offset) {
+        message_len = append_buf_uint64(*buf, message_len, my_htonll(offset));
+        message_len = append_buf_uint64(*buf, message_len, my_htonll(UINT64_MAX));
+    }
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        has_failed = true;
+        close(file_fd);
+        close(progress_fd);
+        free(temp_path);
+        free(progress_path);
+        return -1;
+    }
+    INFO("requested %s/%s content from %" PRIu64, config.remote_dir, path, offset);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(request->path, path);
+    request->modify_time = modify_time;
+    request->file_fd = file_fd;
+    request->is_compressed = is_compressed;
+    request->temp_path = temp_path;
+    request->permission = st.st_mode & 07777;
+    request->is_delta = false;
+    request->is_resumable = true;
+    request->is_chunked = false;
+    request->progress_fd = progress_fd;
+    request->progress_path = progress_path;
+    request->offset = offset;
+    request->striped = NULL;
+    request->batch = NULL;
+    pipeline->size++;
+
+    return 0;
+}
+
+// request stripe `stripe` of `striped` without waiting for the response
+// the oldest request is received first if the pipeline is full
+// return 0 when success, -1 when error
+int request_stripe(pipeline_t *pipeline, striped_file_t *striped, uint64_t stripe, char **buf, uint64_t *buf_size) {
+    while (pipeline->size == pipeline->window) {
+        receive_content(pipeline, buf, buf_size);
+    }
+    char *path = striped->path;
+    if (pipeline->is_broken) {
+        ERROR("request %s/%s content failed", config.remote_dir, path);
+        has_failed = true;
+        finish_stripe(striped, false);
+        return -1;
+    }
+
+    // send [12][path length][path][offset][length]
+    content_range_t range = striped->ranges[stripe];
+    uint64_t path_len = strlen(config.remote_dir) + 1 + strlen(path);
+    uint64_t message_len = sizeof(uint32_t) + 3 * sizeof(uint64_t) + path_len;
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_RANGE_CONTENT));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(path_len));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(range.offset));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(range.end - range.offset));
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        has_failed = true;
+        finish_stripe(striped, false);
+        return -1;
+    }
+    INFO("requested %s/%s content from %" PRIu64 " (%" PRIu64 " bytes)", config.remote_dir, path, range.offset,
+        range.end - range.offset);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = NULL;
+    request->modify_time = striped->modify_time;
+    request->file_fd = striped->file_fd;
+    request->is_compressed = false;
+    request->temp_path = NULL;
+    request->is_delta = false;
+    request->is_resumable = false;
+    request->is_chunked = false;
+    request->striped = striped;
+    request->stripe = stripe;
+    request->batch = NULL;
+    pipeline->size++;
+    pipeline->stripes_size++;
+
+    return 0;
+}
+
+// request contents of the small files collected in `pipeline` without waiting for the response
+// the oldest request is received first if the pipeline is full
+// return 0 when success, -1 when error
+int request_batch(pipeline_t *pipeline, char **buf, uint64_t *buf_size) {
+    batch_file_t *batch = pipeline->batch;
+    uint64_t batch_size = pipeline->batch_size;
+    pipeline->batch = (batch_file_t *)malloc(sizeof(batch_file_t) * BATCH_MAX_FILES);
+    pipeline->batch_size = 0;
+    pipeline->batch_len = 0;
+
+    while (pipeline->size == pipeline->window) {
+        receive_content(pipeline, buf, buf_size);
+    }
+    if (pipeline->is_broken) {
+        ERROR("request batch content failed (%" PRIu64 " files)", batch_size);
+        has_failed = true;
+        kill_batch(batch, batch_size);
+        return -1;
+    }
+
+    // send [13][path length][path][names length]([name length][name])...
+    uint64_t message_len = sizeof(uint32_t) + 2 * sizeof(uint64_t) + strlen(config.remote_dir);
+    for (uint64_t i = 0; i < batch_size; i++) {
+        message_len += VARINT_MAX_LEN + strlen(batch[i].path);
+    }
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_BATCH_CONTENT));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(config.remote_dir)));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    uint64_t names_offset = message_len;
+    message_len += sizeof(uint64_t);
+    for (uint64_t i = 0; i < batch_size; i++) {
+        message_len = append_buf_varint(*buf, message_len, strlen(batch[i].path));
+        message_len = append_buf_charp(*buf, message_len, batch[i].path);
+    }
+    append_buf_uint64(*buf, names_offset, my_htonll(message_len - names_offset - sizeof(uint64_t)));
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request batch content failed (%" PRIu64 " files)", batch_size);
+        pipeline->is_broken = true;
+        has_failed = true;
+        kill_batch(batch, batch_size);
+        return -1;
+    }
+    INFO("requested batch content (%" PRIu64 " files)", batch_size);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = NULL;
+    request->file_fd = -1;
+    request->is_compressed = false;
+    request->temp_path = NULL;
+    request->is_delta = false;
+    request->is_resumable = false;
+    request->is_chunked = false;
+    request->striped = NULL;
+    request->batch = batch;
+    request->batch_size = batch_size;
+    pipeline->size++;
+
+    return 0;
+}
+
+// whether content of a file of `size` bytes is requested in a batch
+static bool is_batched(uint64_t size) {
+    return (server_features & FEATURE_BATCH_CONTENT) && size <= BATCH_MAX_FILE_SIZE;
+}
+
+// add small file "{path}" to the next batch of `pipeline`, the batch is requested when it's full
+// `size` is the remote file size, and the file is created with `permission` if `is_new`
+// return 0 when success, -1 when error
+int batch_content(pipeline_t *pipeline, char *path, struct timespec modify_time, uint64_t size, bool is_new,
+    mode_t permission, char **buf, uint64_t *buf_size) {
+    int ret = 0;
+    if (pipeline->batch_size > 0 && pipeline->batch_len + size > BATCH_MAX_LEN) {
+        ret = request_batch(pipeline, buf, buf_size);
+    }
+
+    batch_file_t *file = &pipeline->batch[pipeline->batch_size];
+    file->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(file->path, path);
+    file->modify_time = modify_time;
+    file->is_new = is_new;
+    file->permission = permission;
+    pipeline->batch_size++;
+    pipeline->batch_len += size;
+
+    if (pipeline->batch_size == BATCH_MAX_FILES && request_batch(pipeline, buf, buf_size) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// copy `len` bytes from `source_fd` to `file_fd`, by reflink if the file system supports it, otherwise in kernel
+// if possible
+// return 0 when success, -1 when error
+static int copy_file_content(int source_fd, int file_fd, uint64_t len) {
+    uint64_t const BUF_LEN = 1 << 16;
+
+    uint64_t copy_len = 0;
+#ifdef __linux__
+    if (ioctl(file_fd, FICLONE, source_fd) == 0) {
+        return 0;
+    }
+    while (copy_len < len) {
+        ssize_t chunk_len = copy_file_range(source_fd, NULL, file_fd, NULL, len - copy_len, 0);
+        if (chunk_len <= 0) {
+            break;
+        }
+        copy_len += chunk_len;
+    }
+#endif
+    // what's left is copied from the current offsets
+    char *buf = copy_len < len ? (char *)malloc(sizeof(char) * BUF_LEN) : NULL;
+    while (copy_len < len) {
+        ssize_t chunk_len = bulk_read(source_fd, buf, MIN(BUF_LEN, len - copy_len));
+        if (chunk_len <= 0 || bulk_write(file_fd, buf, chunk_len) != chunk_len) {
+            free(buf);
+            return -1;
+        }
+        copy_len += chunk_len;
+    }
+    free(buf);
+    return 0;
+}
+
+// whether file "{path}" has `size` bytes of content `hash`
+// a file found in content index is only known by its size and mtime, which don't change on some writes
+static bool has_content(char *path, uint64_t size, uint64_t *hash) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    uint64_t file_hash[2];
+    bool ret = content_hash_read(fd, size, file_hash) == 0 && file_hash[0] == hash[0] && file_hash[1] == hash[1];
+    // nothing may follow
+    char c;
+    ret = ret && read(fd, &c, 1) == 0;
+    close(fd);
+    return ret;
+}
+
+// copy content `hash` of `size` bytes into file "{path}" from a local file which has it
+// file mtime will be set to `modify_time` after the copy is checked against `hash`
+// return 0 when success, -1 when the content isn't found locally, copying fails or the copy differs
+int copy_local_content(char *path, struct timespec modify_time, uint64_t size, uint64_t *hash) {
+    char *source = content_index ? content_index_find(content_index, hash, size) : NULL;
+    if (!source) {
+        return -1;
+    }
+    struct timespec ts[2];
+    ts[0].tv_sec = 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = modify_time;
+
+    // only mtime of the file is changed
+    if (!strcmp(source, path)) {
+        free(source);
+        if (!has_content(path, size, hash)) {
+            INFO("%s differs from its recorded content, request its content", path);
+            return -1;
+        }
+        if (utimensat(AT_FDCWD, path, ts, 0) == -1) {
+            return -1;
+        }
+        content_index_add(content_index, hash, path, size, modify_time);
+        INFO("synced %s (mtime only)", path);
+        return 0;
+    }
+
+    int source_fd = open(source, O_RDONLY);
+    if (source_fd == -1) {
+        free(source);
+        return -1;
+    }
+    int file_fd = open_content_file(path, false, 0);
+    if (file_fd == -1) {
+        close(source_fd);
+        free(source);
+        return -1;
+    }
+    // keep the truncated file out of date until it's copied
+    struct timeval tv[2] = { 0 };
+    if (futimes(file_fd, tv) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+
+    int ret = copy_file_content(source_fd, file_fd, size);
+    close(source_fd);
+    if (ret == -1) {
+        INFO("copy %s from %s failed, request its content", path, source);
+        close(file_fd);
+        free(source);
+        return -1;
+    }
+    // the copy is still out of date, so it's overwritten by requested content if it differs
+    if (!has_content(path, size, hash)) {
+        INFO("%s copied from %s differs from its content, request its content", path, source);
+        close(file_fd);
+        free(source);
+        return -1;
+    }
+    if (futimens(file_fd, ts) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+    close(file_fd);
+    content_index_add(content_index, hash, path, size, modify_time);
+    INFO("synced %s (%" PRIu64 " bytes copied from %s)", path, size, source);
+    free(source);
+
+    return 0;
+}
+
+// request "{remote_dir}/{path}" content without waiting for the response
+// the oldest request is received first if the pipeline is full
+// received content will be written to file "{path}", which must exist
+// file mtime will be set to `modify_time`, and `size` is the remote file size, SIZE_UNKNOWN when it's unknown
+// content is copied from a local file instead if it has content hash `hash`, which is NULL when it's unknown
+// return 0 when success, -1 when error
+int request_content(pipeline_t *pipeline, char *path, struct timespec modify_time, uint64_t size, uint64_t *hash,
+    char **buf, uint64_t *buf_size) {
+    if (hash && copy_local_content(path, modify_time, size, hash) == 0) {
+        return 0;
+    }
+    while (pipeline->size == pipeline->window) {
+        receive_content(pipeline, buf, buf_size);
+    }
+    if (pipeline->is_broken) {
+        ERROR("request %s/%s content failed", config.remote_dir, path);
+        has_failed = true;
+        return -1;
+    }
+
+    // content received partly last time is resumed, otherwise only the difference is transferred
+    // if an old copy is large enough
+    // only a record of content received as a whole can be resumed by one connection
+    uint64_t offset = 0;
+    uint64_t ranges_size;
+    content_range_t *ranges = server_features & FEATURE_RANGE_CONTENT ? load_progress(path, modify_time, &ranges_size)
+        : NULL;
+    if (ranges && ranges_size == 1 && ranges[0].end == UINT64_MAX) {
+        offset = ranges[0].offset;
+    }
+    else if (ranges) {
+        discard_progress(path);
+    }
+    free(ranges);
+    // or chunks found in any local file are copied if large files are requested by chunks
+    int ret = offset ? 1 : request_chunk_list(pipeline, path, modify_time, size, buf, buf_size);
+    if (ret == 1 && !offset) {
+        ret = request_delta(pipeline, path, modify_time, buf, buf_size);
+    }
+    if (ret == 1) {
+        // large content is received into a temporary file, so it can be resumed if it's interrupted
+        ret = request_resumable(pipeline, path, modify_time, size, offset, buf, buf_size);
+    }
+    if (ret != 1) {
+        return ret;
+    }
+
+    // open file
+    int file_fd;
+    // add write permission
+    struct stat st;
+    bool stat_success = true;
+    if (stat(path, &st) == -1) {
+        ERROR("get %s status failed", path);
+        stat_success = false;
+    }
+    if (stat_success && chmod(path, st.st_mode | 0200) == -1) {
+        ERROR("change %s mode failed", path);
+    }
+
+    file_fd = open(path, O_WRONLY | O_TRUNC);
+    if (file_fd == -1) {
+        ERROR("open %s failed", path);
+        has_failed = true;
+        return -1;
+    }
+    // keep the truncated file out of date until its content is received, so it's updated by re-execution
+    // if the client is killed
+    struct timeval tv[2] = { 0 };
+    if (futimes(file_fd, tv) == -1) {
+        ERROR("set %s mtime failed", path);
+    }
+
+    // reset permission
+    if (stat_success && chmod(path, st.st_mode) == -1) {
+        ERROR("reset %s mode failed", path);
+    }
+
+    // send [1][path length][path], or [10] for compressed content
+    bool is_compressed = (server_features & FEATURE_COMPRESSION) && !strcmp(config.compression, "on");
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) + strlen(config.remote_dir) + 1 + strlen(path);
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(is_compressed ? COMMAND_COMPRESSED_CONTENT : COMMAND_CONTENT));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(config.remote_dir) + 1 + strlen(path)));
+    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
+    message_len = append_buf_charp(*buf, message_len, "/");
+    message_len = append_buf_charp(*buf, message_len, path);
+
+    if (transport_write(pipeline->conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s/%s content failed", config.remote_dir, path);
+        pipeline->is_broken = true;
+        has_failed = true;
+        close(file_fd);
+        return -1;
+    }
+    INFO("requested %s/%s content", config.remote_dir, path);
+
+    content_request_t *request = &pipeline->requests[(pipeline->head + pipeline->size) % pipeline->window];
+    request->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(request->path, path);
+    request->modify_time = modify_time;
+    request->file_fd = file_fd;
+    request->is_compressed = is_compressed;
+    request->temp_path = NULL;
+    request->is_delta = false;
+    request->is_resumable = false;
+    request->is_chunked = false;
+    request->striped = NULL;
+    request->batch = NULL;
+    pipeline->size++;
+
+    return 0;
+}
+
+// a file whose content should be requested by a worker
+typedef struct {
+    char *path;
+    struct timespec modify_time;
+    // SIZE_UNKNOWN when it's unknown
+    uint64_t size;
+    // set when its content hash is known
+    bool has_hash;
+    uint64_t hash[2];
+    // set when the file doesn't exist, then it's created with `permission` when its content is received
+    bool is_new;
+    mode_t permission;
+    // set when only stripe `stripe` of it should be requested
+    striped_file_t *striped;
+    uint64_t stripe;
+} content_job_t;
+
+// reserve `len` bytes for `fd`, so writing anywhere in it doesn't run out of space
+// return 0 when success, -1 when error
+static int preallocate(int fd, uint64_t len) {
+#ifdef __linux__
+    if (fallocate(fd, 0, 0, len) == 0) {
+        return 0;
+    }
+#endif
+    // file system which can't reserve space still gets the length
+    return ftruncate(fd, len);
+}
+
+// split file "{path}" of `size` bytes into stripes and push them to `queue`, so they're received by several
+// connections at once into a preallocated temporary file next to it, stripes left last time are resumed
+// return 0 when success, -1 when the file should be requested as a whole
+int push_striped_jobs(work_queue_t *queue, char *path, struct timespec modify_time, uint64_t size) {
+    // stripes are aligned, so they're written by whole pages
+    uint64_t const STRIPE_ALIGN = 1 << 20;
+
+    uint64_t stripes_size = MIN(config.max_stripes, config.parallelism);
+    struct stat st;
+    if (!(server_features & FEATURE_RANGE_CONTENT) || stripes_size < 2 || size == SIZE_UNKNOWN
+        || size < (uint64_t)config.stripe_threshold << 20 || lstat(path, &st) == -1 || !S_ISREG(st.st_mode)
+        || st.st_nlink != 1) {
+        return -1;
+    }
+
+    // what's left last time is resumed, and content received as a whole is resumed as one stripe
+    uint64_t ranges_size;
+    content_range_t *ranges = load_progress(path, modify_time, &ranges_size);
+    for (uint64_t i = 0; ranges && i < ranges_size; i++) {
+        ranges[i].end = MIN(ranges[i].end, size);
+        if (ranges[i].offset > ranges[i].end) {
+            discard_progress(path);
+            free(ranges);
+            ranges = NULL;
+        }
+    }
+    bool is_resumed = ranges != NULL;
+    if (!is_resumed) {
+        // an old copy is updated by delta instead
+        if ((server_features & FEATURE_DELTA) && st.st_size >= DELTA_MIN_SIZE) {
+            return -1;
+        }
+        uint64_t stripe_len = (size / stripes_size + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+        ranges = (content_range_t *)malloc(sizeof(content_range_t) * stripes_size);
+        ranges_size = 0;
+        for (uint64_t offset = 0; offset < size; offset += stripe_len) {
+            ranges[ranges_size].offset = offset;
+            ranges[ranges_size].end = MIN(size, offset + stripe_len);
+            ranges_size++;
+        }
+    }
+
+    char *temp_path = sibling_path(path, PART_SUFFIX);
+    char *progress_path = sibling_path(path, PROGRESS_SUFFIX);
+    int flags = is_resumed ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+    int file_fd = open(temp_path, flags, 0600);
+    int progress_fd = file_fd == -1 ? -1 : open(progress_path, flags, 0600);
+    if (progress_fd == -1 || preallocate(file_fd, size) == -1
+        || save_progress(progress_fd, modify_time, ranges, ranges_size) == -1) {
+        INFO("create %s failed, request whole content", temp_path);
+        if (file_fd != -1) {
+            close(file_fd);
+        }
+        if (progress_fd != -1) {
+            close(progress_fd);
+        }
+        unlink(temp_path);
+        unlink(progress_path);
+        free(temp_path);
+        free(progress_path);
+        free(ranges);
+        return -1;
+    }
+
+    striped_file_t *striped = (striped_file_t *)malloc(sizeof(striped_file_t));
+    striped->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(striped->path, path);
+    striped->size = size;
+    striped->modify_time = modify_time;
+    striped->permission = st.st_mode & 07777;
+    striped->file_fd = file_fd;
+    striped->temp_path = temp_path;
+    striped->progress_fd = progress_fd;
+    striped->progress_path = progress_path;
+    pthread_mutex_init(&striped->lock, NULL);
+    striped->ranges = ranges;
+    striped->ranges_size = ranges_size;
+    striped->has_failed = false;
+
+    // all stripes are counted before any is pushed, so the file isn't completed early
+    striped->remaining = 0;
+    for (uint64_t i = 0; i < ranges_size; i++) {
+        if (ranges[i].offset < ranges[i].end) {
+            striped->remaining++;
+        }
+    }
+    if (striped->remaining == 0) {
+        // everything is received but the client was killed before replacing the file
+        striped->remaining = 1;
+        finish_stripe(striped, true);
+        return 0;
+    }
+    INFO("receive %s in %" PRIu64 " stripes", path, striped->remaining);
+
+    for (uint64_t i = 0; i < ranges_size; i++) {
+        if (ranges[i].offset < ranges[i].end) {
+            content_job_t *job = (content_job_t *)malloc(sizeof(content_job_t));
+            job->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+            strcpy(job->path, path);
+            job->modify_time = modify_time;
+            job->size = size;
+            job->has_hash = false;
+            job->is_new = false;
+            job->striped = striped;
+            job->stripe = i;
+            queue_push(queue, job);
+        }
+    }
+
+    return 0;
+}
+
+void push_content_job(work_queue_t *queue, char *path, struct timespec modify_time, uint64_t size, uint64_t *hash,
+    bool is_new, mode_t permission) {
+    // a large file is received by several connections at once, unless it's copied from a local file
+    // or it's requested by chunks
+    char *source = hash && content_index ? content_index_find(content_index, hash, size) : NULL;
+    bool is_chunked = chunk_store && size != SIZE_UNKNOWN && size >= CHUNKED_MIN_SIZE;
+    if (!source && !is_chunked && push_striped_jobs(queue, path, modify_time, size) == 0) {
+        return;
+    }
+    free(source);
+
+    content_job_t *job = (content_job_t *)malloc(sizeof(content_job_t));
+    job->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(job->path, path);
+    job->modify_time = modify_time;
+    job->size = size;
+    job->has_hash = hash != NULL;
+    if (hash) {
+        job->hash[0] = hash[0];
+        job->hash[1] = hash[1];
+    }
+    job->is_new = is_new;
+    job->permission = permission;
+    job->striped = NULL;
+    queue_push(queue, job);
+}
+
+// a stripe which isn't requested fails
+void kill_content_job(void *job) {
+    if (((content_job_t *)job)->striped) {
+        finish_stripe(((content_job_t *)job)->striped, false);
+    }
+    free(((content_job_t *)job)->path);
+    free(job);
+}
+
+// metadata of a directory which is set after content is synced, since entries created in it change its mtime,
+// and one without write permission can't have entries created in it
+typedef struct {
+    char *path;
+    bool has_permission;
+    mode_t permission;
+    // tv_nsec is UTIME_OMIT when mtime isn't set
+    struct timespec modify_time;
+    uint64_t depth;
+} dir_fixup_t;
+
+// only used by the main thread
+dir_fixup_t *dir_fixups = NULL;
+uint64_t dir_fixups_size = 0;
+uint64_t dir_fixups_capacity = 0;
+// mask applied to permission of created directories, which is applied again when it's set at last
+mode_t process_umask = 0;
+
+void append_dir_fixup(char *path, bool has_permission, mode_t permission, struct timespec modify_time) {
+    if (dir_fixups_size == dir_fixups_capacity) {
+        dir_fixups_capacity = dir_fixups_capacity ? dir_fixups_capacity << 1 : 1 << 6;
+        dir_fixups = (dir_fixup_t *)realloc(dir_fixups, sizeof(dir_fixup_t) * dir_fixups_capacity);
+    }
+    dir_fixup_t *fixup = &dir_fixups[dir_fixups_size++];
+    fixup->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(fixup->path, path);
+    fixup->has_permission = has_permission;
+    fixup->permission = permission;
+    fixup->modify_time = modify_time;
+    fixup->depth = 0;
+    for (char *c = path; *c; c++) {
+        fixup->depth += *c == '/';
+    }
+}
+
+static int compare_dir_fixup(void const *a, void const *b) {
+    uint64_t a_depth = ((dir_fixup_t const *)a)->depth;
+    uint64_t b_depth = ((dir_fixup_t const *)b)->depth;
+    return a_depth > b_depth ? -1 : a_depth < b_depth;
+}
+
+// set metadata of directories deepest first, so a directory isn't made inaccessible before its sub-directories
+void apply_dir_fixups() {
+    qsort(dir_fixups, dir_fixups_size, sizeof(dir_fixup_t), compare_dir_fixup);
+    for (uint64_t i = 0; i < dir_fixups_size; i++) {
+        dir_fixup_t *fixup = &dir_fixups[i];
+        if (fixup->has_permission && chmod(fixup->path, fixup->permission) == -1) {
+            ERROR("change %s mode failed", fixup->path);
+        }
+        struct timespec ts[2];
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1] = fixup->modify_time;
+        if (fixup->modify_time.tv_nsec != UTIME_OMIT
+            && utimensat(AT_FDCWD, fixup->path, ts, AT_SYMLINK_NOFOLLOW) == -1) {
+            ERROR("set %s mtime failed", fixup->path);
+        }
+        free(fixup->path);
+    }
+    free(dir_fixups);
+    dir_fixups = NULL;
+    dir_fixups_size = 0;
+    dir_fixups_capacity = 0;
+}
+
+// local directory of a manifest record, which is only read when an entry in it isn't known to be synced
+typedef struct {
+    char *path;
+    // -1 until it's read, or when it can't be read
+    int fd;
+    bool is_read;
+    // names of its entries sorted by name, which point into `names_buf`
+    char **names;
+    uint64_t names_size;
+    char *names_buf;
+    // names before it are smaller than the last name found
+    uint64_t cursor;
+    // permission before write permission is added to create entries in it
+    bool is_write_allowed;
+    mode_t opermission;
+} local_dir_t;
+
+// `path` isn't copied and should outlive `dir`
+void local_dir_init(local_dir_t *dir, char *path) {
+    memset(dir, 0, sizeof(local_dir_t));
+    dir->path = path;
+    dir->fd = -1;
+}
+
+void local_dir_kill(local_dir_t *dir) {
+    // workers may still create entries in it, so its permission is reset at last
+    if (dir->is_write_allowed) {
+        struct timespec omit = { .tv_nsec = UTIME_OMIT };
+        append_dir_fixup(dir->path, true, dir->opermission, omit);
+    }
+    if (dir->fd != -1) {
+        close(dir->fd);
+    }
+    free(dir->names);
+    free(dir->names_buf);
+}
+
+static int compare_name(void const *a, void const *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// read names of entries in `dir` once
+// return 0 when success, -1 when error
+static int read_local_dir(local_dir_t *dir) {
+    if (dir->is_read) {
+        return dir->fd == -1 ? -1 : 0;
+    }
+    dir->is_read = true;
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY);
+    // `fd` is still needed after reading, so let DIR own a duplicate
+    int dup_fd = dir->fd == -1 ? -1 : dup(dir->fd);
+    DIR *dirp = dup_fd == -1 ? NULL : fdopendir(dup_fd);
+    if (!dirp) {
+        ERROR("read directory %s failed", dir->path);
+        if (dup_fd != -1) {
+            close(dup_fd);
+        }
+        if (dir->fd != -1) {
+            close(dir->fd);
+            dir->fd = -1;
+        }
+        return -1;
+    }
+
+    // names are kept by offsets until `names_buf` stops growing
+    uint64_t *offsets = NULL;
+    uint64_t names_capacity = 0;
+    uint64_t buf_len = 0;
+    uint64_t buf_capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dirp))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        if (dir->names_size == names_capacity) {
+            names_capacity = names_capacity ? names_capacity << 1 : 64;
+            offsets = (uint64_t *)realloc(offsets, sizeof(uint64_t) * names_capacity);
+        }
+        uint64_t name_len = strlen(entry->d_name) + 1;
+        if (buf_len + name_len > buf_capacity) {
+            while (buf_len + name_len > buf_capacity) {
+                buf_capacity = buf_capacity ? buf_capacity << 1 : 1024;
+            }
+            dir->names_buf = (char *)realloc(dir->names_buf, sizeof(char) * buf_capacity);
+        }
+        memcpy(dir->names_buf + buf_len, entry->d_name, name_len);
+        offsets[dir->names_size++] = buf_len;
+        buf_len += name_len;
+    }
+    closedir(dirp);
+
+    dir->names = (char **)malloc(sizeof(char *) * (dir->names_size + 1));
+    for (uint64_t i = 0; i < dir->names_size; i++) {
+        dir->names[i] = dir->names_buf + offsets[i];
+    }
+    free(offsets);
+    qsort(dir->names, dir->names_size, sizeof(char *), compare_name);
+    return 0;
+}
+
+// whether `dir` has entry `name`
+// entries of a record are sorted by name, so they're merged with local names, and searched otherwise
+// return 1 when it has, 0 when it doesn't, -1 when `dir` can't be read
+static int local_dir_has(local_dir_t *dir, char *name) {
+    if (read_local_dir(dir) == -1) {
+        return -1;
+    }
+    if (dir->cursor && strcmp(name, dir->names[dir->cursor - 1]) <= 0) {
+        return bsearch(&name, dir->names, dir->names_size, sizeof(char *), compare_name) != NULL;
+    }
+    while (dir->cursor < dir->names_size && strcmp(dir->names[dir->cursor], name) < 0) {
+        dir->cursor++;
+    }
+    if (dir->cursor < dir->names_size && !strcmp(dir->names[dir->cursor], name)) {
+        dir->cursor++;
+        return 1;
+    }
+    return 0;
+}
+
+// add write permission to `dir` once, which is reset after content is synced
+// return 0 when success, -1 when error
+static int allow_local_dir_write(local_dir_t *dir) {
+    if (dir->is_write_allowed) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(dir->fd, &st) == -1) {
+        ERROR("get %s status failed", dir->path);
+        return -1;
+    }
+    if (st.st_mode & 0200) {
+        return 0;
+    }
+    if (fchmod(dir->fd, st.st_mode | 0200) == -1) {
+        ERROR("change %s mode failed", dir->path);
+        return -1;
+    }
+    dir->is_write_allowed = true;
+    dir->opermission = st.st_mode & 07777;
+    return 0;
+}
+
+// create file or directory "{path}" named `name` in `dir` if it doesn't exist
+// file to be updated is pushed to `queue` and requested by workers, `size` is the file size, SIZE_UNKNOWN when it's
+// unknown, and `hash` is its content hash, NULL when it's unknown
+// return 0 when success, -1 when error
+int sync_entry(work_queue_t *queue, local_dir_t *dir, char *path, char *name, bool is_dir, mode_t permission,
+    struct timespec modify_time, uint64_t size, uint64_t *hash) {
+    if (!is_dir) {
+        // nothing is changed since last sync
+        if (local_index && local_index_is_synced(local_index, path, false, modify_time, size, hash)) {
+            if (hash && content_index) {
+                content_index_add(content_index, hash, path, size, modify_time);
+            }
+            return 0;
+        }
+
+        int has = local_dir_has(dir, name);
+        if (has == -1) {
+            has_failed = true;
+            return -1;
+        }
+        if (!has) {
+            // the file has the content once it's synced
+            if (hash && content_index) {
+                content_index_add(content_index, hash, path, size, modify_time);
+            }
+            if (local_index) {
+                local_index_expect(local_index, path, modify_time, size, hash);
+            }
+
+            // write permission is added here, before any worker may create an entry in `dir`
+            allow_local_dir_write(dir);
+
+            // small file is created by a worker when its content is received
+            if (is_batched(size)) {
+                push_content_job(queue, path, modify_time, size, NULL, true, permission);
+                return 0;
+            }
+
+            // file doesn't exist, create it and request content
+            int file_fd = openat(dir->fd, name, O_CREAT | O_EXCL, permission);
+            if (file_fd == -1) {
+                ERROR("create %s failed", path);
+                has_failed = true;
+                return -1;
+            }
+            // content is requested later, keep the file out of date until then
+            // in case the job is abandoned
+            struct timeval tv[2] = { 0 };
+            if (futimes(file_fd, tv) == -1) {
+                ERROR("set %s mtime failed", path);
+            }
+            close(file_fd);
+            INFO("created %s", path);
+
+            push_content_job(queue, path, modify_time, size, hash, false, 0);
+            return 0;
+        }
+
+        // compare update time
+        struct stat st;
+        if (fstatat(dir->fd, name, &st, 0) == -1) {
+            ERROR("get %s status failed", path);
+            has_failed = true;
+            return -1;
+        }
+        if (local_index) {
+            if (st.st_mtime < modify_time.tv_sec) {
+                local_index_expect(local_index, path, modify_time, size, hash);
+            }
+            else {
+                local_index_add(local_index, path, false, modify_time, size, hash, &st);
+            }
+        }
+        if (st.st_mtime < modify_time.tv_sec && hash && content_index) {
+            // the file has the content but is touched, only its mtime is synced
+            char *source = content_index_find(content_index, hash, size);
+            bool is_same = source && !strcmp(source, path);
+            free(source);
+            if (is_same && copy_local_content(path, modify_time, size, hash) == 0) {
+                return 0;
+            }
+        }
+        if (hash && content_index) {
+            content_index_add(content_index, hash, path, size, modify_time);
+        }
+        if (st.st_mtime < modify_time.tv_sec) {
+            // local file is out of date, request content
+            push_content_job(queue, path, modify_time, size, hash, false, 0);
+        }
+    }
+
+    else {
+        if (local_index && local_index_is_synced(local_index, path, true, modify_time, 0, NULL)) {
+            // its mtime is still synced, since entries may be created in it
+            append_dir_fixup(path, false, 0, modify_time);
+            return 0;
+        }
+
+        int has = local_dir_has(dir, name);
+        if (has == -1) {
+            has_failed = true;
+            return -1;
+        }
+        if (!has) {
+            // the directory doesn't exist, create it writable, and its permission is set after content is synced
+            allow_local_dir_write(dir);
+            if (mkdirat(dir->fd, name, permission | 0700) == -1) {
+                ERROR("create directory %s failed", path);
+                has_failed = true;
+                return -1;
+            }
+            INFO("created directory %s", path);
+        }
+        append_dir_fixup(path, !has && (permission & 0700) != 0700, permission & ~process_umask, modify_time);
+        if (local_index) {
+            local_index_add(local_index, path, true, modify_time, 0, NULL, NULL);
+        }
+    }
+
+    return 0;
+}
+
+// `*path` is a buffer of `*path_capacity` bytes reused through the recursion, whose first `prefix_len` bytes are
+// the prefix, which indicates "./" if `prefix_len` is 0
+// the directory of the prefix must exist
+// files to be updated are pushed to `queue` and requested by workers
+// sub directories of `node` are traversed only if `recursive`
+// return 0 when success, -1 when error
+int traverse(work_queue_t *queue, manifest_tree_t *tree, manifest_node_t *node, char **path, uint64_t *path_capacity,
+    uint64_t prefix_len, bool recursive) {
+    char *dir_path = (char *)malloc(sizeof(char) * (prefix_len ? prefix_len + 1 : 2));
+    if (prefix_len) {
+        memcpy(dir_path, *path, prefix_len);
+        dir_path[prefix_len] = 0;
+    }
+    else {
+        strcpy(dir_path, ".");
+    }
+    local_dir_t dir;
+    local_dir_init(&dir, dir_path);
+
+    for (uint64_t i = 0; i < node->entries_size; i++) {
+        manifest_node_t *sub_node = &tree->nodes[node->entries + i];
+        char *name = tree->names + sub_node->name;
+
+        uint64_t name_len = strlen(name);
+        uint64_t path_len = prefix_len ? prefix_len + 1 + name_len : name_len;
+        if (path_len + 1 > *path_capacity) {
+            while (path_len + 1 > *path_capacity) {
+                *path_capacity <<= 1;
+            }
+            *path = (char *)realloc(*path, sizeof(char) * *path_capacity);
+        }
+        if (prefix_len) {
+            (*path)[prefix_len] = '/';
+        }
+        memcpy(*path + path_len - name_len, name, name_len + 1);
+
+        struct timespec modify_time;
+        modify_time.tv_sec = (time_t)sub_node->mtime_sec;
+        modify_time.tv_nsec = 0;
+
+        if (sub_node->type == MANIFEST_FILE) {
+            sync_entry(queue, &dir, *path, name, false, sub_node->permission, modify_time, SIZE_UNKNOWN, NULL);
+        }
+
+        else if (sub_node->type == MANIFEST_DIRECTORY) {
+            // unlike server, client doesn't chdir because client must request content with full path
+            if (sync_entry(queue, &dir, *path, name, true, sub_node->permission, modify_time, 0, NULL) == 0
+                && recursive) {
+                traverse(queue, tree, sub_node, path, path_capacity, path_len, true);
+            }
+        }
+
+        else {
+            WARN("unknown type of file %s", *path);
+        }
+
+        // check whether sigint was raised, files in queue are abandoned
+        if (raised_sigint) {
+            break;
+        }
+    }
+    local_dir_kill(&dir);
+    free(dir_path);
+
+    return 0;
+}
+
+// merkle hash of a directory synced from server
+typedef struct {
+    char *path;
+    uint64_t hash;
+} dir_hash_t;
+
+typedef struct {
+    dir_hash_t *hashes;
+    uint64_t size;
+    uint64_t capacity;
+} dir_hash_list_t;
+
+// `path` is owned by `list`
+void append_dir_hash(dir_hash_list_t *list, char *path, uint64_t hash) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity << 1 : 1 << 6;
+        list->hashes = (dir_hash_t *)realloc(list->hashes, sizeof(dir_hash_t) * list->capacity);
+    }
+    list->hashes[list->size].path = path;
+    list->hashes[list->size].hash = hash;
+    list->size++;
+}
+
+void kill_dir_hashes(dir_hash_list_t *list) {
+    for (uint64_t i = 0; i < list->size; i++) {
+        free(list->hashes[i].path);
+    }
+    free(list->hashes);
+    list->hashes = NULL;
+    list->size = 0;
+    list->capacity = 0;
+}
+
+// traverse binary manifest `frame` of `frame_len` bytes without recursion
+// directories of records must exist
+// if `hashes` isn't NULL, each record is preceded by its directory hash, which is appended to `hashes`
+// return number of directory records when success, -1 when `frame` is malformed
+int64_t traverse_binary(work_queue_t *queue, char *frame, uint64_t frame_len, dir_hash_list_t *hashes) {
+    char name[NAME_MAX + 1];
+    int64_t records_size = 0;
+    uint64_t offset = 0;
+    while (offset < frame_len) {
+        uint64_t hash;
+        if (hashes && read_buf_uint64(frame, frame_len, &offset, &hash) == -1) {
+            return -1;
+        }
+        char *dir_path;
+        uint64_t entries_size;
+        if (read_buf_manifest_dir(frame, frame_len, &offset, &dir_path, &entries_size) == -1) {
+            return -1;
+        }
+        records_size++;
+
+        // "{dir_path}/" is omitted for the root
+        uint64_t prefix_len = strcmp(dir_path, ".") ? strlen(dir_path) + 1 : 0;
+        char *path = (char *)malloc(sizeof(char) * (prefix_len + NAME_MAX + 1));
+        if (prefix_len) {
+            sprintf(path, "%s/", dir_path);
+        }
+        local_dir_t dir;
+        local_dir_init(&dir, dir_path);
+
+        name[0] = 0;
+        bool is_malformed = false;
+        for (uint64_t i = 0; i < entries_size; i++) {
+            manifest_entry_t entry;
+            if (read_buf_manifest_entry(frame, frame_len, &offset, name, &entry) == -1) {
+                is_malformed = true;
+                break;
+            }
+            strcpy(path + prefix_len, entry.name);
+
+            struct timespec modify_time;
+            modify_time.tv_sec = (time_t)entry.mtime_sec;
+            modify_time.tv_nsec = (long)entry.mtime_nsec;
+            sync_entry(queue, &dir, path, entry.name, entry.is_dir, entry.permission, modify_time, entry.size,
+                entry.has_hash ? entry.hash : NULL);
+
+            // check whether sigint was raised, files in queue are abandoned
+            if (raised_sigint) {
+                break;
+            }
+        }
+        free(path);
+        local_dir_kill(&dir);
+        if (hashes && !is_malformed) {
+            append_dir_hash(hashes, dir_path, hash);
+        }
+        else {
+            free(dir_path);
+        }
+
+        if (is_malformed) {
+            return -1;
+        }
+        if (raised_sigint) {
+            break;
+        }
+    }
+
+    return records_size;
+}
+
+// return 0 when success, -1 when error
+int send_exit(transport_t *conn, char **buf, uint64_t *buf_size) {
+    // send [2]
+    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
+    append_buf_uint32(*buf, 0, htonl(COMMAND_EXIT));
+    if (transport_write(conn, *buf, sizeof(uint32_t), false) != sizeof(uint32_t)) {
+        ERROR("send exit message failed");
+        return -1;
+    }
+    INFO("sent exit message");
+
+    return 0;
+}
+
+// ask for content hashes of files of at least `min_size` bytes in later manifests, nothing is responded
+// return 0 when success, -1 when error
+int request_content_hashes(transport_t *conn, uint64_t min_size, char **buf, uint64_t *buf_size) {
+    // send [14][min size]
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t);
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_CONTENT_HASHES));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(min_size));
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request content hashes failed");
+        return -1;
+    }
+    INFO("requested content hashes of files of at least %" PRIu64 " bytes", min_size);
+
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int request_working_dir(transport_t *conn, char **buf, uint64_t *buf_size) {
+    // send [3]
+    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
+    append_buf_uint32(*buf, 0, htonl(COMMAND_WORKING_DIR));
+    if (transport_write(conn, *buf, sizeof(uint32_t), false) != sizeof(uint32_t)) {
+        ERROR("request working directory failed");
+        return -1;
+    }
+    INFO("requested working directory");
+
+    // get requested result
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive working directory failed");
+        return -1;
+    }
+    message_len = my_ntohll(message_len);
+
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    if (transport_read(conn, *buf, message_len) != message_len) {
+        ERROR("receive working directory failed");
+        return -1;
+    }
+    (*buf)[message_len] = 0;
+    INFO("server is working at %s", *buf);
+
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int request_stats(transport_t *conn, char **buf, uint64_t *buf_size) {
+    // send [11]
+    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
+    append_buf_uint32(*buf, 0, htonl(COMMAND_STATS));
+    if (transport_write(conn, *buf, sizeof(uint32_t), false) != sizeof(uint32_t)) {
+        ERROR("request stats failed");
+        return -1;
+    }
+    INFO("requested stats");
+
+    // get requested result
+    uint64_t message_len;
+    if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive stats failed");
+        return -1;
+    }
+    message_len = my_ntohll(message_len);
+
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    if (transport_read(conn, *buf, message_len) != message_len) {
+        ERROR("receive stats failed");
+        return -1;
+    }
+    (*buf)[message_len] = 0;
+    INFO("server stats: %s", *buf);
+
+    return 0;
+}
+
+// features supported by server are stored in `*features`
+// return 0 when success, -1 when error
+int request_features(transport_t *conn, uint64_t *features, char **buf, uint64_t *buf_size) {
+    // old server ignores the command, so don't wait for it too long
+    int const TIMEOUT_SEC = 3;
+
+    // send [4]
+    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
+    append_buf_uint32(*buf, 0, htonl(COMMAND_FEATURES));
+    if (transport_write(conn, *buf, sizeof(uint32_t), false) != sizeof(uint32_t)) {
+        ERROR("request features failed");
+        return -1;
+    }
+    INFO("requested features");
+
+    struct timeval timeout = { .tv_sec = TIMEOUT_SEC, .tv_usec = 0 };
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) == -1) {
+        ERROR("setsockopt");
+    }
+
+    // get requested result
+    uint64_t message;
+    ssize_t read_len = transport_read(conn, &message, sizeof(uint64_t));
+
+    timeout.tv_sec = 0;
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval)) == -1) {
+        ERROR("setsockopt");
+    }
+
+    if (read_len == sizeof(uint64_t)) {
+        *features = my_ntohll(message);
+    }
+    else if (read_len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // a late response would be read as the response of the next request, so the connection is replaced,
+        // and the new one keeps the fd, which the caller closes
+        WARN("server doesn't respond features, assume none and reconnect");
+        int conn_fd = init_socket(config.host, config.port);
+        if (conn_fd == -1 || dup2(conn_fd, conn->fd) == -1) {
+            ERROR("reconnect to %s:%d failed", config.host, config.port);
+            if (conn_fd != -1) {
+                close(conn_fd);
+            }
+            return -1;
+        }
+        close(conn_fd);
+        transport_kill(conn);
+        transport_init(conn, conn->fd);
+        *features = 0;
+    }
+    else {
+        ERROR("receive features failed");
+        return -1;
+    }
+    INFO("server features: %#" PRIx64, *features);
+
+    return 0;
+}
+
+// receive frames of directory records until the empty one and traverse them
+// the whole stream is read even after sigint to keep the connection usable
+// records are preceded by directory hashes if `hashes` isn't NULL, see traverse_binary()
+// numbers of received records and bytes are stored in `*records_size` and `*total_len`
+// return 0 when success, -1 when error
+int receive_frames(transport_t *conn, bool is_binary, work_queue_t *queue, dir_hash_list_t *hashes, char **buf,
+    uint64_t *buf_size, uint64_t *records_size, uint64_t *total_len) {
+    *records_size = 0;
+    *total_len = 0;
+    while (1) {
+        uint64_t message_len;
+        if (transport_read(conn, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            ERROR("receive frame failed");
+            return -1;
+        }
+        message_len = my_ntohll(message_len);
+        if (message_len == 0) {
+            break;
+        }
+
+        *buf_size = extend_buf(buf, *buf_size, message_len);
+        if (transport_read(conn, *buf, message_len) != message_len) {
+            ERROR("receive frame failed");
+            return -1;
+        }
+        (*buf)[message_len] = 0;
+        *total_len += message_len;
+
+        if (raised_sigint) {
+            continue;
+        }
+
+        if (is_binary) {
+            int64_t frame_size = traverse_binary(queue, *buf, message_len, hashes);
+            if (frame_size == -1) {
+                ERROR("received info is invalid");
+                return -1;
+            }
+            *records_size += frame_size;
+            continue;
+        }
+
+        manifest_tree_t frame;
+        if (manifest_tree_parse(&frame, *buf, message_len) == -1) {
+            ERROR("received info is invalid");
+            return -1;
+        }
+
+        uint64_t path_capacity = 1 << 8;
+        char *path = (char *)malloc(sizeof(char) * path_capacity);
+        for (uint64_t i = 0; i < frame.roots_size; i++) {
+            manifest_node_t *record = &frame.nodes[frame.roots + i];
+            char *dir_path = frame.names + record->name;
+            if (!is_contained_path(dir_path, strlen(dir_path))) {
+                ERROR("received info is invalid");
+                free(path);
+                manifest_tree_kill(&frame);
+                return -1;
+            }
+            uint64_t dir_path_len = strcmp(dir_path, ".") ? strlen(dir_path) : 0;
+            if (dir_path_len + 1 > path_capacity) {
+                while (dir_path_len + 1 > path_capacity) {
+                    path_capacity <<= 1;
+                }
+                path = (char *)realloc(path, sizeof(char) * path_capacity);
+            }
+            memcpy(path, dir_path, dir_path_len);
+            // parent is always sent first, so the directory has been created
+            traverse(queue, &frame, record, &path, &path_capacity, dir_path_len, false);
+        }
+        *records_size += frame.roots_size;
+
+        free(path);
+        manifest_tree_kill(&frame);
+    }
+
+    return 0;
 }
 
-// info is stored in `*info`
+// directories are created and files to be updated are pushed to `queue` as info arrives
+// info is requested in binary manifest if `is_binary`, otherwise in json
 // return 0 when success, -1 when error
-int request_info(int conn_fd, char *path, json_data **info, char **buf, uint64_t *buf_size) {
-    // send [0][path length][path]
+int request_stream_info(transport_t *conn, char *path, bool is_binary, work_queue_t *queue, char **buf,
+    uint64_t *buf_size) {
+    // send [5 or 6][path length][path]
     uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) + strlen(path);
     *buf_size = extend_buf(buf, *buf_size, message_len);
-    message_len = append_buf_uint32(*buf, 0, htonl(0));
+    message_len = append_buf_uint32(*buf, 0, htonl(is_binary ? COMMAND_BINARY_INFO : COMMAND_STREAM_INFO));
     message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(path)));
     message_len = append_buf_charp(*buf, message_len, path);
 
-    if (bulk_write(conn_fd, *buf, message_len) != message_len) {
-        ERROR("request %s info failed", path);
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s stream info failed", path);
         return -1;
     }
-    INFO("requested %s info", path);
-
-    // get requested result
-    if (bulk_read(conn_fd, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        goto receive_fail;
-    }
-    message_len = my_ntohll(message_len);
+    INFO("requested %s stream info", path);
 
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    if (bulk_read(conn_fd, *buf, message_len) != message_len) {
-        goto receive_fail;
+    uint64_t records_size;
+    uint64_t total_len;
+    if (receive_frames(conn, is_binary, queue, NULL, buf, buf_size, &records_size, &total_len) == -1) {
+        ERROR("receive %s stream info failed", path);
+        return -1;
     }
-    (*buf)[message_len] = 0;
-    INFO("received %s info (%" PRIu64 " bytes)", path, message_len);
+    INFO("received %s stream info (%" PRIu64 " directories, %" PRIu64 " bytes)", path, records_size, total_len);
 
-    // convert result to json
-    if (!json_is_valid(*buf)) {
-        ERROR("received info is invalid");
+    if (records_size == 0 && !raised_sigint) {
+        ERROR("received info is empty");
         return -1;
     }
-    *info = json_parse(*buf);
 
     return 0;
-
-receive_fail:
-    ERROR("receive %s info failed", path);
-    return -1;
 }
 
-// add permission to directory of given file
-// original permission will be saved in `opermission`
+// request entries changed since `*generation` of `*epoch`, the whole directory is sent by server
+// if they are unknown, entries are handled like request_stream_info()
+// server epoch and generation are stored back, both are 0 if server doesn't keep them for `path`
 // return 0 when success, -1 when error
-int add_dir_permission(char *path, mode_t permission, mode_t *opermission) {
-    // dirname may modify content, so copy `path`
-    char *path_copy = (char *)malloc(sizeof(char) * (strlen(path) + 1));
-    strcpy(path_copy, path);
-    char *dir = dirname(path_copy);
-    free(path_copy);
+int request_changes(transport_t *conn, char *path, uint64_t *epoch, uint64_t *generation, work_queue_t *queue,
+    char **buf, uint64_t *buf_size) {
+    // send [7][path length][path][epoch][generation]
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) * 3 + strlen(path);
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_CHANGES));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(path)));
+    message_len = append_buf_charp(*buf, message_len, path);
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(*epoch));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(*generation));
 
-    struct stat st;
-    if (stat(dir, &st) == -1) {
-        ERROR("get %s status failed", dir);
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s changes failed", path);
         return -1;
     }
-    if (chmod(dir, st.st_mode | permission) == -1) {
-        ERROR("change %s mode failed", dir);
+    INFO("requested %s changes since generation %" PRIu64, path, *generation);
+
+    // get [epoch][generation][is full]
+    uint64_t header[3];
+    if (transport_read(conn, header, sizeof(header)) != sizeof(header)) {
+        ERROR("receive %s changes failed", path);
         return -1;
     }
+    *epoch = my_ntohll(header[0]);
+    *generation = my_ntohll(header[1]);
+    bool is_full = my_ntohll(header[2]);
+
+    uint64_t records_size;
+    uint64_t total_len;
+    if (receive_frames(conn, true, queue, NULL, buf, buf_size, &records_size, &total_len) == -1) {
+        ERROR("receive %s changes failed", path);
+        return -1;
+    }
+    INFO("received %s %s up to generation %" PRIu64 " (%" PRIu64 " directories, %" PRIu64 " bytes)",
+        path, is_full ? "full manifest" : "changes", *generation, records_size, total_len);
 
-    *opermission = st.st_mode;
-    return 0;
-}
-
-// set permission to directory of given file
-// return 0 when success, -1 when error
-int set_dir_permission(char *path, mode_t permission) {
-    // dirname may modify content, so copy `path`
-    char *path_copy = (char *)malloc(sizeof(char) * (strlen(path) + 1));
-    strcpy(path_copy, path);
-    char *dir = dirname(path_copy);
-    free(path_copy);
-
-    if (chmod(dir, permission) == -1) {
-        ERROR("change %s mode failed", dir);
+    // nothing changed is fine, but a directory always has a record for itself
+    if (is_full && records_size == 0 && !raised_sigint) {
+        ERROR("received info is empty");
         return -1;
     }
 
     return 0;
 }
 
-// request "{remote_dir}/{path}" content
-// received content will be written to file "{path}", which must exist
-// file mtime will be set to `modify_time`
-// return 0 when success, -1 when error
-int request_content(int conn_fd, char *path, time_t modify_time, char **buf, uint64_t *buf_size) {
-    int const BLOCK_SIZE = 4096;
+// sync state of remote directories, kept in local directory
+#define STATE_DIR ".filesync"
+// server manifest each remote directory was synced from
+#define STATE_PATH ".filesync/state.json"
+// merkle hashes of directories synced from a remote directory
+#define HASHES_PATH ".filesync/hashes"
+// local files by content, encoded by content_index_encode()
+#define CONTENT_INDEX_PATH ".filesync/content_index"
+
+// read the whole state file `path`
+// `*len` is set to its length
+// return allocated '\0'-terminated content, NULL when it doesn't exist or error
+char *read_state_file(char *path, uint64_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
 
-    // open file
-    int file_fd;
-    // add write permission
     struct stat st;
-    bool stat_success = true;
-    if (stat(path, &st) == -1) {
-        ERROR("get %s status failed", path);
-        stat_success = false;
+    if (fstat(fd, &st) == -1) {
+        ERROR("get sync state %s status failed", path);
+        close(fd);
+        return NULL;
     }
-    if (stat_success && chmod(path, st.st_mode | 0200) == -1) {
-        ERROR("change %s mode failed", path);
+    char *buf = (char *)malloc(sizeof(char) * (st.st_size + 1));
+    if (bulk_read(fd, buf, st.st_size) != st.st_size) {
+        ERROR("read sync state %s failed", path);
+        free(buf);
+        close(fd);
+        return NULL;
     }
+    close(fd);
+    buf[st.st_size] = 0;
+    *len = st.st_size;
 
-    file_fd = open(path, O_WRONLY | O_TRUNC);
-    if (file_fd == -1) {
-        ERROR("open %s failed", path);
+    return buf;
+}
+
+// replace state file `path` with `data` of `len` bytes at once, so it's never half written
+// return 0 when success, -1 when error
+int write_state_file(char *path, char *data, uint64_t len) {
+    if (mkdir(STATE_DIR, 0700) == -1 && errno != EEXIST) {
+        ERROR("create directory %s failed", STATE_DIR);
         return -1;
     }
 
-    // reset permission
-    if (stat_success && chmod(path, st.st_mode) == -1) {
-        ERROR("reset %s mode failed", path);
+    char *temp_path = (char *)malloc(sizeof(char) * (strlen(path) + 5));
+    sprintf(temp_path, "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        ERROR("open %s failed", temp_path);
+        free(temp_path);
+        return -1;
     }
-
-    // send [1][path length][path]
-    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) + strlen(config.remote_dir) + 1 + strlen(path);
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    message_len = append_buf_uint32(*buf, 0, htonl(1));
-    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(config.remote_dir) + 1 + strlen(path)));
-    message_len = append_buf_charp(*buf, message_len, config.remote_dir);
-    message_len = append_buf_charp(*buf, message_len, "/");
-    message_len = append_buf_charp(*buf, message_len, path);
-
-    if (bulk_write(conn_fd, *buf, message_len) != message_len) {
-        ERROR("request %s/%s content failed", config.remote_dir, path);
-        close(file_fd);
+    if (bulk_write(fd, data, len) != len) {
+        ERROR("write sync state %s failed", temp_path);
+        close(fd);
+        unlink(temp_path);
+        free(temp_path);
         return -1;
     }
-    INFO("requested %s/%s content", config.remote_dir, path);
-
-    // get requested content length
-    if (bulk_read(conn_fd, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("receive %s/%s content failed", config.remote_dir, path);
-        close(file_fd);
+    close(fd);
+    if (rename(temp_path, path) == -1) {
+        ERROR("rename %s to %s failed", temp_path, path);
+        unlink(temp_path);
+        free(temp_path);
         return -1;
     }
-    message_len = my_ntohll(message_len);
-    INFO("receiving %s/%s content", config.remote_dir, path);
+    free(temp_path);
 
-    // get content and write to file
-    *buf_size = extend_buf(buf, *buf_size, BLOCK_SIZE);
-    uint64_t receive_len = 0;
-    while (receive_len < message_len) {
-        // get content
-        int len = bulk_read(conn_fd, *buf, MIN(BLOCK_SIZE, message_len - receive_len));
-        if (len == 0 || len == -1) {
-            ERROR("receive %s/%s content failed", config.remote_dir, path);
-            close(file_fd);
-            return -1;
-        }
-        receive_len += len;
+    return 0;
+}
 
-        // write to file
-        if (bulk_write(file_fd, *buf, len) != len) {
-            ERROR("write %s/%s content to file failed", config.remote_dir, path);
-            close(file_fd);
-            return -1;
-        }
-    }
+// read the server manifest `remote_dir` was synced from last time
+// both are set to 0 if it's unknown
+void load_state(char *remote_dir, uint64_t *epoch, uint64_t *generation) {
+    *epoch = 0;
+    *generation = 0;
 
-    // make mtime equal for bidirectional sync
-    if (fstat(file_fd, &st) == -1) {
-        ERROR("get %s status failed", path);
+    uint64_t len;
+    char *buf = read_state_file(STATE_PATH, &len);
+    if (!buf) {
+        return;
     }
-    else {
-        struct timeval tv[2] = { 0 };
-        // remain atime
-        tv[0].tv_sec = st.st_atime;
-        // set mtime equal to server file
-        tv[1].tv_sec = modify_time;
-        if (futimes(file_fd, tv) == -1) {
-            ERROR("set %s mtime failed", path);
-        }
+    if (!json_is_valid(buf)) {
+        WARN("sync state %s is invalid, ignore it", STATE_PATH);
+        free(buf);
+        return;
     }
-    INFO("synced %s (%" PRIu64 " bytes)", path, receive_len);
-
-    close(file_fd);
+    json_data *states = json_parse(buf);
+    free(buf);
 
-    return 0;
+    int states_size = json_arr_size(states);
+    for (int i = 0; i < states_size; i++) {
+        json_data *state = json_arr_get(states, i);
+        char *dir = json_str_get(json_obj_get(state, "remoteDir"));
+        if (!strcmp(dir, remote_dir)) {
+            *epoch = (uint64_t)json_num_get(json_obj_get(state, "epoch"));
+            *generation = (uint64_t)json_num_get(json_obj_get(state, "generation"));
+        }
+        free(dir);
+    }
+    json_kill(states);
 }
 
-// `prefix` indicates "./" if it's NULL
-// the directory "{prefix}" must exist
+// record the server manifest `remote_dir` is synced from, states of other remote directories are kept
 // return 0 when success, -1 when error
-int traverse(int conn_fd, json_data *info, char *prefix, char **buf, uint64_t *buf_size) {
-    // handle sigint
-    struct sigaction act_sigint;
-    struct sigaction oact_sigint;
-    act_sigint.sa_handler = handler_sigint;
-    sigemptyset(&act_sigint.sa_mask);
-    act_sigint.sa_flags = SA_RESTART;
-    sigaction(SIGINT, &act_sigint, &oact_sigint);
-
-    json_data *entries = json_obj_get(info, "entries");
-    int entries_size = json_arr_size(entries);
-    for (int i = 0; i < entries_size; i++) {
-        json_data *sub_info = json_arr_get(entries, i);
-
-        char *name = json_str_get(json_obj_get(sub_info, "name"));
-        char *path;
-        if (prefix) {
-            path = (char *)malloc(sizeof(char) * (strlen(prefix) + strlen(name) + 2));
-            sprintf(path, "%s/%s", prefix, name);
+int save_state(char *remote_dir, uint64_t epoch, uint64_t generation) {
+    // copy the others from current state
+    json_data *states = json_arr_init();
+    uint64_t len;
+    char *buf = read_state_file(STATE_PATH, &len);
+    if (buf && json_is_valid(buf)) {
+        json_data *old_states = json_parse(buf);
+        int old_states_size = json_arr_size(old_states);
+        for (int i = 0; i < old_states_size; i++) {
+            json_data *old_state = json_arr_get(old_states, i);
+            char *dir = json_str_get(json_obj_get(old_state, "remoteDir"));
+            if (strcmp(dir, remote_dir)) {
+                json_data *state = json_obj_init();
+                json_obj_set(state, "remoteDir", json_str_init(dir));
+                json_obj_set(state, "epoch", json_num_init(json_num_get(json_obj_get(old_state, "epoch"))));
+                json_obj_set(state, "generation",
+                    json_num_init(json_num_get(json_obj_get(old_state, "generation"))));
+                json_arr_append(states, state);
+            }
+            free(dir);
         }
-        else {
-            path = (char *)malloc(sizeof(char) * (strlen(name) + 1));
-            strcpy(path, name);
-        }
-        free(name);
-
-        char *type = json_str_get(json_obj_get(sub_info, "type"));
-        if (!strcmp(type, "file")) {
-            if (access(path, F_OK) == -1) {
-                // file doesn't exist, create it and request content
-                // add write permission to directory
-                mode_t opermission;
-                bool add_permission_success = true;
-                if (add_dir_permission(path, 0200, &opermission) == -1) {
-                    add_permission_success = false;
-                }
-
-                int file_fd = open(path, O_CREAT | O_EXCL, (mode_t)json_num_get(json_obj_get(sub_info, "permission")));
-                if (file_fd == -1) {
-                    ERROR("create %s failed", path);
-                    goto finish_current;
-                }
-                close(file_fd);
-                INFO("created %s", path);
-
-                // reset directory permission
-                if (add_permission_success) {
-                    set_dir_permission(path, opermission);
-                }
+        json_kill(old_states);
+    }
+    free(buf);
 
-                request_content(conn_fd, path, (time_t)json_num_get(json_obj_get(sub_info, "updateTime")), buf, buf_size);
-                goto finish_current;
-            }
+    json_data *state = json_obj_init();
+    json_obj_set(state, "remoteDir", json_str_init(remote_dir));
+    // epoch is in microseconds, which is still exact in double
+    json_obj_set(state, "epoch", json_num_init((double)epoch));
+    json_obj_set(state, "generation", json_num_init((double)generation));
+    json_arr_append(states, state);
+    char *states_str = json_to_str(states, false);
+    json_kill(states);
+
+    int ret = write_state_file(STATE_PATH, states_str, strlen(states_str));
+    free(states_str);
+    if (ret == 0) {
+        INFO("saved sync state of %s (generation %" PRIu64 ")", remote_dir, generation);
+    }
 
-            // compare update time
-            struct stat st;
-            if (stat(path, &st) == -1) {
-                ERROR("get %s status failed", path);
-                goto finish_current;
-            }
-            time_t update_time = (time_t)json_num_get(json_obj_get(sub_info, "updateTime"));
-            if (st.st_mtime < update_time) {
-                // local file is out of date, request content
-                request_content(conn_fd, path, (time_t)json_num_get(json_obj_get(sub_info, "updateTime")), buf, buf_size);
-            }
-        }
+    return ret;
+}
 
-        else if (!strcmp(type, "directory")) {
-            if (access(path, F_OK) == -1) {
-                // the directory doesn't exist, create it
-                // add write permission to parent directory
-                mode_t opermission;
-                bool add_permission_success = true;
-                if (add_dir_permission(path, 0200, &opermission) == -1) {
-                    add_permission_success = false;
-                }
+static int compare_dir_hash(void const *a, void const *b) {
+    return strcmp(((dir_hash_t const *)a)->path, ((dir_hash_t const *)b)->path);
+}
 
-                if (mkdir(path, (mode_t)json_num_get(json_obj_get(sub_info, "permission"))) == -1) {
-                    ERROR("create directory %s failed", path);
-                    goto finish_current;
-                }
-                INFO("created directory %s", path);
+// read directory hashes recorded when `remote_dir` was synced last time into `hashes`
+// the file is [remote directory length][remote directory][directory hash list], only one remote directory is kept
+void load_dir_hashes(char *remote_dir, dir_hash_list_t *hashes) {
+    uint64_t len;
+    char *buf = read_state_file(HASHES_PATH, &len);
+    if (!buf) {
+        return;
+    }
 
-                // reset parent directory permission
-                if (add_permission_success) {
-                    set_dir_permission(path, opermission);
-                }
-            }
+    // recorded for another remote directory
+    uint64_t offset = 0;
+    uint64_t dir_len;
+    if (read_buf_varint(buf, len, &offset, &dir_len) == -1 || dir_len != strlen(remote_dir)
+        || dir_len > len - offset || memcmp(buf + offset, remote_dir, dir_len)) {
+        free(buf);
+        return;
+    }
+    offset += dir_len;
 
-            // unlike server, client doesn't chdir because client must request content with full path
-            traverse(conn_fd, sub_info, path, buf, buf_size);
+    while (offset < len) {
+        char *path;
+        uint64_t hash;
+        if (read_buf_dir_hash(buf, len, &offset, &path, &hash) == -1) {
+            WARN("directory hashes %s are invalid, ignore them", HASHES_PATH);
+            kill_dir_hashes(hashes);
+            break;
         }
+        append_dir_hash(hashes, path, hash);
+    }
+    free(buf);
+}
 
+// record hashes of `remote_dir`, `received` are new ones and the others of `recorded` are still valid,
+// because a sub-tree is only skipped by server if its hash is the same
+// paths of both lists are moved into the record
+// return 0 when success, -1 when error
+int save_dir_hashes(char *remote_dir, dir_hash_list_t *recorded, dir_hash_list_t *received) {
+    qsort(received->hashes, received->size, sizeof(dir_hash_t), compare_dir_hash);
+    for (uint64_t i = 0; i < recorded->size; i++) {
+        dir_hash_t *hash = &recorded->hashes[i];
+        if (bsearch(hash, received->hashes, received->size, sizeof(dir_hash_t), compare_dir_hash)) {
+            free(hash->path);
+        }
         else {
-            WARN("unknown type %s of file %s", type, path);
+            append_dir_hash(received, hash->path, hash->hash);
         }
+    }
+    recorded->size = 0;
+    qsort(received->hashes, received->size, sizeof(dir_hash_t), compare_dir_hash);
 
-finish_current:
-        free(type);
-        free(path);
-
-        // check whether sigint was raised when updating files
-        if (raised_sigint) {
-            break;
-        }
+    uint64_t len = VARINT_MAX_LEN + strlen(remote_dir);
+    for (uint64_t i = 0; i < received->size; i++) {
+        len += DIR_HASH_MAX_LEN(strlen(received->hashes[i].path));
+    }
+    char *buf = (char *)malloc(sizeof(char) * len);
+    len = append_buf_varint(buf, 0, strlen(remote_dir));
+    len = append_buf_charp(buf, len, remote_dir);
+    for (uint64_t i = 0; i < received->size; i++) {
+        len = append_buf_dir_hash(buf, len, received->hashes[i].path, received->hashes[i].hash);
     }
 
-    // restore sigint handler
-    sigaction(SIGINT, &oact_sigint, NULL);
+    int ret = write_state_file(HASHES_PATH, buf, len);
+    free(buf);
+    if (ret == 0) {
+        INFO("saved %" PRIu64 " directory hashes of %s", received->size, remote_dir);
+    }
 
-    return 0;
+    return ret;
 }
 
+// send directory hashes `recorded` last time and receive records of changed directories like request_stream_info()
+// hashes of received directories are appended to `received`
 // return 0 when success, -1 when error
-int send_exit(int conn_fd, char **buf, uint64_t *buf_size) {
-    // send [2]
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
-    append_buf_uint32(*buf, 0, htonl(2));
-    if (bulk_write(conn_fd, *buf, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        ERROR("send exit message failed");
-        return -1;
+int request_merkle(transport_t *conn, char *path, dir_hash_list_t *recorded, dir_hash_list_t *received,
+    work_queue_t *queue, char **buf, uint64_t *buf_size) {
+    // send [8][path length][path][hashes length][hashes]
+    uint64_t hashes_len = 0;
+    for (uint64_t i = 0; i < recorded->size; i++) {
+        hashes_len += DIR_HASH_MAX_LEN(strlen(recorded->hashes[i].path));
     }
-    INFO("sent exit message");
-
-    return 0;
-}
+    // server doesn't take more, then every directory is sent
+    uint64_t hashes_size = recorded->size;
+    if (hashes_len > MAX_DIR_HASHES_LEN) {
+        WARN("too many directory hashes, request the whole manifest");
+        hashes_size = 0;
+        hashes_len = 0;
+    }
+    uint64_t message_len = sizeof(uint32_t) + sizeof(uint64_t) * 2 + strlen(path) + hashes_len;
+    *buf_size = extend_buf(buf, *buf_size, message_len);
+    message_len = append_buf_uint32(*buf, 0, htonl(COMMAND_MERKLE));
+    message_len = append_buf_uint64(*buf, message_len, my_htonll(strlen(path)));
+    message_len = append_buf_charp(*buf, message_len, path);
+    // hashes length is filled after appending them
+    uint64_t hashes_offset = message_len;
+    message_len += sizeof(uint64_t);
+    for (uint64_t i = 0; i < hashes_size; i++) {
+        message_len = append_buf_dir_hash(*buf, message_len, recorded->hashes[i].path, recorded->hashes[i].hash);
+    }
+    append_buf_uint64(*buf, hashes_offset, my_htonll(message_len - hashes_offset - sizeof(uint64_t)));
 
-// return 0 when success, -1 when error
-int request_working_dir(int conn_fd, char **buf, uint64_t *buf_size) {
-    // send [3]
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint32_t));
-    append_buf_uint32(*buf, 0, htonl(3));
-    if (bulk_write(conn_fd, *buf, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        ERROR("request working directory failed");
+    if (transport_write(conn, *buf, message_len, false) != message_len) {
+        ERROR("request %s merkle failed", path);
         return -1;
     }
-    INFO("requested working directory");
+    INFO("requested %s merkle (%" PRIu64 " directory hashes)", path, hashes_size);
 
-    // get requested result
-    uint64_t message_len;
-    if (bulk_read(conn_fd, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("receive working directory failed");
+    uint64_t records_size;
+    uint64_t total_len;
+    if (receive_frames(conn, true, queue, received, buf, buf_size, &records_size, &total_len) == -1) {
+        ERROR("receive %s merkle failed", path);
         return -1;
     }
-    message_len = my_ntohll(message_len);
+    INFO("received %s merkle (%" PRIu64 " changed directories, %" PRIu64 " bytes)", path, records_size, total_len);
 
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    if (bulk_read(conn_fd, *buf, message_len) != message_len) {
-        ERROR("receive working directory failed");
+    // nothing changed is fine, but without recorded hashes everything is changed
+    if (hashes_size == 0 && records_size == 0 && !raised_sigint) {
+        ERROR("received info is empty");
         return -1;
     }
-    (*buf)[message_len] = 0;
-    INFO("server is working at %s", *buf);
 
     return 0;
 }
 
-void communicate(int conn_fd) {
+typedef struct {
+    int id;
+    pthread_t thread;
+    work_queue_t *queue;
+} worker_t;
+
+// connect to server and request content of jobs in queue until it's closed and empty
+void *work(void *arg) {
+    uint64_t const INIT_BUF_SIZE = 128;
+
+    worker_t *worker = (worker_t *)arg;
+
+    int conn_fd = init_socket(config.host, config.port);
+    if (conn_fd == -1) {
+        ERROR("worker %d can't connect to %s:%d", worker->id, config.host, config.port);
+        has_failed = true;
+        return NULL;
+    }
+    INFO("worker %d connected to %s:%d", worker->id, config.host, config.port);
+
+    uint64_t buf_size = INIT_BUF_SIZE;
+    // `buf_size` doesn't include the terminating '\0', so + 1
+    char *buf = (char *)malloc(sizeof(char) * (buf_size + 1));
+
+    transport_t conn;
+    transport_init(&conn, conn_fd);
+    pipeline_t *pipeline = pipeline_init(&conn, config.pipeline_window);
+    // after sigint, requested content is still received but no more is requested
+    while (!raised_sigint && !pipeline->is_broken) {
+        // a stripe is received before taking more jobs, so the other stripes of its file go to other connections
+        if (pipeline->stripes_size > 0) {
+            receive_content(pipeline, &buf, &buf_size);
+            continue;
+        }
+
+        content_job_t *job;
+        if (!queue_try_pop(worker->queue, (void **)&job)) {
+            if (pipeline->size > 0) {
+                // nothing to request for now, receive responded content meanwhile
+                receive_content(pipeline, &buf, &buf_size);
+                continue;
+            }
+            if (pipeline->batch_size > 0) {
+                // no more file to be batched for now
+                request_batch(pipeline, &buf, &buf_size);
+                continue;
+            }
+            job = (content_job_t *)queue_pop(worker->queue);
+            if (!job) {
+                break;
+            }
+        }
+
+        if (job->striped) {
+            request_stripe(pipeline, job->striped, job->stripe, &buf, &buf_size);
+            job->striped = NULL;
+        }
+        else if (is_batched(job->size)) {
+            batch_content(pipeline, job->path, job->modify_time, job->size, job->is_new, job->permission, &buf,
+                &buf_size);
+        }
+        else {
+            request_content(pipeline, job->path, job->modify_time, job->size, job->has_hash ? job->hash : NULL, &buf,
+                &buf_size);
+        }
+        kill_content_job(job);
+    }
+    drain_content(pipeline, &buf, &buf_size);
+    pipeline_kill(pipeline);
+
+    send_exit(&conn, &buf, &buf_size);
+    free(buf);
+    transport_kill(&conn);
+    close(conn_fd);
+    INFO("worker %d disconnected", worker->id);
+
+    return NULL;
+}
+
+void communicate(transport_t *conn) {
     uint64_t const INIT_BUF_SIZE = 128;
 
     uint64_t buf_size = INIT_BUF_SIZE;
     // `buf_size` doesn't include the terminating '\0', so + 1
     char *buf = (char *)malloc(sizeof(char) * (buf_size + 1));
 
-    json_data *info = NULL;
+    manifest_tree_t info;
 
+    uint64_t features;
     if (config.is_query_mode) {
-        request_working_dir(conn_fd, &buf, &buf_size);
+        if (request_working_dir(conn, &buf, &buf_size) == 0
+            && request_features(conn, &features, &buf, &buf_size) == 0 && (features & FEATURE_STATS)) {
+            request_stats(conn, &buf, &buf_size);
+        }
         goto finish;
     }
 
-    if (request_info(conn_fd, config.remote_dir, &info, &buf, &buf_size) == -1) {
+    if (request_features(conn, &features, &buf, &buf_size) == -1) {
         goto finish;
     }
+    server_features = features;
 
-    if (traverse(conn_fd, info, NULL, &buf, &buf_size) == -1) {
-        goto finish;
+    // entries synced last time aren't checked again
+    if (mkdir(STATE_DIR, 0700) == -1 && errno != EEXIST) {
+        ERROR("create directory %s failed", STATE_DIR);
+    }
+    else if (!(local_index = local_index_open(STATE_DIR))) {
+        WARN("local index isn't available, every entry is checked");
+    }
+
+    // content found in local files is copied instead of transferred
+    if ((features & FEATURE_CONTENT_HASHES) && !strcmp(config.dedup, "on")
+        && request_content_hashes(conn, DEDUP_MIN_SIZE, &buf, &buf_size) == 0) {
+        uint64_t len = 0;
+        char *data = read_state_file(CONTENT_INDEX_PATH, &len);
+        content_index = content_index_init(data, len);
+        free(data);
+    }
+
+    // only chunks of large files which aren't found locally are transferred
+    if ((features & FEATURE_CHUNKS) && !strcmp(config.chunking, "on")
+        && !(chunk_store = chunk_store_open(STATE_DIR))) {
+        WARN("chunk store isn't available, large files aren't requested by chunks");
+    }
+
+    // handle sigint
+    struct sigaction act_sigint;
+    struct sigaction oact_sigint;
+    act_sigint.sa_handler = handler_sigint;
+    sigemptyset(&act_sigint.sa_mask);
+    act_sigint.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &act_sigint, &oact_sigint);
+
+    // workers request content with their own connections while traversing
+    work_queue_t *queue = queue_init();
+    worker_t *workers = (worker_t *)malloc(sizeof(worker_t) * config.parallelism);
+    for (int i = 0; i < config.parallelism; i++) {
+        workers[i].id = i;
+        workers[i].queue = queue;
+        if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) {
+            ERROR("create worker %d failed", i);
+            workers[i].id = -1;
+        }
+    }
+
+    // server manifest synced from, only known if server keeps changes
+    uint64_t epoch = 0;
+    uint64_t generation = 0;
+    // directory hashes synced last time and this time
+    dir_hash_list_t recorded_hashes = { 0 };
+    dir_hash_list_t received_hashes = { 0 };
+    bool is_merkle = false;
+    if (features & FEATURE_CHANGES) {
+        // only request what's changed since last sync
+        load_state(config.remote_dir, &epoch, &generation);
+        if (request_changes(conn, config.remote_dir, &epoch, &generation, queue, &buf, &buf_size) == -1) {
+            has_failed = true;
+        }
+    }
+    else if (features & FEATURE_MERKLE) {
+        // skip sub-trees which are the same as last sync
+        is_merkle = true;
+        load_dir_hashes(config.remote_dir, &recorded_hashes);
+        if (request_merkle(conn, config.remote_dir, &recorded_hashes, &received_hashes, queue, &buf, &buf_size) == -1) {
+            has_failed = true;
+        }
+    }
+    else if (features & (FEATURE_BINARY_INFO | FEATURE_STREAM_INFO)) {
+        // traverse each directory as soon as it arrives
+        if (request_stream_info(conn, config.remote_dir, features & FEATURE_BINARY_INFO, queue, &buf, &buf_size) == -1) {
+            has_failed = true;
+        }
+    }
+    else if (request_info(conn, config.remote_dir, &info, &buf, &buf_size) == 0) {
+        uint64_t path_capacity = 1 << 8;
+        char *path = (char *)malloc(sizeof(char) * path_capacity);
+        traverse(queue, &info, &info.nodes[info.roots], &path, &path_capacity, 0, true);
+        free(path);
+        // names are referred by nothing after traversal
+        manifest_tree_kill(&info);
+    }
+    else {
+        has_failed = true;
     }
 
+    queue_close(queue);
+    for (int i = 0; i < config.parallelism; i++) {
+        if (workers[i].id != -1) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    free(workers);
+    // jobs left when all workers are gone
+    void *job;
+    if (queue_try_pop(queue, &job)) {
+        has_failed = true;
+        kill_content_job(job);
+    }
+    queue_kill(queue, kill_content_job);
+
+    // directories are fixed after their entries are synced, even if the sync isn't complete
+    apply_dir_fixups();
+
+    // files which aren't synced aren't recorded
+    if (content_index) {
+        uint64_t len;
+        char *data = content_index_encode(content_index, &len);
+        write_state_file(CONTENT_INDEX_PATH, data, len);
+        free(data);
+        content_index_kill(content_index);
+        content_index = NULL;
+    }
+    if (chunk_store) {
+        chunk_store_close(chunk_store);
+        chunk_store = NULL;
+    }
+    if (local_index) {
+        local_index_close(local_index);
+        local_index = NULL;
+    }
+
+    // changes synced this time won't be requested again
+    if ((epoch || is_merkle) && (raised_sigint || has_failed)) {
+        WARN("sync isn't complete, sync state of %s isn't updated", config.remote_dir);
+    }
+    else if (epoch) {
+        save_state(config.remote_dir, epoch, generation);
+    }
+    else if (is_merkle) {
+        save_dir_hashes(config.remote_dir, &recorded_hashes, &received_hashes);
+    }
+    kill_dir_hashes(&recorded_hashes);
+    kill_dir_hashes(&received_hashes);
+
+    // restore sigint handler
+    sigaction(SIGINT, &oact_sigint, NULL);
+
 finish:
-    send_exit(conn_fd, &buf, &buf_size);
+    send_exit(conn, &buf, &buf_size);
 
     free(buf);
-    if (info) {
-        json_kill(info);
-    }
 }
 
 // create intermediate directory as required
@@ -498,8 +3819,14 @@ int main(int argc, char **argv) {
         kill_config();
         return 1;
     }
-    printf("config:\n  host = %s\n  port = %d\n  remote directory = %s\n  local directory = %s\n\n",
-        config.host, config.port, config.remote_dir, config.local_dir);
+    printf("config:\n  host = %s\n  port = %d\n  remote directory = %s\n  local directory = %s\n  pipeline window = %d\n  parallelism = %d\n  compression = %s\n  stripe threshold = %d MiB\n  max stripes = %d\n  dedup = %s\n  chunking = %s\n  socket buffer = %d KiB\n\n",
+        config.host, config.port, config.remote_dir, config.local_dir, config.pipeline_window, config.parallelism,
+        config.compression, config.stripe_threshold, config.max_stripes, config.dedup, config.chunking,
+        config.socket_buffer);
+
+    // umask can only be read by setting it
+    process_umask = umask(0);
+    umask(process_umask);
 
     if (access(config.local_dir, F_OK) == -1) {
         // local directory doesn't exist, create it
@@ -524,7 +3851,10 @@ int main(int argc, char **argv) {
     }
     INFO("connected to %s:%d", config.host, config.port);
 
-    communicate(conn_fd);
+    transport_t conn;
+    transport_init(&conn, conn_fd);
+    communicate(&conn);
+    transport_kill(&conn);
 
     close(conn_fd);
     INFO("disconnected");
@@ -17,7 +17,16 @@ static void load_config_arg(int argc, char **argv) {
     arg_register(arg, "--rdir", "remote directory", ARG_STRING);
     arg_register(arg, "--ldir", "local directory", ARG_STRING);
     arg_register(arg, "--config", "config file path", ARG_STRING);
-    arg_register_bool(arg, "--query", "query server working directory, no file will be synced");
+    arg_register(arg, "--window", "max number of content requests in flight", ARG_INT);
+    arg_register(arg, "-j", "number of connections to request content", ARG_INT);
+    arg_register(arg, "--compression", "request compressed content, on or off", ARG_STRING);
+    arg_register(arg, "--stripe-threshold", "min size in MiB of a file received by several connections", ARG_INT);
+    arg_register(arg, "--max-stripes", "max number of connections to receive a file", ARG_INT);
+    arg_register(arg, "--dedup", "copy content found in local files instead of transferring it, on or off",
+        ARG_STRING);
+    arg_register(arg, "--chunking", "request only chunks of large files not found locally, on or off", ARG_STRING);
+    arg_register(arg, "--socket-buffer", "socket buffer size of a connection in KiB, 0 for autotuning", ARG_INT);
+    arg_register_bool(arg, "--query", "query server working directory and stats, no file will be synced");
     arg_parse(arg, argc, argv);
 
     if (config.port == -1) {
@@ -35,6 +44,30 @@ static void load_config_arg(int argc, char **argv) {
     if (config.config_path == NULL) {
         arg_get(arg, "--config", &config.config_path);
     }
+    if (config.pipeline_window == -1) {
+        arg_get(arg, "--window", &config.pipeline_window);
+    }
+    if (config.parallelism == -1) {
+        arg_get(arg, "-j", &config.parallelism);
+    }
+    if (config.compression == NULL) {
+        arg_get(arg, "--compression", &config.compression);
+    }
+    if (config.stripe_threshold == -1) {
+        arg_get(arg, "--stripe-threshold", &config.stripe_threshold);
+    }
+    if (config.max_stripes == -1) {
+        arg_get(arg, "--max-stripes", &config.max_stripes);
+    }
+    if (config.dedup == NULL) {
+        arg_get(arg, "--dedup", &config.dedup);
+    }
+    if (config.chunking == NULL) {
+        arg_get(arg, "--chunking", &config.chunking);
+    }
+    if (config.socket_buffer == -1) {
+        arg_get(arg, "--socket-buffer", &config.socket_buffer);
+    }
     if (arg_is_parsed(arg, "--query")) {
         config.is_query_mode = true;
     }
@@ -100,6 +133,38 @@ static void load_config_file(char *path) {
     if (config.local_dir == NULL && sub_json) {
         config.local_dir = json_str_get(sub_json);
     }
+    sub_json = json_obj_get(json, "pipelineWindow");
+    if (config.pipeline_window == -1 && sub_json) {
+        config.pipeline_window = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "parallelism");
+    if (config.parallelism == -1 && sub_json) {
+        config.parallelism = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "compression");
+    if (config.compression == NULL && sub_json) {
+        config.compression = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "stripeThreshold");
+    if (config.stripe_threshold == -1 && sub_json) {
+        config.stripe_threshold = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "maxStripes");
+    if (config.max_stripes == -1 && sub_json) {
+        config.max_stripes = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "dedup");
+    if (config.dedup == NULL && sub_json) {
+        config.dedup = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "chunking");
+    if (config.chunking == NULL && sub_json) {
+        config.chunking = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "socketBuffer");
+    if (config.socket_buffer == -1 && sub_json) {
+        config.socket_buffer = (int)json_num_get(sub_json);
+    }
 
     json_kill(json);
 }
@@ -109,6 +174,14 @@ static void load_config_default() {
     char const *HOST = "127.0.0.1";
     char const *REMOTE_DIR = ".";
     char const *LOCAL_DIR = ".";
+    int const PIPELINE_WINDOW = 16;
+    int const PARALLELISM = 4;
+    char const *COMPRESSION = "on";
+    int const STRIPE_THRESHOLD = 256;
+    int const MAX_STRIPES = 4;
+    char const *DEDUP = "on";
+    char const *CHUNKING = "off";
+    int const SOCKET_BUFFER = 0;
 
     if (config.port == -1) {
         config.port = PORT;
@@ -125,6 +198,33 @@ static void load_config_default() {
         config.local_dir = (char *)malloc(sizeof(char) * (strlen(LOCAL_DIR) + 1));
         strcpy(config.local_dir, LOCAL_DIR);
     }
+    if (config.pipeline_window == -1) {
+        config.pipeline_window = PIPELINE_WINDOW;
+    }
+    if (config.parallelism == -1) {
+        config.parallelism = PARALLELISM;
+    }
+    if (config.compression == NULL) {
+        config.compression = (char *)malloc(sizeof(char) * (strlen(COMPRESSION) + 1));
+        strcpy(config.compression, COMPRESSION);
+    }
+    if (config.stripe_threshold == -1) {
+        config.stripe_threshold = STRIPE_THRESHOLD;
+    }
+    if (config.max_stripes == -1) {
+        config.max_stripes = MAX_STRIPES;
+    }
+    if (config.dedup == NULL) {
+        config.dedup = (char *)malloc(sizeof(char) * (strlen(DEDUP) + 1));
+        strcpy(config.dedup, DEDUP);
+    }
+    if (config.chunking == NULL) {
+        config.chunking = (char *)malloc(sizeof(char) * (strlen(CHUNKING) + 1));
+        strcpy(config.chunking, CHUNKING);
+    }
+    if (config.socket_buffer == -1) {
+        config.socket_buffer = SOCKET_BUFFER;
+    }
 }
 
 void load_config(int argc, char **argv) {
@@ -134,6 +234,14 @@ void load_config(int argc, char **argv) {
     config.remote_dir = NULL;
     config.local_dir = NULL;
     config.config_path = NULL;
+    config.pipeline_window = -1;
+    config.parallelism = -1;
+    config.compression = NULL;
+    config.stripe_threshold = -1;
+    config.max_stripes = -1;
+    config.dedup = NULL;
+    config.chunking = NULL;
+    config.socket_buffer = -1;
     config.is_query_mode = false;
 
     // config priority:
@@ -149,6 +257,48 @@ bool is_valid_config() {
         return false;
     }
 
+    // requests are small, but too many of them may fill socket buffers of both sides
+    if (config.pipeline_window < 1 || config.pipeline_window > 256) {
+        ERROR("invalid pipeline window %d, should be in [1, 256]", config.pipeline_window);
+        return false;
+    }
+
+    if (config.parallelism < 1 || config.parallelism > 64) {
+        ERROR("invalid parallelism %d, should be in [1, 64]", config.parallelism);
+        return false;
+    }
+
+    if (strcmp(config.compression, "on") && strcmp(config.compression, "off")) {
+        ERROR("invalid compression %s, should be on or off", config.compression);
+        return false;
+    }
+
+    if (config.stripe_threshold < 1) {
+        ERROR("invalid stripe threshold %d, should be at least 1", config.stripe_threshold);
+        return false;
+    }
+
+    if (config.max_stripes < 1 || config.max_stripes > 64) {
+        ERROR("invalid max stripes %d, should be in [1, 64]", config.max_stripes);
+        return false;
+    }
+
+    if (strcmp(config.dedup, "on") && strcmp(config.dedup, "off")) {
+        ERROR("invalid dedup %s, should be on or off", config.dedup);
+        return false;
+    }
+
+    if (strcmp(config.chunking, "on") && strcmp(config.chunking, "off")) {
+        ERROR("invalid chunking %s, should be on or off", config.chunking);
+        return false;
+    }
+
+    // at most 1 GiB, so the size in bytes fits in int
+    if (config.socket_buffer < 0 || config.socket_buffer > 1 << 20) {
+        ERROR("invalid socket buffer size %d", config.socket_buffer);
+        return false;
+    }
+
     // prohibit ".." in `remote_dir`
     for (int i = 0; config.remote_dir[i]; i++) {
         if (config.remote_dir[i] == '.' && config.remote_dir[i + 1] == '.') {
@@ -164,6 +314,9 @@ void kill_config() {
     free(config.host);
     free(config.remote_dir);
     free(config.local_dir);
+    free(config.compression);
+    free(config.dedup);
+    free(config.chunking);
     if (config.config_path) {
         free(config.config_path);
     }
@@ -0,0 +1,283 @@
+#include "compress.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define HASH_BITS 14
+#define MIN_MATCH 4
+// the format requires the last bytes of a block to be literals
+#define LAST_LITERALS 5
+#define MATCH_FIND_LIMIT 12
+#define MAX_OFFSET 65535
+
+struct compressor {
+    // last position + 1 of each hash, 0 is none
+    uint32_t table[1 << HASH_BITS];
+    // distance to the previous position of the same hash, 0 is none
+    uint16_t chain[COMPRESS_BLOCK_SIZE];
+};
+
+compressor_t *compressor_init() {
+    return (compressor_t *)malloc(sizeof(compressor_t));
+}
+
+void compressor_kill(compressor_t *compressor) {
+    free(compressor);
+}
+
+uint64_t compress_bound(uint64_t len) {
+    return len + len / 255 + 16;
+}
+
+static uint32_t read32(unsigned char const *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(uint32_t));
+    return value;
+}
+
+static uint64_t read64(unsigned char const *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(uint64_t));
+    return value;
+}
+
+// length of common prefix of `a` and `b`, `b` stops before `limit`
+static uint32_t count_match(unsigned char const *a, unsigned char const *b, unsigned char const *limit) {
+    unsigned char const *start = b;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // compare 8 bytes each time, the first different byte is found by trailing zeros
+    while (b + sizeof(uint64_t) <= limit) {
+        uint64_t diff = read64(a) ^ read64(b);
+        if (diff) {
+            return b - start + (__builtin_ctzll(diff) >> 3);
+        }
+        a += sizeof(uint64_t);
+        b += sizeof(uint64_t);
+    }
+#endif
+    while (b < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return b - start;
+}
+
+// copy at least `len` bytes by 16 bytes, which may write 15 bytes beyond `dst + len`
+static void wild_copy(unsigned char *dst, unsigned char const *src, uint64_t len) {
+    unsigned char *end = dst + len;
+    do {
+        memcpy(dst, src, 16);
+        dst += 16;
+        src += 16;
+    } while (dst < end);
+}
+
+static uint32_t hash32(uint32_t value) {
+    return (value * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *write_length(unsigned char *op, uint64_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// literals of `literal_len` bytes followed by a match, the last sequence has no match
+static unsigned char *write_sequence(unsigned char *op, unsigned char const *literals, uint64_t literal_len,
+    unsigned char const *src_end, uint32_t offset, uint64_t match_len) {
+    unsigned char *token = op++;
+    *token = (literal_len >= 15 ? 15 : literal_len) << 4;
+    if (literal_len >= 15) {
+        op = write_length(op, literal_len - 15);
+    }
+    // short literals are copied by 16 bytes, `dst` is long enough since the bound has 16 more bytes
+    if (literal_len <= 16 && literals + 16 <= src_end) {
+        memcpy(op, literals, 16);
+    }
+    else {
+        memcpy(op, literals, literal_len);
+    }
+    op += literal_len;
+
+    if (match_len) {
+        *op++ = offset & 0xff;
+        *op++ = offset >> 8;
+        match_len -= MIN_MATCH;
+        *token |= match_len >= 15 ? 15 : match_len;
+        if (match_len >= 15) {
+            op = write_length(op, match_len - 15);
+        }
+    }
+    return op;
+}
+
+static void insert(compressor_t *compressor, unsigned char const *src, uint32_t pos) {
+    uint32_t hash = hash32(read32(src + pos));
+    uint32_t last = compressor->table[hash];
+    compressor->chain[pos] = last && pos - (last - 1) <= MAX_OFFSET ? pos - (last - 1) : 0;
+    compressor->table[hash] = pos + 1;
+}
+
+uint64_t compress_block(compressor_t *compressor, char const *src_, uint64_t len, char *dst, int level) {
+    unsigned char const *src = (unsigned char const *)src_;
+    unsigned char *op = (unsigned char *)dst;
+    if (len <= MATCH_FIND_LIMIT) {
+        return write_sequence(op, src, len, src + len, 0, 0) - (unsigned char *)dst;
+    }
+
+    memset(compressor->table, 0, sizeof(compressor->table));
+    // level 1 only tries the last position of a hash, higher level follows the chain for 2 ^ (level - 1) positions
+    bool is_chained = level > COMPRESS_MIN_LEVEL;
+    int depth = is_chained ? 1 << (level - 1) : 1;
+    uint32_t match_limit = len - LAST_LITERALS;
+    uint32_t find_limit = len - MATCH_FIND_LIMIT;
+
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    uint32_t misses = 0;
+    while (pos < find_limit) {
+        uint32_t value = read32(src + pos);
+        uint32_t hash = hash32(value);
+        uint32_t candidate = compressor->table[hash];
+        if (is_chained) {
+            compressor->chain[pos] = candidate && pos - (candidate - 1) <= MAX_OFFSET ? pos - (candidate - 1) : 0;
+        }
+        compressor->table[hash] = pos + 1;
+
+        // find the longest match
+        uint32_t match = 0;
+        uint32_t match_len = 0;
+        for (int i = 0; i < depth && candidate; i++) {
+            uint32_t candidate_pos = candidate - 1;
+            if (pos - candidate_pos > MAX_OFFSET) {
+                break;
+            }
+            if (read32(src + candidate_pos) == value) {
+                uint32_t candidate_len = MIN_MATCH
+                    + count_match(src + candidate_pos + MIN_MATCH, src + pos + MIN_MATCH, src + match_limit);
+                if (candidate_len > match_len) {
+                    match = candidate_pos;
+                    match_len = candidate_len;
+                }
+            }
+            if (!is_chained || !compressor->chain[candidate_pos]) {
+                break;
+            }
+            candidate -= compressor->chain[candidate_pos];
+        }
+
+        // skip faster and faster in data which doesn't compress
+        if (!match_len) {
+            pos += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        // extend backwards over literals
+        while (pos > anchor && match > 0 && src[pos - 1] == src[match - 1]) {
+            pos--;
+            match--;
+            match_len++;
+        }
+
+        op = write_sequence(op, src + anchor, pos - anchor, src + len, pos - match, match_len);
+        if (is_chained) {
+            for (uint32_t i = pos + 1; i < pos + match_len && i < find_limit; i++) {
+                insert(compressor, src, i);
+            }
+        }
+        pos += match_len;
+        anchor = pos;
+    }
+
+    op = write_sequence(op, src + anchor, len - anchor, src + len, 0, 0);
+    return op - (unsigned char *)dst;
+}
+
+// return 0 when success, -1 when `*ip` reaches `end`
+static int read_length(unsigned char const **ip, unsigned char const *end, uint64_t *len) {
+    unsigned char byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int64_t decompress_block(char const *src, uint64_t len, char *dst, uint64_t capacity) {
+    unsigned char const *ip = (unsigned char const *)src;
+    unsigned char const *iend = ip + len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *oend = op + capacity;
+
+    while (1) {
+        if (ip >= iend) {
+            return -1;
+        }
+        unsigned char token = *ip++;
+
+        uint64_t literal_len = token >> 4;
+        if (literal_len == 15 && read_length(&ip, iend, &literal_len) == -1) {
+            return -1;
+        }
+        if (literal_len > (uint64_t)(iend - ip) || literal_len > (uint64_t)(oend - op)) {
+            return -1;
+        }
+        if (iend - ip >= literal_len + 16 && oend - op >= literal_len + 16) {
+            wild_copy(op, ip, literal_len);
+        }
+        else {
+            memcpy(op, ip, literal_len);
+        }
+        ip += literal_len;
+        op += literal_len;
+
+        // the last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        uint64_t match_len = token & 15;
+        if (match_len == 15 && read_length(&ip, iend, &match_len) == -1) {
+            return -1;
+        }
+        match_len += MIN_MATCH;
+        if (offset == 0 || offset > (uint64_t)(op - (unsigned char *)dst) || match_len > (uint64_t)(oend - op)) {
+            return -1;
+        }
+
+        unsigned char *match = op - offset;
+        if (offset >= 16 && oend - op >= match_len + 16) {
+            wild_copy(op, match, match_len);
+        }
+        else if (offset >= match_len) {
+            memcpy(op, match, match_len);
+        }
+        else {
+            // overlapped match repeats the last `offset` bytes, which is copied by chunks not overlapped
+            uint64_t i = 0;
+            if (offset >= sizeof(uint64_t)) {
+                for (; i + sizeof(uint64_t) <= match_len; i += sizeof(uint64_t)) {
+                    memcpy(op + i, match + i, sizeof(uint64_t));
+                }
+            }
+            for (; i < match_len; i++) {
+                op[i] = match[i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op - (unsigned char *)dst;
+}
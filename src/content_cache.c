@@ -0,0 +1,259 @@
+#include "content_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <inttypes.h>
+#include <time.h>
+#include "utils.h"
+
+// name of a cached file is 128-bit hash in hex
+#define NAME_LEN 32
+// a temporary file not written for this long is left by a crashed process
+#define STALE_TEMP_SECS 3600
+
+// state shared by forked processes
+typedef struct {
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t hit_bytes;
+    atomic_uint_fast64_t insertions;
+    atomic_uint_fast64_t evictions;
+    atomic_uint_fast64_t size;
+    // only one process evicts at a time
+    atomic_flag is_evicting;
+    // makes unique temporary names
+    atomic_uint_fast64_t temp_id;
+} shared_state_t;
+
+struct content_cache {
+    int dir_fd;
+    uint64_t max_size;
+    shared_state_t *shared;
+};
+
+// a cached file found when evicting
+typedef struct {
+    char name[NAME_LEN + 1];
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t size;
+} cached_file_t;
+
+static int compare_cached_file(void const *a, void const *b) {
+    cached_file_t const *a_file = (cached_file_t const *)a;
+    cached_file_t const *b_file = (cached_file_t const *)b;
+    if (a_file->mtime_sec != b_file->mtime_sec) {
+        return a_file->mtime_sec < b_file->mtime_sec ? -1 : 1;
+    }
+    return a_file->mtime_nsec < b_file->mtime_nsec ? -1 : a_file->mtime_nsec > b_file->mtime_nsec;
+}
+
+// remove the least recently used files until the cache is 7/8 of its limit, and recount its size
+// the mtime of a cached file is updated whenever it's used
+static void evict(content_cache_t *cache) {
+    if (atomic_flag_test_and_set(&cache->shared->is_evicting)) {
+        return;
+    }
+
+    int dir_fd = dup(cache->dir_fd);
+    DIR *dir = dir_fd == -1 ? NULL : fdopendir(dir_fd);
+    if (!dir) {
+        ERROR("open content cache directory failed");
+        if (dir_fd != -1) {
+            close(dir_fd);
+        }
+        atomic_flag_clear(&cache->shared->is_evicting);
+        return;
+    }
+    rewinddir(dir);
+
+    uint64_t files_size = 0;
+    uint64_t files_capacity = 64;
+    cached_file_t *files = (cached_file_t *)malloc(sizeof(cached_file_t) * files_capacity);
+    uint64_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        // temporary files are being written and not counted, unless they're left by a crashed process
+        if (strlen(entry->d_name) != NAME_LEN) {
+            struct stat st;
+            if (!strncmp(entry->d_name, "tmp.", 4) && fstatat(cache->dir_fd, entry->d_name, &st, 0) == 0
+                && st.st_mtime + STALE_TEMP_SECS < time(NULL)) {
+                unlinkat(cache->dir_fd, entry->d_name, 0);
+            }
+            continue;
+        }
+        struct stat st;
+        if (fstatat(cache->dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (files_size == files_capacity) {
+            files_capacity *= 2;
+            files = (cached_file_t *)realloc(files, sizeof(cached_file_t) * files_capacity);
+        }
+        strcpy(files[files_size].name, entry->d_name);
+        files[files_size].mtime_sec = st.st_mtime;
+#ifdef __APPLE__
+        files[files_size].mtime_nsec = st.st_mtimespec.tv_nsec;
+#else
+        files[files_size].mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+        files[files_size].size = st.st_size;
+        files_size++;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    qsort(files, files_size, sizeof(cached_file_t), compare_cached_file);
+    uint64_t target = cache->max_size / 8 * 7;
+    uint64_t evicted = 0;
+    for (uint64_t i = 0; i < files_size && total > target; i++) {
+        if (unlinkat(cache->dir_fd, files[i].name, 0) == 0) {
+            total -= files[i].size;
+            evicted++;
+        }
+    }
+    free(files);
+
+    atomic_fetch_add(&cache->shared->evictions, evicted);
+    atomic_store(&cache->shared->size, total);
+    if (evicted) {
+        INFO("evicted %" PRIu64 " files from content cache (%" PRIu64 " bytes left)", evicted, total);
+    }
+    atomic_flag_clear(&cache->shared->is_evicting);
+}
+
+content_cache_t *content_cache_init(char *dir, uint64_t max_size) {
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+        ERROR("create content cache directory %s failed", dir);
+        return NULL;
+    }
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        ERROR("open content cache directory %s failed", dir);
+        return NULL;
+    }
+
+    shared_state_t *shared = (shared_state_t *)mmap(NULL, sizeof(shared_state_t), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        ERROR("map content cache state failed");
+        close(dir_fd);
+        return NULL;
+    }
+    atomic_init(&shared->hits, 0);
+    atomic_init(&shared->misses, 0);
+    atomic_init(&shared->hit_bytes, 0);
+    atomic_init(&shared->insertions, 0);
+    atomic_init(&shared->evictions, 0);
+    atomic_init(&shared->size, 0);
+    atomic_flag_clear(&shared->is_evicting);
+    atomic_init(&shared->temp_id, 0);
+
+    content_cache_t *cache = (content_cache_t *)malloc(sizeof(content_cache_t));
+    cache->dir_fd = dir_fd;
+    cache->max_size = max_size;
+    cache->shared = shared;
+
+    // count what's left by the last run
+    evict(cache);
+    INFO("content cache at %s (%" PRIu64 " of %" PRIu64 " bytes used)", dir, (uint64_t)atomic_load(&shared->size),
+        max_size);
+
+    return cache;
+}
+
+static void cached_name(char *path, struct stat *st, char *name) {
+    uint64_t key_len = 5 * sizeof(uint64_t) + strlen(path);
+    char *key = (char *)malloc(sizeof(char) * (key_len + 1));
+    uint64_t len = append_buf_uint64(key, 0, st->st_dev);
+    len = append_buf_uint64(key, len, st->st_ino);
+    len = append_buf_uint64(key, len, st->st_size);
+    len = append_buf_uint64(key, len, st->st_mtime);
+#ifdef __APPLE__
+    len = append_buf_uint64(key, len, st->st_mtimespec.tv_nsec);
+#else
+    len = append_buf_uint64(key, len, st->st_mtim.tv_nsec);
+#endif
+    len = append_buf_charp(key, len, path);
+
+    uint64_t hash[2];
+    murmur3_128(key, len, hash);
+    sprintf(name, "%016" PRIx64 "%016" PRIx64, hash[0], hash[1]);
+    free(key);
+}
+
+int content_cache_open(content_cache_t *cache, char *path, struct stat *st, uint64_t *len) {
+    char name[NAME_LEN + 1];
+    cached_name(path, st, name);
+
+    int fd = openat(cache->dir_fd, name, O_RDONLY);
+    struct stat cached_st;
+    if (fd != -1 && fstat(fd, &cached_st) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        atomic_fetch_add(&cache->shared->misses, 1);
+        return -1;
+    }
+
+    // mark as recently used
+    futimens(fd, NULL);
+    *len = cached_st.st_size;
+    atomic_fetch_add(&cache->shared->hits, 1);
+    atomic_fetch_add(&cache->shared->hit_bytes, cached_st.st_size);
+    return fd;
+}
+
+int content_cache_create(content_cache_t *cache, char **temp_name) {
+    // "tmp.{pid}.{id}", which is never as long as a cached name
+    *temp_name = (char *)malloc(sizeof(char) * (NAME_LEN + 1));
+    snprintf(*temp_name, NAME_LEN, "tmp.%d.%" PRIu64, (int)getpid(),
+        (uint64_t)atomic_fetch_add(&cache->shared->temp_id, 1));
+
+    int fd = openat(cache->dir_fd, *temp_name, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        ERROR("create content cache file failed");
+        free(*temp_name);
+        *temp_name = NULL;
+    }
+    return fd;
+}
+
+void content_cache_commit(content_cache_t *cache, char *path, struct stat *st, int fd, char *temp_name,
+    bool is_complete) {
+    // a file which can't fit in the cache after eviction would only evict others
+    struct stat temp_st;
+    if (is_complete && (fstat(fd, &temp_st) == -1 || temp_st.st_size > cache->max_size / 8 * 7)) {
+        is_complete = false;
+    }
+    close(fd);
+
+    char name[NAME_LEN + 1];
+    cached_name(path, st, name);
+    if (!is_complete || renameat(cache->dir_fd, temp_name, cache->dir_fd, name) == -1) {
+        unlinkat(cache->dir_fd, temp_name, 0);
+        free(temp_name);
+        return;
+    }
+    free(temp_name);
+
+    atomic_fetch_add(&cache->shared->insertions, 1);
+    if (atomic_fetch_add(&cache->shared->size, temp_st.st_size) + temp_st.st_size > cache->max_size) {
+        evict(cache);
+    }
+}
+
+void content_cache_get_stats(content_cache_t *cache, content_cache_stats_t *stats) {
+    stats->hits = atomic_load(&cache->shared->hits);
+    stats->misses = atomic_load(&cache->shared->misses);
+    stats->hit_bytes = atomic_load(&cache->shared->hit_bytes);
+    stats->insertions = atomic_load(&cache->shared->insertions);
+    stats->evictions = atomic_load(&cache->shared->evictions);
+    stats->size = atomic_load(&cache->shared->size);
+}
@@ -0,0 +1,161 @@
+#include "content_hash.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+// a file is hashed by chunks, and its hash is that of the chunk hashes
+#define CHUNK_SIZE (1 << 20)
+
+// a slot is being written when its sequence is odd, and read again if it's changed while being read
+typedef struct {
+    atomic_uint_fast64_t seq;
+    uint64_t key[2];
+    uint64_t hash[2];
+} slot_t;
+
+struct content_hash_cache {
+    slot_t *slots;
+    uint64_t slots_size;
+};
+
+content_hash_cache_t *content_hash_init(uint64_t slots_size) {
+    slot_t *slots = (slot_t *)mmap(NULL, sizeof(slot_t) * slots_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        ERROR("map content hash cache failed");
+        return NULL;
+    }
+    for (uint64_t i = 0; i < slots_size; i++) {
+        atomic_init(&slots[i].seq, 0);
+    }
+
+    content_hash_cache_t *cache = (content_hash_cache_t *)malloc(sizeof(content_hash_cache_t));
+    cache->slots = slots;
+    cache->slots_size = slots_size;
+    return cache;
+}
+
+static void cache_key(char *path, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec, uint64_t *key) {
+    uint64_t key_len = 3 * sizeof(uint64_t) + strlen(path);
+    char *buf = (char *)malloc(sizeof(char) * (key_len + 1));
+    uint64_t len = append_buf_uint64(buf, 0, size);
+    len = append_buf_uint64(buf, len, mtime_sec);
+    len = append_buf_uint64(buf, len, mtime_nsec);
+    len = append_buf_charp(buf, len, path);
+    murmur3_128(buf, len, key);
+    free(buf);
+}
+
+// return 0 when `key` is cached, -1 otherwise
+static int cache_lookup(content_hash_cache_t *cache, uint64_t *key, uint64_t *hash) {
+    slot_t *slot = &cache->slots[key[0] % cache->slots_size];
+    uint64_t seq = atomic_load(&slot->seq);
+    if (seq & 1) {
+        return -1;
+    }
+    uint64_t slot_key[2] = { slot->key[0], slot->key[1] };
+    uint64_t slot_hash[2] = { slot->hash[0], slot->hash[1] };
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load(&slot->seq) != seq || !seq || slot_key[0] != key[0] || slot_key[1] != key[1]) {
+        return -1;
+    }
+    hash[0] = slot_hash[0];
+    hash[1] = slot_hash[1];
+    return 0;
+}
+
+// the slot is left as it is if another one is writing it
+static void cache_insert(content_hash_cache_t *cache, uint64_t *key, uint64_t *hash) {
+    slot_t *slot = &cache->slots[key[0] % cache->slots_size];
+    uint_fast64_t seq = atomic_load(&slot->seq);
+    if ((seq & 1) || !atomic_compare_exchange_strong(&slot->seq, &seq, seq + 1)) {
+        return;
+    }
+    slot->key[0] = key[0];
+    slot->key[1] = key[1];
+    slot->hash[0] = hash[0];
+    slot->hash[1] = hash[1];
+    atomic_store(&slot->seq, seq + 2);
+}
+
+// whether `st` is still the status in the manifest
+static bool is_same_status(struct stat *st, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec) {
+#ifdef __APPLE__
+    uint32_t nsec = st->st_mtimespec.tv_nsec;
+#else
+    uint32_t nsec = st->st_mtim.tv_nsec;
+#endif
+    return (uint64_t)st->st_size == size && st->st_mtime == mtime_sec && nsec == mtime_nsec;
+}
+
+// return 0 when success, -1 when error
+static int hash_file(int dir_fd, char *path, uint64_t size, int64_t mtime_sec, uint32_t mtime_nsec, uint64_t *hash) {
+    int fd = openat(dir_fd, path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !is_same_status(&st, size, mtime_sec, mtime_nsec)) {
+        close(fd);
+        return -1;
+    }
+
+    int ret = content_hash_read(fd, size, hash);
+    // the file may be modified while being read
+    if (ret == 0 && (fstat(fd, &st) == -1 || !is_same_status(&st, size, mtime_sec, mtime_nsec))) {
+        ret = -1;
+    }
+    close(fd);
+    return ret;
+}
+
+int content_hash_read(int fd, uint64_t size, uint64_t *hash) {
+    uint64_t chunks_size = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    // chunk hashes are kept in little-endian, so the hash doesn't depend on host byte order
+    unsigned char *chunk_hashes = (unsigned char *)malloc(sizeof(uint64_t) * 2 * (chunks_size ? chunks_size : 1));
+    char *chunk = (char *)malloc(sizeof(char) * CHUNK_SIZE);
+    if (!chunk_hashes || !chunk) {
+        free(chunk);
+        free(chunk_hashes);
+        return -1;
+    }
+    int ret = 0;
+    for (uint64_t i = 0; i < chunks_size; i++) {
+        uint64_t len = MIN(CHUNK_SIZE, size - i * CHUNK_SIZE);
+        if (bulk_read(fd, chunk, len) != len) {
+            ret = -1;
+            break;
+        }
+        uint64_t chunk_hash[2];
+        murmur3_128(chunk, len, chunk_hash);
+        for (int j = 0; j < 2 * (int)sizeof(uint64_t); j++) {
+            chunk_hashes[i * 2 * sizeof(uint64_t) + j] = chunk_hash[j / sizeof(uint64_t)] >> (j % sizeof(uint64_t) * 8);
+        }
+    }
+    if (ret == 0) {
+        murmur3_128(chunk_hashes, sizeof(uint64_t) * 2 * chunks_size, hash);
+    }
+    free(chunk);
+    free(chunk_hashes);
+    return ret;
+}
+
+int content_hash_get(content_hash_cache_t *cache, int dir_fd, char *path, uint64_t size, int64_t mtime_sec,
+    uint32_t mtime_nsec, uint64_t *hash) {
+    uint64_t key[2];
+    cache_key(path, size, mtime_sec, mtime_nsec, key);
+    if (cache_lookup(cache, key, hash) == 0) {
+        return 0;
+    }
+    if (hash_file(dir_fd, path, size, mtime_sec, mtime_nsec, hash) == -1) {
+        return -1;
+    }
+    cache_insert(cache, key, hash);
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include "content_index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "utils.h"
+
+// encoded as ([path length][path][size][mtime sec][mtime nsec][hash])..., path length is varint, others are uint64
+// in network order
+
+typedef struct {
+    bool is_used;
+    uint64_t hash[2];
+    char *path;
+    uint64_t size;
+    struct timespec mtime;
+} entry_t;
+
+struct content_index {
+    pthread_mutex_t lock;
+    // open addressing by the first half of hash, at most half full
+    entry_t *entries;
+    uint64_t entries_size;
+    uint64_t capacity;
+};
+
+static void insert(content_index_t *index, uint64_t *hash, char *path, uint64_t size, struct timespec mtime);
+
+static void grow(content_index_t *index) {
+    entry_t *entries = index->entries;
+    uint64_t capacity = index->capacity;
+    index->capacity = capacity ? capacity << 1 : 1 << 10;
+    index->entries = (entry_t *)calloc(index->capacity, sizeof(entry_t));
+    index->entries_size = 0;
+    for (uint64_t i = 0; i < capacity; i++) {
+        if (entries[i].is_used) {
+            insert(index, entries[i].hash, entries[i].path, entries[i].size, entries[i].mtime);
+        }
+    }
+    free(entries);
+}
+
+// `path` is taken by the index, and replaces the file recorded with the same content
+static void insert(content_index_t *index, uint64_t *hash, char *path, uint64_t size, struct timespec mtime) {
+    if ((index->entries_size + 1) * 2 > index->capacity) {
+        grow(index);
+    }
+    uint64_t mask = index->capacity - 1;
+    uint64_t i = hash[0] & mask;
+    entry_t *entry = &index->entries[i];
+    while (entry->is_used && (entry->hash[0] != hash[0] || entry->hash[1] != hash[1])) {
+        i = (i + 1) & mask;
+        entry = &index->entries[i];
+    }
+
+    if (entry->is_used) {
+        free(entry->path);
+    }
+    else {
+        entry->is_used = true;
+        entry->hash[0] = hash[0];
+        entry->hash[1] = hash[1];
+        index->entries_size++;
+    }
+    entry->path = path;
+    entry->size = size;
+    entry->mtime = mtime;
+}
+
+// whether file `entry->path` is still as recorded
+static bool is_valid(entry_t *entry) {
+    struct stat st;
+    if (lstat(entry->path, &st) == -1 || !S_ISREG(st.st_mode) || (uint64_t)st.st_size != entry->size) {
+        return false;
+    }
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec == entry->mtime.tv_sec && st.st_mtimespec.tv_nsec == entry->mtime.tv_nsec;
+#else
+    return st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+#endif
+}
+
+// return the entry of `hash`, NULL when it's not recorded
+static entry_t *find(content_index_t *index, uint64_t *hash) {
+    uint64_t mask = index->capacity - 1;
+    for (uint64_t i = hash[0] & mask; index->entries[i].is_used; i = (i + 1) & mask) {
+        entry_t *entry = &index->entries[i];
+        if (entry->hash[0] == hash[0] && entry->hash[1] == hash[1]) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+content_index_t *content_index_init(char const *data, uint64_t len) {
+    content_index_t *index = (content_index_t *)malloc(sizeof(content_index_t));
+    pthread_mutex_init(&index->lock, NULL);
+    index->entries = NULL;
+    index->entries_size = 0;
+    index->capacity = 0;
+    grow(index);
+
+    uint64_t offset = 0;
+    while (data && offset < len) {
+        uint64_t path_len;
+        uint64_t size;
+        uint64_t mtime_sec;
+        uint64_t mtime_nsec;
+        uint64_t hash[2];
+        if (read_buf_varint(data, len, &offset, &path_len) == -1 || path_len == 0 || path_len > len - offset) {
+            break;
+        }
+        char *path = (char *)malloc(sizeof(char) * (path_len + 1));
+        memcpy(path, data + offset, path_len);
+        path[path_len] = 0;
+        offset += path_len;
+        if (read_buf_uint64(data, len, &offset, &size) == -1 || read_buf_uint64(data, len, &offset, &mtime_sec) == -1
+            || read_buf_uint64(data, len, &offset, &mtime_nsec) == -1
+            || read_buf_uint64(data, len, &offset, &hash[0]) == -1
+            || read_buf_uint64(data, len, &offset, &hash[1]) == -1 || strlen(path) != path_len) {
+            free(path);
+            break;
+        }
+        struct timespec mtime = { (time_t)(int64_t)mtime_sec, (long)mtime_nsec };
+        insert(index, hash, path, size, mtime);
+    }
+
+    return index;
+}
+
+void content_index_kill(content_index_t *index) {
+    for (uint64_t i = 0; i < index->capacity; i++) {
+        if (index->entries[i].is_used) {
+            free(index->entries[i].path);
+        }
+    }
+    free(index->entries);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+void content_index_add(content_index_t *index, uint64_t *hash, char *path, uint64_t size, struct timespec mtime) {
+    pthread_mutex_lock(&index->lock);
+    entry_t *entry = find(index, hash);
+    if (!entry || (strcmp(entry->path, path) && !is_valid(entry))) {
+        char *path_copy = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+        strcpy(path_copy, path);
+        insert(index, hash, path_copy, size, mtime);
+    }
+    else if (!strcmp(entry->path, path)) {
+        entry->size = size;
+        entry->mtime = mtime;
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+char *content_index_find(content_index_t *index, uint64_t *hash, uint64_t size) {
+    char *path = NULL;
+    pthread_mutex_lock(&index->lock);
+    entry_t *entry = find(index, hash);
+    if (entry && entry->size == size && is_valid(entry)) {
+        path = (char *)malloc(sizeof(char) * (strlen(entry->path) + 1));
+        strcpy(path, entry->path);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return path;
+}
+
+char *content_index_encode(content_index_t *index, uint64_t *len) {
+    pthread_mutex_lock(&index->lock);
+    uint64_t data_len = 0;
+    for (uint64_t i = 0; i < index->capacity; i++) {
+        if (index->entries[i].is_used) {
+            data_len += VARINT_MAX_LEN + 5 * sizeof(uint64_t) + strlen(index->entries[i].path);
+        }
+    }
+
+    char *data = (char *)malloc(sizeof(char) * (data_len + 1));
+    *len = 0;
+    for (uint64_t i = 0; i < index->capacity; i++) {
+        entry_t *entry = &index->entries[i];
+        if (!entry->is_used || !is_valid(entry)) {
+            continue;
+        }
+        *len = append_buf_varint(data, *len, strlen(entry->path));
+        *len = append_buf_charp(data, *len, entry->path);
+        *len = append_buf_uint64(data, *len, my_htonll(entry->size));
+        *len = append_buf_uint64(data, *len, my_htonll((uint64_t)(int64_t)entry->mtime.tv_sec));
+        *len = append_buf_uint64(data, *len, my_htonll((uint64_t)entry->mtime.tv_nsec));
+        *len = append_buf_uint64(data, *len, my_htonll(entry->hash[0]));
+        *len = append_buf_uint64(data, *len, my_htonll(entry->hash[1]));
+    }
+    pthread_mutex_unlock(&index->lock);
+    return data;
+}
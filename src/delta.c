@@ -0,0 +1,220 @@
+#include "delta.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "utils.h"
+
+uint64_t delta_block_size(uint64_t size) {
+    uint64_t const MIN_BLOCK_SIZE = 1 << 11;
+    uint64_t const MAX_BLOCK_SIZE = 1 << 17;
+
+    uint64_t block_size = MIN_BLOCK_SIZE;
+    while (block_size < MAX_BLOCK_SIZE && block_size * block_size < size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+void delta_sign(void const *block, uint64_t len, delta_signature_t *signature) {
+    signature->weak = weak_checksum(block, len);
+    murmur3_128(block, len, signature->strong);
+}
+
+// open addressing table from weak checksum to block, slots hold block + 1 and 0 is empty
+typedef struct {
+    uint32_t *slots;
+    uint64_t mask;
+    int shift;
+} block_table_t;
+
+static uint64_t table_slot(block_table_t *table, uint32_t weak) {
+    // fibonacci hashing, low bits of checksum aren't uniform for similar blocks
+    return ((uint64_t)weak * 0x9e3779b97f4a7c15ULL) >> table->shift;
+}
+
+// return 0 when success, -1 when error
+static int table_init(block_table_t *table, delta_signature_t *signatures, uint64_t signatures_size) {
+    // at most half full, so a miss usually ends at the first slot
+    int bits = 4;
+    while (((uint64_t)1 << bits) < signatures_size * 2) {
+        bits++;
+    }
+    table->slots = (uint32_t *)calloc((uint64_t)1 << bits, sizeof(uint32_t));
+    if (!table->slots) {
+        return -1;
+    }
+    table->mask = ((uint64_t)1 << bits) - 1;
+    table->shift = 64 - bits;
+
+    for (uint64_t i = 0; i < signatures_size; i++) {
+        uint64_t slot = table_slot(table, signatures[i].weak);
+        while (table->slots[slot]) {
+            slot = (slot + 1) & table->mask;
+        }
+        table->slots[slot] = (uint32_t)(i + 1);
+    }
+    return 0;
+}
+
+// return a block whose signature matches `window`, -1 when none
+static int64_t table_find(block_table_t *table, delta_signature_t *signatures, uint32_t weak, char *window,
+    uint64_t block_size) {
+    bool is_hashed = false;
+    uint64_t strong[2];
+    for (uint64_t slot = table_slot(table, weak); table->slots[slot]; slot = (slot + 1) & table->mask) {
+        uint32_t block = table->slots[slot] - 1;
+        if (signatures[block].weak != weak) {
+            continue;
+        }
+        // strong hash is only computed when weak checksum matches
+        if (!is_hashed) {
+            murmur3_128(window, block_size, strong);
+            is_hashed = true;
+        }
+        if (signatures[block].strong[0] == strong[0] && signatures[block].strong[1] == strong[1]) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+// consecutive copied blocks not visited yet
+typedef struct {
+    int64_t block;
+    uint64_t blocks_size;
+} copy_run_t;
+
+static int flush_run(copy_run_t *run, delta_visit_t visit, void *arg) {
+    if (!run->blocks_size) {
+        return 0;
+    }
+    int ret = visit(NULL, run->blocks_size, run->block, arg);
+    run->blocks_size = 0;
+    return ret;
+}
+
+int delta_generate(int fd, uint64_t size, uint64_t block_size, delta_signature_t *signatures,
+    uint64_t signatures_size, delta_visit_t visit, void *arg) {
+    // literal data is visited before it grows too long, so the buffer never holds more than
+    // a pending literal and a window
+    uint64_t const MAX_LITERAL_LEN = 1 << 20;
+    uint64_t const READ_SIZE = 1 << 20;
+
+    uint64_t buf_size = MAX_LITERAL_LEN + block_size + READ_SIZE;
+    // block numbers are kept in uint32
+    if (signatures_size >= UINT32_MAX) {
+        return -1;
+    }
+    char *buf = (char *)malloc(sizeof(char) * buf_size);
+    if (!buf) {
+        return -1;
+    }
+    block_table_t table;
+    if (table_init(&table, signatures, signatures_size) == -1) {
+        free(buf);
+        return -1;
+    }
+
+    // `buf[start, pos)` is pending literal, `buf[pos, pos + block_size)` is the window, `buf[pos, end)` is read
+    uint64_t start = 0;
+    uint64_t pos = 0;
+    uint64_t end = 0;
+    uint64_t read_len = 0;
+    copy_run_t run = { .block = -1, .blocks_size = 0 };
+    // rolling checksum of the window, see weak_checksum()
+    uint32_t a = 0;
+    uint32_t b = 0;
+    bool is_rolling = false;
+    int ret = 0;
+
+    while (1) {
+        // keep one more byte than the window to roll
+        if (end - pos <= block_size && read_len < size) {
+            memmove(buf, buf + start, end - start);
+            pos -= start;
+            end -= start;
+            start = 0;
+
+            while (end < buf_size && read_len < size) {
+                ssize_t len = read(fd, buf + end, MIN(buf_size - end, size - read_len));
+                if (len == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (len <= 0) {
+                    ret = -1;
+                    goto finish;
+                }
+                end += len;
+                read_len += len;
+            }
+        }
+        if (end - pos < block_size) {
+            break;
+        }
+
+        if (!is_rolling) {
+            a = 0;
+            b = 0;
+            for (uint64_t i = 0; i < block_size; i++) {
+                a += (unsigned char)buf[pos + i];
+                b += a;
+            }
+            is_rolling = true;
+        }
+
+        int64_t block = table_find(&table, signatures, (a & 0xffff) | (b << 16), buf + pos, block_size);
+        if (block != -1) {
+            if (pos > start) {
+                if (flush_run(&run, visit, arg) == -1 || visit(buf + start, pos - start, -1, arg) == -1) {
+                    ret = -1;
+                    goto finish;
+                }
+            }
+            if (run.blocks_size && block == run.block + (int64_t)run.blocks_size) {
+                run.blocks_size++;
+            }
+            else {
+                if (flush_run(&run, visit, arg) == -1) {
+                    ret = -1;
+                    goto finish;
+                }
+                run.block = block;
+                run.blocks_size = 1;
+            }
+            pos += block_size;
+            start = pos;
+            is_rolling = false;
+            continue;
+        }
+
+        // slide the window by one byte
+        if (pos + block_size == end) {
+            pos++;
+            break;
+        }
+        unsigned char out = (unsigned char)buf[pos];
+        unsigned char in = (unsigned char)buf[pos + block_size];
+        a += in - out;
+        b += a - (uint32_t)block_size * out;
+        pos++;
+
+        if (pos - start >= MAX_LITERAL_LEN) {
+            if (flush_run(&run, visit, arg) == -1 || visit(buf + start, pos - start, -1, arg) == -1) {
+                ret = -1;
+                goto finish;
+            }
+            start = pos;
+        }
+    }
+
+    // the rest is shorter than a block
+    if (flush_run(&run, visit, arg) == -1 || (end > start && visit(buf + start, end - start, -1, arg) == -1)) {
+        ret = -1;
+    }
+
+finish:
+    free(table.slots);
+    free(buf);
+    return ret;
+}
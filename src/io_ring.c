@@ -0,0 +1,219 @@
+#include "io_ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "utils.h"
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// not defined by old libc headers
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+struct io_ring {
+    int fd;
+
+    // submission queue shared with kernel
+    void *sq_map;
+    uint64_t sq_map_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    uint64_t sqes_len;
+    unsigned sq_entries;
+    // queued but not submitted
+    unsigned to_submit;
+
+    // completion queue shared with kernel
+    void *cq_map;
+    uint64_t cq_map_len;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    char *bufs;
+    int bufs_size;
+    uint64_t buf_len;
+};
+
+io_ring_t *ring_init(unsigned entries, int bufs_size, uint64_t buf_len) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+        return NULL;
+    }
+    // reading at the current position is needed for socket
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return NULL;
+    }
+
+    io_ring_t *ring = (io_ring_t *)calloc(1, sizeof(io_ring_t));
+    ring->fd = fd;
+    ring->sq_entries = params.sq_entries;
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_map + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_map + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_map + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_map + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_map + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_map + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_map + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+
+    // buffers are registered so they aren't mapped for each request
+    ring->bufs_size = bufs_size;
+    ring->buf_len = buf_len;
+    ring->bufs = (char *)mmap(NULL, bufs_size * buf_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        goto fail;
+    }
+    struct iovec *iovecs = (struct iovec *)malloc(sizeof(struct iovec) * bufs_size);
+    for (int i = 0; i < bufs_size; i++) {
+        iovecs[i].iov_base = ring->bufs + i * buf_len;
+        iovecs[i].iov_len = buf_len;
+    }
+    int ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecs, bufs_size);
+    free(iovecs);
+    if (ret == -1) {
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    ring_kill(ring);
+    return NULL;
+}
+
+void ring_kill(io_ring_t *ring) {
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) {
+        munmap(ring->sq_map, ring->sq_map_len);
+    }
+    if (ring->cq_map && ring->cq_map != MAP_FAILED) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    if (ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->bufs) {
+        munmap(ring->bufs, ring->bufs_size * ring->buf_len);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+char *ring_buf(io_ring_t *ring, int index) {
+    return ring->bufs + index * ring->buf_len;
+}
+
+static int ring_queue(io_ring_t *ring, int opcode, int fd, int64_t offset, int index, uint64_t buf_offset,
+    uint32_t len, uint64_t data) {
+    // only this thread moves the tail, and kernel moves the head
+    unsigned tail = *ring->sq_tail;
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries) {
+        return -1;
+    }
+
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)offset;
+    sqe->addr = (uint64_t)(uintptr_t)(ring_buf(ring, index) + buf_offset);
+    sqe->len = len;
+    sqe->buf_index = index;
+    sqe->user_data = data;
+    ring->sq_array[slot] = slot;
+
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return 0;
+}
+
+int ring_read(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data) {
+    return ring_queue(ring, IORING_OP_READ_FIXED, fd, offset, index, buf_offset, len, data);
+}
+
+int ring_write(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data) {
+    return ring_queue(ring, IORING_OP_WRITE_FIXED, fd, offset, index, buf_offset, len, data);
+}
+
+int ring_wait(io_ring_t *ring, uint64_t *data, int32_t *res) {
+    while (1) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret == -1 && errno != EINTR) {
+            return -1;
+        }
+        if (ret > 0) {
+            ring->to_submit -= ret;
+        }
+    }
+}
+
+#else
+
+io_ring_t *ring_init(unsigned entries, int bufs_size, uint64_t buf_len) {
+    return NULL;
+}
+
+void ring_kill(io_ring_t *ring) {
+}
+
+char *ring_buf(io_ring_t *ring, int index) {
+    return NULL;
+}
+
+int ring_read(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data) {
+    return -1;
+}
+
+int ring_write(io_ring_t *ring, int fd, int64_t offset, int index, uint64_t buf_offset, uint32_t len, uint64_t data) {
+    return -1;
+}
+
+int ring_wait(io_ring_t *ring, uint64_t *data, int32_t *res) {
+    return -1;
+}
+
+#endif
@@ -0,0 +1,529 @@
+#include "local_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include "utils.h"
+
+// "{dir}/local_index" is a header followed by slots, and it's written in place through a shared mapping
+// "{dir}/local_dirs" is ([path length][path])... of recorded directories, path length is varint
+#define TABLE_NAME "local_index"
+#define DIRS_NAME "local_dirs"
+// "FSLOCAL1"
+#define TABLE_MAGIC 0x46534c4f43414c31ULL
+#define MIN_SLOTS_SIZE (1 << 16)
+
+// a dropped entry is still used, so probing passes it
+#define SLOT_USED 1
+#define SLOT_LIVE 2
+#define SLOT_DIR 4
+#define SLOT_HASH 8
+
+typedef struct {
+    uint64_t magic;
+    // a power of 2
+    uint64_t slots_size;
+    uint64_t used;
+    // set while it's open, so a table left by a killed client is dropped
+    uint64_t is_open;
+    // incremented whenever it's opened, what's checked in a run is marked with it
+    uint64_t run;
+} header_t;
+
+typedef struct {
+    uint64_t path_hash[2];
+    // content hash of a file if SLOT_HASH
+    uint64_t hash[2];
+    // server mtime of a file, or local mtime of a directory when the index is closed
+    int64_t mtime_sec;
+    // server size of a file
+    uint64_t size;
+    uint64_t ino;
+    uint32_t mtime_nsec;
+    uint32_t flags;
+    // run in which the entry is found with the recorded inode
+    uint32_t valid_run;
+    // run in which a directory is found with the recorded inode and mtime
+    uint32_t intact_run;
+} slot_t;
+
+typedef struct {
+    int fd;
+    header_t *header;
+    slot_t *slots;
+    uint64_t map_len;
+} table_t;
+
+// a file which is being synced
+typedef struct {
+    char *path;
+    struct timespec mtime;
+    uint64_t size;
+    uint64_t hash[2];
+    bool has_hash;
+} expected_t;
+
+struct local_index {
+    char *table_path;
+    char *dirs_path;
+    table_t table;
+    uint32_t run;
+
+    // paths of live directory entries, each of which is owned by the index
+    char **dirs;
+    uint64_t dirs_size;
+    uint64_t dirs_capacity;
+
+    expected_t *expected;
+    uint64_t expected_size;
+    uint64_t expected_capacity;
+
+    uint64_t trusted_size;
+};
+
+static char *join_path(char *dir, char *name) {
+    char *path = (char *)malloc(sizeof(char) * (strlen(dir) + strlen(name) + 2));
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+static void unmap_table(table_t *table) {
+    munmap(table->header, table->map_len);
+    close(table->fd);
+    table->header = NULL;
+}
+
+// map file `path` as a table, it's created empty with `slots_size` slots unless `slots_size` is 0
+// return 0 when success, -1 when error or it isn't a valid table
+static int map_table(char *path, uint64_t slots_size, table_t *table) {
+    int fd = slots_size ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0600) : open(path, O_RDWR);
+    if (fd == -1) {
+        return -1;
+    }
+    // slots of a new table are empty since the file is filled with zeros
+    uint64_t map_len = sizeof(header_t) + sizeof(slot_t) * slots_size;
+    struct stat st;
+    if (slots_size ? ftruncate(fd, map_len) == -1 : fstat(fd, &st) == -1 || st.st_size < sizeof(header_t)) {
+        close(fd);
+        return -1;
+    }
+    if (!slots_size) {
+        map_len = st.st_size;
+    }
+    void *map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    table->fd = fd;
+    table->header = (header_t *)map;
+    table->slots = (slot_t *)(table->header + 1);
+    table->map_len = map_len;
+
+    header_t *header = table->header;
+    if (slots_size) {
+        header->magic = TABLE_MAGIC;
+        header->slots_size = slots_size;
+        header->used = 0;
+        header->is_open = 1;
+        header->run = 0;
+        return 0;
+    }
+    uint64_t size = header->slots_size;
+    if (header->magic != TABLE_MAGIC || !size || (size & (size - 1))
+        || map_len != sizeof(header_t) + sizeof(slot_t) * size) {
+        unmap_table(table);
+        return -1;
+    }
+    return 0;
+}
+
+// slot of `path_hash`, or the empty slot where it should be
+static slot_t *find_slot(table_t *table, uint64_t *path_hash) {
+    uint64_t mask = table->header->slots_size - 1;
+    uint64_t i = path_hash[0] & mask;
+    while ((table->slots[i].flags & SLOT_USED)
+        && (table->slots[i].path_hash[0] != path_hash[0] || table->slots[i].path_hash[1] != path_hash[1])) {
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
+}
+
+static slot_t *find_path(table_t *table, char *path, uint64_t len) {
+    uint64_t path_hash[2];
+    murmur3_128(path, len, path_hash);
+    return find_slot(table, path_hash);
+}
+
+static bool is_live_dir(slot_t *slot) {
+    return (slot->flags & (SLOT_LIVE | SLOT_DIR)) == (SLOT_LIVE | SLOT_DIR);
+}
+
+// move live entries into a new table of `slots_size` slots, which replaces the old one
+// return 0 when success, -1 when error, then the old table is kept
+static int rebuild(local_index_t *index, uint64_t slots_size) {
+    char *temp_path = (char *)malloc(sizeof(char) * (strlen(index->table_path) + 5));
+    sprintf(temp_path, "%s.tmp", index->table_path);
+    table_t table;
+    if (map_table(temp_path, slots_size, &table) == -1) {
+        ERROR("create local index %s failed", temp_path);
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+
+    if (index->table.header) {
+        for (uint64_t i = 0; i < index->table.header->slots_size; i++) {
+            slot_t *slot = &index->table.slots[i];
+            if (slot->flags & SLOT_LIVE) {
+                *find_slot(&table, slot->path_hash) = *slot;
+                table.header->used++;
+            }
+        }
+        table.header->run = index->table.header->run;
+    }
+
+    if (rename(temp_path, index->table_path) == -1) {
+        ERROR("rename %s to %s failed", temp_path, index->table_path);
+        unmap_table(&table);
+        unlink(temp_path);
+        free(temp_path);
+        return -1;
+    }
+    free(temp_path);
+    if (index->table.header) {
+        unmap_table(&index->table);
+    }
+    index->table = table;
+    return 0;
+}
+
+// `path` is taken by the index
+static void append_dir(local_index_t *index, char *path) {
+    if (index->dirs_size == index->dirs_capacity) {
+        index->dirs_capacity = index->dirs_capacity ? index->dirs_capacity * 2 : 64;
+        index->dirs = (char **)realloc(index->dirs, sizeof(char *) * index->dirs_capacity);
+    }
+    index->dirs[index->dirs_size++] = path;
+}
+
+static void clear_dirs(local_index_t *index) {
+    for (uint64_t i = 0; i < index->dirs_size; i++) {
+        free(index->dirs[i]);
+    }
+    index->dirs_size = 0;
+}
+
+// return 0 when success, -1 when it doesn't exist or it's invalid, then no directory is loaded
+static int load_dirs(local_index_t *index) {
+    int fd = open(index->dirs_path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    char *buf = (char *)malloc(sizeof(char) * (st.st_size + 1));
+    if (bulk_read(fd, buf, st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    uint64_t len = st.st_size;
+    uint64_t offset = 0;
+    while (offset < len) {
+        uint64_t path_len;
+        if (read_buf_varint(buf, len, &offset, &path_len) == -1 || !path_len || path_len > len - offset) {
+            free(buf);
+            clear_dirs(index);
+            return -1;
+        }
+        char *path = (char *)malloc(sizeof(char) * (path_len + 1));
+        memcpy(path, buf + offset, path_len);
+        path[path_len] = 0;
+        offset += path_len;
+        append_dir(index, path);
+    }
+    free(buf);
+    return 0;
+}
+
+// return 0 when success, -1 when error
+static int save_dirs(local_index_t *index) {
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < index->dirs_size; i++) {
+        len += VARINT_MAX_LEN + strlen(index->dirs[i]);
+    }
+    char *buf = (char *)malloc(sizeof(char) * (len + 1));
+    len = 0;
+    for (uint64_t i = 0; i < index->dirs_size; i++) {
+        len = append_buf_varint(buf, len, strlen(index->dirs[i]));
+        len = append_buf_charp(buf, len, index->dirs[i]);
+    }
+
+    char *temp_path = (char *)malloc(sizeof(char) * (strlen(index->dirs_path) + 5));
+    sprintf(temp_path, "%s.tmp", index->dirs_path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int ret = fd == -1 || bulk_write(fd, buf, len) != len ? -1 : 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (ret == 0 && rename(temp_path, index->dirs_path) == -1) {
+        ret = -1;
+    }
+    if (ret == -1) {
+        ERROR("write local directories %s failed", index->dirs_path);
+        unlink(temp_path);
+    }
+    free(temp_path);
+    free(buf);
+    return ret;
+}
+
+static uint32_t stat_mtime_nsec(struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+// trust files which directory `path` still has with the recorded inodes
+static void scan_dir(local_index_t *index, char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return;
+    }
+    // names are joined to "{path}/", which is omitted for the root
+    uint64_t prefix_len = strcmp(path, ".") ? strlen(path) + 1 : 0;
+    char *child = (char *)malloc(sizeof(char) * (prefix_len + NAME_MAX + 1));
+    if (prefix_len) {
+        sprintf(child, "%s/", path);
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+        strcpy(child + prefix_len, entry->d_name);
+        slot_t *slot = find_path(&index->table, child, strlen(child));
+        if ((slot->flags & (SLOT_LIVE | SLOT_DIR)) == SLOT_LIVE && slot->ino == entry->d_ino) {
+            slot->valid_run = index->run;
+        }
+    }
+    free(child);
+    closedir(dir);
+}
+
+// check each recorded directory, and the files in a changed one
+static void check_dirs(local_index_t *index) {
+    uint64_t intact_size = 0;
+    uint64_t changed_size = 0;
+    for (uint64_t i = 0; i < index->dirs_size; i++) {
+        char *path = index->dirs[i];
+        slot_t *slot = find_path(&index->table, path, strlen(path));
+        struct stat st;
+        if (!is_live_dir(slot) || lstat(path, &st) == -1 || !S_ISDIR(st.st_mode) || st.st_ino != slot->ino) {
+            continue;
+        }
+        slot->valid_run = index->run;
+        if (st.st_mtime == slot->mtime_sec && stat_mtime_nsec(&st) == slot->mtime_nsec) {
+            slot->intact_run = index->run;
+            intact_size++;
+        }
+        else {
+            scan_dir(index, path);
+            changed_size++;
+        }
+    }
+    INFO("local index has %" PRIu64 " directories, %" PRIu64 " unchanged, %" PRIu64 " changed", index->dirs_size,
+        intact_size, changed_size);
+}
+
+local_index_t *local_index_open(char *dir) {
+    local_index_t *index = (local_index_t *)calloc(1, sizeof(local_index_t));
+    index->table_path = join_path(dir, TABLE_NAME);
+    index->dirs_path = join_path(dir, DIRS_NAME);
+
+    // the table is only trusted with the directories it's closed with
+    bool is_valid = load_dirs(index) == 0 && map_table(index->table_path, 0, &index->table) == 0;
+    if (is_valid && index->table.header->is_open) {
+        unmap_table(&index->table);
+        is_valid = false;
+    }
+    if (!is_valid) {
+        clear_dirs(index);
+        if (rebuild(index, MIN_SLOTS_SIZE) == -1) {
+            free(index->dirs);
+            free(index->table_path);
+            free(index->dirs_path);
+            free(index);
+            return NULL;
+        }
+    }
+    header_t *header = index->table.header;
+    header->is_open = 1;
+    // 0 is never a run, which a new slot has
+    header->run++;
+    if (!(uint32_t)header->run) {
+        header->run++;
+    }
+    index->run = (uint32_t)header->run;
+
+    struct timespec zero = { 0 };
+    local_index_add(index, ".", true, zero, 0, NULL, NULL);
+    check_dirs(index);
+    return index;
+}
+
+static int compare_path(void const *a, void const *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void local_index_close(local_index_t *index) {
+    uint64_t recorded_size = 0;
+    for (uint64_t i = 0; i < index->expected_size; i++) {
+        expected_t *expected = &index->expected[i];
+        struct stat st;
+        if (lstat(expected->path, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime >= expected->mtime.tv_sec) {
+            local_index_add(index, expected->path, false, expected->mtime, expected->size,
+                expected->has_hash ? expected->hash : NULL, &st);
+            recorded_size++;
+        }
+        free(expected->path);
+    }
+    free(index->expected);
+
+    // directories are recorded as they are after the sync, each of which is only kept once
+    qsort(index->dirs, index->dirs_size, sizeof(char *), compare_path);
+    uint64_t dirs_size = 0;
+    for (uint64_t i = 0; i < index->dirs_size; i++) {
+        char *path = index->dirs[i];
+        slot_t *slot = find_path(&index->table, path, strlen(path));
+        struct stat st;
+        bool is_kept = (!dirs_size || strcmp(index->dirs[dirs_size - 1], path)) && is_live_dir(slot);
+        if (is_kept && lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            slot->ino = st.st_ino;
+            slot->mtime_sec = st.st_mtime;
+            slot->mtime_nsec = stat_mtime_nsec(&st);
+            index->dirs[dirs_size++] = path;
+            continue;
+        }
+        if (is_kept) {
+            slot->flags &= ~SLOT_LIVE;
+        }
+        free(path);
+    }
+    index->dirs_size = dirs_size;
+
+    if (save_dirs(index) == 0) {
+        index->table.header->is_open = 0;
+    }
+    INFO("local index trusted %" PRIu64 " entries, recorded %" PRIu64 " synced files", index->trusted_size,
+        recorded_size);
+    unmap_table(&index->table);
+
+    clear_dirs(index);
+    free(index->dirs);
+    free(index->table_path);
+    free(index->dirs_path);
+    free(index);
+}
+
+bool local_index_is_synced(local_index_t *index, char *path, bool is_dir, struct timespec mtime, uint64_t size,
+    uint64_t *hash) {
+    slot_t *slot = find_path(&index->table, path, strlen(path));
+    if (!(slot->flags & SLOT_LIVE) || !(slot->flags & SLOT_DIR) != !is_dir) {
+        return false;
+    }
+    // a directory is only checked by itself, its mtime isn't synced
+    if (is_dir && slot->valid_run != index->run) {
+        return false;
+    }
+    if (!is_dir && (slot->mtime_sec != mtime.tv_sec || slot->mtime_nsec != mtime.tv_nsec || slot->size != size
+        || !(slot->flags & SLOT_HASH) != !hash || (hash && (slot->hash[0] != hash[0] || slot->hash[1] != hash[1])))) {
+        return false;
+    }
+    if (!is_dir && slot->valid_run != index->run) {
+        // "{parent}/{name}", or "{name}" in the root
+        char *slash = strrchr(path, '/');
+        slot_t *parent = slash ? find_path(&index->table, path, slash - path) : find_path(&index->table, ".", 1);
+        if (!is_live_dir(parent) || parent->intact_run != index->run) {
+            return false;
+        }
+    }
+    index->trusted_size++;
+    return true;
+}
+
+void local_index_add(local_index_t *index, char *path, bool is_dir, struct timespec mtime, uint64_t size,
+    uint64_t *hash, struct stat *st) {
+    // at most 3/4 full, a full table keeps what it has
+    header_t *header = index->table.header;
+    if ((header->used + 1) * 4 > header->slots_size * 3 && rebuild(index, header->slots_size * 2) == -1
+        && header->used + 1 >= header->slots_size) {
+        return;
+    }
+    uint64_t path_hash[2];
+    murmur3_128(path, strlen(path), path_hash);
+    slot_t *slot = find_slot(&index->table, path_hash);
+    // a recorded directory is kept with its status
+    if (is_dir && is_live_dir(slot)) {
+        return;
+    }
+    if (!(slot->flags & SLOT_USED)) {
+        index->table.header->used++;
+    }
+
+    memset(slot, 0, sizeof(slot_t));
+    slot->path_hash[0] = path_hash[0];
+    slot->path_hash[1] = path_hash[1];
+    slot->flags = SLOT_USED | SLOT_LIVE;
+    if (is_dir) {
+        // its status is recorded when the index is closed
+        slot->flags |= SLOT_DIR;
+        char *path_copy = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+        strcpy(path_copy, path);
+        append_dir(index, path_copy);
+        return;
+    }
+    if (hash) {
+        slot->flags |= SLOT_HASH;
+        slot->hash[0] = hash[0];
+        slot->hash[1] = hash[1];
+    }
+    slot->mtime_sec = mtime.tv_sec;
+    slot->mtime_nsec = mtime.tv_nsec;
+    slot->size = size;
+    slot->ino = st->st_ino;
+    slot->valid_run = index->run;
+}
+
+void local_index_expect(local_index_t *index, char *path, struct timespec mtime, uint64_t size, uint64_t *hash) {
+    slot_t *slot = find_path(&index->table, path, strlen(path));
+    slot->flags &= ~SLOT_LIVE;
+
+    if (index->expected_size == index->expected_capacity) {
+        index->expected_capacity = index->expected_capacity ? index->expected_capacity * 2 : 64;
+        index->expected = (expected_t *)realloc(index->expected, sizeof(expected_t) * index->expected_capacity);
+    }
+    expected_t *expected = &index->expected[index->expected_size++];
+    expected->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(expected->path, path);
+    expected->mtime = mtime;
+    expected->size = size;
+    expected->has_hash = hash;
+    if (hash) {
+        expected->hash[0] = hash[0];
+        expected->hash[1] = hash[1];
+    }
+}
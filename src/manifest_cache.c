@@ -0,0 +1,994 @@
+#include "manifest_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include "utils.h"
+
+void snapshot_release(manifest_snapshot_t *snapshot) {
+    if (atomic_fetch_sub(&snapshot->refs, 1) != 1) {
+        return;
+    }
+    free(snapshot->name_offsets);
+    free(snapshot->types);
+    free(snapshot->permissions);
+    free(snapshot->mtime_secs);
+    free(snapshot->mtime_nsecs);
+    free(snapshot->sizes);
+    free(snapshot->first_children);
+    free(snapshot->children_sizes);
+    free(snapshot->wds);
+    free(snapshot->hashes);
+    free(snapshot->names);
+    free(snapshot);
+}
+
+// return child of directory node `dir` named `name`, -1 when not found
+static int64_t find_child(manifest_snapshot_t *snapshot, uint32_t dir, char *name, uint64_t name_len) {
+    // children are sorted by name
+    int64_t low = snapshot->first_children[dir];
+    int64_t high = low + snapshot->children_sizes[dir] - 1;
+    while (low <= high) {
+        int64_t mid = (low + high) / 2;
+        char *mid_name = snapshot->names + snapshot->name_offsets[mid];
+        int cmp = strncmp(mid_name, name, name_len);
+        if (cmp == 0 && mid_name[name_len]) {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return -1;
+}
+
+int64_t snapshot_find(manifest_snapshot_t *snapshot, char *path) {
+    int64_t node = 0;
+    while (*path) {
+        uint64_t len = strcspn(path, "/");
+        if (len && !(len == 1 && path[0] == '.')) {
+            if (snapshot->types[node] != WALK_DIRECTORY) {
+                return -1;
+            }
+            node = find_child(snapshot, (uint32_t)node, path, len);
+            if (node == -1) {
+                return -1;
+            }
+        }
+        path += len;
+        if (*path) {
+            path++;
+        }
+    }
+    return node;
+}
+
+int64_t snapshot_find_dir(manifest_snapshot_t *snapshot, char *path) {
+    int64_t node = snapshot_find(snapshot, path);
+    if (node == -1 || snapshot->types[node] != WALK_DIRECTORY) {
+        return -1;
+    }
+    return node;
+}
+
+void snapshot_node(manifest_snapshot_t *snapshot, uint32_t node, walk_node_t *walk_node) {
+    walk_node->name = snapshot->names + snapshot->name_offsets[node];
+    walk_node->type = (walk_type_t)snapshot->types[node];
+    walk_node->permission = snapshot->permissions[node];
+    walk_node->mtime_sec = snapshot->mtime_secs[node];
+    walk_node->mtime_nsec = snapshot->mtime_nsecs[node];
+    walk_node->size = snapshot->sizes[node];
+    walk_node->entries = NULL;
+    walk_node->entries_size = 0;
+    walk_node->names = NULL;
+    walk_node->hash = snapshot->hashes[node];
+}
+
+static void walk_snapshot_dir(manifest_snapshot_t *snapshot, uint32_t dir, walk_node_t *walk_node) {
+    uint32_t first = snapshot->first_children[dir];
+    walk_node->entries_size = snapshot->children_sizes[dir];
+    walk_node->entries = (walk_node_t *)malloc(sizeof(walk_node_t) * walk_node->entries_size);
+    for (uint32_t i = 0; i < walk_node->entries_size; i++) {
+        snapshot_node(snapshot, first + i, &walk_node->entries[i]);
+        if (snapshot->types[first + i] == WALK_DIRECTORY) {
+            walk_snapshot_dir(snapshot, first + i, &walk_node->entries[i]);
+        }
+    }
+}
+
+void snapshot_walk(manifest_snapshot_t *snapshot, uint32_t dir, char *name, walk_node_t *root) {
+    snapshot_node(snapshot, dir, root);
+    root->name = name;
+    walk_snapshot_dir(snapshot, dir, root);
+}
+
+// `path` is the path of `dir`, its buffer may be extended for sub-directories
+// `entries` is shared by all directories since they are only used while visiting
+// return 0 when success, -1 when walking is stopped
+static int stream_snapshot_dir(manifest_snapshot_t *snapshot, uint32_t dir, char **path, uint64_t *path_size,
+    walk_node_t **entries, uint64_t *entries_size, walk_visit_t visit, void *arg) {
+    uint32_t first = snapshot->first_children[dir];
+    uint32_t children_size = snapshot->children_sizes[dir];
+    if (children_size > *entries_size) {
+        *entries_size = children_size;
+        *entries = (walk_node_t *)realloc(*entries, sizeof(walk_node_t) * *entries_size);
+    }
+
+    walk_node_t walk_node;
+    snapshot_node(snapshot, dir, &walk_node);
+    walk_node.entries = *entries;
+    walk_node.entries_size = children_size;
+    for (uint32_t i = 0; i < children_size; i++) {
+        snapshot_node(snapshot, first + i, &walk_node.entries[i]);
+    }
+    if (visit(*path, &walk_node, arg) == -1) {
+        return -1;
+    }
+
+    // root is "." but its sub-directories don't start with "./"
+    uint64_t path_len = strcmp(*path, ".") ? strlen(*path) : 0;
+    int ret = 0;
+    for (uint32_t i = 0; ret == 0 && i < children_size; i++) {
+        if (snapshot->types[first + i] != WALK_DIRECTORY) {
+            continue;
+        }
+
+        char *name = snapshot->names + snapshot->name_offsets[first + i];
+        uint64_t sub_path_len = path_len + (path_len ? 1 : 0) + strlen(name);
+        if (sub_path_len + 1 > *path_size) {
+            while (sub_path_len + 1 > *path_size) {
+                *path_size <<= 1;
+            }
+            *path = (char *)realloc(*path, sizeof(char) * *path_size);
+        }
+        if (path_len) {
+            (*path)[path_len] = '/';
+        }
+        strcpy(*path + sub_path_len - strlen(name), name);
+
+        ret = stream_snapshot_dir(snapshot, first + i, path, path_size, entries, entries_size, visit, arg);
+        (*path)[path_len] = 0;
+    }
+    if (!path_len) {
+        strcpy(*path, ".");
+    }
+
+    return ret;
+}
+
+int snapshot_walk_stream(manifest_snapshot_t *snapshot, uint32_t dir, walk_visit_t visit, void *arg) {
+    uint64_t path_size = 256;
+    char *path = (char *)malloc(sizeof(char) * path_size);
+    strcpy(path, ".");
+
+    walk_node_t *entries = NULL;
+    uint64_t entries_size = 0;
+    int ret = stream_snapshot_dir(snapshot, dir, &path, &path_size, &entries, &entries_size, visit, arg);
+    free(entries);
+    free(path);
+
+    return ret;
+}
+
+#ifdef __linux__
+
+typedef enum {
+    // no watch
+    WATCH_FREE,
+    // directory is the same as in the snapshot
+    WATCH_CLEAN,
+    // entries or status of directory changed, it must be read again
+    WATCH_DIRTY,
+    // directory was moved or deleted, the watch may belong to another path now
+    WATCH_STALE
+} watch_state_t;
+
+typedef struct {
+    char *path;
+    watch_state_t state;
+    // the last build reaching the directory
+    uint64_t build_id;
+} watch_t;
+
+typedef enum {
+    CHANGE_CREATED,
+    CHANGE_MODIFIED,
+    CHANGE_DELETED
+} change_type_t;
+
+typedef struct {
+    // generation of the snapshot where the change appears first
+    uint64_t generation;
+    change_type_t type;
+    // relative to the root
+    char *path;
+} change_t;
+
+struct manifest_cache {
+    // protects `snapshot` and the journal
+    pthread_mutex_t mutex;
+    manifest_snapshot_t *snapshot;
+    uint64_t epoch;
+    uint64_t generation;
+    // ring buffer of the latest changes
+    change_t *journal;
+    uint64_t journal_size;
+    uint64_t journal_head;
+    uint64_t journal_len;
+    // changes up to this generation may have been dropped
+    uint64_t compacted_generation;
+
+    // following fields are only used by the watching thread
+    pthread_t thread;
+    int inotify_fd;
+    // indexed by watch descriptor
+    watch_t *watches;
+    int watches_size;
+    uint64_t build_id;
+    bool is_dirty;
+    bool is_overflowed;
+    struct timespec dirty_time;
+};
+
+// snapshot must not be swapped while forking, or the child may see a locked mutex
+static manifest_cache_t *fork_cache = NULL;
+
+static void lock_before_fork() {
+    pthread_mutex_lock(&fork_cache->mutex);
+}
+
+static void unlock_after_fork() {
+    pthread_mutex_unlock(&fork_cache->mutex);
+}
+
+// snapshot being built with capacities of its arrays
+typedef struct {
+    manifest_snapshot_t *snapshot;
+    uint32_t nodes_capacity;
+    uint64_t names_capacity;
+} builder_t;
+
+static void builder_init(builder_t *builder) {
+    uint32_t const INIT_NODES_CAPACITY = 1 << 10;
+    uint64_t const INIT_NAMES_CAPACITY = 1 << 14;
+
+    manifest_snapshot_t *snapshot = (manifest_snapshot_t *)calloc(1, sizeof(manifest_snapshot_t));
+    atomic_init(&snapshot->refs, 1);
+    builder->snapshot = snapshot;
+    builder->nodes_capacity = INIT_NODES_CAPACITY;
+    builder->names_capacity = INIT_NAMES_CAPACITY;
+
+    uint32_t capacity = builder->nodes_capacity;
+    snapshot->name_offsets = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+    snapshot->types = (uint8_t *)malloc(sizeof(uint8_t) * capacity);
+    snapshot->permissions = (uint16_t *)malloc(sizeof(uint16_t) * capacity);
+    snapshot->mtime_secs = (int64_t *)malloc(sizeof(int64_t) * capacity);
+    snapshot->mtime_nsecs = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    snapshot->sizes = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+    snapshot->first_children = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    snapshot->children_sizes = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+    snapshot->wds = (int *)malloc(sizeof(int) * capacity);
+    snapshot->hashes = (uint64_t *)malloc(sizeof(uint64_t) * capacity);
+    snapshot->names = (char *)malloc(sizeof(char) * builder->names_capacity);
+}
+
+// append a node with status of `walk_node`, return the node
+static uint32_t builder_append(builder_t *builder, walk_node_t *walk_node) {
+    manifest_snapshot_t *snapshot = builder->snapshot;
+
+    if (snapshot->nodes_size == builder->nodes_capacity) {
+        uint32_t capacity = builder->nodes_capacity <<= 1;
+        snapshot->name_offsets = (uint64_t *)realloc(snapshot->name_offsets, sizeof(uint64_t) * capacity);
+        snapshot->types = (uint8_t *)realloc(snapshot->types, sizeof(uint8_t) * capacity);
+        snapshot->permissions = (uint16_t *)realloc(snapshot->permissions, sizeof(uint16_t) * capacity);
+        snapshot->mtime_secs = (int64_t *)realloc(snapshot->mtime_secs, sizeof(int64_t) * capacity);
+        snapshot->mtime_nsecs = (uint32_t *)realloc(snapshot->mtime_nsecs, sizeof(uint32_t) * capacity);
+        snapshot->sizes = (uint64_t *)realloc(snapshot->sizes, sizeof(uint64_t) * capacity);
+        snapshot->first_children = (uint32_t *)realloc(snapshot->first_children, sizeof(uint32_t) * capacity);
+        snapshot->children_sizes = (uint32_t *)realloc(snapshot->children_sizes, sizeof(uint32_t) * capacity);
+        snapshot->wds = (int *)realloc(snapshot->wds, sizeof(int) * capacity);
+        snapshot->hashes = (uint64_t *)realloc(snapshot->hashes, sizeof(uint64_t) * capacity);
+    }
+
+    uint64_t name_len = strlen(walk_node->name);
+    if (snapshot->names_len + name_len + 1 > builder->names_capacity) {
+        while (snapshot->names_len + name_len + 1 > builder->names_capacity) {
+            builder->names_capacity <<= 1;
+        }
+        snapshot->names = (char *)realloc(snapshot->names, sizeof(char) * builder->names_capacity);
+    }
+
+    uint32_t node = snapshot->nodes_size++;
+    snapshot->name_offsets[node] = snapshot->names_len;
+    memcpy(snapshot->names + snapshot->names_len, walk_node->name, name_len + 1);
+    snapshot->names_len += name_len + 1;
+
+    snapshot->types[node] = (uint8_t)walk_node->type;
+    snapshot->permissions[node] = (uint16_t)walk_node->permission;
+    snapshot->mtime_secs[node] = walk_node->mtime_sec;
+    snapshot->mtime_nsecs[node] = walk_node->mtime_nsec;
+    snapshot->sizes[node] = walk_node->size;
+    snapshot->first_children[node] = 0;
+    snapshot->children_sizes[node] = 0;
+    snapshot->wds[node] = -1;
+    snapshot->hashes[node] = 0;
+
+    return node;
+}
+
+static void set_status(manifest_snapshot_t *snapshot, uint32_t node, walk_node_t *walk_node) {
+    snapshot->permissions[node] = (uint16_t)walk_node->permission;
+    snapshot->mtime_secs[node] = walk_node->mtime_sec;
+    snapshot->mtime_nsecs[node] = walk_node->mtime_nsec;
+    snapshot->sizes[node] = walk_node->size;
+}
+
+// return "{dir_path}/{name}", or `name` if `dir_path` is "."
+static char *join_path(char *dir_path, char *name) {
+    char *path;
+    if (strcmp(dir_path, ".")) {
+        path = (char *)malloc(sizeof(char) * (strlen(dir_path) + strlen(name) + 2));
+        sprintf(path, "%s/%s", dir_path, name);
+    }
+    else {
+        path = (char *)malloc(sizeof(char) * (strlen(name) + 1));
+        strcpy(path, name);
+    }
+    return path;
+}
+
+typedef struct {
+    change_t *changes;
+    uint64_t size;
+    uint64_t capacity;
+} change_list_t;
+
+static void append_change(change_list_t *list, change_type_t type, char *path) {
+    if (list->size == list->capacity) {
+        list->capacity = list->capacity ? list->capacity << 1 : 1 << 4;
+        list->changes = (change_t *)realloc(list->changes, sizeof(change_t) * list->capacity);
+    }
+    change_t *change = &list->changes[list->size++];
+    change->generation = 0;
+    change->type = type;
+    change->path = path;
+}
+
+static bool is_status_changed(manifest_snapshot_t *old, uint32_t node, walk_node_t *entry) {
+    // size of directory depends on file system, client only syncs its permission and mtime
+    return old->permissions[node] != entry->permission || old->mtime_secs[node] != entry->mtime_sec
+        || old->mtime_nsecs[node] != entry->mtime_nsec
+        || (entry->type != WALK_DIRECTORY && old->sizes[node] != entry->size);
+}
+
+// record differences between children of `old_dir` in `old` and entries of `dir`, which is read from disk
+// all entries are created if `old_dir` is -1
+static void diff_entries(change_list_t *changes, char *path, manifest_snapshot_t *old, int64_t old_dir, walk_node_t *dir) {
+    uint32_t old_first = old_dir == -1 ? 0 : old->first_children[old_dir];
+    uint32_t old_size = old_dir == -1 ? 0 : old->children_sizes[old_dir];
+
+    // both are sorted by name
+    uint32_t i = 0;
+    uint64_t j = 0;
+    while (i < old_size || j < dir->entries_size) {
+        char *old_name = i < old_size ? old->names + old->name_offsets[old_first + i] : NULL;
+        walk_node_t *entry = j < dir->entries_size ? &dir->entries[j] : NULL;
+        int cmp = !old_name ? 1 : !entry ? -1 : strcmp(old_name, entry->name);
+        if (cmp < 0) {
+            append_change(changes, CHANGE_DELETED, join_path(path, old_name));
+            i++;
+        }
+        else if (cmp > 0) {
+            append_change(changes, CHANGE_CREATED, join_path(path, entry->name));
+            j++;
+        }
+        else {
+            if (old->types[old_first + i] != entry->type) {
+                append_change(changes, CHANGE_DELETED, join_path(path, old_name));
+                append_change(changes, CHANGE_CREATED, join_path(path, entry->name));
+            }
+            else if (is_status_changed(old, old_first + i, entry)) {
+                append_change(changes, CHANGE_MODIFIED, join_path(path, entry->name));
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+// set merkle hashes of all directories
+static void hash_snapshot(manifest_snapshot_t *snapshot) {
+    // children are always appended after their parent
+    for (uint32_t node = snapshot->nodes_size; node-- > 0; ) {
+        if (snapshot->types[node] != WALK_DIRECTORY) {
+            continue;
+        }
+
+        uint64_t hash = HASH_INIT;
+        uint32_t first = snapshot->first_children[node];
+        for (uint32_t i = 0; i < snapshot->children_sizes[node]; i++) {
+            walk_node_t entry;
+            snapshot_node(snapshot, first + i, &entry);
+            hash = walk_hash_entry(hash, &entry);
+        }
+        snapshot->hashes[node] = hash;
+    }
+}
+
+// a directory whose children are not built yet
+typedef struct {
+    uint32_t node;
+    // the same directory in the old snapshot, -1 if none
+    int64_t old_node;
+    char *path;
+} pending_dir_t;
+
+// watch directory `path` and return its watch descriptor, -1 when error
+static int add_watch(manifest_cache_t *cache, char *path) {
+    uint32_t const MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO
+        | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    int wd = inotify_add_watch(cache->inotify_fd, path, MASK);
+    if (wd == -1) {
+        return -1;
+    }
+
+    if (wd >= cache->watches_size) {
+        int watches_size = cache->watches_size;
+        while (wd >= cache->watches_size) {
+            cache->watches_size <<= 1;
+        }
+        cache->watches = (watch_t *)realloc(cache->watches, sizeof(watch_t) * cache->watches_size);
+        memset(cache->watches + watches_size, 0, sizeof(watch_t) * (cache->watches_size - watches_size));
+    }
+
+    // a moved directory keeps its watch descriptor
+    watch_t *watch = &cache->watches[wd];
+    free(watch->path);
+    watch->path = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    strcpy(watch->path, path);
+    watch->state = WATCH_CLEAN;
+    watch->build_id = cache->build_id;
+
+    return wd;
+}
+
+// build a new snapshot, directories which aren't changed since `old` are copied from it
+// `old` is NULL for a full scan, otherwise changes since `old` are appended to `changes`
+// `*read_size` is set to the number of directories read from disk
+// return NULL when a directory can't be watched
+static manifest_snapshot_t *build(manifest_cache_t *cache, manifest_snapshot_t *old, change_list_t *changes,
+    uint64_t *read_size) {
+    cache->build_id++;
+    *read_size = 0;
+
+    builder_t builder;
+    builder_init(&builder);
+    manifest_snapshot_t *snapshot = builder.snapshot;
+
+    walk_node_t root;
+    memset(&root, 0, sizeof(walk_node_t));
+    root.name = ".";
+    root.type = WALK_DIRECTORY;
+    if (old) {
+        snapshot_node(old, 0, &root);
+    }
+    builder_append(&builder, &root);
+
+    uint64_t stack_size = 1 << 6;
+    pending_dir_t *stack = (pending_dir_t *)malloc(sizeof(pending_dir_t) * stack_size);
+    uint64_t stack_len = 0;
+    stack[stack_len].node = 0;
+    stack[stack_len].old_node = old ? 0 : -1;
+    stack[stack_len].path = (char *)malloc(sizeof(char) * 2);
+    strcpy(stack[stack_len].path, ".");
+    stack_len++;
+
+    bool is_broken = false;
+    while (stack_len > 0) {
+        pending_dir_t dir = stack[--stack_len];
+
+        // children of a directory are appended together to keep them contiguous
+        snapshot->first_children[dir.node] = snapshot->nodes_size;
+
+        int old_wd = dir.old_node == -1 ? -1 : old->wds[dir.old_node];
+        walk_node_t walk_dir;
+        memset(&walk_dir, 0, sizeof(walk_node_t));
+        if (old_wd != -1 && cache->watches[old_wd].state == WATCH_CLEAN) {
+            // unchanged, copy from old snapshot
+            snapshot->wds[dir.node] = old_wd;
+            cache->watches[old_wd].build_id = cache->build_id;
+
+            uint32_t first = old->first_children[dir.old_node];
+            walk_dir.entries_size = old->children_sizes[dir.old_node];
+            walk_dir.entries = (walk_node_t *)malloc(sizeof(walk_node_t) * walk_dir.entries_size);
+            for (uint64_t i = 0; i < walk_dir.entries_size; i++) {
+                snapshot_node(old, first + i, &walk_dir.entries[i]);
+            }
+        }
+        else {
+            // watch before reading, so no change is missed
+            int wd = add_watch(cache, dir.path);
+            if (wd == -1 && (errno == ENOSPC || errno == ENOMEM)) {
+                ERROR("watch directory %s failed", dir.path);
+                free(dir.path);
+                is_broken = true;
+                break;
+            }
+            snapshot->wds[dir.node] = wd;
+
+            // a directory which can't be watched is read again whenever its parent changes
+            int dir_fd = wd == -1 ? -1 : open(dir.path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            if (dir_fd == -1) {
+                // like walk_stream(), the directory is still listed
+                ERROR("open directory %s failed", dir.path);
+            }
+            else {
+                walk_dir.name = snapshot->names + snapshot->name_offsets[dir.node];
+                if (walk_entries(dir_fd, &walk_dir) == -1) {
+                    ERROR("read directory %s failed", dir.path);
+                }
+                else {
+                    set_status(snapshot, dir.node, &walk_dir);
+                    // its parent may not be read again, e.g. when only its entries change, so its own status is
+                    // compared here, root has no parent record to carry it
+                    if (old && dir.old_node > 0 && is_status_changed(old, (uint32_t)dir.old_node, &walk_dir)) {
+                        char *path = (char *)malloc(sizeof(char) * (strlen(dir.path) + 1));
+                        strcpy(path, dir.path);
+                        append_change(changes, CHANGE_MODIFIED, path);
+                    }
+                }
+                close(dir_fd);
+                (*read_size)++;
+            }
+
+            if (old) {
+                diff_entries(changes, dir.path, old, dir.old_node, &walk_dir);
+            }
+        }
+
+        for (uint64_t i = 0; i < walk_dir.entries_size; i++) {
+            walk_node_t *entry = &walk_dir.entries[i];
+            uint32_t node = builder_append(&builder, entry);
+            if (entry->type != WALK_DIRECTORY) {
+                continue;
+            }
+
+            if (stack_len == stack_size) {
+                stack_size <<= 1;
+                stack = (pending_dir_t *)realloc(stack, sizeof(pending_dir_t) * stack_size);
+            }
+            pending_dir_t *sub_dir = &stack[stack_len++];
+            sub_dir->node = node;
+            sub_dir->old_node = dir.old_node == -1 ? -1 : find_child(old, (uint32_t)dir.old_node, entry->name, strlen(entry->name));
+            if (sub_dir->old_node != -1 && old->types[sub_dir->old_node] != WALK_DIRECTORY) {
+                sub_dir->old_node = -1;
+            }
+            sub_dir->path = join_path(dir.path, entry->name);
+        }
+        snapshot->children_sizes[dir.node] = (uint32_t)walk_dir.entries_size;
+
+        // entries copied from old snapshot don't own their names
+        if (walk_dir.names) {
+            walk_node_kill(&walk_dir);
+        }
+        else {
+            free(walk_dir.entries);
+        }
+        free(dir.path);
+    }
+
+    for (uint64_t i = 0; i < stack_len; i++) {
+        free(stack[i].path);
+    }
+    free(stack);
+
+    if (is_broken) {
+        snapshot_release(snapshot);
+        return NULL;
+    }
+    hash_snapshot(snapshot);
+
+    // directories not reached anymore are moved out or deleted
+    for (int wd = 0; wd < cache->watches_size; wd++) {
+        watch_t *watch = &cache->watches[wd];
+        if (watch->state != WATCH_FREE && watch->build_id != cache->build_id) {
+            inotify_rm_watch(cache->inotify_fd, wd);
+            free(watch->path);
+            watch->path = NULL;
+            watch->state = WATCH_FREE;
+        }
+    }
+
+    return snapshot;
+}
+
+// drop all watches and watch again from a new inotify instance
+// return 0 when success, -1 when error
+static int reset_watches(manifest_cache_t *cache) {
+    int const INIT_WATCHES_SIZE = 1 << 6;
+
+    if (cache->inotify_fd != -1) {
+        close(cache->inotify_fd);
+    }
+    for (int i = 0; i < cache->watches_size; i++) {
+        free(cache->watches[i].path);
+    }
+    free(cache->watches);
+
+    cache->watches_size = INIT_WATCHES_SIZE;
+    cache->watches = (watch_t *)calloc(cache->watches_size, sizeof(watch_t));
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd == -1) {
+        ERROR("inotify_init1");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void drop_oldest_change(manifest_cache_t *cache) {
+    change_t *change = &cache->journal[cache->journal_head];
+    if (change->generation > cache->compacted_generation) {
+        cache->compacted_generation = change->generation;
+    }
+    free(change->path);
+    cache->journal_head = (cache->journal_head + 1) % cache->journal_size;
+    cache->journal_len--;
+}
+
+// replace the published snapshot with a new generation, NULL disables the cache
+// `changes` are moved into the journal, the journal is dropped if they are unknown (NULL)
+static void publish(manifest_cache_t *cache, manifest_snapshot_t *snapshot, change_list_t *changes) {
+    pthread_mutex_lock(&cache->mutex);
+    cache->generation++;
+    if (snapshot) {
+        snapshot->epoch = cache->epoch;
+        snapshot->generation = cache->generation;
+    }
+
+    if (changes) {
+        for (uint64_t i = 0; i < changes->size; i++) {
+            if (cache->journal_len == cache->journal_size) {
+                drop_oldest_change(cache);
+            }
+            change_t *change = &cache->journal[(cache->journal_head + cache->journal_len) % cache->journal_size];
+            *change = changes->changes[i];
+            change->generation = cache->generation;
+            cache->journal_len++;
+        }
+        changes->size = 0;
+    }
+    else {
+        while (cache->journal_len > 0) {
+            drop_oldest_change(cache);
+        }
+        cache->compacted_generation = cache->generation;
+    }
+
+    manifest_snapshot_t *old = cache->snapshot;
+    cache->snapshot = snapshot;
+    pthread_mutex_unlock(&cache->mutex);
+
+    if (old) {
+        snapshot_release(old);
+    }
+}
+
+static void handle_event(manifest_cache_t *cache, struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        cache->is_overflowed = true;
+    }
+    else {
+        if (event->wd < 0 || event->wd >= cache->watches_size) {
+            return;
+        }
+
+        watch_t *watch = &cache->watches[event->wd];
+        if (watch->state == WATCH_FREE) {
+            return;
+        }
+
+        if (event->mask & IN_IGNORED) {
+            free(watch->path);
+            watch->path = NULL;
+            watch->state = WATCH_FREE;
+        }
+        else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            // its parent is notified as well
+            watch->state = WATCH_STALE;
+        }
+        else if (watch->state == WATCH_CLEAN) {
+            watch->state = WATCH_DIRTY;
+        }
+        else {
+            return;
+        }
+    }
+
+    if (!cache->is_dirty) {
+        cache->is_dirty = true;
+        clock_gettime(CLOCK_MONOTONIC, &cache->dirty_time);
+    }
+}
+
+static int64_t elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// rebuild snapshot a while after the first change, so a burst of changes is handled once
+static void *watch(void *arg) {
+    int const REBUILD_DELAY_MS = 200;
+    size_t const EVENTS_BUF_SIZE = 1 << 16;
+
+    manifest_cache_t *cache = (manifest_cache_t *)arg;
+    char *buf = (char *)malloc(sizeof(char) * EVENTS_BUF_SIZE);
+    change_list_t changes = { 0 };
+
+    while (1) {
+        int timeout = -1;
+        if (cache->is_dirty) {
+            int64_t elapsed = elapsed_ms(&cache->dirty_time);
+            timeout = elapsed >= REBUILD_DELAY_MS ? 0 : (int)(REBUILD_DELAY_MS - elapsed);
+        }
+
+        struct pollfd pfd = { .fd = cache->inotify_fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, timeout);
+        if (ret == -1 && errno != EINTR) {
+            ERROR("poll");
+            break;
+        }
+
+        if (ret > 0) {
+            ssize_t len;
+            while ((len = read(cache->inotify_fd, buf, EVENTS_BUF_SIZE)) > 0) {
+                for (char *p = buf; p < buf + len; ) {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    handle_event(cache, event);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (len == -1 && errno != EAGAIN) {
+                ERROR("read inotify events failed");
+                break;
+            }
+            errno = 0;
+        }
+
+        if (!cache->is_dirty || elapsed_ms(&cache->dirty_time) < REBUILD_DELAY_MS) {
+            continue;
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t read_size;
+        manifest_snapshot_t *snapshot;
+        if (cache->is_overflowed) {
+            // changes are lost, start over
+            WARN("inotify queue overflowed, rescan the whole tree");
+            if (reset_watches(cache) == -1) {
+                break;
+            }
+            snapshot = build(cache, NULL, NULL, &read_size);
+        }
+        else {
+            // nothing else touches `cache->snapshot`, so it's safe to read without lock
+            snapshot = build(cache, cache->snapshot, &changes, &read_size);
+        }
+        if (!snapshot) {
+            break;
+        }
+        uint64_t changes_size = changes.size;
+        publish(cache, snapshot, cache->is_overflowed ? NULL : &changes);
+        cache->is_dirty = false;
+        cache->is_overflowed = false;
+        INFO("rebuilt manifest cache (generation %" PRIu64 ", %" PRIu32 " nodes, %" PRIu64 " changes, %" PRIu64 " directories read, %" PRId64 " ms)",
+            snapshot->generation, snapshot->nodes_size, changes_size, read_size, elapsed_ms(&start));
+    }
+
+    // serving stale manifest is worse than walking
+    ERROR("manifest cache is disabled");
+    publish(cache, NULL, NULL);
+    for (uint64_t i = 0; i < changes.size; i++) {
+        free(changes.changes[i].path);
+    }
+    free(changes.changes);
+    free(buf);
+
+    return NULL;
+}
+
+manifest_cache_t *cache_init(uint64_t journal_size) {
+    manifest_cache_t *cache = (manifest_cache_t *)calloc(1, sizeof(manifest_cache_t));
+    pthread_mutex_init(&cache->mutex, NULL);
+    cache->inotify_fd = -1;
+    cache->journal_size = journal_size;
+    cache->journal = (change_t *)malloc(sizeof(change_t) * journal_size);
+    // generations of different processes must not be mixed up
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache->epoch = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    if (reset_watches(cache) == -1) {
+        goto fail;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t read_size;
+    manifest_snapshot_t *snapshot = build(cache, NULL, NULL, &read_size);
+    if (!snapshot) {
+        goto fail;
+    }
+    publish(cache, snapshot, NULL);
+    INFO("built manifest cache (epoch %" PRIu64 ", %" PRIu32 " nodes, %" PRIu64 " directories read, %" PRId64 " ms)",
+        cache->epoch, snapshot->nodes_size, read_size, elapsed_ms(&start));
+
+    if (pthread_create(&cache->thread, NULL, watch, cache) != 0) {
+        ERROR("create manifest cache thread failed");
+        goto fail;
+    }
+
+    // the cache is never freed once it's running
+    fork_cache = cache;
+    pthread_atfork(lock_before_fork, unlock_after_fork, unlock_after_fork);
+
+    return cache;
+
+fail:
+    if (cache->snapshot) {
+        snapshot_release(cache->snapshot);
+    }
+    if (cache->inotify_fd != -1) {
+        close(cache->inotify_fd);
+    }
+    for (int i = 0; i < cache->watches_size; i++) {
+        free(cache->watches[i].path);
+    }
+    free(cache->watches);
+    free(cache->journal);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+    return NULL;
+}
+
+manifest_snapshot_t *cache_acquire(manifest_cache_t *cache) {
+    pthread_mutex_lock(&cache->mutex);
+    manifest_snapshot_t *snapshot = cache->snapshot;
+    if (snapshot) {
+        atomic_fetch_add(&snapshot->refs, 1);
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return snapshot;
+}
+
+// return number of '/' in `path`
+static int depth(char const *path) {
+    int count = 0;
+    for (; *path; path++) {
+        count += *path == '/';
+    }
+    return count;
+}
+
+static int compare_path(void const *a, void const *b) {
+    char const *path_a = *(char * const *)a;
+    char const *path_b = *(char * const *)b;
+    int depth_a = depth(path_a);
+    int depth_b = depth(path_b);
+    if (depth_a != depth_b) {
+        return depth_a < depth_b ? -1 : 1;
+    }
+    return strcmp(path_a, path_b);
+}
+
+int cache_acquire_changes(manifest_cache_t *cache, char *path, uint64_t epoch, uint64_t generation,
+    manifest_snapshot_t **snapshot, char ***paths, uint64_t *paths_size) {
+    *paths = NULL;
+    *paths_size = 0;
+
+    // journal paths have no "." or empty components
+    char *prefix = (char *)malloc(sizeof(char) * (strlen(path) + 1));
+    uint64_t prefix_len = 0;
+    while (*path) {
+        uint64_t len = strcspn(path, "/");
+        if (len && !(len == 1 && path[0] == '.')) {
+            if (prefix_len) {
+                prefix[prefix_len++] = '/';
+            }
+            memcpy(prefix + prefix_len, path, len);
+            prefix_len += len;
+        }
+        path += len;
+        if (*path) {
+            path++;
+        }
+    }
+    prefix[prefix_len] = 0;
+
+    pthread_mutex_lock(&cache->mutex);
+    *snapshot = cache->snapshot;
+    if (*snapshot) {
+        atomic_fetch_add(&(*snapshot)->refs, 1);
+    }
+    if (!*snapshot || epoch != cache->epoch || generation < cache->compacted_generation
+        || generation > cache->generation) {
+        pthread_mutex_unlock(&cache->mutex);
+        free(prefix);
+        return -1;
+    }
+
+    uint64_t capacity = 0;
+    for (uint64_t i = cache->journal_len; i > 0; i--) {
+        change_t *change = &cache->journal[(cache->journal_head + i - 1) % cache->journal_size];
+        if (change->generation <= generation) {
+            break;
+        }
+
+        char *relative_path = change->path;
+        if (prefix_len) {
+            if (strncmp(change->path, prefix, prefix_len) || change->path[prefix_len] != '/') {
+                continue;
+            }
+            relative_path += prefix_len + 1;
+        }
+
+        if (*paths_size == capacity) {
+            capacity = capacity ? capacity << 1 : 1 << 4;
+            *paths = (char **)realloc(*paths, sizeof(char *) * capacity);
+        }
+        (*paths)[*paths_size] = (char *)malloc(sizeof(char) * (strlen(relative_path) + 1));
+        strcpy((*paths)[*paths_size], relative_path);
+        (*paths_size)++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    free(prefix);
+
+    // a path may be changed many times
+    qsort(*paths, *paths_size, sizeof(char *), compare_path);
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < *paths_size; i++) {
+        if (size && !strcmp((*paths)[size - 1], (*paths)[i])) {
+            free((*paths)[i]);
+            continue;
+        }
+        (*paths)[size++] = (*paths)[i];
+    }
+    *paths_size = size;
+
+    return 0;
+}
+
+#else
+
+manifest_cache_t *cache_init(uint64_t journal_size) {
+    ERROR("manifest cache is only supported on Linux");
+    return NULL;
+}
+
+manifest_snapshot_t *cache_acquire(manifest_cache_t *cache) {
+    return NULL;
+}
+
+int cache_acquire_changes(manifest_cache_t *cache, char *path, uint64_t epoch, uint64_t generation,
+    manifest_snapshot_t **snapshot, char ***paths, uint64_t *paths_size) {
+    *snapshot = NULL;
+    return -1;
+}
+
+#endif
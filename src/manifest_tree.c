@@ -0,0 +1,506 @@
+#include "manifest_tree.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "utils.h"
+
+// nesting deeper than any path can have is malformed
+#define MAX_DEPTH (PATH_MAX / 2)
+// long enough for any number in a manifest
+#define MAX_NUMBER_LEN 64
+#define MIN_INTERNED_CAPACITY (1 << 10)
+
+typedef enum {
+    KEY_OTHER,
+    KEY_NAME,
+    KEY_TYPE,
+    KEY_PERMISSION,
+    KEY_UPDATE_TIME,
+    KEY_ENTRIES
+} manifest_key_t;
+
+typedef struct {
+    char const *p;
+    char const *end;
+    manifest_tree_t *tree;
+    // nodes whose siblings aren't all parsed, which are moved to the tree when their array ends
+    manifest_node_t *pending;
+    uint64_t pending_size;
+    uint64_t pending_capacity;
+    // open addressing of interned name offset + 1, 0 is empty, at most half full
+    uint64_t *interned;
+    uint64_t interned_size;
+    uint64_t interned_capacity;
+    // the last parsed string
+    char *str;
+    uint64_t str_len;
+    uint64_t str_capacity;
+} parser_t;
+
+static void skip_space(parser_t *parser) {
+    while (parser->p < parser->end
+        && (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n' || *parser->p == '\r')) {
+        parser->p++;
+    }
+}
+
+// skip spaces and consume `c`
+// return 0 when success, -1 when the next character isn't `c`
+static int expect(parser_t *parser, char c) {
+    skip_space(parser);
+    if (parser->p == parser->end || *parser->p != c) {
+        return -1;
+    }
+    parser->p++;
+    return 0;
+}
+
+// skip spaces and consume `c` if it's the next character
+static bool accept(parser_t *parser, char c) {
+    skip_space(parser);
+    if (parser->p < parser->end && *parser->p == c) {
+        parser->p++;
+        return true;
+    }
+    return false;
+}
+
+static void append_str(parser_t *parser, char const *data, uint64_t len) {
+    if (parser->str_len + len + 1 > parser->str_capacity) {
+        while (parser->str_len + len + 1 > parser->str_capacity) {
+            parser->str_capacity = parser->str_capacity ? parser->str_capacity << 1 : 64;
+        }
+        parser->str = (char *)realloc(parser->str, sizeof(char) * parser->str_capacity);
+    }
+    memcpy(parser->str + parser->str_len, data, len);
+    parser->str_len += len;
+    parser->str[parser->str_len] = 0;
+}
+
+// return 0 when success, -1 when they aren't 4 hex digits
+static int read_hex4(parser_t *parser, uint32_t *code) {
+    if (parser->end - parser->p < 4) {
+        return -1;
+    }
+    *code = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = *parser->p++;
+        *code <<= 4;
+        if (c >= '0' && c <= '9') {
+            *code |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            *code |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F') {
+            *code |= c - 'A' + 10;
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void append_utf8(parser_t *parser, uint32_t code) {
+    char bytes[4];
+    int len;
+    if (code < 0x80) {
+        bytes[0] = code;
+        len = 1;
+    }
+    else if (code < 0x800) {
+        bytes[0] = 0xc0 | code >> 6;
+        bytes[1] = 0x80 | (code & 0x3f);
+        len = 2;
+    }
+    else if (code < 0x10000) {
+        bytes[0] = 0xe0 | code >> 12;
+        bytes[1] = 0x80 | (code >> 6 & 0x3f);
+        bytes[2] = 0x80 | (code & 0x3f);
+        len = 3;
+    }
+    else {
+        bytes[0] = 0xf0 | code >> 18;
+        bytes[1] = 0x80 | (code >> 12 & 0x3f);
+        bytes[2] = 0x80 | (code >> 6 & 0x3f);
+        bytes[3] = 0x80 | (code & 0x3f);
+        len = 4;
+    }
+    append_str(parser, bytes, len);
+}
+
+// parse a string into `parser->str`, which can't have '\0'
+// return 0 when success, -1 when it's malformed
+static int parse_string(parser_t *parser) {
+    if (expect(parser, '"') == -1) {
+        return -1;
+    }
+    parser->str_len = 0;
+    append_str(parser, "", 0);
+    while (parser->p < parser->end) {
+        // characters which aren't escaped are copied at once
+        char const *start = parser->p;
+        while (parser->p < parser->end && *parser->p != '"' && *parser->p != '\\') {
+            parser->p++;
+        }
+        append_str(parser, start, parser->p - start);
+        if (parser->p == parser->end) {
+            return -1;
+        }
+        if (*parser->p++ == '"') {
+            return 0;
+        }
+        if (parser->p == parser->end) {
+            return -1;
+        }
+
+        char c = *parser->p++;
+        uint32_t code;
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                append_str(parser, &c, 1);
+                break;
+            case 'b':
+                append_str(parser, "\b", 1);
+                break;
+            case 'f':
+                append_str(parser, "\f", 1);
+                break;
+            case 'n':
+                append_str(parser, "\n", 1);
+                break;
+            case 'r':
+                append_str(parser, "\r", 1);
+                break;
+            case 't':
+                append_str(parser, "\t", 1);
+                break;
+            case 'u':
+                if (read_hex4(parser, &code) == -1 || !code) {
+                    return -1;
+                }
+                // a code point above U+FFFF is a surrogate pair
+                if (code >= 0xd800 && code < 0xdc00) {
+                    uint32_t low;
+                    if (parser->end - parser->p < 2 || parser->p[0] != '\\' || parser->p[1] != 'u') {
+                        return -1;
+                    }
+                    parser->p += 2;
+                    if (read_hex4(parser, &low) == -1 || low < 0xdc00 || low >= 0xe000) {
+                        return -1;
+                    }
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                append_utf8(parser, code);
+                break;
+            default:
+                return -1;
+        }
+    }
+    return -1;
+}
+
+static bool is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+
+// return 0 when success, -1 when it's malformed
+static int parse_number(parser_t *parser, double *value) {
+    skip_space(parser);
+    // `data` may not be terminated, so the number is copied for strtod
+    char number[MAX_NUMBER_LEN + 1];
+    uint64_t len = 0;
+    while (parser->p + len < parser->end && len < MAX_NUMBER_LEN && is_number_char(parser->p[len])) {
+        len++;
+    }
+    memcpy(number, parser->p, len);
+    number[len] = 0;
+    char *number_end;
+    *value = strtod(number, &number_end);
+    if (!len || number_end != number + len) {
+        return -1;
+    }
+    parser->p += len;
+    return 0;
+}
+
+// return 0 when success, -1 when it's malformed
+static int skip_value(parser_t *parser, int depth) {
+    skip_space(parser);
+    if (depth > MAX_DEPTH || parser->p == parser->end) {
+        return -1;
+    }
+
+    if (*parser->p == '"') {
+        return parse_string(parser);
+    }
+    if (*parser->p == '{') {
+        parser->p++;
+        if (accept(parser, '}')) {
+            return 0;
+        }
+        do {
+            if (parse_string(parser) == -1 || expect(parser, ':') == -1 || skip_value(parser, depth + 1) == -1) {
+                return -1;
+            }
+        } while (accept(parser, ','));
+        return expect(parser, '}');
+    }
+    if (*parser->p == '[') {
+        parser->p++;
+        if (accept(parser, ']')) {
+            return 0;
+        }
+        do {
+            if (skip_value(parser, depth + 1) == -1) {
+                return -1;
+            }
+        } while (accept(parser, ','));
+        return expect(parser, ']');
+    }
+
+    char const *literals[] = { "true", "false", "null" };
+    for (int i = 0; i < 3; i++) {
+        uint64_t len = strlen(literals[i]);
+        if ((uint64_t)(parser->end - parser->p) >= len && !memcmp(parser->p, literals[i], len)) {
+            parser->p += len;
+            return 0;
+        }
+    }
+    double value;
+    return parse_number(parser, &value);
+}
+
+static uint64_t interned_slot(parser_t *parser, char const *name, uint64_t len) {
+    uint64_t mask = parser->interned_capacity - 1;
+    uint64_t i = hash_bytes(HASH_INIT, name, len) & mask;
+    while (parser->interned[i] && strcmp(parser->tree->names + parser->interned[i] - 1, name)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// add `parser->str` to names if it isn't there
+// return its offset
+static uint64_t intern(parser_t *parser) {
+    manifest_tree_t *tree = parser->tree;
+    if (!parser->str_len) {
+        return 0;
+    }
+
+    if ((parser->interned_size + 1) * 2 > parser->interned_capacity) {
+        uint64_t *old = parser->interned;
+        uint64_t old_capacity = parser->interned_capacity;
+        parser->interned_capacity <<= 1;
+        parser->interned = (uint64_t *)calloc(parser->interned_capacity, sizeof(uint64_t));
+        for (uint64_t i = 0; i < old_capacity; i++) {
+            if (old[i]) {
+                char *name = tree->names + old[i] - 1;
+                parser->interned[interned_slot(parser, name, strlen(name))] = old[i];
+            }
+        }
+        free(old);
+    }
+
+    uint64_t i = interned_slot(parser, parser->str, parser->str_len);
+    if (parser->interned[i]) {
+        return parser->interned[i] - 1;
+    }
+    if (tree->names_len + parser->str_len + 1 > tree->names_capacity) {
+        while (tree->names_len + parser->str_len + 1 > tree->names_capacity) {
+            tree->names_capacity <<= 1;
+        }
+        tree->names = (char *)realloc(tree->names, sizeof(char) * tree->names_capacity);
+    }
+    uint64_t offset = tree->names_len;
+    memcpy(tree->names + offset, parser->str, parser->str_len + 1);
+    tree->names_len += parser->str_len + 1;
+    parser->interned[i] = offset + 1;
+    parser->interned_size++;
+    return offset;
+}
+
+static void push_pending(parser_t *parser, manifest_node_t *node) {
+    if (parser->pending_size == parser->pending_capacity) {
+        parser->pending_capacity = parser->pending_capacity ? parser->pending_capacity << 1 : 64;
+        parser->pending = (manifest_node_t *)realloc(parser->pending,
+            sizeof(manifest_node_t) * parser->pending_capacity);
+    }
+    parser->pending[parser->pending_size++] = *node;
+}
+
+// move pending nodes from `base` to the tree as entries of `parent`
+static void move_entries(parser_t *parser, uint64_t base, manifest_node_t *parent) {
+    manifest_tree_t *tree = parser->tree;
+    uint64_t size = parser->pending_size - base;
+    if (tree->nodes_size + size > tree->nodes_capacity) {
+        while (tree->nodes_size + size > tree->nodes_capacity) {
+            tree->nodes_capacity = tree->nodes_capacity ? tree->nodes_capacity << 1 : 64;
+        }
+        tree->nodes = (manifest_node_t *)realloc(tree->nodes, sizeof(manifest_node_t) * tree->nodes_capacity);
+    }
+    if (size) {
+        memcpy(tree->nodes + tree->nodes_size, parser->pending + base, sizeof(manifest_node_t) * size);
+    }
+    parent->entries = tree->nodes_size;
+    parent->entries_size = size;
+    tree->nodes_size += size;
+    parser->pending_size = base;
+}
+
+static manifest_key_t to_key(char *str) {
+    if (!strcmp(str, "name") || !strcmp(str, "path")) {
+        return KEY_NAME;
+    }
+    if (!strcmp(str, "type")) {
+        return KEY_TYPE;
+    }
+    if (!strcmp(str, "permission")) {
+        return KEY_PERMISSION;
+    }
+    if (!strcmp(str, "updateTime")) {
+        return KEY_UPDATE_TIME;
+    }
+    if (!strcmp(str, "entries")) {
+        return KEY_ENTRIES;
+    }
+    return KEY_OTHER;
+}
+
+static int parse_entries(parser_t *parser, manifest_node_t *parent, int depth);
+
+// return 0 when success, -1 when it's malformed
+static int parse_node(parser_t *parser, manifest_node_t *node, int depth) {
+    memset(node, 0, sizeof(manifest_node_t));
+    if (depth > MAX_DEPTH || expect(parser, '{') == -1) {
+        return -1;
+    }
+    if (accept(parser, '}')) {
+        return 0;
+    }
+
+    do {
+        if (parse_string(parser) == -1 || expect(parser, ':') == -1) {
+            return -1;
+        }
+        double value;
+        int ret = 0;
+        switch (to_key(parser->str)) {
+            case KEY_NAME:
+                ret = parse_string(parser);
+                // name of an entry must be a single path component
+                if (ret == 0 && depth > 0 && (parser->str_len == 0 || strchr(parser->str, '/')
+                    || !strcmp(parser->str, ".") || !strcmp(parser->str, ".."))) {
+                    ret = -1;
+                }
+                if (ret == 0) {
+                    node->name = intern(parser);
+                }
+                break;
+            case KEY_TYPE:
+                if ((ret = parse_string(parser)) == 0) {
+                    node->type = !strcmp(parser->str, "file") ? MANIFEST_FILE
+                        : !strcmp(parser->str, "directory") ? MANIFEST_DIRECTORY : MANIFEST_UNKNOWN;
+                }
+                break;
+            case KEY_PERMISSION:
+                if ((ret = parse_number(parser, &value)) == 0) {
+                    node->permission = (mode_t)value;
+                }
+                break;
+            case KEY_UPDATE_TIME:
+                if ((ret = parse_number(parser, &value)) == 0) {
+                    node->mtime_sec = (int64_t)value;
+                }
+                break;
+            case KEY_ENTRIES:
+                ret = parse_entries(parser, node, depth + 1);
+                break;
+            default:
+                ret = skip_value(parser, depth + 1);
+        }
+        if (ret == -1) {
+            return -1;
+        }
+    } while (accept(parser, ','));
+    return expect(parser, '}');
+}
+
+// entries of `parent` are placed after entries of their sub-directories, so siblings are adjacent
+// return 0 when success, -1 when it's malformed
+static int parse_entries(parser_t *parser, manifest_node_t *parent, int depth) {
+    if (expect(parser, '[') == -1) {
+        return -1;
+    }
+    uint64_t base = parser->pending_size;
+    if (!accept(parser, ']')) {
+        do {
+            manifest_node_t node;
+            if (parse_node(parser, &node, depth) == -1) {
+                return -1;
+            }
+            push_pending(parser, &node);
+        } while (accept(parser, ','));
+        if (expect(parser, ']') == -1) {
+            return -1;
+        }
+    }
+    move_entries(parser, base, parent);
+    return 0;
+}
+
+int manifest_tree_parse(manifest_tree_t *tree, char const *data, uint64_t len) {
+    memset(tree, 0, sizeof(manifest_tree_t));
+    tree->names_capacity = 1 << 10;
+    tree->names = (char *)malloc(sizeof(char) * tree->names_capacity);
+    tree->names[0] = 0;
+    tree->names_len = 1;
+
+    parser_t parser;
+    memset(&parser, 0, sizeof(parser_t));
+    parser.p = data;
+    parser.end = data + len;
+    parser.tree = tree;
+    parser.interned_capacity = MIN_INTERNED_CAPACITY;
+    parser.interned = (uint64_t *)calloc(parser.interned_capacity, sizeof(uint64_t));
+
+    // a frame is an array of records, otherwise there's one root
+    manifest_node_t top;
+    memset(&top, 0, sizeof(manifest_node_t));
+    skip_space(&parser);
+    int ret;
+    if (parser.p < parser.end && *parser.p == '[') {
+        ret = parse_entries(&parser, &top, 0);
+    }
+    else {
+        manifest_node_t root;
+        ret = parse_node(&parser, &root, 0);
+        if (ret == 0) {
+            push_pending(&parser, &root);
+            move_entries(&parser, 0, &top);
+        }
+    }
+    skip_space(&parser);
+    if (ret == 0 && parser.p != parser.end) {
+        ret = -1;
+    }
+    tree->roots = top.entries;
+    tree->roots_size = top.entries_size;
+
+    free(parser.pending);
+    free(parser.interned);
+    free(parser.str);
+    if (ret == -1) {
+        manifest_tree_kill(tree);
+    }
+    return ret;
+}
+
+void manifest_tree_kill(manifest_tree_t *tree) {
+    free(tree->nodes);
+    free(tree->names);
+    memset(tree, 0, sizeof(manifest_tree_t));
+}
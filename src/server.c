@@ -1,23 +1,143 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// for splice
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#endif
 #include "json.h"
 #include "utils.h"
+#include "work_queue.h"
+#include "walker.h"
+#include "manifest_cache.h"
+#include "delta.h"
+#include "compress.h"
+#include "content_cache.h"
+#include "content_hash.h"
+#include "chunk.h"
+#include "protocol.h"
 #include "server_config.h"
 
+// directory which requested paths are relative to
+int root_fd = -1;
+// NULL when manifest is made by walking
+manifest_cache_t *cache = NULL;
+// NULL when compressed content isn't cached
+content_cache_t *content_cache = NULL;
+// NULL when content hashes aren't supported
+content_hash_cache_t *hash_cache = NULL;
+#define HASH_CACHE_SLOTS (1 << 18)
+// set in epoll mode, where large content is sent by send_pending() as the socket accepts it
+bool is_send_deferred = false;
+
+// state of a connection
+typedef struct {
+    int fd;
+    // reads of `fd` must go through it, since it may have buffered the next command
+    transport_t transport;
+    int id;
+    char host[INET_ADDRSTRLEN];
+    int port;
+    // command being handled
+    uint32_t command;
+    char *buf;
+    uint64_t buf_size;
+    // created when content is compressed first time
+    compressor_t *compressor;
+    // adapted to how fast content is sent
+    // socket buffer makes sending block rarely but long, so time is a decaying sum over blocks
+    int compress_level;
+    int measured_blocks;
+    uint64_t compress_ns;
+    uint64_t send_ns;
+    // files of at least this size have content hashes in binary manifests, 0 when they aren't requested
+    uint64_t hash_min_size;
+    // file whose content is still to be sent after its length, -1 when none,
+    // `send_len` bytes are left from its current offset, `send_path` is for logs
+    int send_fd;
+    uint64_t send_len;
+    char *send_path;
+} conn_t;
+
+conn_t *conn_init(int conn_fd, int id, struct sockaddr_in *addr) {
+    uint64_t const INIT_BUF_SIZE = 128;
+
+    conn_t *conn = (conn_t *)malloc(sizeof(conn_t));
+    conn->fd = conn_fd;
+    transport_init(&conn->transport, conn_fd);
+    conn->id = id;
+    inet_ntop(AF_INET, &addr->sin_addr, conn->host, sizeof(conn->host));
+    conn->port = ntohs(addr->sin_port);
+    conn->command = 0;
+    conn->buf_size = INIT_BUF_SIZE;
+    // `buf_size` doesn't include the terminating '\0', so + 1
+    conn->buf = (char *)malloc(sizeof(char) * (conn->buf_size + 1));
+    conn->compressor = NULL;
+    conn->compress_level = COMPRESS_MIN_LEVEL;
+    conn->hash_min_size = 0;
+    conn->measured_blocks = 0;
+    conn->compress_ns = 0;
+    conn->send_ns = 0;
+    conn->send_fd = -1;
+    conn->send_len = 0;
+    conn->send_path = NULL;
+
+    // a response is written at once, or its parts are held by MSG_MORE, so nothing should wait for ack
+    int option_value = 1;
+    if (setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int)) == -1) {
+        ERROR("setsockopt (conn %d)", id);
+    }
+
+    // a peer stalling in a request fails the read or write, so it can't hold a process or thread forever
+    // it only applies once a command has arrived, waiting for the next command isn't limited
+    struct timeval timeout = { .tv_sec = config.timeout, .tv_usec = 0 };
+    if (setsockopt(conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+        || setsockopt(conn_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1) {
+        ERROR("setsockopt (conn %d)", id);
+    }
+
+    return conn;
+}
+
+// connection is closed
+void conn_kill(conn_t *conn) {
+    if (conn->send_fd != -1) {
+        close(conn->send_fd);
+        free(conn->send_path);
+    }
+    close(conn->fd);
+    transport_kill(&conn->transport);
+    free(conn->buf);
+    if (conn->compressor) {
+        compressor_kill(conn->compressor);
+    }
+    free(conn);
+}
+
 // return socket fd when success, -1 when error
 int init_socket(int port) {
-    int const LISTEN_BACKLOG = 5;
+    // many clients may connect at the same time
+    int const LISTEN_BACKLOG = SOMAXCONN;
 
     // socket
     int sock_fd = socket(PF_INET, SOCK_STREAM, 0);
@@ -30,6 +150,11 @@ int init_socket(int port) {
         ERROR("setsockopt");
         return -1;
     }
+    // accepted connections inherit them, with the window scale negotiated for them
+    if (set_socket_buffers(sock_fd, config.socket_buffer << 10) == -1) {
+        ERROR("set socket buffers");
+        return -1;
+    }
 
     // bind
     struct sockaddr_in addr;
@@ -52,89 +177,29 @@ int init_socket(int port) {
     return sock_fd;
 }
 
-// traverse current working directory and store result in `*info`
-// return 0 when success, -1 when working directory error
-int traverse(char *name, json_data **info) {
-    // init info of current directory
-    struct stat st;
-    if (stat(".", &st) == -1) {
-        // skip current working directory
-        char *cwd = getcwd(NULL, 0);
-        ERROR("get %s status failed (pid %d)", cwd, getpid());
-        free(cwd);
-        return 0;
-    }
-
-    *info = json_obj_init();
-    json_obj_set(*info, "name", json_str_init(name));
-    json_obj_set(*info, "type", json_str_init("directory"));
-    json_obj_set(*info, "entries", json_arr_init());
-    json_obj_set(*info, "updateTime", json_num_init((double)st.st_mtime));
-    json_obj_set(*info, "permission", json_num_init((double)(st.st_mode & 0777)));
-
-    // read directory
-    DIR *dirp = opendir(".");
-    if (!dirp) {
-        // skip entries of current working directory
-        char *cwd = getcwd(NULL, 0);
-        ERROR("open directory %s failed (pid %d)", cwd, getpid());
-        free(cwd);
-        return 0;
-    }
-
-    struct dirent *entry;
-    while ((entry = readdir(dirp))) {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-            continue;
-        }
-
-        json_data *sub_info = NULL;
-
-        if (entry->d_type == DT_REG) {
-            if (stat(entry->d_name, &st) == -1) {
-                ERROR("get %s status failed (pid %d)", entry->d_name, getpid());
-                continue;
-            }
-
-            sub_info = json_obj_init();
-            json_obj_set(sub_info, "name", json_str_init(entry->d_name));
-            json_obj_set(sub_info, "type", json_str_init("file"));
-            json_obj_set(sub_info, "updateTime", json_num_init((double)st.st_mtime));
-            json_obj_set(sub_info, "permission", json_num_init((double)(st.st_mode & 0777)));
-        }
-
-        else if (entry->d_type == DT_DIR) {
-            char *cwd = getcwd(NULL, 0);
-            if (chdir(entry->d_name) == -1) {
-                ERROR("change working directory to %s failed (pid %d)", entry->d_name, getpid());
-                free(cwd);
-                continue;
-            }
+// convert status of walked `node` to info, entries of directory aren't included
+json_data *node_status_to_info(walk_node_t *node) {
+    json_data *info = json_obj_init();
+    json_obj_set(info, "name", json_str_init(node->name));
+    json_obj_set(info, "type", json_str_init(node->type == WALK_DIRECTORY ? "directory" : "file"));
+    json_obj_set(info, "updateTime", json_num_init((double)node->mtime_sec));
+    json_obj_set(info, "permission", json_num_init((double)node->permission));
 
-            // the result doesn't matter, only care whether we can change back to correct working directory later
-            traverse(entry->d_name, &sub_info);
-
-            if (chdir(cwd) == -1) {
-                // can't change back to correct working directory
-                ERROR("change working directory to %s failed (pid %d)", cwd, getpid());
-                if (sub_info) {
-                    json_arr_append(json_obj_get(*info, "entries"), sub_info);
-                }
-                free(cwd);
-                closedir(dirp);
-                return -1;
-            }
-            free(cwd);
-        }
+    return info;
+}
 
-        if (sub_info) {
-            json_arr_append(json_obj_get(*info, "entries"), sub_info);
+// convert walked `node` to info recursively
+json_data *node_to_info(walk_node_t *node) {
+    json_data *info = node_status_to_info(node);
+    if (node->type == WALK_DIRECTORY) {
+        json_data *entries = json_arr_init();
+        for (uint64_t i = 0; i < node->entries_size; i++) {
+            json_arr_append(entries, node_to_info(&node->entries[i]));
         }
+        json_obj_set(info, "entries", entries);
     }
 
-    closedir(dirp);
-
-    return 0;
+    return info;
 }
 
 bool is_valid_request_path(char *path) {
@@ -164,88 +229,99 @@ void to_relative(char *path) {
     memmove(path, path + i, sizeof(char) * (strlen(path) + 1 - i));
 }
 
-// return 0 when success, -1 when error
-int respond_info(int conn_fd, char **buf, uint64_t *buf_size) {
-    // get requested path
+// receive [path length][path] of a `what` request and store it in `conn->buf` as relative path
+// return 1 when success, 0 when the path is empty or invalid, -1 when error
+int receive_request_path(conn_t *conn, char *what) {
     uint64_t message_len;
-    if (bulk_read(conn_fd, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("receive info request failed (pid %d)", getpid());
+    if (transport_read(&conn->transport, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive %s request failed (conn %d)", what, conn->id);
         return -1;
     }
     message_len = my_ntohll(message_len);
 
     if (message_len == 0) {
-        INFO("receive info request with empty path (pid %d)", getpid());
-        goto respond_empty;
+        INFO("receive %s request with empty path (conn %d)", what, conn->id);
+        return 0;
+    }
+    // the rest of the request can't be skipped, so the connection is closed
+    if (message_len > PATH_MAX) {
+        ERROR("received %s request with too long path (conn %d)", what, conn->id);
+        return -1;
     }
 
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    if (bulk_read(conn_fd, *buf, message_len) != message_len) {
-        ERROR("receive info request failed (pid %d)", getpid());
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, message_len);
+    if (transport_read(&conn->transport, conn->buf, message_len) != message_len) {
+        ERROR("receive %s request failed (conn %d)", what, conn->id);
         return -1;
     }
-    (*buf)[message_len] = 0;
-    INFO("received %s info request (pid %d)", *buf, getpid());
+    conn->buf[message_len] = 0;
+    INFO("received %s %s request (conn %d)", conn->buf, what, conn->id);
 
-    if (!is_valid_request_path(*buf)) {
-        INFO("invalid info request path %s (pid %d)", *buf, getpid());
-        goto respond_empty;
+    if (!is_valid_request_path(conn->buf)) {
+        INFO("invalid %s request path %s (conn %d)", what, conn->buf, conn->id);
+        return 0;
     }
 
     // transform to relative path
-    to_relative(*buf);
+    to_relative(conn->buf);
 
-    // traverse
-    // change directory outside of `traverse` because in this way,
-    // we don't need to release `cwd` when there's error in `traverse`
-    char *cwd = getcwd(NULL, 0);
-    if (chdir(*buf) == -1) {
-        ERROR("change working directory to %s failed (pid %d)", *buf, getpid());
-        free(cwd);
+    return 1;
+}
+
+// return 0 when success, -1 when error
+int respond_info(conn_t *conn) {
+    // get requested path
+    int ret = receive_request_path(conn, "info");
+    if (ret == -1) {
+        return -1;
+    }
+    if (ret == 0) {
         goto respond_empty;
     }
 
-    json_data *info = NULL;
-    // the result doesn't matter, only care whether we can change back to correct working directory later
-    traverse(".", &info);
+    // traverse, paths not in cache (e.g. through a symbolic link) are walked
+    walk_node_t root;
+    manifest_snapshot_t *snapshot = cache ? cache_acquire(cache) : NULL;
+    int64_t dir = snapshot ? snapshot_find_dir(snapshot, conn->buf) : -1;
+    if (dir != -1) {
+        snapshot_walk(snapshot, (uint32_t)dir, ".", &root);
+    }
+    else {
+        if (snapshot) {
+            snapshot_release(snapshot);
+            snapshot = NULL;
+        }
 
-    if (chdir(cwd) == -1) {
-        ERROR("change working directory to %s failed (pid %d)", cwd, getpid());
-        if (info) {
-            json_kill(info);
+        int dir_fd = openat(root_fd, conn->buf, O_RDONLY | O_DIRECTORY);
+        if (dir_fd == -1) {
+            ERROR("open directory %s failed (conn %d)", conn->buf, conn->id);
+            goto respond_empty;
+        }
+        if (walk(dir_fd, ".", config.scan_threads, &root) == -1) {
+            goto respond_empty;
         }
-        free(cwd);
-        return -1;
     }
-    free(cwd);
-
-    if (!info) {
-        goto respond_empty;
+    json_data *info = node_to_info(&root);
+    walk_node_kill(&root);
+    if (snapshot) {
+        snapshot_release(snapshot);
     }
 
     // send to client
     char *info_str = json_to_str(info, false);
     json_kill(info);
 
-    char *path = (char *)malloc(sizeof(char) * (strlen(*buf) + 1));
-    strcpy(path, *buf);
+    char *path = (char *)malloc(sizeof(char) * (strlen(conn->buf) + 1));
+    strcpy(path, conn->buf);
 
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint64_t));
-    append_buf_uint64(*buf, 0, my_htonll(strlen(info_str)));
-    // not appending `info_str` to `*buf` because it's too large
-    if (bulk_write(conn_fd, *buf, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("respond %s info failed (pid %d)", path, getpid());
+    // not appending `info_str` to `conn->buf` because it's too large
+    if (transport_write_frame(&conn->transport, info_str, strlen(info_str), false) == -1) {
+        ERROR("respond %s info failed (conn %d)", path, conn->id);
         free(info_str);
         free(path);
         return -1;
     }
-    if (bulk_write(conn_fd, info_str, strlen(info_str)) != strlen(info_str)) {
-        ERROR("respond %s info failed (pid %d)", path, getpid());
-        free(info_str);
-        free(path);
-        return -1;
-    }
-    INFO("responded %s info (%zu bytes) (pid %d)", path, strlen(info_str), getpid());
+    INFO("responded %s info (%zu bytes) (conn %d)", path, strlen(info_str), conn->id);
 
     free(info_str);
     free(path);
@@ -253,103 +329,223 @@ int respond_info(int conn_fd, char **buf, uint64_t *buf_size) {
     return 0;
 
 respond_empty:
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint64_t));
-    append_buf_uint64(*buf, 0, my_htonll(0));
-    if (bulk_write(conn_fd, *buf, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("respond empty info failed (pid %d)", getpid());
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t));
+    append_buf_uint64(conn->buf, 0, my_htonll(0));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), false) != sizeof(uint64_t)) {
+        ERROR("respond empty info failed (conn %d)", conn->id);
         return -1;
     }
-    INFO("responded empty info (pid %d)", getpid());
+    INFO("responded empty info (conn %d)", conn->id);
 
     return 0;
 }
 
-// return 0 when success, -1 when error
-int respond_content(int conn_fd, char **buf, uint64_t *buf_size) {
-    int const BLOCK_SIZE = 4096;
+#ifdef __linux__
+// send up to `len` bytes from the current offset of `file_fd` through a pipe without copying to user space
+// return bytes sent, -1 when the connection fails
+static int64_t splice_file(int conn_fd, int file_fd, uint64_t len) {
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        return 0;
+    }
 
-    // get requested path
-    uint64_t message_len;
-    if (bulk_read(conn_fd, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("receive content request failed (pid %d)", getpid());
-        return -1;
+    uint64_t send_len = 0;
+    while (send_len < len) {
+        ssize_t in_len = splice(file_fd, NULL, pipe_fds[1], NULL, len - send_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (in_len <= 0) {
+            break;
+        }
+
+        // the pipe must be drained, or the data in it is lost
+        while (in_len > 0) {
+            ssize_t out_len = splice(pipe_fds[0], NULL, conn_fd, NULL, in_len, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out_len == -1 && errno == EINTR) {
+                continue;
+            }
+            if (out_len <= 0) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            in_len -= out_len;
+            send_len += out_len;
+        }
     }
-    message_len = my_ntohll(message_len);
 
-    if (message_len == 0) {
-        INFO("receive content request with empty path (pid %d)", getpid());
-        goto respond_empty;
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return send_len;
+}
+
+// send up to `len` bytes from the current offset of `file_fd` with sendfile(), or splice() if it's not supported
+// less is sent when the file ends early or neither is supported, the rest can be sent by copying
+// return bytes sent, -1 when the connection fails
+static int64_t send_file(int conn_fd, int file_fd, uint64_t len) {
+    // sendfile() sends at most about 2 GB each time
+    uint64_t const MAX_SENDFILE_LEN = 1 << 30;
+
+    uint64_t send_len = 0;
+    while (send_len < len) {
+        ssize_t ret = sendfile(conn_fd, file_fd, NULL, MIN(MAX_SENDFILE_LEN, len - send_len));
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret == -1 && (errno == EINVAL || errno == ENOSYS || errno == EOVERFLOW)) {
+            int64_t splice_len = splice_file(conn_fd, file_fd, len - send_len);
+            return splice_len == -1 ? -1 : send_len + splice_len;
+        }
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        send_len += ret;
     }
+    return send_len;
+}
+#endif
 
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    if (bulk_read(conn_fd, *buf, message_len) != message_len) {
-        ERROR("receive content request failed (pid %d)", getpid());
+// send `len` bytes from the current offset of `file_fd`, by kernel if possible
+// what's left is copied through `buf` of `buf_size` bytes
+// return 0 when success, -1 when error
+static int send_file_range(int conn_fd, int file_fd, uint64_t len, char *buf, uint64_t buf_size) {
+    uint64_t send_len = 0;
+#ifdef __linux__
+    int64_t file_send_len = send_file(conn_fd, file_fd, len);
+    if (file_send_len == -1) {
         return -1;
     }
-    (*buf)[message_len] = 0;
-    INFO("received %s content request (pid %d)", *buf, getpid());
+    send_len = file_send_len;
+#endif
+    while (send_len < len) {
+        int chunk_len = bulk_read(file_fd, buf, MIN(buf_size, len - send_len));
+        if (chunk_len <= 0 || bulk_write(conn_fd, buf, chunk_len) != chunk_len) {
+            return -1;
+        }
+        send_len += chunk_len;
+    }
+    return 0;
+}
 
-    if (!is_valid_request_path(*buf)) {
-        INFO("invalid content request path %s (pid %d)", *buf, getpid());
+// return 0 when success, -1 when error
+int respond_content(conn_t *conn) {
+    int const BLOCK_SIZE = 4096;
+    uint64_t const SMALL_CONTENT_LEN = 1 << 14;
+
+    // get requested path
+    int ret = receive_request_path(conn, "content");
+    if (ret == -1) {
+        return -1;
+    }
+    if (ret == 0) {
         goto respond_empty;
     }
 
-    // transform to relative path
-    to_relative(*buf);
-
     // open file and get file size
-    int file_fd = open(*buf, O_RDONLY);
+    int file_fd = openat(root_fd, conn->buf, O_RDONLY);
     if (file_fd == -1) {
-        ERROR("open %s failed (pid %d)", *buf, getpid());
+        ERROR("open %s failed (conn %d)", conn->buf, conn->id);
         goto respond_empty;
     }
 
     struct stat st;
     if (fstat(file_fd, &st) == -1) {
-        ERROR("get %s status failed (pid %d)", *buf, getpid());
+        ERROR("get %s status failed (conn %d)", conn->buf, conn->id);
         close(file_fd);
         goto respond_empty;
     }
 
     // send file length
-    char *path = (char *)malloc(sizeof(char) * (strlen(*buf) + 1));
-    strcpy(path, *buf);
+    char *path = (char *)malloc(sizeof(char) * (strlen(conn->buf) + 1));
+    strcpy(path, conn->buf);
+
+    // a small file is read after its length and sent with it at once
+    if (S_ISREG(st.st_mode) && st.st_size <= SMALL_CONTENT_LEN) {
+        conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t) + st.st_size);
+        append_buf_uint64(conn->buf, 0, my_htonll(st.st_size));
+        // nothing is sent yet, so a file which shrinks or can't be read is responded as empty like one can't be opened
+        if (bulk_read(file_fd, conn->buf + sizeof(uint64_t), st.st_size) != st.st_size) {
+            ERROR("read %s failed (conn %d)", path, conn->id);
+            free(path);
+            close(file_fd);
+            goto respond_empty;
+        }
+        if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t) + st.st_size, false)
+            != sizeof(uint64_t) + st.st_size) {
+            ERROR("respond %s content failed (conn %d)", path, conn->id);
+            free(path);
+            close(file_fd);
+            return -1;
+        }
+        INFO("responded %s content (%" PRIu64 " bytes) (conn %d)", path, (uint64_t)st.st_size, conn->id);
+
+        free(path);
+        close(file_fd);
+
+        return 0;
+    }
 
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint64_t));
-    append_buf_uint64(*buf, 0, my_htonll(st.st_size));
-    if (bulk_write(conn_fd, *buf, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("respond %s content failed (pid %d)", path, getpid());
+    // the length waits for content instead of going out in its own segment
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t));
+    append_buf_uint64(conn->buf, 0, my_htonll(st.st_size));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), st.st_size > 0) != sizeof(uint64_t)) {
+        ERROR("respond %s content failed (conn %d)", path, conn->id);
         free(path);
         close(file_fd);
         return -1;
     }
 
-    // read file and send to client
-    *buf_size = extend_buf(buf, *buf_size, BLOCK_SIZE);
     uint64_t send_len = 0;
+#ifdef __linux__
+    // in epoll mode, a slow client doesn't hold the thread while the file is sent
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && is_send_deferred) {
+        conn->send_fd = file_fd;
+        conn->send_len = st.st_size;
+        conn->send_path = path;
+        return 0;
+    }
+    // regular file is sent by kernel directly, and what's left is sent by copying below
+    if (S_ISREG(st.st_mode)) {
+        int64_t file_send_len = send_file(conn->fd, file_fd, st.st_size);
+        if (file_send_len == -1) {
+            ERROR("respond %s content failed (conn %d)", path, conn->id);
+            free(path);
+            close(file_fd);
+            return -1;
+        }
+        send_len = file_send_len;
+    }
+#endif
+
+    // read file and send to client
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BLOCK_SIZE);
     while (send_len < st.st_size) {
         // read file
-        int len = bulk_read(file_fd, *buf, BLOCK_SIZE);
+        int len = bulk_read(file_fd, conn->buf, BLOCK_SIZE);
         if (len == 0) {
-            WARN("unexpected EOF when reading %s (pid %d)", path, getpid());
+            WARN("unexpected EOF when reading %s (conn %d)", path, conn->id);
         }
         if (len == 0 || len == -1) {
-            ERROR("read %s failed (pid %d)", path, getpid());
+            ERROR("read %s failed (conn %d)", path, conn->id);
             free(path);
             close(file_fd);
             return -1;
         }
 
         // send to client
-        if (bulk_write(conn_fd, *buf, len) != len) {
-            ERROR("respond %s content failed (pid %d)", path, getpid());
+        if (transport_write(&conn->transport, conn->buf, len, false) != len) {
+            ERROR("respond %s content failed (conn %d)", path, conn->id);
             free(path);
             close(file_fd);
             return -1;
         }
         send_len += len;
     }
-    INFO("responded %s content (%" PRIu64 " bytes) (pid %d)", path, send_len, getpid());
+    INFO("responded %s content (%" PRIu64 " bytes) (conn %d)", path, send_len, conn->id);
 
     free(path);
     close(file_fd);
@@ -357,151 +553,1861 @@ int respond_content(int conn_fd, char **buf, uint64_t *buf_size) {
     return 0;
 
 respond_empty:
-    *buf_size = extend_buf(buf, *buf_size, sizeof(uint64_t));
-    append_buf_uint64(*buf, 0, my_htonll(0));
-    if (bulk_write(conn_fd, *buf, sizeof(uint64_t)) != sizeof(uint64_t)) {
-        ERROR("respond empty content failed (pid %d)", getpid());
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t));
+    append_buf_uint64(conn->buf, 0, my_htonll(0));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), false) != sizeof(uint64_t)) {
+        ERROR("respond empty content failed (conn %d)", conn->id);
         return -1;
     }
-    INFO("responded empty content (pid %d)", getpid());
+    INFO("responded empty content (conn %d)", conn->id);
 
     return 0;
 }
 
 // return 0 when success, -1 when error
-int respond_working_dir(int conn_fd, char **buf, uint64_t *buf_size) {
-    char *cwd = getcwd(NULL, 0);
+int respond_range_content(conn_t *conn) {
+    int const BLOCK_SIZE = 4096;
 
-    uint64_t message_len = sizeof(uint64_t) + strlen(cwd);
-    *buf_size = extend_buf(buf, *buf_size, message_len);
-    message_len = append_buf_uint64(*buf, 0, my_htonll(strlen(cwd)));
-    message_len = append_buf_charp(*buf, message_len, cwd);
-    free(cwd);
+    // get requested path, then offset and length
+    int ret = receive_request_path(conn, "range content");
+    if (ret == -1) {
+        return -1;
+    }
+    char *path = (char *)malloc(sizeof(char) * ((ret == 1 ? strlen(conn->buf) : 0) + 1));
+    strcpy(path, ret == 1 ? conn->buf : "");
+
+    uint64_t range[2];
+    if (transport_read(&conn->transport, range, sizeof(range)) != sizeof(range)) {
+        ERROR("receive range content request failed (conn %d)", conn->id);
+        free(path);
+        return -1;
+    }
+    uint64_t offset = my_ntohll(range[0]);
+    uint64_t len = my_ntohll(range[1]);
 
-    if (bulk_write(conn_fd, *buf, message_len) != message_len) {
-        ERROR("respond working directory failed (pid %d)", getpid());
+    // like respond_content(), a file which can't be read is responded as empty
+    int file_fd = ret == 1 ? openat(root_fd, path, O_RDONLY) : -1;
+    if (ret == 1 && file_fd == -1) {
+        ERROR("open %s failed (conn %d)", path, conn->id);
+    }
+    struct stat st;
+    if (file_fd != -1 && fstat(file_fd, &st) == -1) {
+        ERROR("get %s status failed (conn %d)", path, conn->id);
+        close(file_fd);
+        file_fd = -1;
+    }
+    if (file_fd != -1 && offset < st.st_size && lseek(file_fd, offset, SEEK_SET) == -1) {
+        ERROR("seek %s failed (conn %d)", path, conn->id);
+        close(file_fd);
+        file_fd = -1;
+    }
+    len = file_fd != -1 && offset < st.st_size ? MIN(len, st.st_size - offset) : 0;
+
+    // send [content length][content]
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BLOCK_SIZE);
+    append_buf_uint64(conn->buf, 0, my_htonll(len));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), len > 0) != sizeof(uint64_t)
+        || (len && send_file_range(conn->fd, file_fd, len, conn->buf, BLOCK_SIZE) == -1)) {
+        ERROR("respond %s range content failed (conn %d)", path, conn->id);
+        free(path);
+        if (file_fd != -1) {
+            close(file_fd);
+        }
         return -1;
     }
-    INFO("responded working directory (pid %d)", getpid());
+    INFO("responded %s content from %" PRIu64 " (%" PRIu64 " bytes) (conn %d)", path, offset, len, conn->id);
+
+    free(path);
+    if (file_fd != -1) {
+        close(file_fd);
+    }
 
     return 0;
 }
 
-void communicate(int conn_fd) {
-    uint64_t const INIT_BUF_SIZE = 128;
+// return 0 when success, -1 when error
+int respond_batch_content(conn_t *conn) {
+    // requested names are limited, and small files are sent together through a buffer of `BUF_LEN` bytes
+    uint64_t const MAX_NAMES_LEN = 1 << 24;
+    uint64_t const BUF_LEN = 1 << 18;
+
+    // get requested directory, then names of files in it
+    int ret = receive_request_path(conn, "batch content");
+    if (ret == -1) {
+        return -1;
+    }
+    char *dir = (char *)malloc(sizeof(char) * ((ret == 1 ? strlen(conn->buf) : 0) + 1));
+    strcpy(dir, ret == 1 ? conn->buf : "");
 
-    uint64_t buf_size = INIT_BUF_SIZE;
-    char *buf = (char *)malloc(sizeof(char) * (buf_size + 1));
+    uint64_t message_len;
+    if (transport_read(&conn->transport, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)
+        || (message_len = my_ntohll(message_len)) > MAX_NAMES_LEN) {
+        ERROR("receive batch content request failed (conn %d)", conn->id);
+        free(dir);
+        return -1;
+    }
+    char *message = (char *)malloc(sizeof(char) * (message_len + 1));
+    if (!message) {
+        ERROR("malloc (conn %d)", conn->id);
+        free(dir);
+        return -1;
+    }
+    if (transport_read(&conn->transport, message, message_len) != message_len) {
+        ERROR("receive batch content request failed (conn %d)", conn->id);
+        free(message);
+        free(dir);
+        return -1;
+    }
 
-    uint32_t command;
-    while (1) {
-        if (bulk_read(conn_fd, &command, sizeof(uint32_t)) != sizeof(uint32_t)) {
-            goto finish;
+    // join names with the directory, and get their sizes so the bundle length is known before sending
+    // like respond_content(), a file which can't be read is responded as empty
+    char **paths = NULL;
+    uint64_t *lens = NULL;
+    uint64_t paths_size = 0;
+    uint64_t paths_capacity = 0;
+    uint64_t bundle_len = 0;
+    uint64_t offset = 0;
+    while (offset < message_len) {
+        uint64_t name_len;
+        if (read_buf_varint(message, message_len, &offset, &name_len) == -1 || name_len > message_len - offset) {
+            ERROR("received invalid batch content request (conn %d)", conn->id);
+            goto fail;
+        }
+        if (paths_size == paths_capacity) {
+            paths_capacity = paths_capacity ? paths_capacity << 1 : 1 << 6;
+            paths = (char **)realloc(paths, sizeof(char *) * paths_capacity);
+            lens = (uint64_t *)realloc(lens, sizeof(uint64_t) * paths_capacity);
         }
-        command = ntohl(command);
+        char *path = (char *)malloc(sizeof(char) * (strlen(dir) + name_len + 2));
+        sprintf(path, "%s/%.*s", dir, (int)name_len, message + offset);
+        offset += name_len;
+        paths[paths_size] = path;
+        lens[paths_size] = 0;
+        paths_size++;
+
+        struct stat st;
+        if (ret == 1 && name_len && is_valid_request_path(path) && fstatat(root_fd, path, &st, 0) == 0
+            && S_ISREG(st.st_mode)) {
+            lens[paths_size - 1] = st.st_size;
+        }
+        else if (ret == 1) {
+            ERROR("get %s status failed (conn %d)", path, conn->id);
+        }
+        bundle_len += sizeof(uint64_t) + lens[paths_size - 1];
+    }
 
-        switch (command) {
-        case 0:
-        {
-            INFO("received command: request info (pid %d)", getpid());
-            if (respond_info(conn_fd, &buf, &buf_size) == -1) {
-                goto finish;
+    // send [bundle length]([content length][content])..., small contents are read into the buffer,
+    // a file which changed since its status was got fails the connection as the length is already sent
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BUF_LEN + sizeof(uint64_t));
+    uint64_t buf_len = append_buf_uint64(conn->buf, 0, my_htonll(bundle_len));
+    for (uint64_t i = 0; i < paths_size; i++) {
+        if (buf_len + sizeof(uint64_t) > BUF_LEN) {
+            if (transport_write(&conn->transport, conn->buf, buf_len, true) != buf_len) {
+                goto respond_fail;
             }
-            break;
+            buf_len = 0;
         }
-        case 1:
-        {
-            INFO("received command: request content (pid %d)", getpid());
-            if (respond_content(conn_fd, &buf, &buf_size) == -1) {
-                goto finish;
-            }
-            break;
+        buf_len = append_buf_uint64(conn->buf, buf_len, my_htonll(lens[i]));
+        if (!lens[i]) {
+            continue;
         }
-        case 2:
-        {
-            INFO("received exit message (pid %d)", getpid());
-            goto finish;
-            break;
+
+        int file_fd = openat(root_fd, paths[i], O_RDONLY);
+        if (file_fd == -1) {
+            ERROR("open %s failed (conn %d)", paths[i], conn->id);
+            goto respond_fail;
         }
-        case 3:
-        {
-            INFO("received command: request working directory (pid %d)", getpid());
-            if (respond_working_dir(conn_fd, &buf, &buf_size) == -1) {
-                goto finish;
-            }
-            break;
+        if (buf_len + lens[i] <= BUF_LEN) {
+            ret = bulk_read(file_fd, conn->buf + buf_len, lens[i]) == lens[i] ? 0 : -1;
+            buf_len += lens[i];
         }
-        default:
-        {
-            WARN("received unknown command (pid %d)", getpid());
-            break;
+        else {
+            ret = transport_write(&conn->transport, conn->buf, buf_len, true) == buf_len
+                ? send_file_range(conn->fd, file_fd, lens[i], conn->buf, BUF_LEN) : -1;
+            buf_len = 0;
         }
+        close(file_fd);
+        if (ret == -1) {
+            ERROR("read %s failed (conn %d)", paths[i], conn->id);
+            goto respond_fail;
         }
     }
+    if (transport_write(&conn->transport, conn->buf, buf_len, false) != buf_len) {
+        goto respond_fail;
+    }
+    INFO("responded %s batch content (%" PRIu64 " files, %" PRIu64 " bytes) (conn %d)", dir, paths_size, bundle_len,
+        conn->id);
 
-finish:
-    free(buf);
-}
-
-int main(int argc, char **argv) {
-    load_config(argc, argv);
-    if (!is_valid_config()) {
-        kill_config();
-        return 1;
+    for (uint64_t i = 0; i < paths_size; i++) {
+        free(paths[i]);
     }
-    printf("config:\n  port = %d\n  working directory = %s\n\n", config.port, config.work_dir);
+    free(paths);
+    free(lens);
+    free(message);
+    free(dir);
+    return 0;
 
-    if (chdir(config.work_dir) == -1) {
-        ERROR("change working directory to %s failed", config.work_dir);
-        kill_config();
-        return 1;
+respond_fail:
+    ERROR("respond %s batch content failed (conn %d)", dir, conn->id);
+fail:
+    for (uint64_t i = 0; i < paths_size; i++) {
+        free(paths[i]);
     }
-    char *cwd = getcwd(NULL, 0);
-    INFO("working at %s", cwd);
-    free(cwd);
+    free(paths);
+    free(lens);
+    free(message);
+    free(dir);
+    return -1;
+}
 
-    int sock_fd = init_socket(config.port);
-    if (sock_fd == -1) {
-        kill_config();
-        return 1;
+// mtime nsec of `st`
+static uint64_t stat_mtime_nsec(struct stat *st) {
+#ifdef __APPLE__
+    return st->st_mtimespec.tv_nsec;
+#else
+    return st->st_mtim.tv_nsec;
+#endif
+}
+
+// a chunk list being built
+typedef struct {
+    char *buf;
+    uint64_t len;
+    uint64_t size;
+    uint64_t chunks_size;
+} chunk_list_t;
+
+static int append_chunk(uint64_t offset, uint64_t len, uint64_t *hash, void *arg) {
+    chunk_list_t *list = (chunk_list_t *)arg;
+    if (list->len + VARINT_MAX_LEN + 2 * sizeof(uint64_t) > list->size) {
+        list->size *= 2;
+        list->buf = (char *)realloc(list->buf, sizeof(char) * list->size);
     }
-    INFO("listening on port %d", config.port);
+    list->len = append_buf_varint(list->buf, list->len, len);
+    list->len = append_buf_uint64(list->buf, list->len, my_htonll(hash[0]));
+    list->len = append_buf_uint64(list->buf, list->len, my_htonll(hash[1]));
+    list->chunks_size++;
+    return 0;
+}
 
-    while (1) {
-        // accept connection
-        struct sockaddr_in addr;
-        socklen_t addr_size = sizeof(addr);
-        int conn_fd = accept(sock_fd, (struct sockaddr *)&addr, &addr_size);
-        if (conn_fd == -1) {
-            ERROR("accept");
-            continue;
+// return 0 when success, -1 when error
+int respond_chunk_list(conn_t *conn) {
+    int ret = receive_request_path(conn, "chunk list");
+    if (ret == -1) {
+        return -1;
+    }
+    char *path = (char *)malloc(sizeof(char) * ((ret == 1 ? strlen(conn->buf) : 0) + 1));
+    strcpy(path, ret == 1 ? conn->buf : "");
+
+    // [list length] is filled at last
+    chunk_list_t list;
+    list.size = 1 << 12;
+    list.buf = (char *)malloc(sizeof(char) * list.size);
+    list.len = sizeof(uint64_t);
+    list.chunks_size = 0;
+
+    // a file which can't be read or is changed while it's split is responded as an empty list
+    bool is_valid = false;
+    struct stat st;
+    int file_fd = ret == 1 ? openat(root_fd, path, O_RDONLY) : -1;
+    if (ret == 1 && file_fd == -1) {
+        ERROR("open %s failed (conn %d)", path, conn->id);
+    }
+    if (file_fd != -1 && fstat(file_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        list.len = append_buf_uint64(list.buf, list.len, my_htonll(st.st_size));
+        list.len = append_buf_uint64(list.buf, list.len, my_htonll(st.st_mtime));
+        list.len = append_buf_uint64(list.buf, list.len, my_htonll(stat_mtime_nsec(&st)));
+        struct stat end_st;
+        is_valid = chunk_file(file_fd, st.st_size, append_chunk, &list) == 0 && fstat(file_fd, &end_st) == 0
+            && end_st.st_size == st.st_size && end_st.st_mtime == st.st_mtime
+            && stat_mtime_nsec(&end_st) == stat_mtime_nsec(&st);
+        if (!is_valid) {
+            ERROR("split %s into chunks failed (conn %d)", path, conn->id);
         }
+    }
+    if (file_fd != -1) {
+        close(file_fd);
+    }
+    if (!is_valid) {
+        list.len = sizeof(uint64_t);
+        list.chunks_size = 0;
+    }
 
-        // use multiprocess because we need to change working directory
-        int pid = fork();
-        if (pid == -1) {
-            ERROR("fork");
-            close(conn_fd);
-            continue;
-        }
+    // send [list length][list]
+    append_buf_uint64(list.buf, 0, my_htonll(list.len - sizeof(uint64_t)));
+    if (transport_write(&conn->transport, list.buf, list.len, false) != list.len) {
+        ERROR("respond %s chunk list failed (conn %d)", path, conn->id);
+        free(list.buf);
+        free(path);
+        return -1;
+    }
+    INFO("responded %s chunk list (%" PRIu64 " chunks) (conn %d)", path, list.chunks_size, conn->id);
 
-        if (pid == 0) {
-            // child
-            close(sock_fd);
+    free(list.buf);
+    free(path);
+    return 0;
+}
 
-            INFO("connected from %s:%d (pid %d)", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), getpid());
-            communicate(conn_fd);
+// return 0 when success, -1 when error
+int respond_chunk_content(conn_t *conn) {
+    uint64_t const MAX_RANGES_LEN = 1 << 24;
+    int const BLOCK_SIZE = 4096;
 
-            close(conn_fd);
-            INFO("disconnected %s:%d (pid %d)", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), getpid());
-            kill_config();
-            return 0;
-        }
+    // get requested path, then status in its chunk list and ranges
+    int ret = receive_request_path(conn, "chunk content");
+    if (ret == -1) {
+        return -1;
+    }
+    char *path = (char *)malloc(sizeof(char) * ((ret == 1 ? strlen(conn->buf) : 0) + 1));
+    strcpy(path, ret == 1 ? conn->buf : "");
 
-        close(conn_fd);
+    uint64_t header[4];
+    if (transport_read(&conn->transport, header, sizeof(header)) != sizeof(header)
+        || my_ntohll(header[3]) > MAX_RANGES_LEN) {
+        ERROR("receive chunk content request failed (conn %d)", conn->id);
+        free(path);
+        return -1;
+    }
+    uint64_t size = my_ntohll(header[0]);
+    int64_t mtime_sec = (int64_t)my_ntohll(header[1]);
+    uint64_t mtime_nsec = my_ntohll(header[2]);
+    uint64_t ranges_len = my_ntohll(header[3]);
+    char *ranges = (char *)malloc(sizeof(char) * (ranges_len + 1));
+    if (transport_read(&conn->transport, ranges, ranges_len) != ranges_len) {
+        ERROR("receive chunk content request failed (conn %d)", conn->id);
+        free(ranges);
+        free(path);
+        return -1;
+    }
+
+    // ranges must be ascending and in the file
+    uint64_t content_len = 0;
+    uint64_t ranges_size = 0;
+    uint64_t end = 0;
+    for (uint64_t offset = 0; offset < ranges_len;) {
+        uint64_t range[2];
+        if (read_buf_varint(ranges, ranges_len, &offset, &range[0]) == -1
+            || read_buf_varint(ranges, ranges_len, &offset, &range[1]) == -1 || range[0] < end || range[0] > size
+            || range[1] > size - range[0]) {
+            ERROR("invalid chunk content request of %s (conn %d)", path, conn->id);
+            free(ranges);
+            free(path);
+            return -1;
+        }
+        end = range[0] + range[1];
+        content_len += range[1];
+        ranges_size++;
+    }
+
+    // the content is empty if the file isn't the one in its chunk list anymore
+    struct stat st;
+    int file_fd = ret == 1 ? openat(root_fd, path, O_RDONLY) : -1;
+    if (ret == 1 && file_fd == -1) {
+        ERROR("open %s failed (conn %d)", path, conn->id);
+    }
+    if (file_fd != -1 && (fstat(file_fd, &st) == -1 || st.st_size != size || st.st_mtime != mtime_sec
+        || stat_mtime_nsec(&st) != mtime_nsec)) {
+        INFO("%s is changed since its chunk list (conn %d)", path, conn->id);
+        close(file_fd);
+        file_fd = -1;
+    }
+    if (file_fd == -1) {
+        content_len = 0;
+    }
+
+    // send [content length][content]
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BLOCK_SIZE);
+    append_buf_uint64(conn->buf, 0, my_htonll(content_len));
+    ret = transport_write(&conn->transport, conn->buf, sizeof(uint64_t), content_len > 0) == sizeof(uint64_t) ? 0 : -1;
+    for (uint64_t offset = 0; ret == 0 && content_len && offset < ranges_len;) {
+        uint64_t range[2];
+        read_buf_varint(ranges, ranges_len, &offset, &range[0]);
+        read_buf_varint(ranges, ranges_len, &offset, &range[1]);
+        if (lseek(file_fd, range[0], SEEK_SET) == -1
+            || send_file_range(conn->fd, file_fd, range[1], conn->buf, BLOCK_SIZE) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == -1) {
+        ERROR("respond %s chunk content failed (conn %d)", path, conn->id);
+    }
+    else {
+        INFO("responded %s chunk content (%" PRIu64 " ranges, %" PRIu64 " bytes) (conn %d)", path, ranges_size,
+            content_len, conn->id);
+    }
+
+    if (file_fd != -1) {
+        close(file_fd);
+    }
+    free(ranges);
+    free(path);
+
+    // the response can't be finished once it's started
+    return ret;
+}
+
+static uint64_t elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000LL + end->tv_nsec - start->tv_nsec;
+}
+
+// return 0 when success, -1 when error
+int respond_compressed_content(conn_t *conn) {
+    // the file is compressed only if its first block shrinks to 7/8 or less
+    uint64_t const SAMPLE_RATIO = 7;
+    int const MEASURE_BLOCKS = 16;
+    uint64_t const BLOCK_HEADER_LEN = 2 * sizeof(uint32_t);
+
+    // get requested path
+    int ret = receive_request_path(conn, "compressed content");
+    if (ret == -1) {
+        return -1;
+    }
+    if (ret == 0) {
+        goto respond_empty;
+    }
+
+    // open file and get file size
+    int file_fd = openat(root_fd, conn->buf, O_RDONLY);
+    if (file_fd == -1) {
+        ERROR("open %s failed (conn %d)", conn->buf, conn->id);
+        goto respond_empty;
+    }
+
+    struct stat st;
+    if (fstat(file_fd, &st) == -1) {
+        ERROR("get %s status failed (conn %d)", conn->buf, conn->id);
+        close(file_fd);
+        goto respond_empty;
+    }
+
+    // send file length
+    char *path = (char *)malloc(sizeof(char) * (strlen(conn->buf) + 1));
+    strcpy(path, conn->buf);
+
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BLOCK_HEADER_LEN + compress_bound(COMPRESS_BLOCK_SIZE));
+    append_buf_uint64(conn->buf, 0, my_htonll(st.st_size));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), st.st_size > 0) != sizeof(uint64_t)) {
+        ERROR("respond %s content failed (conn %d)", path, conn->id);
+        free(path);
+        close(file_fd);
+        return -1;
+    }
+
+    char *block = (char *)malloc(sizeof(char) * COMPRESS_BLOCK_SIZE);
+
+    // cached blocks are sent by kernel directly, otherwise they're cached while being sent
+    bool is_cacheable = content_cache && S_ISREG(st.st_mode) && st.st_size >= COMPRESS_BLOCK_SIZE;
+    uint64_t cached_len;
+    int cached_fd = is_cacheable ? content_cache_open(content_cache, path, &st, &cached_len) : -1;
+    if (cached_fd != -1) {
+        ret = send_file_range(conn->fd, cached_fd, cached_len, block, COMPRESS_BLOCK_SIZE);
+        if (ret == -1) {
+            ERROR("respond %s content failed (conn %d)", path, conn->id);
+        }
+        else {
+            INFO("responded %s compressed content from cache (%" PRIu64 " bytes, %" PRIu64 " bytes sent) (conn %d)",
+                path, (uint64_t)st.st_size, cached_len, conn->id);
+        }
+        close(cached_fd);
+        free(block);
+        free(path);
+        close(file_fd);
+        return ret;
+    }
+    char *temp_name = NULL;
+    int temp_fd = is_cacheable ? content_cache_create(content_cache, &temp_name) : -1;
+
+    if (!conn->compressor) {
+        conn->compressor = compressor_init();
+    }
+    bool is_compressing = true;
+    uint64_t send_len = 0;
+    uint64_t compressed_len = 0;
+    ret = 0;
+    while (send_len < st.st_size) {
+        // a file not worth compressing is sent by kernel directly, and isn't cached
+        if (!is_compressing) {
+            if (temp_fd != -1) {
+                content_cache_commit(content_cache, path, &st, temp_fd, temp_name, false);
+                temp_fd = -1;
+            }
+
+            uint32_t len = MIN(COMPRESS_BLOCK_SIZE, st.st_size - send_len);
+            append_buf_uint32(conn->buf, 0, htonl(len));
+            append_buf_uint32(conn->buf, sizeof(uint32_t), htonl(len));
+            if (transport_write(&conn->transport, conn->buf, BLOCK_HEADER_LEN, true) != BLOCK_HEADER_LEN
+                || send_file_range(conn->fd, file_fd, len, block, COMPRESS_BLOCK_SIZE) == -1) {
+                ERROR("respond %s content failed (conn %d)", path, conn->id);
+                ret = -1;
+                break;
+            }
+            send_len += len;
+            compressed_len += BLOCK_HEADER_LEN + len;
+            continue;
+        }
+
+        // read a block
+        int len = bulk_read(file_fd, block, MIN(COMPRESS_BLOCK_SIZE, st.st_size - send_len));
+        if (len == 0) {
+            WARN("unexpected EOF when reading %s (conn %d)", path, conn->id);
+        }
+        if (len == 0 || len == -1) {
+            ERROR("read %s failed (conn %d)", path, conn->id);
+            ret = -1;
+            break;
+        }
+
+        // compress it, the first block decides whether the file is worth compressing
+        struct timespec start;
+        struct timespec compressed;
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t stored_len = len;
+        if (is_compressing) {
+            bool is_sample = send_len == 0;
+            uint64_t block_len = compress_block(conn->compressor, block, len, conn->buf + BLOCK_HEADER_LEN,
+                is_sample ? COMPRESS_MIN_LEVEL : conn->compress_level);
+            if (is_sample) {
+                is_compressing = block_len * 8 <= len * SAMPLE_RATIO;
+            }
+            if (block_len < len) {
+                stored_len = block_len;
+            }
+        }
+        if (stored_len == len) {
+            memcpy(conn->buf + BLOCK_HEADER_LEN, block, len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &compressed);
+
+        // send [raw length][stored length][data]
+        append_buf_uint32(conn->buf, 0, htonl(len));
+        append_buf_uint32(conn->buf, sizeof(uint32_t), htonl(stored_len));
+        if (transport_write(&conn->transport, conn->buf, BLOCK_HEADER_LEN + stored_len, false)
+            != BLOCK_HEADER_LEN + stored_len) {
+            ERROR("respond %s content failed (conn %d)", path, conn->id);
+            ret = -1;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        send_len += len;
+        compressed_len += BLOCK_HEADER_LEN + stored_len;
+
+        if (temp_fd != -1
+            && bulk_write(temp_fd, conn->buf, BLOCK_HEADER_LEN + stored_len) != BLOCK_HEADER_LEN + stored_len) {
+            ERROR("write %s to content cache failed (conn %d)", path, conn->id);
+            content_cache_commit(content_cache, path, &st, temp_fd, temp_name, false);
+            temp_fd = -1;
+        }
+
+        // when sending is slower than compressing, the link is the bottleneck, so compress more,
+        // and the other way around
+        if (!is_compressing) {
+            continue;
+        }
+        conn->compress_ns += elapsed_ns(&start, &compressed);
+        conn->send_ns += elapsed_ns(&compressed, &sent);
+        if (++conn->measured_blocks < MEASURE_BLOCKS) {
+            continue;
+        }
+        if (conn->send_ns > 2 * conn->compress_ns && conn->compress_level < COMPRESS_MAX_LEVEL) {
+            conn->compress_level++;
+        }
+        else if (conn->compress_ns > 2 * conn->send_ns && conn->compress_level > COMPRESS_MIN_LEVEL) {
+            conn->compress_level--;
+        }
+        conn->measured_blocks = 0;
+        conn->compress_ns /= 2;
+        conn->send_ns /= 2;
+    }
+    if (ret == 0) {
+        INFO("responded %s compressed content (%" PRIu64 " bytes, %" PRIu64 " bytes sent, level %d) (conn %d)",
+            path, send_len, compressed_len, is_compressing ? conn->compress_level : 0, conn->id);
+    }
+
+    // the file may be changed while being read, then its content can't be cached with its old status
+    if (temp_fd != -1) {
+        struct stat end_st;
+        bool is_complete = ret == 0 && fstat(file_fd, &end_st) == 0 && end_st.st_size == st.st_size
+            && end_st.st_mtime == st.st_mtime;
+#ifdef __APPLE__
+        is_complete = is_complete && end_st.st_mtimespec.tv_nsec == st.st_mtimespec.tv_nsec;
+#else
+        is_complete = is_complete && end_st.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+#endif
+        content_cache_commit(content_cache, path, &st, temp_fd, temp_name, is_complete);
+    }
+
+    free(block);
+    free(path);
+    close(file_fd);
+
+    return ret;
+
+respond_empty:
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t));
+    append_buf_uint64(conn->buf, 0, my_htonll(0));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), false) != sizeof(uint64_t)) {
+        ERROR("respond empty content failed (conn %d)", conn->id);
+        return -1;
+    }
+    INFO("responded empty content (conn %d)", conn->id);
+
+    return 0;
+}
+
+// delta instructions being sent, small ones are buffered
+typedef struct {
+    conn_t *conn;
+    char *buf;
+    uint64_t buf_len;
+    uint64_t sent_len;
+    uint64_t literal_len;
+    uint64_t copied_len;
+    uint64_t block_size;
+    uint64_t blocks_size;
+} delta_stream_t;
+
+// large enough to hold small instructions of many pieces
+#define DELTA_BUF_SIZE (1 << 16)
+
+// more instructions follow if `has_more`, so a partial segment can wait for them
+static int flush_delta(delta_stream_t *stream, bool has_more) {
+    if (transport_write(&stream->conn->transport, stream->buf, stream->buf_len, has_more) != stream->buf_len) {
+        return -1;
+    }
+    stream->sent_len += stream->buf_len;
+    stream->buf_len = 0;
+    return 0;
+}
+
+// send a piece of delta_generate() as an instruction
+static int send_delta_piece(char *data, uint64_t len, int64_t block, void *arg) {
+    delta_stream_t *stream = (delta_stream_t *)arg;
+
+    uint64_t const INSTRUCTION_LEN = sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    if (stream->buf_len + INSTRUCTION_LEN > DELTA_BUF_SIZE && flush_delta(stream, true) == -1) {
+        return -1;
+    }
+
+    if (block != -1) {
+        stream->buf_len = append_buf_uint32(stream->buf, stream->buf_len, htonl(DELTA_COPY));
+        stream->buf_len = append_buf_uint64(stream->buf, stream->buf_len, my_htonll(block));
+        stream->buf_len = append_buf_uint64(stream->buf, stream->buf_len, my_htonll(len));
+        stream->copied_len += len * stream->block_size;
+        return 0;
+    }
+
+    stream->buf_len = append_buf_uint32(stream->buf, stream->buf_len, htonl(DELTA_LITERAL));
+    stream->buf_len = append_buf_uint64(stream->buf, stream->buf_len, my_htonll(len));
+    stream->literal_len += len;
+    // large literal is sent without copying, together with buffered instructions
+    if (stream->buf_len + len > DELTA_BUF_SIZE) {
+        struct iovec iov[2];
+        iov[0].iov_base = stream->buf;
+        iov[0].iov_len = stream->buf_len;
+        iov[1].iov_base = data;
+        iov[1].iov_len = len;
+        if (transport_writev(&stream->conn->transport, iov, 2, true) != stream->buf_len + len) {
+            return -1;
+        }
+        stream->sent_len += stream->buf_len + len;
+        stream->buf_len = 0;
+        return 0;
+    }
+    memcpy(stream->buf + stream->buf_len, data, len);
+    stream->buf_len += len;
+
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int respond_delta(conn_t *conn) {
+    uint64_t const MAX_BLOCK_SIZE = 1 << 20;
+
+    // get requested path, then block size and signatures of client copy
+    int ret = receive_request_path(conn, "delta");
+    if (ret == -1) {
+        return -1;
+    }
+    char *path = (char *)malloc(sizeof(char) * ((ret == 1 ? strlen(conn->buf) : 0) + 1));
+    strcpy(path, ret == 1 ? conn->buf : "");
+
+    uint64_t header[2];
+    if (transport_read(&conn->transport, header, sizeof(header)) != sizeof(header)) {
+        ERROR("receive delta request failed (conn %d)", conn->id);
+        free(path);
+        return -1;
+    }
+    uint64_t block_size = my_ntohll(header[0]);
+    uint64_t signatures_len = my_ntohll(header[1]);
+    if (block_size == 0 || block_size > MAX_BLOCK_SIZE || signatures_len % DELTA_SIGNATURE_LEN
+        || signatures_len > MAX_DELTA_SIGNATURES_LEN) {
+        ERROR("invalid delta request of %s (conn %d)", path, conn->id);
+        free(path);
+        return -1;
+    }
+
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, signatures_len);
+    if (!conn->buf) {
+        ERROR("malloc (conn %d)", conn->id);
+        conn->buf_size = 0;
+        free(path);
+        return -1;
+    }
+    if (transport_read(&conn->transport, conn->buf, signatures_len) != signatures_len) {
+        ERROR("receive delta request failed (conn %d)", conn->id);
+        free(path);
+        return -1;
+    }
+    uint64_t signatures_size = signatures_len / DELTA_SIGNATURE_LEN;
+    delta_signature_t *signatures = (delta_signature_t *)malloc(sizeof(delta_signature_t) * (signatures_size + 1));
+    if (!signatures) {
+        ERROR("malloc (conn %d)", conn->id);
+        free(path);
+        return -1;
+    }
+    for (uint64_t i = 0; i < signatures_size; i++) {
+        char *signature = conn->buf + i * DELTA_SIGNATURE_LEN;
+        uint32_t weak;
+        uint64_t strong[2];
+        memcpy(&weak, signature, sizeof(uint32_t));
+        memcpy(strong, signature + sizeof(uint32_t), sizeof(strong));
+        signatures[i].weak = ntohl(weak);
+        signatures[i].strong[0] = my_ntohll(strong[0]);
+        signatures[i].strong[1] = my_ntohll(strong[1]);
+    }
+
+    delta_stream_t stream;
+    stream.conn = conn;
+    stream.buf = (char *)malloc(sizeof(char) * DELTA_BUF_SIZE);
+    if (!stream.buf) {
+        ERROR("malloc (conn %d)", conn->id);
+        free(signatures);
+        free(path);
+        return -1;
+    }
+    stream.buf_len = 0;
+    stream.sent_len = 0;
+    stream.literal_len = 0;
+    stream.copied_len = 0;
+    stream.block_size = block_size;
+    stream.blocks_size = signatures_size;
+
+    // like respond_content(), a file which can't be read is responded as empty
+    struct stat st;
+    st.st_size = 0;
+    int file_fd = ret == 1 ? openat(root_fd, path, O_RDONLY) : -1;
+    if (ret == 1 && file_fd == -1) {
+        ERROR("open %s failed (conn %d)", path, conn->id);
+    }
+    if (file_fd != -1 && fstat(file_fd, &st) == -1) {
+        ERROR("get %s status failed (conn %d)", path, conn->id);
+        close(file_fd);
+        file_fd = -1;
+        st.st_size = 0;
+    }
+
+    // send [content length] (instruction)... [end]
+    stream.buf_len = append_buf_uint64(stream.buf, 0, my_htonll(st.st_size));
+    ret = 0;
+    if (file_fd != -1) {
+        if (delta_generate(file_fd, st.st_size, block_size, signatures, signatures_size, send_delta_piece, &stream) == -1) {
+            ERROR("respond %s delta failed (conn %d)", path, conn->id);
+            ret = -1;
+        }
+        close(file_fd);
+    }
+    if (ret == 0) {
+        stream.buf_len = append_buf_uint32(stream.buf, stream.buf_len, htonl(DELTA_END));
+        if (flush_delta(&stream, false) == -1) {
+            ERROR("respond %s delta failed (conn %d)", path, conn->id);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        INFO("responded %s delta (%" PRIu64 " bytes copied, %" PRIu64 " bytes literal, %" PRIu64 " bytes sent) (conn %d)",
+            path, stream.copied_len, stream.literal_len, stream.sent_len, conn->id);
+    }
+
+    free(stream.buf);
+    free(signatures);
+    free(path);
+
+    // the response can't be finished once it's started
+    return ret;
+}
+
+// streamed info being sent
+typedef struct {
+    conn_t *conn;
+    // json array or binary manifest of directory records
+    bool is_binary;
+    char *frame;
+    uint64_t frame_len;
+    uint64_t frame_size;
+    uint64_t sent_len;
+    bool is_broken;
+} info_stream_t;
+
+// send [frame length][frame], an empty frame terminates the stream
+// return 0 when success, -1 when error
+static int send_frame(info_stream_t *stream) {
+    if (!stream->is_binary && stream->frame_len) {
+        stream->frame[stream->frame_len++] = ']';
+    }
+
+    if (transport_write_frame(&stream->conn->transport, stream->frame, stream->frame_len, false) == -1) {
+        return -1;
+    }
+    stream->sent_len += sizeof(uint64_t) + stream->frame_len;
+    stream->frame_len = 0;
+
+    return 0;
+}
+
+// large enough to amortize per frame cost, small enough to let client start early
+#define FRAME_SIZE (1 << 16)
+
+// make sure `stream->frame` can hold `len` more bytes
+static void reserve_frame(info_stream_t *stream, uint64_t len) {
+    if (stream->frame_len + len > stream->frame_size) {
+        while (stream->frame_len + len > stream->frame_size) {
+            stream->frame_size <<= 1;
+        }
+        stream->frame = (char *)realloc(stream->frame, sizeof(char) * stream->frame_size);
+    }
+}
+
+// append the json record of directory `path` to current frame, and send the frame if it's large enough
+static int stream_dir_info(char *path, walk_node_t *dir, void *arg) {
+    info_stream_t *stream = (info_stream_t *)arg;
+
+    json_data *record = json_obj_init();
+    json_obj_set(record, "path", json_str_init(path));
+    json_data *entries = json_arr_init();
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        json_arr_append(entries, node_status_to_info(&dir->entries[i]));
+    }
+    json_obj_set(record, "entries", entries);
+    char *record_str = json_to_str(record, false);
+    json_kill(record);
+
+    // '[' or ',' before the record and ']' after it
+    uint64_t record_len = strlen(record_str);
+    reserve_frame(stream, record_len + 2);
+    char separator = stream->frame_len ? ',' : '[';
+    stream->frame[stream->frame_len++] = separator;
+    memcpy(stream->frame + stream->frame_len, record_str, record_len);
+    stream->frame_len += record_len;
+    free(record_str);
+
+    if (stream->frame_len >= FRAME_SIZE && send_frame(stream) == -1) {
+        stream->is_broken = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+// append the binary record of directory `path` to current frame, and send the frame if it's large enough
+static int stream_dir_binary_info(char *path, walk_node_t *dir, void *arg) {
+    info_stream_t *stream = (info_stream_t *)arg;
+
+    reserve_frame(stream, MANIFEST_DIR_MAX_LEN(strlen(path)));
+    stream->frame_len = append_buf_manifest_dir(stream->frame, stream->frame_len, path, dir->entries_size);
+
+    char *prev_name = NULL;
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        walk_node_t *node = &dir->entries[i];
+        manifest_entry_t entry;
+        entry.name = node->name;
+        entry.is_dir = node->type == WALK_DIRECTORY;
+        entry.permission = node->permission;
+        entry.mtime_sec = node->mtime_sec;
+        entry.mtime_nsec = node->mtime_nsec;
+        entry.size = node->size;
+        entry.has_hash = false;
+        conn_t *conn = stream->conn;
+        if (conn->hash_min_size && node->type == WALK_FILE && node->size >= conn->hash_min_size) {
+            char *file_path = (char *)malloc(sizeof(char)
+                * (strlen(conn->buf) + strlen(path) + strlen(node->name) + 3));
+            sprintf(file_path, "%s/%s/%s", conn->buf, path, node->name);
+            // a file which can't be hashed is still listed
+            entry.has_hash = content_hash_get(hash_cache, root_fd, file_path, node->size, node->mtime_sec,
+                node->mtime_nsec, entry.hash) == 0;
+            free(file_path);
+        }
+
+        reserve_frame(stream, MANIFEST_ENTRY_MAX_LEN(strlen(node->name)));
+        stream->frame_len = append_buf_manifest_entry(stream->frame, stream->frame_len, prev_name, &entry);
+        prev_name = node->name;
+    }
+
+    if (stream->frame_len >= FRAME_SIZE && send_frame(stream) == -1) {
+        stream->is_broken = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void info_stream_init(info_stream_t *stream, conn_t *conn, bool is_binary) {
+    stream->conn = conn;
+    stream->is_binary = is_binary;
+    stream->frame_len = 0;
+    stream->frame_size = 1 << 12;
+    stream->frame = (char *)malloc(sizeof(char) * stream->frame_size);
+    stream->sent_len = 0;
+    stream->is_broken = false;
+}
+
+// stream every directory under `conn->buf`, from `snapshot` if it's not NULL, otherwise walk it
+// directories are sent while walking
+// return 0 when success, -1 when error
+static int stream_tree(info_stream_t *stream, manifest_snapshot_t *snapshot) {
+    conn_t *conn = stream->conn;
+    walk_visit_t visit = stream->is_binary ? stream_dir_binary_info : stream_dir_info;
+
+    int64_t dir = snapshot ? snapshot_find_dir(snapshot, conn->buf) : -1;
+    if (dir != -1) {
+        if (snapshot_walk_stream(snapshot, (uint32_t)dir, visit, stream) == -1 && stream->is_broken) {
+            return -1;
+        }
+        return 0;
+    }
+
+    int dir_fd = openat(root_fd, conn->buf, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1) {
+        ERROR("open directory %s failed (conn %d)", conn->buf, conn->id);
+        return 0;
+    }
+    if (walk_stream(dir_fd, visit, stream) == -1 && stream->is_broken) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// send rest records and the terminating frame
+// return 0 when success, -1 when error
+static int finish_stream(info_stream_t *stream) {
+    if (stream->is_broken) {
+        return -1;
+    }
+    if ((stream->frame_len && send_frame(stream) == -1) || send_frame(stream) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+// directory records are in json if not `is_binary`
+// return 0 when success, -1 when error
+int respond_stream_info(conn_t *conn, bool is_binary) {
+    info_stream_t stream;
+    info_stream_init(&stream, conn, is_binary);
+
+    // get requested path
+    int ret = receive_request_path(conn, "stream info");
+    if (ret == -1) {
+        free(stream.frame);
+        return -1;
+    }
+
+    // paths not in cache (e.g. through a symbolic link) are walked
+    if (ret == 1) {
+        manifest_snapshot_t *snapshot = cache ? cache_acquire(cache) : NULL;
+        stream_tree(&stream, snapshot);
+        if (snapshot) {
+            snapshot_release(snapshot);
+        }
+    }
+
+    if (finish_stream(&stream) == -1) {
+        ERROR("respond %s stream info failed (conn %d)", conn->buf, conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    INFO("responded %s stream info (%" PRIu64 " bytes) (conn %d)", conn->buf, stream.sent_len, conn->id);
+    free(stream.frame);
+
+    return 0;
+}
+
+// stream records of changed `paths` under `conn->buf`, which are sorted by depth then by name,
+// a record is made for each directory with changed entries, deleted entries are skipped
+static void stream_changes(info_stream_t *stream, manifest_snapshot_t *snapshot, char **paths, uint64_t paths_size) {
+    char *dir_path = stream->conn->buf;
+    walk_node_t dir;
+    memset(&dir, 0, sizeof(walk_node_t));
+    dir.entries = (walk_node_t *)malloc(sizeof(walk_node_t) * (paths_size ? paths_size : 1));
+
+    uint64_t i = 0;
+    while (i < paths_size && !stream->is_broken) {
+        // entries of the same directory are adjacent
+        char *name = strrchr(paths[i], '/');
+        uint64_t parent_len = name ? (uint64_t)(name - paths[i]) : 0;
+        uint64_t j = i;
+        dir.entries_size = 0;
+        for (; j < paths_size; j++) {
+            char *other_name = strrchr(paths[j], '/');
+            uint64_t other_parent_len = other_name ? (uint64_t)(other_name - paths[j]) : 0;
+            if (other_parent_len != parent_len || strncmp(paths[i], paths[j], parent_len)) {
+                break;
+            }
+
+            char *path = (char *)malloc(sizeof(char) * (strlen(dir_path) + strlen(paths[j]) + 2));
+            sprintf(path, "%s/%s", dir_path, paths[j]);
+            int64_t node = snapshot_find(snapshot, path);
+            free(path);
+            if (node != -1) {
+                snapshot_node(snapshot, (uint32_t)node, &dir.entries[dir.entries_size++]);
+            }
+        }
+
+        if (dir.entries_size) {
+            char *parent = (char *)malloc(sizeof(char) * (parent_len + 2));
+            if (parent_len) {
+                memcpy(parent, paths[i], parent_len);
+                parent[parent_len] = 0;
+            }
+            else {
+                strcpy(parent, ".");
+            }
+            stream_dir_binary_info(parent, &dir, stream);
+            free(parent);
+        }
+        i = j;
+    }
+
+    free(dir.entries);
+}
+
+// return 0 when success, -1 when error
+int respond_changes(conn_t *conn) {
+    info_stream_t stream;
+    info_stream_init(&stream, conn, true);
+
+    // get requested path and the manifest client synced last time
+    int ret = receive_request_path(conn, "changes");
+    if (ret == -1) {
+        free(stream.frame);
+        return -1;
+    }
+    uint64_t since[2];
+    if (transport_read(&conn->transport, since, sizeof(since)) != sizeof(since)) {
+        ERROR("receive changes request failed (conn %d)", conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    uint64_t epoch = my_ntohll(since[0]);
+    uint64_t generation = my_ntohll(since[1]);
+
+    bool is_valid_path = ret == 1;
+    manifest_snapshot_t *snapshot = NULL;
+    char **paths = NULL;
+    uint64_t paths_size = 0;
+    bool is_full = true;
+    if (is_valid_path && cache) {
+        ret = cache_acquire_changes(cache, conn->buf, epoch, generation, &snapshot, &paths, &paths_size);
+        // paths not in cache (e.g. through a symbolic link) are walked without a generation
+        if (snapshot && snapshot_find_dir(snapshot, conn->buf) == -1) {
+            snapshot_release(snapshot);
+            snapshot = NULL;
+        }
+        is_full = ret == -1 || !snapshot;
+    }
+
+    uint64_t header[3];
+    header[0] = my_htonll(snapshot ? snapshot->epoch : 0);
+    header[1] = my_htonll(snapshot ? snapshot->generation : 0);
+    header[2] = my_htonll(is_full);
+    // frames always follow, at least the terminating one
+    if (transport_write(&conn->transport, header, sizeof(header), true) != sizeof(header)) {
+        stream.is_broken = true;
+    }
+    else if (is_full) {
+        if (is_valid_path && stream_tree(&stream, snapshot) == -1) {
+            stream.is_broken = true;
+        }
+    }
+    else {
+        stream_changes(&stream, snapshot, paths, paths_size);
+    }
+
+    for (uint64_t i = 0; i < paths_size; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    if (snapshot) {
+        snapshot_release(snapshot);
+    }
+
+    if (finish_stream(&stream) == -1) {
+        ERROR("respond %s changes failed (conn %d)", conn->buf, conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    if (is_full) {
+        INFO("responded %s changes with full manifest (%" PRIu64 " bytes) (conn %d)", conn->buf, stream.sent_len, conn->id);
+    }
+    else {
+        INFO("responded %s changes since generation %" PRIu64 " (%" PRIu64 " paths, %" PRIu64 " bytes) (conn %d)",
+            conn->buf, generation, paths_size, stream.sent_len, conn->id);
+    }
+    free(stream.frame);
+
+    return 0;
+}
+
+// hash of a directory recorded by client
+typedef struct {
+    char *path;
+    uint64_t hash;
+} dir_hash_t;
+
+static int compare_dir_hash(void const *a, void const *b) {
+    return strcmp(((dir_hash_t const *)a)->path, ((dir_hash_t const *)b)->path);
+}
+
+// stream records of directory `path` and its sub-directories whose merkle hashes differ from `hashes`,
+// which are sorted by path, a sub-tree is skipped as a whole if its hash is the same
+// the directory is `dir` of a walked tree, or node `node` of `snapshot` if it isn't NULL,
+// whose entries are only read when it's sent
+// each record is preceded by its directory hash, the number of sent records is added to `*sent_size`
+static void stream_merkle_dir(info_stream_t *stream, char *path, walk_node_t *dir, manifest_snapshot_t *snapshot,
+    uint32_t node, dir_hash_t *hashes, uint64_t hashes_size, uint64_t *sent_size) {
+    uint64_t hash = snapshot ? snapshot->hashes[node] : dir->hash;
+    dir_hash_t key = { .path = path };
+    dir_hash_t *recorded = (dir_hash_t *)bsearch(&key, hashes, hashes_size, sizeof(dir_hash_t), compare_dir_hash);
+    if (recorded && recorded->hash == hash) {
+        return;
+    }
+
+    walk_node_t snapshot_dir;
+    uint32_t first = 0;
+    if (snapshot) {
+        snapshot_node(snapshot, node, &snapshot_dir);
+        first = snapshot->first_children[node];
+        snapshot_dir.entries_size = snapshot->children_sizes[node];
+        snapshot_dir.entries = (walk_node_t *)malloc(sizeof(walk_node_t) * snapshot_dir.entries_size);
+        for (uint64_t i = 0; i < snapshot_dir.entries_size; i++) {
+            snapshot_node(snapshot, first + i, &snapshot_dir.entries[i]);
+        }
+        dir = &snapshot_dir;
+    }
+
+    reserve_frame(stream, sizeof(uint64_t));
+    stream->frame_len = append_buf_uint64(stream->frame, stream->frame_len, my_htonll(hash));
+    if (stream_dir_binary_info(path, dir, stream) == 0) {
+        (*sent_size)++;
+    }
+
+    for (uint64_t i = 0; i < dir->entries_size && !stream->is_broken; i++) {
+        walk_node_t *entry = &dir->entries[i];
+        if (entry->type != WALK_DIRECTORY) {
+            continue;
+        }
+
+        // "{path}/" is omitted for the root
+        char *sub_path;
+        if (strcmp(path, ".")) {
+            sub_path = (char *)malloc(sizeof(char) * (strlen(path) + strlen(entry->name) + 2));
+            sprintf(sub_path, "%s/%s", path, entry->name);
+        }
+        else {
+            sub_path = (char *)malloc(sizeof(char) * (strlen(entry->name) + 1));
+            strcpy(sub_path, entry->name);
+        }
+        stream_merkle_dir(stream, sub_path, entry, snapshot, first + (uint32_t)i, hashes, hashes_size, sent_size);
+        free(sub_path);
+    }
+
+    if (snapshot) {
+        free(snapshot_dir.entries);
+    }
+}
+
+// return 0 when success, -1 when error
+int respond_merkle(conn_t *conn) {
+    info_stream_t stream;
+    info_stream_init(&stream, conn, true);
+
+    // get requested path and directory hashes client recorded
+    int ret = receive_request_path(conn, "merkle");
+    if (ret == -1) {
+        free(stream.frame);
+        return -1;
+    }
+    uint64_t message_len;
+    if (transport_read(&conn->transport, &message_len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive merkle request failed (conn %d)", conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    message_len = my_ntohll(message_len);
+    if (message_len > MAX_DIR_HASHES_LEN) {
+        ERROR("received invalid merkle request (conn %d)", conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    char *message = (char *)malloc(sizeof(char) * (message_len + 1));
+    if (!message) {
+        ERROR("malloc (conn %d)", conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    if (transport_read(&conn->transport, message, message_len) != message_len) {
+        ERROR("receive merkle request failed (conn %d)", conn->id);
+        free(message);
+        free(stream.frame);
+        return -1;
+    }
+
+    dir_hash_t *hashes = NULL;
+    uint64_t hashes_size = 0;
+    uint64_t hashes_capacity = 0;
+    uint64_t offset = 0;
+    while (offset < message_len) {
+        if (hashes_size == hashes_capacity) {
+            hashes_capacity = hashes_capacity ? hashes_capacity << 1 : 1 << 6;
+            hashes = (dir_hash_t *)realloc(hashes, sizeof(dir_hash_t) * hashes_capacity);
+        }
+        dir_hash_t *hash = &hashes[hashes_size];
+        if (read_buf_dir_hash(message, message_len, &offset, &hash->path, &hash->hash) == -1) {
+            // everything not recorded is sent anyway
+            WARN("received invalid directory hashes, ignore the rest (conn %d)", conn->id);
+            break;
+        }
+        hashes_size++;
+    }
+    free(message);
+    qsort(hashes, hashes_size, sizeof(dir_hash_t), compare_dir_hash);
+
+    // paths not in cache (e.g. through a symbolic link) are walked and hashed
+    uint64_t sent_size = 0;
+    if (ret == 1) {
+        manifest_snapshot_t *snapshot = cache ? cache_acquire(cache) : NULL;
+        int64_t dir = snapshot ? snapshot_find_dir(snapshot, conn->buf) : -1;
+        if (dir != -1) {
+            stream_merkle_dir(&stream, ".", NULL, snapshot, (uint32_t)dir, hashes, hashes_size, &sent_size);
+        }
+        else {
+            walk_node_t root;
+            int dir_fd = openat(root_fd, conn->buf, O_RDONLY | O_DIRECTORY);
+            if (dir_fd == -1) {
+                ERROR("open directory %s failed (conn %d)", conn->buf, conn->id);
+            }
+            else if (walk(dir_fd, ".", config.scan_threads, &root) == 0) {
+                walk_hash(&root);
+                stream_merkle_dir(&stream, ".", &root, NULL, 0, hashes, hashes_size, &sent_size);
+                walk_node_kill(&root);
+            }
+        }
+        if (snapshot) {
+            snapshot_release(snapshot);
+        }
+    }
+
+    for (uint64_t i = 0; i < hashes_size; i++) {
+        free(hashes[i].path);
+    }
+    free(hashes);
+
+    if (finish_stream(&stream) == -1) {
+        ERROR("respond %s merkle failed (conn %d)", conn->buf, conn->id);
+        free(stream.frame);
+        return -1;
+    }
+    INFO("responded %s merkle (%" PRIu64 " changed directories, %" PRIu64 " bytes) (conn %d)",
+        conn->buf, sent_size, stream.sent_len, conn->id);
+    free(stream.frame);
+
+    return 0;
+}
+
+// nothing is responded
+// return 0 when success, -1 when error
+int receive_content_hashes(conn_t *conn) {
+    uint64_t min_size;
+    if (transport_read(&conn->transport, &min_size, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ERROR("receive content hashes request failed (conn %d)", conn->id);
+        return -1;
+    }
+    conn->hash_min_size = hash_cache ? MAX(my_ntohll(min_size), 1) : 0;
+    INFO("content hashes of files of at least %" PRIu64 " bytes are sent (conn %d)", conn->hash_min_size, conn->id);
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int respond_features(conn_t *conn) {
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, sizeof(uint64_t));
+    uint64_t features = FEATURE_STREAM_INFO | FEATURE_BINARY_INFO | FEATURE_MERKLE | FEATURE_DELTA
+        | FEATURE_COMPRESSION | FEATURE_STATS | FEATURE_RANGE_CONTENT | FEATURE_BATCH_CONTENT | FEATURE_CHUNKS;
+    if (hash_cache) {
+        features |= FEATURE_CONTENT_HASHES;
+    }
+    // changes are only kept in cache
+    if (cache) {
+        features |= FEATURE_CHANGES;
+    }
+    append_buf_uint64(conn->buf, 0, my_htonll(features));
+    if (transport_write(&conn->transport, conn->buf, sizeof(uint64_t), false) != sizeof(uint64_t)) {
+        ERROR("respond features failed (conn %d)", conn->id);
+        return -1;
+    }
+    INFO("responded features (conn %d)", conn->id);
+
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int respond_working_dir(conn_t *conn) {
+    char *cwd = getcwd(NULL, 0);
+
+    uint64_t message_len = sizeof(uint64_t) + strlen(cwd);
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, message_len);
+    message_len = append_buf_uint64(conn->buf, 0, my_htonll(strlen(cwd)));
+    message_len = append_buf_charp(conn->buf, message_len, cwd);
+    free(cwd);
+
+    if (transport_write(&conn->transport, conn->buf, message_len, false) != message_len) {
+        ERROR("respond working directory failed (conn %d)", conn->id);
+        return -1;
+    }
+    INFO("responded working directory (conn %d)", conn->id);
+
+    return 0;
+}
+
+// return 0 when success, -1 when error
+int respond_stats(conn_t *conn) {
+    json_data *stats = json_obj_init();
+    if (content_cache) {
+        content_cache_stats_t cache_stats;
+        content_cache_get_stats(content_cache, &cache_stats);
+        json_data *cache_json = json_obj_init();
+        json_obj_set(cache_json, "hits", json_num_init(cache_stats.hits));
+        json_obj_set(cache_json, "misses", json_num_init(cache_stats.misses));
+        json_obj_set(cache_json, "hitBytes", json_num_init(cache_stats.hit_bytes));
+        json_obj_set(cache_json, "insertions", json_num_init(cache_stats.insertions));
+        json_obj_set(cache_json, "evictions", json_num_init(cache_stats.evictions));
+        json_obj_set(cache_json, "size", json_num_init(cache_stats.size));
+        json_obj_set(stats, "compressCache", cache_json);
+    }
+    char *stats_str = json_to_str(stats, false);
+    json_kill(stats);
+
+    uint64_t message_len = sizeof(uint64_t) + strlen(stats_str);
+    conn->buf_size = extend_buf(&conn->buf, conn->buf_size, message_len);
+    message_len = append_buf_uint64(conn->buf, 0, my_htonll(strlen(stats_str)));
+    message_len = append_buf_charp(conn->buf, message_len, stats_str);
+    free(stats_str);
+
+    if (transport_write(&conn->transport, conn->buf, message_len, false) != message_len) {
+        ERROR("respond stats failed (conn %d)", conn->id);
+        return -1;
+    }
+    INFO("responded stats (conn %d)", conn->id);
+
+    return 0;
+}
+
+// read a command and respond it
+// return 0 when the connection should be kept, -1 when it should be closed
+int handle_command(conn_t *conn) {
+    if (transport_read(&conn->transport, &conn->command, sizeof(uint32_t)) != sizeof(uint32_t)) {
+        return -1;
+    }
+    conn->command = ntohl(conn->command);
+
+    switch (conn->command) {
+    case COMMAND_INFO:
+    {
+        INFO("received command: request info (conn %d)", conn->id);
+        return respond_info(conn);
+    }
+    case COMMAND_CONTENT:
+    {
+        INFO("received command: request content (conn %d)", conn->id);
+        return respond_content(conn);
+    }
+    case COMMAND_EXIT:
+    {
+        INFO("received exit message (conn %d)", conn->id);
+        return -1;
+    }
+    case COMMAND_WORKING_DIR:
+    {
+        INFO("received command: request working directory (conn %d)", conn->id);
+        return respond_working_dir(conn);
+    }
+    case COMMAND_FEATURES:
+    {
+        INFO("received command: request features (conn %d)", conn->id);
+        return respond_features(conn);
+    }
+    case COMMAND_STREAM_INFO:
+    {
+        INFO("received command: request stream info (conn %d)", conn->id);
+        return respond_stream_info(conn, false);
+    }
+    case COMMAND_BINARY_INFO:
+    {
+        INFO("received command: request binary info (conn %d)", conn->id);
+        return respond_stream_info(conn, true);
+    }
+    case COMMAND_CHANGES:
+    {
+        INFO("received command: request changes (conn %d)", conn->id);
+        return respond_changes(conn);
+    }
+    case COMMAND_MERKLE:
+    {
+        INFO("received command: request merkle (conn %d)", conn->id);
+        return respond_merkle(conn);
+    }
+    case COMMAND_DELTA:
+    {
+        INFO("received command: request delta (conn %d)", conn->id);
+        return respond_delta(conn);
+    }
+    case COMMAND_COMPRESSED_CONTENT:
+    {
+        INFO("received command: request compressed content (conn %d)", conn->id);
+        return respond_compressed_content(conn);
+    }
+    case COMMAND_STATS:
+    {
+        INFO("received command: request stats (conn %d)", conn->id);
+        return respond_stats(conn);
+    }
+    case COMMAND_RANGE_CONTENT:
+    {
+        INFO("received command: request range content (conn %d)", conn->id);
+        return respond_range_content(conn);
+    }
+    case COMMAND_BATCH_CONTENT:
+    {
+        INFO("received command: request batch content (conn %d)", conn->id);
+        return respond_batch_content(conn);
+    }
+    case COMMAND_CONTENT_HASHES:
+    {
+        INFO("received command: request content hashes (conn %d)", conn->id);
+        return receive_content_hashes(conn);
+    }
+    case COMMAND_CHUNK_LIST:
+    {
+        INFO("received command: request chunk list (conn %d)", conn->id);
+        return respond_chunk_list(conn);
+    }
+    case COMMAND_CHUNK_CONTENT:
+    {
+        INFO("received command: request chunk content (conn %d)", conn->id);
+        return respond_chunk_content(conn);
+    }
+    default:
+    {
+        WARN("received unknown command (conn %d)", conn->id);
+        return 0;
+    }
+    }
+}
+
+// wait until a command arrives, without the timeout of the connection
+// return 0 when success, -1 when error
+static int wait_command(conn_t *conn) {
+    if (transport_buffered(&conn->transport)) {
+        return 0;
+    }
+    struct pollfd poll_fd = { .fd = conn->fd, .events = POLLIN };
+    int ret;
+    while ((ret = poll(&poll_fd, 1, -1)) == -1 && errno == EINTR);
+    return ret == 1 ? 0 : -1;
+}
+
+// commands are handled one by one, so pipelined requests are responded in order
+void communicate(conn_t *conn) {
+    while (wait_command(conn) == 0 && handle_command(conn) == 0);
+}
+
+// one process per connection
+void serve_fork(int sock_fd) {
+    int conn_id = 0;
+    while (1) {
+        // accept connection
+        struct sockaddr_in addr;
+        socklen_t addr_size = sizeof(addr);
+        int conn_fd = accept(sock_fd, (struct sockaddr *)&addr, &addr_size);
+        if (conn_fd == -1) {
+            ERROR("accept");
+            continue;
+        }
+        conn_id++;
+
+        int pid = fork();
+        if (pid == -1) {
+            ERROR("fork");
+            close(conn_fd);
+            continue;
+        }
+
+        if (pid == 0) {
+            // child
+            close(sock_fd);
+
+            conn_t *conn = conn_init(conn_fd, conn_id, &addr);
+            INFO("connected from %s:%d (conn %d, pid %d)", conn->host, conn->port, conn->id, getpid());
+            communicate(conn);
+            INFO("disconnected %s:%d (conn %d, pid %d)", conn->host, conn->port, conn->id, getpid());
+            conn_kill(conn);
+
+            close(root_fd);
+            kill_config();
+            exit(0);
+        }
+
+        close(conn_fd);
+    }
+}
+
+#ifdef __linux__
+typedef struct {
+    int epoll_fd;
+    // connections ready to be read
+    work_queue_t *queue;
+} event_loop_t;
+
+// wait for the connection to be readable, or writable when `events` is EPOLLOUT
+// return 0 when success, -1 when error
+static int rearm_conn(event_loop_t *loop, conn_t *conn, uint32_t events) {
+    struct epoll_event event;
+    event.events = events | (events & EPOLLIN ? EPOLLRDHUP : 0) | EPOLLONESHOT;
+    event.data.ptr = conn;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+// send content left by respond_content() as far as the socket takes it without blocking, at most `max_len` bytes
+// return 0 when it's all sent, 1 when the socket is full, 2 when `max_len` bytes are sent, -1 when error
+static int send_pending(conn_t *conn, uint64_t max_len) {
+    int const BLOCK_SIZE = 4096;
+
+    int flags = fcntl(conn->fd, F_GETFL);
+    if (flags == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        ERROR("fcntl (conn %d)", conn->id);
+        return -1;
+    }
+
+    int ret = 2;
+    bool is_supported = true;
+    for (uint64_t send_len = 0; send_len < max_len && conn->send_len > 0;) {
+        ssize_t len = sendfile(conn->fd, conn->send_fd, NULL, MIN(max_len - send_len, conn->send_len));
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ret = 1;
+            break;
+        }
+        if (len == -1 && (errno == EINVAL || errno == ENOSYS || errno == EOVERFLOW)) {
+            is_supported = false;
+            break;
+        }
+        if (len == 0) {
+            WARN("unexpected EOF when reading %s (conn %d)", conn->send_path, conn->id);
+        }
+        if (len <= 0) {
+            ret = -1;
+            break;
+        }
+        send_len += len;
+        conn->send_len -= len;
+    }
+
+    if (fcntl(conn->fd, F_SETFL, flags) == -1) {
+        ret = -1;
+    }
+    // without sendfile(), the rest is sent at once like in the other modes
+    if (ret != -1 && !is_supported) {
+        conn->buf_size = extend_buf(&conn->buf, conn->buf_size, BLOCK_SIZE);
+        if (send_file_range(conn->fd, conn->send_fd, conn->send_len, conn->buf, BLOCK_SIZE) == -1) {
+            ret = -1;
+        }
+        else {
+            conn->send_len = 0;
+        }
+    }
+    if (ret == -1) {
+        ERROR("respond %s content failed (conn %d)", conn->send_path, conn->id);
+        return -1;
+    }
+    if (conn->send_len > 0) {
+        return ret;
+    }
+
+    // the file offset is where sending stopped
+    INFO("responded %s content (%" PRIu64 " bytes) (conn %d)", conn->send_path,
+        (uint64_t)lseek(conn->send_fd, 0, SEEK_CUR), conn->id);
+    close(conn->send_fd);
+    free(conn->send_path);
+    conn->send_fd = -1;
+    conn->send_path = NULL;
+    return 0;
+}
+
+// what a connection waits for after it's served
+typedef enum {
+    CONN_READ,
+    CONN_WRITE,
+    // served again after the other ready connections, without waiting
+    CONN_AGAIN,
+    CONN_CLOSE
+} conn_wait_t;
+
+// handle commands which have arrived and send what's pending, until the connection has to wait or its turn is over
+static conn_wait_t serve_ready_conn(conn_t *conn) {
+    // commands of the same connection handled in a row at most, and the time they can take,
+    // so a busy pipelined connection won't starve the others
+    int const MAX_BATCH = 64;
+    uint64_t const MAX_TURN_NS = 10000000;
+    // bytes of content sent in a turn at most, so a fast client doesn't hold the thread either
+    uint64_t const MAX_SEND_LEN = 1 << 22;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < MAX_BATCH; i++) {
+        // the next response waits until the content before it is sent
+        if (conn->send_fd != -1) {
+            int ret = send_pending(conn, MAX_SEND_LEN);
+            if (ret == -1) {
+                return CONN_CLOSE;
+            }
+            if (ret == 1) {
+                return CONN_WRITE;
+            }
+            if (ret == 2) {
+                return CONN_AGAIN;
+            }
+        }
+
+        // keep going only if the next command has arrived, epoll doesn't see buffered ones
+        if (!transport_buffered(&conn->transport)) {
+            char c;
+            ssize_t len = recv(conn->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return CONN_READ;
+            }
+            // EOF and error are found by handle_command()
+        }
+        if (handle_command(conn) == -1) {
+            return CONN_CLOSE;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ns(&start, &now) >= MAX_TURN_NS) {
+            break;
+        }
+    }
+    return CONN_AGAIN;
+}
+
+// worker thread of epoll mode
+static void *handle_ready_conns(void *arg) {
+    event_loop_t *loop = (event_loop_t *)arg;
+
+    conn_t *conn;
+    while ((conn = (conn_t *)queue_pop(loop->queue))) {
+        conn_wait_t wait = serve_ready_conn(conn);
+        if (wait == CONN_AGAIN) {
+            queue_push(loop->queue, conn);
+            continue;
+        }
+        if (wait != CONN_CLOSE && rearm_conn(loop, conn, wait == CONN_WRITE ? EPOLLOUT : EPOLLIN) == -1) {
+            ERROR("epoll_ctl (conn %d)", conn->id);
+            wait = CONN_CLOSE;
+        }
+        if (wait == CONN_CLOSE) {
+            // closing fd also removes it from epoll
+            INFO("disconnected %s:%d (conn %d)", conn->host, conn->port, conn->id);
+            conn_kill(conn);
+        }
+    }
+
+    return NULL;
+}
+
+// single thread waits for events, commands are handled by a fixed pool of threads
+// connections are registered with EPOLLONESHOT, so only one thread handles a connection at a time
+void serve_epoll(int sock_fd) {
+    int const MAX_EVENTS = 64;
+
+    struct epoll_event events[MAX_EVENTS];
+    event_loop_t loop;
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epoll_fd == -1) {
+        ERROR("epoll_create1");
+        return;
+    }
+    loop.queue = queue_init();
+    is_send_deferred = true;
+
+    // accept in a loop until EAGAIN, so listening socket is nonblocking
+    int flags = fcntl(sock_fd, F_GETFL);
+    if (flags == -1 || fcntl(sock_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        ERROR("fcntl");
+        goto finish;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, sock_fd, &event) == -1) {
+        ERROR("epoll_ctl");
+        goto finish;
+    }
+
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * config.threads);
+    int threads_size = 0;
+    while (threads_size < config.threads) {
+        if (pthread_create(&threads[threads_size], NULL, handle_ready_conns, &loop) != 0) {
+            ERROR("create thread %d failed", threads_size);
+            break;
+        }
+        threads_size++;
+    }
+    INFO("handling connections with %d threads", threads_size);
+
+    int conn_id = 0;
+    while (threads_size > 0) {
+        int events_size = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, -1);
+        if (events_size == -1) {
+            if (errno != EINTR) {
+                ERROR("epoll_wait");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < events_size; i++) {
+            conn_t *conn = (conn_t *)events[i].data.ptr;
+            if (conn) {
+                queue_push(loop.queue, conn);
+                continue;
+            }
+
+            // listening socket
+            while (1) {
+                struct sockaddr_in addr;
+                socklen_t addr_size = sizeof(addr);
+                int conn_fd = accept(sock_fd, (struct sockaddr *)&addr, &addr_size);
+                if (conn_fd == -1) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        ERROR("accept");
+                    }
+                    break;
+                }
+                conn_id++;
+
+                conn = conn_init(conn_fd, conn_id, &addr);
+                INFO("connected from %s:%d (conn %d)", conn->host, conn->port, conn->id);
+
+                event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                event.data.ptr = conn;
+                if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, conn_fd, &event) == -1) {
+                    ERROR("epoll_ctl (conn %d)", conn->id);
+                    conn_kill(conn);
+                }
+            }
+        }
+    }
+
+    queue_close(loop.queue);
+    for (int i = 0; i < threads_size; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+finish:
+    queue_kill(loop.queue, NULL);
+    close(loop.epoll_fd);
+}
+#endif
+
+int main(int argc, char **argv) {
+    load_config(argc, argv);
+    if (!is_valid_config()) {
+        kill_config();
+        return 1;
+    }
+    printf("config:\n  port = %d\n  working directory = %s\n  mode = %s\n  threads = %d\n  scan threads = %d\n  manifest = %s\n  journal size = %d\n  compress cache directory = %s\n  compress cache size = %d MiB\n  socket buffer = %d KiB\n  timeout = %d s\n\n",
+        config.port, config.work_dir, config.mode, config.threads, config.scan_threads, config.manifest,
+        config.journal_size, config.compress_cache_dir, config.compress_cache_size, config.socket_buffer,
+        config.timeout);
+
+    // before changing working directory, so a relative path is where the server is started
+    if (config.compress_cache_dir[0]) {
+        content_cache = content_cache_init(config.compress_cache_dir, (uint64_t)config.compress_cache_size << 20);
+        if (!content_cache) {
+            kill_config();
+            return 1;
+        }
+    }
+
+    // shared by forked processes, so a file is hashed once for all connections
+    hash_cache = content_hash_init(HASH_CACHE_SLOTS);
+    if (!hash_cache) {
+        WARN("content hashes aren't supported");
+    }
+
+    if (chdir(config.work_dir) == -1) {
+        ERROR("change working directory to %s failed", config.work_dir);
+        kill_config();
+        return 1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    INFO("working at %s", cwd);
+    free(cwd);
+
+    // requested paths are resolved relative to it, so working directory is never changed later
+    root_fd = open(".", O_RDONLY | O_DIRECTORY);
+    if (root_fd == -1) {
+        ERROR("open working directory failed");
+        kill_config();
+        return 1;
+    }
+
+    if (!strcmp(config.manifest, "cache")) {
+        cache = cache_init((uint64_t)config.journal_size);
+        if (!cache) {
+            close(root_fd);
+            kill_config();
+            return 1;
+        }
+    }
+
+    // a client may disconnect when being responded, handle it by return value of write
+    signal(SIGPIPE, SIG_IGN);
+
+    int sock_fd = init_socket(config.port);
+    if (sock_fd == -1) {
+        close(root_fd);
+        kill_config();
+        return 1;
+    }
+    INFO("listening on port %d", config.port);
+
+#ifdef __linux__
+    if (!strcmp(config.mode, "epoll")) {
+        serve_epoll(sock_fd);
+    }
+    else
+#endif
+    {
+        serve_fork(sock_fd);
     }
 
     close(sock_fd);
+    close(root_fd);
     kill_config();
 
     return 0;
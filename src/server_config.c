@@ -15,6 +15,15 @@ static void load_config_arg(int argc, char **argv) {
     arg_register(arg, "-p", "port", ARG_INT);
     arg_register(arg, "-d", "working directory", ARG_STRING);
     arg_register(arg, "--config", "config file path", ARG_STRING);
+    arg_register(arg, "--mode", "how connections are served, fork or epoll", ARG_STRING);
+    arg_register(arg, "--threads", "number of threads in epoll mode", ARG_INT);
+    arg_register(arg, "--scan-threads", "number of threads walking a requested directory", ARG_INT);
+    arg_register(arg, "--manifest", "how manifest is made, walk or cache", ARG_STRING);
+    arg_register(arg, "--journal-size", "number of changes kept in cache mode", ARG_INT);
+    arg_register(arg, "--compress-cache-dir", "directory to cache compressed content", ARG_STRING);
+    arg_register(arg, "--compress-cache-size", "max size of compressed content cache in MiB", ARG_INT);
+    arg_register(arg, "--socket-buffer", "socket buffer size of a connection in KiB, 0 for autotuning", ARG_INT);
+    arg_register(arg, "--timeout", "seconds a connection may stall in a request, 0 for no limit", ARG_INT);
     arg_parse(arg, argc, argv);
 
     if (config.port == -1) {
@@ -26,6 +35,33 @@ static void load_config_arg(int argc, char **argv) {
     if (config.config_path == NULL) {
         arg_get(arg, "--config", &config.config_path);
     }
+    if (config.mode == NULL) {
+        arg_get(arg, "--mode", &config.mode);
+    }
+    if (config.threads == -1) {
+        arg_get(arg, "--threads", &config.threads);
+    }
+    if (config.scan_threads == -1) {
+        arg_get(arg, "--scan-threads", &config.scan_threads);
+    }
+    if (config.manifest == NULL) {
+        arg_get(arg, "--manifest", &config.manifest);
+    }
+    if (config.journal_size == -1) {
+        arg_get(arg, "--journal-size", &config.journal_size);
+    }
+    if (config.compress_cache_dir == NULL) {
+        arg_get(arg, "--compress-cache-dir", &config.compress_cache_dir);
+    }
+    if (config.compress_cache_size == -1) {
+        arg_get(arg, "--compress-cache-size", &config.compress_cache_size);
+    }
+    if (config.socket_buffer == -1) {
+        arg_get(arg, "--socket-buffer", &config.socket_buffer);
+    }
+    if (config.timeout == -1) {
+        arg_get(arg, "--timeout", &config.timeout);
+    }
 
     arg_kill(arg);
 }
@@ -80,6 +116,42 @@ static void load_config_file(char *path) {
     if (config.work_dir == NULL && sub_json) {
         config.work_dir = json_str_get(sub_json);
     }
+    sub_json = json_obj_get(json, "mode");
+    if (config.mode == NULL && sub_json) {
+        config.mode = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "threads");
+    if (config.threads == -1 && sub_json) {
+        config.threads = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "scanThreads");
+    if (config.scan_threads == -1 && sub_json) {
+        config.scan_threads = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "manifest");
+    if (config.manifest == NULL && sub_json) {
+        config.manifest = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "journalSize");
+    if (config.journal_size == -1 && sub_json) {
+        config.journal_size = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "compressCacheDir");
+    if (config.compress_cache_dir == NULL && sub_json) {
+        config.compress_cache_dir = json_str_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "compressCacheSize");
+    if (config.compress_cache_size == -1 && sub_json) {
+        config.compress_cache_size = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "socketBuffer");
+    if (config.socket_buffer == -1 && sub_json) {
+        config.socket_buffer = (int)json_num_get(sub_json);
+    }
+    sub_json = json_obj_get(json, "timeout");
+    if (config.timeout == -1 && sub_json) {
+        config.timeout = (int)json_num_get(sub_json);
+    }
 
     json_kill(json);
 }
@@ -87,6 +159,15 @@ static void load_config_file(char *path) {
 static void load_config_default() {
     int const PORT = 52124;
     char const *WORK_DIR = ".";
+    char const *MODE = "fork";
+    int const THREADS = 8;
+    int const SCAN_THREADS = 1;
+    char const *MANIFEST = "walk";
+    int const JOURNAL_SIZE = 65536;
+    char const *COMPRESS_CACHE_DIR = "";
+    int const COMPRESS_CACHE_SIZE = 1024;
+    int const SOCKET_BUFFER = 0;
+    int const TIMEOUT = 60;
 
     if (config.port == -1) {
         config.port = PORT;
@@ -95,6 +176,36 @@ static void load_config_default() {
         config.work_dir = (char *)malloc(sizeof(char) * (strlen(WORK_DIR) + 1));
         strcpy(config.work_dir, WORK_DIR);
     }
+    if (config.mode == NULL) {
+        config.mode = (char *)malloc(sizeof(char) * (strlen(MODE) + 1));
+        strcpy(config.mode, MODE);
+    }
+    if (config.threads == -1) {
+        config.threads = THREADS;
+    }
+    if (config.scan_threads == -1) {
+        config.scan_threads = SCAN_THREADS;
+    }
+    if (config.manifest == NULL) {
+        config.manifest = (char *)malloc(sizeof(char) * (strlen(MANIFEST) + 1));
+        strcpy(config.manifest, MANIFEST);
+    }
+    if (config.journal_size == -1) {
+        config.journal_size = JOURNAL_SIZE;
+    }
+    if (config.compress_cache_dir == NULL) {
+        config.compress_cache_dir = (char *)malloc(sizeof(char) * (strlen(COMPRESS_CACHE_DIR) + 1));
+        strcpy(config.compress_cache_dir, COMPRESS_CACHE_DIR);
+    }
+    if (config.compress_cache_size == -1) {
+        config.compress_cache_size = COMPRESS_CACHE_SIZE;
+    }
+    if (config.socket_buffer == -1) {
+        config.socket_buffer = SOCKET_BUFFER;
+    }
+    if (config.timeout == -1) {
+        config.timeout = TIMEOUT;
+    }
 }
 
 void load_config(int argc, char **argv) {
@@ -102,6 +213,15 @@ void load_config(int argc, char **argv) {
     config.port = -1;
     config.work_dir = NULL;
     config.config_path = NULL;
+    config.mode = NULL;
+    config.threads = -1;
+    config.scan_threads = -1;
+    config.manifest = NULL;
+    config.journal_size = -1;
+    config.compress_cache_dir = NULL;
+    config.compress_cache_size = -1;
+    config.socket_buffer = -1;
+    config.timeout = -1;
 
     // config priority:
     // arg > file > default
@@ -115,11 +235,68 @@ bool is_valid_config() {
         ERROR("invalid port %d", config.port);
         return false;
     }
+
+    if (!strcmp(config.mode, "epoll")) {
+#ifndef __linux__
+        ERROR("epoll mode is only supported on Linux");
+        return false;
+#endif
+    }
+    else if (strcmp(config.mode, "fork")) {
+        ERROR("invalid mode %s, should be fork or epoll", config.mode);
+        return false;
+    }
+
+    if (config.threads < 1) {
+        ERROR("invalid number of threads %d", config.threads);
+        return false;
+    }
+
+    if (config.scan_threads < 1) {
+        ERROR("invalid number of scan threads %d", config.scan_threads);
+        return false;
+    }
+
+    if (!strcmp(config.manifest, "cache")) {
+#ifndef __linux__
+        ERROR("manifest cache is only supported on Linux");
+        return false;
+#endif
+    }
+    else if (strcmp(config.manifest, "walk")) {
+        ERROR("invalid manifest %s, should be walk or cache", config.manifest);
+        return false;
+    }
+
+    if (config.journal_size < 1) {
+        ERROR("invalid journal size %d", config.journal_size);
+        return false;
+    }
+
+    if (config.compress_cache_size < 1) {
+        ERROR("invalid compressed content cache size %d", config.compress_cache_size);
+        return false;
+    }
+
+    // at most 1 GiB, so the size in bytes fits in int
+    if (config.socket_buffer < 0 || config.socket_buffer > 1 << 20) {
+        ERROR("invalid socket buffer size %d", config.socket_buffer);
+        return false;
+    }
+
+    if (config.timeout < 0) {
+        ERROR("invalid timeout %d", config.timeout);
+        return false;
+    }
+
     return true;
 }
 
 void kill_config() {
     free(config.work_dir);
+    free(config.mode);
+    free(config.manifest);
+    free(config.compress_cache_dir);
     if (config.config_path) {
         free(config.config_path);
     }
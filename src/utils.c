@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <sys/socket.h>
 
 uint64_t extend_buf(char **buf, uint64_t buf_size, uint64_t new_buf_size) {
     if (buf_size >= new_buf_size) {
@@ -37,6 +38,301 @@ uint64_t append_buf_charp(char *buf, uint64_t offset, char *data) {
     return offset + strlen(data);
 }
 
+uint64_t append_buf_varint(char *buf, uint64_t offset, uint64_t data) {
+    while (data >= 0x80) {
+        buf[offset++] = (char)((data & 0x7f) | 0x80);
+        data >>= 7;
+    }
+    buf[offset++] = (char)data;
+    return offset;
+}
+
+int read_buf_varint(char const *buf, uint64_t buf_len, uint64_t *offset, uint64_t *data) {
+    *data = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*offset >= buf_len) {
+            return -1;
+        }
+        uint8_t byte = (uint8_t)buf[(*offset)++];
+        *data |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+uint64_t append_buf_manifest_dir(char *buf, uint64_t offset, char *path, uint64_t entries_size) {
+    uint64_t path_len = strlen(path);
+    offset = append_buf_varint(buf, offset, path_len);
+    memcpy(buf + offset, path, path_len);
+    offset += path_len;
+    return append_buf_varint(buf, offset, entries_size);
+}
+
+uint64_t append_buf_manifest_entry(char *buf, uint64_t offset, char *prev_name, manifest_entry_t *entry) {
+    uint64_t shared_len = 0;
+    if (prev_name) {
+        while (prev_name[shared_len] && prev_name[shared_len] == entry->name[shared_len]) {
+            shared_len++;
+        }
+    }
+    uint64_t suffix_len = strlen(entry->name + shared_len);
+    offset = append_buf_varint(buf, offset, shared_len);
+    offset = append_buf_varint(buf, offset, suffix_len);
+    memcpy(buf + offset, entry->name + shared_len, suffix_len);
+    offset += suffix_len;
+
+    offset = append_buf_varint(buf, offset,
+        ((uint64_t)entry->has_hash << 13) | ((uint64_t)(entry->permission & 07777) << 1) | entry->is_dir);
+    // zigzag keeps small negative numbers short
+    offset = append_buf_varint(buf, offset, ((uint64_t)entry->mtime_sec << 1) ^ (uint64_t)(entry->mtime_sec >> 63));
+    offset = append_buf_varint(buf, offset, entry->mtime_nsec);
+    if (!entry->is_dir) {
+        offset = append_buf_varint(buf, offset, entry->size);
+    }
+    if (entry->has_hash) {
+        offset = append_buf_uint64(buf, offset, my_htonll(entry->hash[0]));
+        offset = append_buf_uint64(buf, offset, my_htonll(entry->hash[1]));
+    }
+    return offset;
+}
+
+bool is_contained_path(char const *path, uint64_t len) {
+    if (len == 0 || path[0] == '/') {
+        return false;
+    }
+    uint64_t start = 0;
+    while (start < len) {
+        char const *slash = (char const *)memchr(path + start, '/', len - start);
+        uint64_t end = slash ? (uint64_t)(slash - path) : len;
+        if (end - start == 2 && path[start] == '.' && path[start + 1] == '.') {
+            return false;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+int read_buf_manifest_dir(char const *buf, uint64_t buf_len, uint64_t *offset, char **path, uint64_t *entries_size) {
+    uint64_t path_len;
+    if (read_buf_varint(buf, buf_len, offset, &path_len) == -1 || path_len > buf_len - *offset) {
+        return -1;
+    }
+    if (memchr(buf + *offset, 0, path_len) || !is_contained_path(buf + *offset, path_len)) {
+        return -1;
+    }
+    uint64_t path_offset = *offset;
+    *offset += path_len;
+    if (read_buf_varint(buf, buf_len, offset, entries_size) == -1) {
+        return -1;
+    }
+
+    *path = (char *)malloc(sizeof(char) * (path_len + 1));
+    memcpy(*path, buf + path_offset, path_len);
+    (*path)[path_len] = 0;
+    return 0;
+}
+
+int read_buf_manifest_entry(char const *buf, uint64_t buf_len, uint64_t *offset, char *name, manifest_entry_t *entry) {
+    uint64_t shared_len;
+    uint64_t suffix_len;
+    if (read_buf_varint(buf, buf_len, offset, &shared_len) == -1 || shared_len > strlen(name)) {
+        return -1;
+    }
+    if (read_buf_varint(buf, buf_len, offset, &suffix_len) == -1 || suffix_len > buf_len - *offset) {
+        return -1;
+    }
+    if (shared_len + suffix_len == 0 || shared_len + suffix_len > NAME_MAX) {
+        return -1;
+    }
+    memcpy(name + shared_len, buf + *offset, suffix_len);
+    name[shared_len + suffix_len] = 0;
+    *offset += suffix_len;
+    // name must be a single path component
+    if (strlen(name) != shared_len + suffix_len || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        return -1;
+    }
+    entry->name = name;
+
+    uint64_t mode;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    if (read_buf_varint(buf, buf_len, offset, &mode) == -1
+        || read_buf_varint(buf, buf_len, offset, &mtime_sec) == -1
+        || read_buf_varint(buf, buf_len, offset, &mtime_nsec) == -1
+        || mode >> 14 || mtime_nsec >= 1000000000) {
+        return -1;
+    }
+    entry->is_dir = mode & 1;
+    entry->permission = (mode_t)((mode >> 1) & 07777);
+    entry->has_hash = mode >> 13;
+    if (entry->is_dir && entry->has_hash) {
+        return -1;
+    }
+    entry->mtime_sec = (int64_t)((mtime_sec >> 1) ^ -(mtime_sec & 1));
+    entry->mtime_nsec = (uint32_t)mtime_nsec;
+    entry->size = 0;
+    if (!entry->is_dir && read_buf_varint(buf, buf_len, offset, &entry->size) == -1) {
+        return -1;
+    }
+    if (entry->has_hash && (read_buf_uint64(buf, buf_len, offset, &entry->hash[0]) == -1
+        || read_buf_uint64(buf, buf_len, offset, &entry->hash[1]) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t append_buf_dir_hash(char *buf, uint64_t offset, char *path, uint64_t hash) {
+    uint64_t path_len = strlen(path);
+    offset = append_buf_varint(buf, offset, path_len);
+    memcpy(buf + offset, path, path_len);
+    offset += path_len;
+    return append_buf_uint64(buf, offset, my_htonll(hash));
+}
+
+int read_buf_uint64(char const *buf, uint64_t buf_len, uint64_t *offset, uint64_t *data) {
+    if (sizeof(uint64_t) > buf_len - *offset) {
+        return -1;
+    }
+    memcpy(data, buf + *offset, sizeof(uint64_t));
+    *data = my_ntohll(*data);
+    *offset += sizeof(uint64_t);
+    return 0;
+}
+
+int read_buf_dir_hash(char const *buf, uint64_t buf_len, uint64_t *offset, char **path, uint64_t *hash) {
+    uint64_t path_len;
+    if (read_buf_varint(buf, buf_len, offset, &path_len) == -1 || path_len > buf_len - *offset) {
+        return -1;
+    }
+    if (memchr(buf + *offset, 0, path_len)) {
+        return -1;
+    }
+    uint64_t path_offset = *offset;
+    *offset += path_len;
+    if (read_buf_uint64(buf, buf_len, offset, hash) == -1) {
+        return -1;
+    }
+
+    *path = (char *)malloc(sizeof(char) * (path_len + 1));
+    memcpy(*path, buf + path_offset, path_len);
+    (*path)[path_len] = 0;
+    return 0;
+}
+
+uint64_t hash_bytes(uint64_t hash, void const *data, uint64_t len) {
+    uint64_t const PRIME = 0x100000001b3ULL;
+
+    unsigned char const *bytes = (unsigned char const *)data;
+    for (uint64_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= PRIME;
+    }
+    return hash;
+}
+
+uint64_t hash_uint64(uint64_t hash, uint64_t data) {
+    unsigned char bytes[sizeof(uint64_t)];
+    for (int i = 0; i < (int)sizeof(uint64_t); i++) {
+        bytes[i] = (unsigned char)(data >> (i * 8));
+    }
+    return hash_bytes(hash, bytes, sizeof(uint64_t));
+}
+
+uint32_t weak_checksum(void const *data, uint64_t len) {
+    unsigned char const *bytes = (unsigned char const *)data;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (uint64_t i = 0; i < len; i++) {
+        a += bytes[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+static uint64_t load_le64(unsigned char const *bytes) {
+    uint64_t data = 0;
+    for (int i = 7; i >= 0; i--) {
+        data = data << 8 | bytes[i];
+    }
+    return data;
+}
+
+static uint64_t rotl64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+void murmur3_128(void const *data, uint64_t len, uint64_t *hash) {
+    uint64_t const C1 = 0x87c37b91114253d5ULL;
+    uint64_t const C2 = 0x4cf5ad432745937fULL;
+
+    unsigned char const *bytes = (unsigned char const *)data;
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+
+    uint64_t blocks_size = len / 16;
+    for (uint64_t i = 0; i < blocks_size; i++) {
+        uint64_t k1 = load_le64(bytes + i * 16);
+        uint64_t k2 = load_le64(bytes + i * 16 + 8);
+
+        k1 *= C1;
+        k1 = rotl64(k1, 31);
+        k1 *= C2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+
+        k2 *= C2;
+        k2 = rotl64(k2, 33);
+        k2 *= C1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    // the rest bytes are loaded as if zero padded
+    unsigned char tail[16] = { 0 };
+    memcpy(tail, bytes + blocks_size * 16, len % 16);
+    uint64_t k1 = load_le64(tail);
+    uint64_t k2 = load_le64(tail + 8);
+    if (len % 16 > 8) {
+        k2 *= C2;
+        k2 = rotl64(k2, 33);
+        k2 *= C1;
+        h2 ^= k2;
+    }
+    if (len % 16) {
+        k1 *= C1;
+        k1 = rotl64(k1, 31);
+        k1 *= C2;
+        h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+
+    hash[0] = h1;
+    hash[1] = h2;
+}
+
 ssize_t bulk_read(int fd, void *buf, size_t len) {
     ssize_t read_len = 0;
     while (len > 0) {
@@ -71,6 +367,154 @@ ssize_t bulk_write(int fd, void const *buf, size_t len) {
     return write_len;
 }
 
+ssize_t bulk_pwrite(int fd, void const *buf, size_t len, off_t offset) {
+    ssize_t write_len = 0;
+    while (len > 0) {
+        ssize_t ret = pwrite(fd, buf, len, offset + write_len);
+        if (ret == -1 && write_len == 0) {
+            return -1;
+        }
+        if (ret == 0 || ret == -1) {
+            break;
+        }
+        len -= ret;
+        buf = (char *)buf + ret;
+        write_len += ret;
+    }
+    return write_len;
+}
+
+// MSG_MORE is only in Linux, elsewhere each write is sent as is
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+void transport_init(transport_t *transport, int fd) {
+    transport->fd = fd;
+    transport->buf = (char *)malloc(sizeof(char) * TRANSPORT_BUF_LEN);
+    transport->start = 0;
+    transport->end = 0;
+}
+
+void transport_kill(transport_t *transport) {
+    free(transport->buf);
+    transport->buf = NULL;
+}
+
+ssize_t transport_read_some(transport_t *transport, void *buf, size_t len) {
+    if (transport->start == transport->end) {
+        return read(transport->fd, buf, len);
+    }
+    uint64_t read_len = MIN(len, transport->end - transport->start);
+    memcpy(buf, transport->buf + transport->start, read_len);
+    transport->start += read_len;
+    return read_len;
+}
+
+ssize_t transport_read(transport_t *transport, void *buf, size_t len) {
+    ssize_t read_len = 0;
+    while (len > 0) {
+        if (transport->start < transport->end) {
+            ssize_t ret = transport_read_some(transport, buf, len);
+            len -= ret;
+            buf = (char *)buf + ret;
+            read_len += ret;
+            continue;
+        }
+
+        // a large read goes to `buf` directly, otherwise the buffer is filled as much as received
+        ssize_t ret;
+        if (len >= TRANSPORT_BUF_LEN) {
+            ret = read(transport->fd, buf, len);
+        }
+        else {
+            ret = read(transport->fd, transport->buf, TRANSPORT_BUF_LEN);
+            if (ret > 0) {
+                transport->start = 0;
+                transport->end = ret;
+                continue;
+            }
+        }
+        if (ret == -1 && read_len == 0) {
+            return -1;
+        }
+        if (ret == 0 || ret == -1) {
+            break;
+        }
+        len -= ret;
+        buf = (char *)buf + ret;
+        read_len += ret;
+    }
+    return read_len;
+}
+
+uint64_t transport_buffered(transport_t *transport) {
+    return transport->end - transport->start;
+}
+
+ssize_t transport_writev(transport_t *transport, struct iovec *iov, int iov_size, bool has_more) {
+    struct msghdr message;
+    memset(&message, 0, sizeof(struct msghdr));
+    message.msg_iov = iov;
+    message.msg_iovlen = iov_size;
+
+    ssize_t write_len = 0;
+    while (message.msg_iovlen > 0) {
+        // skip empty and written parts
+        if (message.msg_iov->iov_len == 0) {
+            message.msg_iov++;
+            message.msg_iovlen--;
+            continue;
+        }
+
+        ssize_t ret = sendmsg(transport->fd, &message, has_more ? MSG_MORE : 0);
+        if (ret == -1 && write_len == 0) {
+            return -1;
+        }
+        if (ret == 0 || ret == -1) {
+            break;
+        }
+        write_len += ret;
+        while (ret > 0) {
+            size_t len = MIN((size_t)ret, message.msg_iov->iov_len);
+            message.msg_iov->iov_base = (char *)message.msg_iov->iov_base + len;
+            message.msg_iov->iov_len -= len;
+            ret -= len;
+            if (message.msg_iov->iov_len == 0) {
+                message.msg_iov++;
+                message.msg_iovlen--;
+            }
+        }
+    }
+    return write_len;
+}
+
+ssize_t transport_write(transport_t *transport, void const *buf, size_t len, bool has_more) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    return transport_writev(transport, &iov, 1, has_more);
+}
+
+int transport_write_frame(transport_t *transport, void const *data, uint64_t len, bool has_more) {
+    uint64_t header = my_htonll(len);
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(uint64_t);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return transport_writev(transport, iov, 2, has_more) == sizeof(uint64_t) + len ? 0 : -1;
+}
+
+int set_socket_buffers(int fd, int size) {
+    if (size == 0) {
+        return 0;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int)) == -1
+        || setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int)) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
 uint64_t my_ntohll(uint64_t n) {
     // don't need to consider (un)signed problem
     if (ntohl(2) == 2) {
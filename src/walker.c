@@ -0,0 +1,628 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// for statx
+#define _GNU_SOURCE
+#endif
+#include "walker.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "utils.h"
+
+// large enough to read most directories with a single getdents64
+static size_t const DENTS_BUF_SIZE = 1 << 18;
+
+#ifdef __linux__
+// glibc may not wrap getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+// statx may not be supported by kernel even if glibc has it
+static bool is_statx_supported = true;
+#endif
+
+static void set_status(walk_node_t *node, struct stat *st) {
+    node->type = S_ISREG(st->st_mode) ? WALK_FILE : S_ISDIR(st->st_mode) ? WALK_DIRECTORY : WALK_NONE;
+    node->permission = st->st_mode & 0777;
+    node->mtime_sec = st->st_mtime;
+#ifdef __APPLE__
+    node->mtime_nsec = st->st_mtimespec.tv_nsec;
+#else
+    node->mtime_nsec = st->st_mtim.tv_nsec;
+#endif
+    node->size = st->st_size;
+}
+
+// get status of `name` in `dir_fd` without following symbolic link
+// return 0 when success, -1 when error
+static int stat_entry(int dir_fd, char *name, walk_node_t *node) {
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+    if (is_statx_supported) {
+        // only ask for what is recorded, so filesystem may skip the rest
+        struct statx stx;
+        if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+            STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_SIZE, &stx) == 0) {
+            node->type = S_ISREG(stx.stx_mode) ? WALK_FILE : S_ISDIR(stx.stx_mode) ? WALK_DIRECTORY : WALK_NONE;
+            node->permission = stx.stx_mode & 0777;
+            node->mtime_sec = stx.stx_mtime.tv_sec;
+            node->mtime_nsec = stx.stx_mtime.tv_nsec;
+            node->size = stx.stx_size;
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        is_statx_supported = false;
+    }
+#endif
+
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return -1;
+    }
+    set_status(node, &st);
+    return 0;
+}
+
+// entries being read from a directory
+// names are kept as offsets until the pool stops growing
+typedef struct {
+    walk_node_t *entries;
+    uint64_t *name_offsets;
+    uint64_t size;
+    uint64_t capacity;
+    char *names;
+    uint64_t names_len;
+    uint64_t names_capacity;
+} dir_reader_t;
+
+static void reader_append(dir_reader_t *reader, char *name, walk_type_t type) {
+    if (reader->size == reader->capacity) {
+        reader->capacity = reader->capacity ? reader->capacity << 1 : 16;
+        reader->entries = (walk_node_t *)realloc(reader->entries, sizeof(walk_node_t) * reader->capacity);
+        reader->name_offsets = (uint64_t *)realloc(reader->name_offsets, sizeof(uint64_t) * reader->capacity);
+    }
+    uint64_t name_len = strlen(name) + 1;
+    if (reader->names_len + name_len > reader->names_capacity) {
+        while (reader->names_len + name_len > reader->names_capacity) {
+            reader->names_capacity = reader->names_capacity ? reader->names_capacity << 1 : 256;
+        }
+        reader->names = (char *)realloc(reader->names, sizeof(char) * reader->names_capacity);
+    }
+
+    walk_node_t *entry = &reader->entries[reader->size];
+    memset(entry, 0, sizeof(walk_node_t));
+    entry->type = type;
+    reader->name_offsets[reader->size] = reader->names_len;
+    memcpy(reader->names + reader->names_len, name, name_len);
+    reader->names_len += name_len;
+    reader->size++;
+}
+
+// return whether an entry with `d_type` may be a regular file or directory
+static bool is_candidate(unsigned char d_type) {
+    return d_type == DT_REG || d_type == DT_DIR || d_type == DT_UNKNOWN;
+}
+
+// read names of entries in `dir_fd`
+// return 0 when success, -1 when error
+static int read_names(char *buf, int dir_fd, dir_reader_t *reader) {
+#ifdef __linux__
+    long len;
+    while ((len = syscall(SYS_getdents64, dir_fd, buf, DENTS_BUF_SIZE)) > 0) {
+        for (long offset = 0; offset < len;) {
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *)(buf + offset);
+            offset += dirent->d_reclen;
+
+            if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..") || !is_candidate(dirent->d_type)) {
+                continue;
+            }
+            reader_append(reader, dirent->d_name, WALK_NONE);
+        }
+    }
+    return len == -1 ? -1 : 0;
+#else
+    // `dir_fd` is still needed after reading, so let DIR own a duplicate
+    int dup_fd = dup(dir_fd);
+    if (dup_fd == -1) {
+        return -1;
+    }
+    DIR *dirp = fdopendir(dup_fd);
+    if (!dirp) {
+        close(dup_fd);
+        return -1;
+    }
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dirp))) {
+        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, "..") || !is_candidate(dirent->d_type)) {
+            continue;
+        }
+        reader_append(reader, dirent->d_name, WALK_NONE);
+    }
+    closedir(dirp);
+    return 0;
+#endif
+}
+
+static int compare_name(void const *a, void const *b) {
+    return strcmp(((walk_node_t *)a)->name, ((walk_node_t *)b)->name);
+}
+
+// read entries of `dir_fd` into `dir`, entries which can't be recorded are dropped
+// return 0 when success, -1 when error
+static int read_dir(char *buf, int dir_fd, walk_node_t *dir) {
+    dir_reader_t reader = { 0 };
+    int ret = read_names(buf, dir_fd, &reader);
+
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < reader.size; i++) {
+        walk_node_t *entry = &reader.entries[size];
+        reader.entries[i].name = reader.names + reader.name_offsets[i];
+        if (i != size) {
+            *entry = reader.entries[i];
+        }
+
+        // d_type may be DT_UNKNOWN on some filesystems, so type is always decided by status
+        if (stat_entry(dir_fd, entry->name, entry) == -1) {
+            ERROR("get %s status failed", entry->name);
+            continue;
+        }
+        if (entry->type == WALK_NONE) {
+            continue;
+        }
+        size++;
+    }
+    free(reader.name_offsets);
+
+    // order of getdents is arbitrary, sort to make the result deterministic
+    qsort(reader.entries, size, sizeof(walk_node_t), compare_name);
+
+    dir->entries = reader.entries;
+    dir->entries_size = size;
+    dir->names = reader.names;
+
+    return ret;
+}
+
+// drop directories which can't be entered, they are marked as WALK_NONE
+static void prune(walk_node_t *dir) {
+    uint64_t size = 0;
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        walk_node_t *entry = &dir->entries[i];
+        if (entry->type == WALK_NONE) {
+            continue;
+        }
+        if (entry->type == WALK_DIRECTORY) {
+            prune(entry);
+        }
+
+        if (i != size) {
+            dir->entries[size] = *entry;
+        }
+        size++;
+    }
+    dir->entries_size = size;
+}
+
+// open sub-directory `dir` in `parent_fd`, `dir` is marked as WALK_NONE when failed
+// return fd of `dir`, -1 when error
+static int open_dir(int parent_fd, walk_node_t *dir) {
+    int dir_fd = openat(parent_fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    if (dir_fd == -1) {
+        // skip directory which can't be entered
+        ERROR("open directory %s failed", dir->name);
+        dir->type = WALK_NONE;
+    }
+    return dir_fd;
+}
+
+// `dir` must have its status, its entries are walked recursively
+// `dir_fd` is closed when returned
+static void walk_dir(char *buf, int dir_fd, walk_node_t *dir) {
+    if (read_dir(buf, dir_fd, dir) == -1) {
+        // entries read so far are kept
+        ERROR("read directory %s failed", dir->name);
+    }
+
+    // the whole directory has been read, so `buf` can be reused by sub-directories
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        walk_node_t *entry = &dir->entries[i];
+        if (entry->type != WALK_DIRECTORY) {
+            continue;
+        }
+
+        int sub_dir_fd = open_dir(dir_fd, entry);
+        if (sub_dir_fd != -1) {
+            walk_dir(buf, sub_dir_fd, entry);
+        }
+    }
+
+    close(dir_fd);
+}
+
+// a directory whose sub-directories are waiting to be scanned
+// its fd is closed when all of them are opened
+typedef struct {
+    int fd;
+    atomic_int refs;
+} dir_ref_t;
+
+// scan `dir`, which is opened in `parent`
+// `parent` is NULL for the root, which is opened as `fd`
+typedef struct {
+    walk_node_t *dir;
+    dir_ref_t *parent;
+    int fd;
+} scan_task_t;
+
+// tasks of a scanner thread
+// the owner pushes and pops at the bottom (depth first),
+// others steal from the top, which are usually large subtrees
+typedef struct {
+    scan_task_t *tasks;
+    uint64_t top;
+    uint64_t size;
+    uint64_t capacity;
+    pthread_mutex_t mutex;
+} task_deque_t;
+
+typedef struct {
+    task_deque_t *deques;
+    int threads_size;
+    // tasks pushed but not finished
+    atomic_long pending;
+    // tasks in deques
+    atomic_long queued;
+    // idle threads wait until a task is pushed or all are finished
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+} scanner_t;
+
+typedef struct {
+    scanner_t *scanner;
+    int id;
+} scanner_thread_t;
+
+static void deque_push(task_deque_t *deque, scan_task_t task) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->size == deque->capacity) {
+        uint64_t capacity = deque->capacity ? deque->capacity << 1 : 64;
+        scan_task_t *tasks = (scan_task_t *)malloc(sizeof(scan_task_t) * capacity);
+        for (uint64_t i = 0; i < deque->size; i++) {
+            tasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->top = 0;
+        deque->capacity = capacity;
+    }
+    deque->tasks[(deque->top + deque->size) % deque->capacity] = task;
+    deque->size++;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+// take a task from the bottom when `is_owner`, otherwise from the top
+// return whether a task is taken
+static bool deque_pop(task_deque_t *deque, bool is_owner, scan_task_t *task) {
+    pthread_mutex_lock(&deque->mutex);
+    bool is_taken = deque->size > 0;
+    if (is_taken) {
+        if (is_owner) {
+            *task = deque->tasks[(deque->top + deque->size - 1) % deque->capacity];
+        }
+        else {
+            *task = deque->tasks[deque->top];
+            deque->top = (deque->top + 1) % deque->capacity;
+        }
+        deque->size--;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+
+    return is_taken;
+}
+
+// take a task from own deque, or steal one from others
+// block until there's one
+// return false when all tasks are finished
+static bool take_task(scanner_t *scanner, int id, scan_task_t *task) {
+    while (1) {
+        for (int i = 0; i < scanner->threads_size; i++) {
+            int victim = (id + i) % scanner->threads_size;
+            if (deque_pop(&scanner->deques[victim], victim == id, task)) {
+                atomic_fetch_sub(&scanner->queued, 1);
+                return true;
+            }
+        }
+
+        pthread_mutex_lock(&scanner->idle_mutex);
+        while (atomic_load(&scanner->queued) == 0 && atomic_load(&scanner->pending) > 0) {
+            pthread_cond_wait(&scanner->idle_cond, &scanner->idle_mutex);
+        }
+        bool is_finished = atomic_load(&scanner->pending) == 0;
+        pthread_mutex_unlock(&scanner->idle_mutex);
+        if (is_finished) {
+            return false;
+        }
+    }
+}
+
+static void release_dir_ref(dir_ref_t *ref) {
+    if (atomic_fetch_sub(&ref->refs, 1) == 1) {
+        close(ref->fd);
+        free(ref);
+    }
+}
+
+static void *scan(void *arg) {
+    scanner_thread_t *thread = (scanner_thread_t *)arg;
+    scanner_t *scanner = thread->scanner;
+
+    char *buf = (char *)malloc(sizeof(char) * DENTS_BUF_SIZE);
+
+    scan_task_t task;
+    while (take_task(scanner, thread->id, &task)) {
+        walk_node_t *dir = task.dir;
+        int dir_fd = task.fd;
+        if (task.parent) {
+            dir_fd = open_dir(task.parent->fd, dir);
+            release_dir_ref(task.parent);
+        }
+
+        long pushed = 0;
+        if (dir_fd != -1) {
+            if (read_dir(buf, dir_fd, dir) == -1) {
+                // entries read so far are kept
+                ERROR("read directory %s failed", dir->name);
+            }
+
+            dir_ref_t *ref = (dir_ref_t *)malloc(sizeof(dir_ref_t));
+            ref->fd = dir_fd;
+            // hold a reference while pushing, so it isn't closed by early finished tasks
+            atomic_init(&ref->refs, 1);
+            for (uint64_t i = 0; i < dir->entries_size; i++) {
+                if (dir->entries[i].type != WALK_DIRECTORY) {
+                    continue;
+                }
+
+                atomic_fetch_add(&ref->refs, 1);
+                atomic_fetch_add(&scanner->pending, 1);
+                atomic_fetch_add(&scanner->queued, 1);
+                scan_task_t sub_task = { &dir->entries[i], ref, -1 };
+                deque_push(&scanner->deques[thread->id], sub_task);
+                pushed++;
+            }
+            release_dir_ref(ref);
+        }
+
+        bool is_finished = atomic_fetch_sub(&scanner->pending, 1) == 1;
+        if (pushed > 1 || is_finished) {
+            // wake up idle threads to steal, or to exit
+            pthread_mutex_lock(&scanner->idle_mutex);
+            pthread_cond_broadcast(&scanner->idle_cond);
+            pthread_mutex_unlock(&scanner->idle_mutex);
+        }
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+// scan with work-stealing threads, each directory is a task
+// `root` must have its status
+static void walk_parallel(int dir_fd, walk_node_t *root, int threads_size) {
+    scanner_t scanner;
+    scanner.threads_size = threads_size;
+    scanner.deques = (task_deque_t *)calloc(threads_size, sizeof(task_deque_t));
+    for (int i = 0; i < threads_size; i++) {
+        pthread_mutex_init(&scanner.deques[i].mutex, NULL);
+    }
+    atomic_init(&scanner.pending, 1);
+    atomic_init(&scanner.queued, 1);
+    pthread_mutex_init(&scanner.idle_mutex, NULL);
+    pthread_cond_init(&scanner.idle_cond, NULL);
+
+    scan_task_t root_task = { root, NULL, dir_fd };
+    deque_push(&scanner.deques[0], root_task);
+
+    scanner_thread_t *threads = (scanner_thread_t *)malloc(sizeof(scanner_thread_t) * threads_size);
+    pthread_t *tids = (pthread_t *)malloc(sizeof(pthread_t) * threads_size);
+    int created_size = 0;
+    for (int i = 0; i < threads_size; i++) {
+        threads[i].scanner = &scanner;
+        threads[i].id = i;
+        if (pthread_create(&tids[i], NULL, scan, &threads[i]) != 0) {
+            // remaining tasks are stolen by created threads
+            ERROR("create scanner thread %d failed", i);
+            break;
+        }
+        created_size++;
+    }
+    if (created_size == 0) {
+        // scan by caller itself
+        scanner.threads_size = 1;
+        scan(&threads[0]);
+    }
+    for (int i = 0; i < created_size; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < threads_size; i++) {
+        free(scanner.deques[i].tasks);
+        pthread_mutex_destroy(&scanner.deques[i].mutex);
+    }
+    free(scanner.deques);
+    pthread_mutex_destroy(&scanner.idle_mutex);
+    pthread_cond_destroy(&scanner.idle_cond);
+    free(threads);
+    free(tids);
+}
+
+int walk(int dir_fd, char *name, int threads_size, walk_node_t *root) {
+    memset(root, 0, sizeof(walk_node_t));
+    root->name = name;
+
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1) {
+        ERROR("get %s status failed", name);
+        close(dir_fd);
+        return -1;
+    }
+    set_status(root, &st);
+
+    if (threads_size > 1) {
+        walk_parallel(dir_fd, root, threads_size);
+    }
+    else {
+        char *buf = (char *)malloc(sizeof(char) * DENTS_BUF_SIZE);
+        walk_dir(buf, dir_fd, root);
+        free(buf);
+    }
+    prune(root);
+
+    return 0;
+}
+
+int walk_entries(int dir_fd, walk_node_t *dir) {
+    char *name = dir->name;
+    memset(dir, 0, sizeof(walk_node_t));
+    dir->name = name;
+
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1) {
+        return -1;
+    }
+    set_status(dir, &st);
+
+    char *buf = (char *)malloc(sizeof(char) * DENTS_BUF_SIZE);
+    int ret = read_dir(buf, dir_fd, dir);
+    free(buf);
+
+    return ret;
+}
+
+// `path` is the path of `dir`, its buffer may be extended for sub-directories
+// `dir_fd` is closed when returned
+// return 0 when success, -1 when walking is stopped
+static int stream_dir(char *buf, int dir_fd, char **path, uint64_t *path_size, walk_node_t *dir,
+    walk_visit_t visit, void *arg) {
+    if (read_dir(buf, dir_fd, dir) == -1) {
+        // entries read so far are kept
+        ERROR("read directory %s failed", *path);
+    }
+
+    int ret = visit(*path, dir, arg);
+
+    // root is "." but its sub-directories don't start with "./"
+    uint64_t path_len = strcmp(*path, ".") ? strlen(*path) : 0;
+    for (uint64_t i = 0; ret == 0 && i < dir->entries_size; i++) {
+        walk_node_t *entry = &dir->entries[i];
+        if (entry->type != WALK_DIRECTORY) {
+            continue;
+        }
+
+        int sub_dir_fd = open_dir(dir_fd, entry);
+        if (sub_dir_fd == -1) {
+            continue;
+        }
+
+        uint64_t sub_path_len = path_len + (path_len ? 1 : 0) + strlen(entry->name);
+        if (sub_path_len + 1 > *path_size) {
+            while (sub_path_len + 1 > *path_size) {
+                *path_size <<= 1;
+            }
+            *path = (char *)realloc(*path, sizeof(char) * *path_size);
+        }
+        if (path_len) {
+            (*path)[path_len] = '/';
+        }
+        strcpy(*path + sub_path_len - strlen(entry->name), entry->name);
+
+        ret = stream_dir(buf, sub_dir_fd, path, path_size, entry, visit, arg);
+        (*path)[path_len] = 0;
+        // the subtree has been visited, release it to keep memory bounded
+        walk_node_kill(entry);
+    }
+    if (!path_len) {
+        strcpy(*path, ".");
+    }
+
+    close(dir_fd);
+
+    return ret;
+}
+
+int walk_stream(int dir_fd, walk_visit_t visit, void *arg) {
+    walk_node_t root;
+    memset(&root, 0, sizeof(walk_node_t));
+    root.name = ".";
+
+    struct stat st;
+    if (fstat(dir_fd, &st) == -1) {
+        ERROR("get . status failed");
+        close(dir_fd);
+        return -1;
+    }
+    set_status(&root, &st);
+
+    uint64_t path_size = 256;
+    char *path = (char *)malloc(sizeof(char) * path_size);
+    strcpy(path, ".");
+
+    char *buf = (char *)malloc(sizeof(char) * DENTS_BUF_SIZE);
+    int ret = stream_dir(buf, dir_fd, &path, &path_size, &root, visit, arg);
+    free(buf);
+    free(path);
+    walk_node_kill(&root);
+
+    return ret;
+}
+
+uint64_t walk_hash_entry(uint64_t hash, walk_node_t *entry) {
+    // '\0' separates names
+    hash = hash_bytes(hash, entry->name, strlen(entry->name) + 1);
+    hash = hash_uint64(hash, entry->type);
+    hash = hash_uint64(hash, entry->permission);
+    hash = hash_uint64(hash, (uint64_t)entry->mtime_sec);
+    hash = hash_uint64(hash, entry->mtime_nsec);
+    return hash_uint64(hash, entry->type == WALK_DIRECTORY ? entry->hash : entry->size);
+}
+
+void walk_hash(walk_node_t *dir) {
+    uint64_t hash = HASH_INIT;
+    for (uint64_t i = 0; i < dir->entries_size; i++) {
+        walk_node_t *entry = &dir->entries[i];
+        if (entry->type == WALK_DIRECTORY) {
+            walk_hash(entry);
+        }
+        hash = walk_hash_entry(hash, entry);
+    }
+    dir->hash = hash;
+}
+
+void walk_node_kill(walk_node_t *node) {
+    for (uint64_t i = 0; i < node->entries_size; i++) {
+        walk_node_kill(&node->entries[i]);
+    }
+    free(node->entries);
+    free(node->names);
+    node->entries = NULL;
+    node->entries_size = 0;
+    node->names = NULL;
+}
@@ -0,0 +1,102 @@
+#include "work_queue.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct queue_node {
+    void *item;
+    struct queue_node *next;
+} queue_node_t;
+
+struct work_queue {
+    queue_node_t *head;
+    queue_node_t *tail;
+    bool is_closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+work_queue_t *queue_init() {
+    work_queue_t *queue = (work_queue_t *)malloc(sizeof(work_queue_t));
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->is_closed = false;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    return queue;
+}
+
+void queue_push(work_queue_t *queue, void *item) {
+    queue_node_t *node = (queue_node_t *)malloc(sizeof(queue_node_t));
+    node->item = item;
+    node->next = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->is_closed) {
+        pthread_mutex_unlock(&queue->mutex);
+        free(node);
+        return;
+    }
+    if (queue->tail) {
+        queue->tail->next = node;
+    }
+    else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// `queue->mutex` must be held and `queue` must not be empty
+static void *pop_locked(work_queue_t *queue) {
+    queue_node_t *node = queue->head;
+    queue->head = node->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+
+    void *item = node->item;
+    free(node);
+    return item;
+}
+
+void *queue_pop(work_queue_t *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->head && !queue->is_closed) {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+    void *item = queue->head ? pop_locked(queue) : NULL;
+    pthread_mutex_unlock(&queue->mutex);
+
+    return item;
+}
+
+bool queue_try_pop(work_queue_t *queue, void **item) {
+    pthread_mutex_lock(&queue->mutex);
+    bool is_taken = queue->head != NULL;
+    if (is_taken) {
+        *item = pop_locked(queue);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return is_taken;
+}
+
+void queue_close(work_queue_t *queue) {
+    pthread_mutex_lock(&queue->mutex);
+    queue->is_closed = true;
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+void queue_kill(work_queue_t *queue, void (*release)(void *)) {
+    while (queue->head) {
+        void *item = pop_locked(queue);
+        if (release) {
+            release(item);
+        }
+    }
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->cond);
+    free(queue);
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# changes of a server keeping its manifest carry mtime of directories, which change with their entries or by touch
+# usage: tests/changes.sh [server] [client], run from the repository after `make all`
+SERVER=${1:-./server}
+CLIENT=${2:-./client}
+PORT=${PORT:-53342}
+
+DIR=$(mktemp -d)
+FAILED=0
+
+sync_dirs() {
+    "$CLIENT" -p "$PORT" --ldir "$DIR/dst" --config /dev/null > "$DIR/client.log" 2>&1
+}
+
+# `$1` is the case, `$2` is what the client log must have
+check() {
+    (cd "$DIR/src" && find . -mindepth 1 -printf '%p %m %T@\n' | sort) > "$DIR/src.lst"
+    (cd "$DIR/dst" && find . -mindepth 1 -path ./.filesync -prune -o -printf '%p %m %T@\n' | sort) > "$DIR/dst.lst"
+    if diff -r -x .filesync "$DIR/src" "$DIR/dst" > /dev/null && diff "$DIR/src.lst" "$DIR/dst.lst" > /dev/null \
+        && grep -q "$2" "$DIR/client.log"; then
+        echo "$1 OK"
+    else
+        echo "$1 FAILED"
+        FAILED=1
+    fi
+}
+
+mkdir -p "$DIR/src/a/b" "$DIR/src/c" "$DIR/dst"
+echo a > "$DIR/src/a/b/f"
+echo c > "$DIR/src/c/f"
+touch -d '-1 hour' "$DIR/src/a/b" "$DIR/src/a" "$DIR/src/c"
+
+"$SERVER" -d "$DIR/src" -p "$PORT" --config /dev/null --manifest cache > "$DIR/server.log" 2>&1 &
+SERVER_PID=$!
+sleep 0.5
+sync_dirs
+check "full sync" "received"
+
+# only the entries of `a/b` and the status of `c` change, their parents aren't read again
+echo g > "$DIR/src/a/b/g"
+touch -d '-2 hours' "$DIR/src/c"
+sleep 0.5
+sync_dirs
+check "directory mtime in changes" "received . changes up to"
+
+kill $SERVER_PID
+wait $SERVER_PID 2> /dev/null
+rm -rf "$DIR"
+exit $FAILED
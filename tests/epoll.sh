@@ -0,0 +1,20 @@
+#!/bin/sh
+# an epoll server with 2 threads still serves a new connection while 4 others wait to send large content
+# usage: tests/epoll.sh [server] [test_epoll], run from the repository after `make test`
+SERVER=${1:-./server}
+TEST=${2:-./obj/test_epoll}
+PORT=${PORT:-53341}
+
+DIR=$(mktemp -d)
+dd if=/dev/urandom of="$DIR/a" bs=1M count=64 status=none
+
+"$SERVER" -d "$DIR" -p "$PORT" --config /dev/null --mode epoll --threads 2 --socket-buffer 4 > "$DIR/server.log" 2>&1 &
+SERVER_PID=$!
+sleep 0.3
+"$TEST" "$PORT" a 4
+RET=$?
+kill $SERVER_PID
+wait $SERVER_PID 2> /dev/null
+
+rm -rf "$DIR"
+exit $RET
@@ -0,0 +1,70 @@
+#!/bin/sh
+# a large request (delta signatures, or chunk ranges) pipelined after a large content response is sent without
+# both sides blocking on full socket buffers
+# usage: tests/pipeline.sh [server] [client], run from the repository after `make all`
+SERVER=${1:-./server}
+CLIENT=${2:-./client}
+PORT=${PORT:-53340}
+
+DIR=$(mktemp -d)
+FAILED=0
+
+# `$1` and `$2` are the options of server and client
+sync_dirs() {
+    "$SERVER" -d "$DIR/src" -p "$PORT" --config /dev/null --timeout 10 --socket-buffer 1 $1 > "$DIR/server.log" 2>&1 &
+    SERVER_PID=$!
+    sleep 0.3
+    "$CLIENT" -p "$PORT" --ldir "$DIR/dst" --config /dev/null -j 1 --socket-buffer 1 --compression off \
+        --dedup off $2 > "$DIR/client.log" 2>&1
+    CLIENT_RET=$?
+    kill $SERVER_PID
+    wait $SERVER_PID 2> /dev/null
+    return $CLIENT_RET
+}
+
+# `$1` is the case, `$2` is the file whose old copy is updated
+check() {
+    if diff -r -x .filesync "$DIR/src" "$DIR/dst" > /dev/null && grep -q "$3" "$DIR/client.log"; then
+        echo "$1 OK"
+    else
+        echo "$1 FAILED"
+        FAILED=1
+    fi
+}
+
+# `a` and `c` are requested as a whole, too small for chunks or delta, and `b` by its old copy between them
+prepare() {
+    rm -rf "$DIR/src" "$DIR/dst"
+    mkdir "$DIR/src" "$DIR/dst"
+    dd if=/dev/urandom of="$DIR/src/a" bs=1K count=1000 status=none
+    dd if=/dev/urandom of="$DIR/src/c" bs=1K count=1000 status=none
+    dd if=/dev/urandom of="$DIR/src/b" bs=1M count="$1" status=none
+    cp "$DIR/src/b" "$DIR/dst/b"
+    touch -d '-1 hour' "$DIR/dst/b"
+}
+
+# a byte is changed every `$1` bytes of the old copy of `b`
+modify() {
+    size=$(stat -c %s "$DIR/dst/b")
+    offset=0
+    while [ $offset -lt $size ]; do
+        printf 'x' | dd of="$DIR/dst/b" bs=1 seek=$offset conv=notrunc status=none
+        offset=$((offset + $1))
+    done
+    touch -d '-1 hour' "$DIR/dst/b"
+}
+
+# signatures of 64 MiB in 8 KiB blocks are 160 KiB
+prepare 64
+modify 1048576
+sync_dirs "" "--chunking off"
+check "delta after content" b "requested .*b delta"
+
+# chunks of 64 KiB on average, every other one is missing
+prepare 256
+modify 131072
+sync_dirs "" "--chunking on"
+check "chunk content after content" b "requested .*b chunk content"
+
+rm -rf "$DIR"
+exit $FAILED
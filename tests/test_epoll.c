@@ -0,0 +1,134 @@
+// connections of an epoll server, more than its threads, which don't read their large content responses yet,
+// don't keep a new connection from being served
+// usage: test_epoll <port> <path> <connections>
+// content of "{path}" is requested on each connection, then features on a new one, then all content is received
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "utils.h"
+#include "protocol.h"
+
+// return connected fd, -1 when error
+static int connect_server(int port) {
+    // small buffers, so responses fill them soon
+    int const SOCKET_BUFFER_SIZE = 1 << 12;
+    // longer than this, the new connection is starved
+    struct timeval const TIMEOUT = { .tv_sec = 2, .tv_usec = 0 };
+
+    int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock_fd == -1) {
+        return -1;
+    }
+    set_socket_buffers(sock_fd, SOCKET_BUFFER_SIZE);
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &TIMEOUT, sizeof(TIMEOUT));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+// return content length, -1 when error
+static int64_t receive_content(int sock_fd, char *buf, uint64_t buf_size) {
+    uint64_t len;
+    if (bulk_read(sock_fd, &len, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        return -1;
+    }
+    len = my_ntohll(len);
+    for (uint64_t left = len; left > 0;) {
+        ssize_t read_len = read(sock_fd, buf, MIN(buf_size, left));
+        if (read_len <= 0) {
+            return -1;
+        }
+        left -= read_len;
+    }
+    return len;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s <port> <path> <connections>\n", argv[0]);
+        return 1;
+    }
+    int port = atoi(argv[1]);
+    char *path = argv[2];
+    int conns_size = atoi(argv[3]);
+    if (conns_size <= 0) {
+        fprintf(stderr, "invalid number of connections %s\n", argv[3]);
+        return 1;
+    }
+
+    // [1][path length][path]
+    uint64_t request_len = sizeof(uint32_t) + sizeof(uint64_t) + strlen(path);
+    char *request = (char *)malloc(sizeof(char) * (request_len + 1));
+    uint64_t offset = append_buf_uint32(request, 0, htonl(COMMAND_CONTENT));
+    offset = append_buf_uint64(request, offset, my_htonll(strlen(path)));
+    append_buf_charp(request, offset, path);
+
+    int ret = 1;
+    int *conn_fds = (int *)malloc(sizeof(int) * conns_size);
+    int connected_size = 0;
+    for (; connected_size < conns_size; connected_size++) {
+        conn_fds[connected_size] = connect_server(port);
+        if (conn_fds[connected_size] == -1) {
+            ERROR("connect");
+            goto finish;
+        }
+        if (bulk_write(conn_fds[connected_size], request, request_len) != (ssize_t)request_len) {
+            ERROR("send request on connection %d failed", connected_size);
+            connected_size++;
+            goto finish;
+        }
+    }
+
+    // [4], answered while the other responses are still being sent
+    int sock_fd = connect_server(port);
+    uint32_t command = htonl(COMMAND_FEATURES);
+    uint64_t features;
+    if (sock_fd == -1 || bulk_write(sock_fd, &command, sizeof(uint32_t)) != sizeof(uint32_t)
+        || bulk_read(sock_fd, &features, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        fprintf(stderr, "new connection isn't served while %d responses are pending\n", conns_size);
+        if (sock_fd != -1) {
+            close(sock_fd);
+        }
+        goto finish;
+    }
+    close(sock_fd);
+
+    uint64_t const buf_size = 1 << 16;
+    char *buf = (char *)malloc(sizeof(char) * buf_size);
+    int64_t len = -1;
+    for (int i = 0; i < conns_size; i++) {
+        int64_t conn_len = receive_content(conn_fds[i], buf, buf_size);
+        if (conn_len <= 0 || (i > 0 && conn_len != len)) {
+            fprintf(stderr, "content on connection %d is incomplete\n", i);
+            break;
+        }
+        len = conn_len;
+        if (i == conns_size - 1) {
+            printf("%d connections of %" PRId64 " bytes content and a new connection OK\n", conns_size, len);
+            ret = 0;
+        }
+    }
+    free(buf);
+
+finish:
+    for (int i = 0; i < connected_size; i++) {
+        close(conn_fds[i]);
+    }
+    free(conn_fds);
+    free(request);
+    return ret;
+}
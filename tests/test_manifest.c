@@ -0,0 +1,308 @@
+// round trip of binary manifest records and directory hashes, and rejection of truncated or malformed buffers,
+// and of JSON manifests whose names or paths leave the synced directory
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "utils.h"
+#include "manifest_tree.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do {\
+    if (!(cond)) {\
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);\
+        failures++;\
+    }\
+} while (0)
+
+// return 0 when `buf` of `len` bytes is read as a directory record of `path` with `entries_size` entries
+static int read_dir(char const *buf, uint64_t len, char const *path, uint64_t entries_size) {
+    uint64_t offset = 0;
+    char *read_path;
+    uint64_t read_entries_size;
+    if (read_buf_manifest_dir(buf, len, &offset, &read_path, &read_entries_size) == -1) {
+        return -1;
+    }
+    int ret = offset == len && !strcmp(read_path, path) && read_entries_size == entries_size ? 0 : 1;
+    free(read_path);
+    return ret;
+}
+
+static void test_dir() {
+    char *paths[] = { ".", "a", "a/b/c", "..a/b..", "a/.../b", "./a" };
+    char buf[MANIFEST_DIR_MAX_LEN(64)];
+    for (uint64_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        uint64_t entries_sizes[] = { 0, 1, 127, 128, UINT64_MAX };
+        for (uint64_t j = 0; j < sizeof(entries_sizes) / sizeof(entries_sizes[0]); j++) {
+            uint64_t len = append_buf_manifest_dir(buf, 0, paths[i], entries_sizes[j]);
+            CHECK(len <= MANIFEST_DIR_MAX_LEN(strlen(paths[i])));
+            CHECK(read_dir(buf, len, paths[i], entries_sizes[j]) == 0);
+            for (uint64_t k = 0; k < len; k++) {
+                CHECK(read_dir(buf, k, paths[i], entries_sizes[j]) == -1);
+            }
+        }
+    }
+
+    // paths which would leave the synced directory
+    char *escaping[] = { "", "/", "/etc", "..", "../a", "a/..", "a/../b", "a/b/../../.." };
+    for (uint64_t i = 0; i < sizeof(escaping) / sizeof(escaping[0]); i++) {
+        uint64_t len = append_buf_manifest_dir(buf, 0, escaping[i], 1);
+        CHECK(read_dir(buf, len, escaping[i], 1) == -1);
+    }
+
+    // '\0' in path
+    uint64_t len = append_buf_manifest_dir(buf, 0, "ab", 1);
+    buf[2] = 0;
+    CHECK(read_dir(buf, len, "a", 1) == -1);
+
+    // path length beyond the buffer
+    len = append_buf_varint(buf, 0, UINT64_MAX);
+    len = append_buf_varint(buf, len, 0);
+    CHECK(read_dir(buf, len, "", 0) == -1);
+}
+
+static bool is_same_entry(manifest_entry_t *a, manifest_entry_t *b) {
+    if (strcmp(a->name, b->name) || a->is_dir != b->is_dir || a->permission != b->permission
+        || a->mtime_sec != b->mtime_sec || a->mtime_nsec != b->mtime_nsec || a->has_hash != b->has_hash) {
+        return false;
+    }
+    if (!a->is_dir && a->size != b->size) {
+        return false;
+    }
+    return !a->has_hash || (a->hash[0] == b->hash[0] && a->hash[1] == b->hash[1]);
+}
+
+// return 0 when `buf` of `len` bytes is read as `entry` after an entry named `prev_name`
+static int read_entry(char const *buf, uint64_t len, char const *prev_name, manifest_entry_t *entry) {
+    char name[NAME_MAX + 1];
+    strcpy(name, prev_name);
+    uint64_t offset = 0;
+    manifest_entry_t read;
+    if (read_buf_manifest_entry(buf, len, &offset, name, &read) == -1) {
+        return -1;
+    }
+    return offset == len && is_same_entry(&read, entry) ? 0 : 1;
+}
+
+static void test_entry() {
+    char long_name[NAME_MAX + 1];
+    memset(long_name, 'x', NAME_MAX);
+    long_name[NAME_MAX] = 0;
+
+    manifest_entry_t entries[] = {
+        { .name = "a", .is_dir = false, .permission = 0644, .mtime_sec = 1700000000, .mtime_nsec = 123456789,
+            .size = 0, .has_hash = false },
+        { .name = "abc", .is_dir = false, .permission = 07777, .mtime_sec = -1, .mtime_nsec = 999999999,
+            .size = UINT64_MAX, .has_hash = true, .hash = { 0x0123456789abcdefULL, UINT64_MAX } },
+        { .name = "abd", .is_dir = true, .permission = 0, .mtime_sec = INT64_MIN, .mtime_nsec = 0 },
+        { .name = "b", .is_dir = true, .permission = 0755, .mtime_sec = INT64_MAX, .mtime_nsec = 1 },
+        { .name = long_name, .is_dir = false, .permission = 0600, .mtime_sec = 0, .mtime_nsec = 0,
+            .size = 4096, .has_hash = true, .hash = { 0, 0 } },
+    };
+    char buf[MANIFEST_ENTRY_MAX_LEN(NAME_MAX)];
+    char *prev_name = "";
+    for (uint64_t i = 0; i < sizeof(entries) / sizeof(entries[0]); i++) {
+        // the first entry of a record has no previous name
+        uint64_t len = append_buf_manifest_entry(buf, 0, i ? prev_name : NULL, &entries[i]);
+        CHECK(len <= MANIFEST_ENTRY_MAX_LEN(strlen(entries[i].name)));
+        CHECK(read_entry(buf, len, prev_name, &entries[i]) == 0);
+        for (uint64_t k = 0; k < len; k++) {
+            CHECK(read_entry(buf, k, prev_name, &entries[i]) == -1);
+        }
+        prev_name = entries[i].name;
+    }
+
+    // a record is a directory followed by its entries
+    char record[MANIFEST_DIR_MAX_LEN(8) + 8 * MANIFEST_ENTRY_MAX_LEN(NAME_MAX)];
+    uint64_t entries_size = sizeof(entries) / sizeof(entries[0]);
+    uint64_t record_len = append_buf_manifest_dir(record, 0, "d/e", entries_size);
+    for (uint64_t i = 0; i < entries_size; i++) {
+        record_len = append_buf_manifest_entry(record, record_len, i ? entries[i - 1].name : NULL, &entries[i]);
+    }
+    uint64_t offset = 0;
+    char *path;
+    uint64_t read_entries_size;
+    CHECK(read_buf_manifest_dir(record, record_len, &offset, &path, &read_entries_size) == 0);
+    CHECK(!strcmp(path, "d/e") && read_entries_size == entries_size);
+    free(path);
+    char name[NAME_MAX + 1] = "";
+    for (uint64_t i = 0; i < entries_size; i++) {
+        manifest_entry_t read;
+        CHECK(read_buf_manifest_entry(record, record_len, &offset, name, &read) == 0);
+        CHECK(is_same_entry(&read, &entries[i]));
+    }
+    CHECK(offset == record_len);
+}
+
+// encode an entry field by field, so malformed ones can be made
+static uint64_t append_raw_entry(char *buf, uint64_t shared_len, char const *suffix, uint64_t suffix_len,
+    uint64_t mode, uint64_t mtime_nsec) {
+    uint64_t len = append_buf_varint(buf, 0, shared_len);
+    len = append_buf_varint(buf, len, suffix_len);
+    memcpy(buf + len, suffix, suffix_len);
+    len += suffix_len;
+    len = append_buf_varint(buf, len, mode);
+    len = append_buf_varint(buf, len, 0);
+    len = append_buf_varint(buf, len, mtime_nsec);
+    // size, or hash if it's a file with hash
+    len = append_buf_varint(buf, len, 0);
+    len = append_buf_uint64(buf, len, 0);
+    return append_buf_uint64(buf, len, 0);
+}
+
+static void test_malformed_entry() {
+    char buf[2 * NAME_MAX + 64];
+    manifest_entry_t entry;
+    char name[NAME_MAX + 1];
+    uint64_t offset;
+
+    // a valid one, so the cases below fail for their own reasons
+    uint64_t len = append_raw_entry(buf, 0, "a", 1, 0644 << 1, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == 0);
+
+    char *bad_names[] = { ".", "..", "a/b", "/" };
+    for (uint64_t i = 0; i < sizeof(bad_names) / sizeof(bad_names[0]); i++) {
+        len = append_raw_entry(buf, 0, bad_names[i], strlen(bad_names[i]), 0644 << 1, 0);
+        strcpy(name, "");
+        offset = 0;
+        CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+    }
+
+    // empty name
+    len = append_raw_entry(buf, 0, "", 0, 0644 << 1, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // '\0' in name
+    len = append_raw_entry(buf, 0, "a\0b", 3, 0644 << 1, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // more shared bytes than the previous name has
+    len = append_raw_entry(buf, 2, "c", 1, 0644 << 1, 0);
+    strcpy(name, "a");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // name longer than NAME_MAX
+    char long_suffix[NAME_MAX + 1];
+    memset(long_suffix, 'x', sizeof(long_suffix));
+    len = append_raw_entry(buf, 0, long_suffix, NAME_MAX + 1, 0644 << 1, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // unknown mode bits
+    len = append_raw_entry(buf, 0, "a", 1, (uint64_t)1 << 14, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // directory with hash
+    len = append_raw_entry(buf, 0, "a", 1, ((uint64_t)1 << 13) | 1, 0);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // nanoseconds out of range
+    len = append_raw_entry(buf, 0, "a", 1, 0644 << 1, 1000000000);
+    strcpy(name, "");
+    offset = 0;
+    CHECK(read_buf_manifest_entry(buf, len, &offset, name, &entry) == -1);
+
+    // varint longer than 64 bits
+    memset(buf, 0xff, VARINT_MAX_LEN + 1);
+    uint64_t data;
+    offset = 0;
+    CHECK(read_buf_varint(buf, VARINT_MAX_LEN + 1, &offset, &data) == -1);
+}
+
+static void test_dir_hash() {
+    char *paths[] = { ".", "a", "a/b/c" };
+    uint64_t hashes[] = { 0, 1, UINT64_MAX };
+    char buf[3 * DIR_HASH_MAX_LEN(8)];
+    uint64_t len = 0;
+    for (uint64_t i = 0; i < 3; i++) {
+        len = append_buf_dir_hash(buf, len, paths[i], hashes[i]);
+    }
+
+    uint64_t offset = 0;
+    for (uint64_t i = 0; i < 3; i++) {
+        char *path;
+        uint64_t hash;
+        CHECK(read_buf_dir_hash(buf, len, &offset, &path, &hash) == 0);
+        CHECK(!strcmp(path, paths[i]) && hash == hashes[i]);
+        free(path);
+    }
+    CHECK(offset == len);
+
+    uint64_t first_len = append_buf_dir_hash(buf, 0, paths[2], hashes[2]);
+    for (uint64_t k = 0; k < first_len; k++) {
+        char *path;
+        uint64_t hash;
+        offset = 0;
+        CHECK(read_buf_dir_hash(buf, k, &offset, &path, &hash) == -1);
+    }
+
+    // '\0' in path
+    buf[1] = 0;
+    char *path;
+    uint64_t hash;
+    offset = 0;
+    CHECK(read_buf_dir_hash(buf, first_len, &offset, &path, &hash) == -1);
+}
+
+static int parse_json(char const *json) {
+    manifest_tree_t tree;
+    if (manifest_tree_parse(&tree, json, strlen(json)) == -1) {
+        return -1;
+    }
+    manifest_tree_kill(&tree);
+    return 0;
+}
+
+static void test_json() {
+    CHECK(parse_json("{\"name\":\"d\",\"entries\":[{\"name\":\"a\"},{\"name\":\"..a\"}]}") == 0);
+    CHECK(parse_json("[{\"path\":\"a/b\",\"entries\":[{\"name\":\"c\"}]}]") == 0);
+
+    char *names[] = { "", ".", "..", "a/b", "/a", "..\\/a", "\\u002e\\u002e" };
+    char json[64];
+    for (uint64_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(json, sizeof(json), "{\"name\":\"d\",\"entries\":[{\"name\":\"%s\"}]}", names[i]);
+        CHECK(parse_json(json) == -1);
+        snprintf(json, sizeof(json), "[{\"path\":\"a\",\"entries\":[{\"name\":\"%s\"}]}]", names[i]);
+        CHECK(parse_json(json) == -1);
+    }
+
+    // record paths are parsed as they are, and checked by the client
+    char *paths[] = { ".", "a", "a/b", "a/..b" };
+    for (uint64_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+        CHECK(is_contained_path(paths[i], strlen(paths[i])));
+    }
+    char *bad_paths[] = { "", "/a", "..", "a/..", "../a", "a/../b" };
+    for (uint64_t i = 0; i < sizeof(bad_paths) / sizeof(bad_paths[0]); i++) {
+        CHECK(!is_contained_path(bad_paths[i], strlen(bad_paths[i])));
+    }
+}
+
+int main() {
+    test_dir();
+    test_entry();
+    test_malformed_entry();
+    test_dir_hash();
+    test_json();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("manifest records OK\n");
+    return 0;
+}